@@ -7,11 +7,15 @@ const cfg = require('./Config_pb.js');
 
 const kMutateInsert = Symbol();
 const kMutateModify = Symbol();
+const kMutateDelete = Symbol();
 
 const kApplySubmit = Symbol();
 const kApplyCommit = Symbol();
 const kApplyRollback = Symbol();
 
+const kCompressLz4 = Symbol();
+const kCompressZstd = Symbol();
+
 function nodeToView(node_buffer) {
 	assert(Buffer.isBuffer(node_buffer));
 	return new Uint8Array(node_buffer.buffer,
@@ -24,9 +28,54 @@ function viewToNode(view) {
 
 function createStorage(client, opts) {
 	return new Promise((resolve, reject) => {
+		let config = new cfg.StorageConfig();
+		if(opts.blockSize)
+			config.setBlockSize(opts.blockSize);
+		if(opts.gcInterval)
+			config.setGcInterval(opts.gcInterval);
+		if(opts.retainSequences)
+			config.setRetainSequences(opts.retainSequences);
+		if(opts.retainVersions)
+			config.setRetainVersions(opts.retainVersions);
+		if(opts.compactThreshold)
+			config.setCompactThreshold(opts.compactThreshold);
+		if(opts.compactBatch)
+			config.setCompactBatch(opts.compactBatch);
+		if(opts.compression) {
+			switch(opts.compression) {
+			case kCompressLz4:
+				config.setCompression(cfg.StorageConfig.Compression.KCOMPRESSIONLZ4);
+				break;
+			case kCompressZstd:
+				config.setCompression(cfg.StorageConfig.Compression.KCOMPRESSIONZSTD);
+				break;
+			default:
+				throw new Error("Unexpected compression codec");
+			}
+		}
+		if(opts.compressionLevel)
+			config.setCompressionLevel(opts.compressionLevel);
+		if(opts.compressionDictionary)
+			config.setCompressionDictionary(nodeToView(opts.compressionDictionary));
+		if(opts.inlineThreshold)
+			config.setInlineThreshold(opts.inlineThreshold);
+		if(opts.documentCacheLimit)
+			config.setDocumentCacheLimit(opts.documentCacheLimit);
+		if(opts.filterBitsPerKey)
+			config.setFilterBitsPerKey(opts.filterBitsPerKey);
+		if(opts.memtableLimit)
+			config.setMemtableLimit(opts.memtableLimit);
+		if(opts.segmentSize)
+			config.setSegmentSize(opts.segmentSize);
+		if(opts.levelRatio)
+			config.setLevelRatio(opts.levelRatio);
+		if(opts.level0Segments)
+			config.setLevel0Segments(opts.level0Segments);
+
 		let req = new api.CqCreateStorage();
 		req.setDriver(opts.driver);
 		req.setIdentifier(opts.identifier);
+		req.setConfig(config);
 
 		let exchange = client.exchange((opcode, data) => {
 			if(opcode == d3b.ServerResponses.kSrFin) {
@@ -44,6 +93,14 @@ function createView(client, opts) {
 		let config = new cfg.ViewConfig();
 		config.setBaseStorage(opts.baseStorage);
 		config.setScriptFile(opts.scriptFile);
+		if(opts.orderStatistics)
+			config.setOrderStatistics(true);
+		if(opts.blockSize)
+			config.setBlockSize(opts.blockSize);
+		if(opts.prefetchFraction !== undefined)
+			config.setPrefetchFraction(opts.prefetchFraction);
+		if(opts.prefetchDistance !== undefined)
+			config.setPrefetchDistance(opts.prefetchDistance);
 
 		let req = new api.CqCreateView();
 		req.setDriver(opts.driver);
@@ -195,12 +252,92 @@ function fetch(client, opts) {
 	});
 }
 
+// resolves to an array of { documentId, sequenceId, buffer }.
+// documents that do not exist are omitted
+function multiFetch(client, opts) {
+	let result = [ ];
+
+	return new Promise((resolve, reject) => {
+		let req = new api.CqMultiFetch();
+		req.setStorageName(opts.storageName);
+		req.setDocumentIdsList(opts.documentIds);
+		if(opts.sequenceId)
+			req.setSequenceId(opts.sequenceId);
+
+		let exchange = client.exchange(function(opcode, data) {
+			if(opcode == d3b.ServerResponses.kSrDocuments) {
+				data.getDocumentsList().forEach(document => {
+					result.push({
+						documentId: document.getDocumentId(),
+						sequenceId: document.getSequenceId(),
+						buffer: viewToNode(document.getBuffer())
+					});
+				});
+			}else if(opcode == d3b.ServerResponses.kSrFin) {
+				if(data.getError() == api.ErrorCode.KCODESUCCESS) {
+					resolve(result);
+				}else{
+					reject(new Error("d3b error code " + data.getError()));
+				}
+				exchange.fin();
+			}else throw new Error("Unexpected response " + opcode);
+		});
+
+		exchange.send(d3b.ClientRequests.kCqMultiFetch, req);
+	});
+}
+
+// resolves to an array of { sequenceId, deleted, buffer } in ascending order
+function history(client, opts) {
+	let result = [ ];
+
+	return new Promise((resolve, reject) => {
+		let req = new api.CqHistory();
+		req.setStorageName(opts.storageName);
+		req.setDocumentId(opts.documentId);
+		if(opts.fromSequenceId)
+			req.setFromSequenceId(opts.fromSequenceId);
+		if(opts.toSequenceId)
+			req.setToSequenceId(opts.toSequenceId);
+
+		let exchange = client.exchange(function(opcode, data) {
+			if(opcode == d3b.ServerResponses.kSrVersions) {
+				data.getVersionsList().forEach(version => {
+					result.push({
+						sequenceId: version.getSequenceId(),
+						deleted: version.getDeleted(),
+						buffer: version.getDeleted() ? null
+								: viewToNode(version.getBuffer())
+					});
+				});
+			}else if(opcode == d3b.ServerResponses.kSrFin) {
+				if(data.getError() == api.ErrorCode.KCODESUCCESS) {
+					resolve(result);
+				}else{
+					reject(new Error("d3b error code " + data.getError()));
+				}
+				exchange.fin();
+			}else throw new Error("Unexpected response " + opcode);
+		});
+
+		exchange.send(d3b.ClientRequests.kCqHistory, req);
+	});
+}
+
 function query(client, opts, handler) {
 	return new Promise((resolve, reject) => {
 		let req = new api.CqQuery();
 		req.setViewName(opts.viewName);
 		if(opts.sequenceId)
 			req.setSequenceId(opts.sequenceId);
+		if(opts.limit)
+			req.setLimit(opts.limit);
+		if(opts.descending)
+			req.setDescending(true);
+		if(opts.countOnly)
+			req.setCountOnly(true);
+		if(opts.offset)
+			req.setOffset(opts.offset);
 
 		let exchange = client.exchange((opcode, data) => {
 			if(opcode == d3b.ServerResponses.kSrRows) {
@@ -209,7 +346,8 @@ function query(client, opts, handler) {
 				});
 			}else if(opcode == d3b.ServerResponses.kSrFin) {
 				if(data.getError() == api.ErrorCode.KCODESUCCESS) {
-					resolve();
+					// count_only queries resolve to the number of entries
+					resolve(data.hasCount() ? data.getCount() : undefined);
 				}else{
 					reject(new Error("d3b error code " + data.getError()));
 				}
@@ -256,12 +394,16 @@ function update(client, opts) {
 				case kMutateModify:
 					mutation.setType(api.Mutation.Type.KTYPEMODIFY);
 					break;
+				case kMutateDelete:
+					mutation.setType(api.Mutation.Type.KTYPEDELETE);
+					break;
 				default:
 					throw new Error("Unexpected mutation type");
 				}
 
 				mutation.setStorageName(entry.storageName);
-				mutation.setBuffer(nodeToView(entry.buffer));
+				if(entry.buffer)
+					mutation.setBuffer(nodeToView(entry.buffer));
 				if(entry.documentId)
 					mutation.setDocumentId(entry.documentId);
 
@@ -311,7 +453,8 @@ function apply(client, opts) {
 		var exchange = client.exchange(function(opcode, data) {
 			if(opcode == d3b.ServerResponses.kSrFin) {
 				if(data.getError() == api.ErrorCode.KCODESUCCESS) {
-					resolve();
+					// commits resolve to the sequence id of the transaction
+					resolve(data.hasSequenceId() ? data.getSequenceId() : undefined);
 				}else{
 					reject(new Error("d3b error code " + data.getError()));
 				}
@@ -323,6 +466,32 @@ function apply(client, opts) {
 	});
 }
 
+function checkIntegrity(client, opts) {
+	let report;
+
+	return new Promise((resolve, reject) => {
+		var req = new api.CqCheckIntegrity();
+		if(opts.storageName)
+			req.setStorageName(opts.storageName);
+		if(opts.viewName)
+			req.setViewName(opts.viewName);
+
+		var exchange = client.exchange((opcode, data) => {
+			if(opcode == d3b.ServerResponses.kSrBlob) {
+				report = viewToNode(data.getBuffer()).toString();
+			}else if(opcode == d3b.ServerResponses.kSrFin) {
+				if(data.getError() == api.ErrorCode.KCODESUCCESS) {
+					resolve(report);
+				}else{
+					reject(new Error("d3b error code " + data.getError()));
+				}
+				exchange.fin();
+			}else throw new Error("Unexpected response " + opcode);
+		});
+		exchange.send(d3b.ClientRequests.kCqCheckIntegrity, req);
+	});
+}
+
 function shutdown(client) {
 	var req = client.request();
 	req.send(d3b.ClientRequests.kCqShutdown, { });
@@ -330,11 +499,15 @@ function shutdown(client) {
 
 module.exports.kMutateInsert = kMutateInsert;
 module.exports.kMutateModify = kMutateModify;
+module.exports.kMutateDelete = kMutateDelete;
 
 module.exports.kApplySubmit = kApplySubmit;
 module.exports.kApplyCommit = kApplyCommit;
 module.exports.kApplyRollback = kApplyRollback;
 
+module.exports.kCompressLz4 = kCompressLz4;
+module.exports.kCompressZstd = kCompressZstd;
+
 module.exports.createStorage = createStorage;
 module.exports.createView = createView;
 module.exports.unlinkStorage = unlinkStorage;
@@ -344,9 +517,12 @@ module.exports.downloadExtern = downloadExtern;
 module.exports.insert = insert;
 module.exports.modify = modify;
 module.exports.fetch = fetch;
+module.exports.multiFetch = multiFetch;
+module.exports.history = history;
 module.exports.query = query;
 module.exports.transaction = transaction;
 module.exports.update = update;
 module.exports.apply = apply;
+module.exports.checkIntegrity = checkIntegrity;
 module.exports.shutdown = shutdown;
 
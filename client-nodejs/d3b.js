@@ -17,6 +17,8 @@ var ClientRequests = {
 	kCqTransaction: 4,
 	kCqUpdate: 5,
 	kCqApply: 6,
+	kCqMultiFetch: 7,
+	kCqHistory: 8,
 
 	kCqCreateStorage: 256,
 	kCqCreateView: 257,
@@ -24,13 +26,16 @@ var ClientRequests = {
 	kCqUnlinkView: 259,
 	kCqUploadExtern: 260,
 	kCqDownloadExtern: 261,
-	kCqShutdown: 262
+	kCqShutdown: 262,
+	kCqCheckIntegrity: 263
 };
 var ServerResponses = {
 	kSrFin: 1,
 	kSrRows: 2,
 	kSrBlob: 3,
-	kSrShortTransact: 4
+	kSrShortTransact: 4,
+	kSrDocuments: 5,
+	kSrVersions: 6
 };
 
 function Client() {
@@ -78,6 +83,8 @@ Client.prototype.p_onMessage = function() {
 	case ServerResponses.kSrRows: Message = api.SrRows; break;
 	case ServerResponses.kSrBlob: Message = api.SrBlob; break;
 	case ServerResponses.kSrShortTransact: Message = api.SrShortTransact; break;
+	case ServerResponses.kSrDocuments: Message = api.SrDocuments; break;
+	case ServerResponses.kSrVersions: Message = api.SrVersions; break;
 	default: throw new Error("p_onMessage(): Illegal opcode");
 	}
 	
@@ -102,6 +102,42 @@ private:
 		Db::FetchRequest p_request;
 	};
 
+	class MultiFetchClosure {
+	public:
+		MultiFetchClosure(Db::Engine *engine, Connection *connection,
+				ResponseId response_id);
+		
+		void execute(size_t packet_size, const void *packet_buffer);
+
+	private:
+		void onData(std::vector<Db::FetchData> &batch);
+		void complete(Db::FetchError error);
+
+		Db::Engine *p_engine;
+		Connection *p_connection;
+		ResponseId p_responseId;
+
+		Db::MultiFetchRequest p_request;
+	};
+
+	class HistoryClosure {
+	public:
+		HistoryClosure(Db::Engine *engine, Connection *connection,
+				ResponseId response_id);
+		
+		void execute(size_t packet_size, const void *packet_buffer);
+
+	private:
+		void onData(std::vector<Db::VersionData> &batch);
+		void complete(Db::FetchError error);
+
+		Db::Engine *p_engine;
+		Connection *p_connection;
+		ResponseId p_responseId;
+
+		Db::HistoryRequest p_request;
+	};
+
 	class QueryClosure {
 	public:
 		QueryClosure(Db::Engine *engine, Connection *connection,
@@ -155,6 +191,21 @@ private:
 		Connection *p_connection;
 		ResponseId p_responseId;
 	};
+
+	class CheckIntegrityClosure {
+	public:
+		CheckIntegrityClosure(Db::Engine *engine, Connection *connection,
+				ResponseId response_id);
+		
+		void execute(size_t packet_size, const void *packet_buffer);
+
+	private:
+		void complete(const std::string &report);
+
+		Db::Engine *p_engine;
+		Connection *p_connection;
+		ResponseId p_responseId;
+	};
 };
 
 };
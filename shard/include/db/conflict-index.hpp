@@ -0,0 +1,56 @@
+#include <unordered_map>
+
+namespace Db {
+
+// remembers the documents that are modified or deleted by submitted
+// transactions and the documents whose sequence id is matched by their
+// constraints. a transaction is checked against all submitted
+// transactions with one hash lookup per mutation or constraint
+class ConflictIndex {
+public:
+	// returns true if a mutation and a constraint cannot be
+	// part of two transactions that are submitted at the same time
+	static bool conflicts(const Mutation &mutation, const Constraint &constraint);
+
+	// checks the constraints against the mutations of the submitted transactions
+	bool conflictsWithMutations(const std::vector<Constraint> &constraints);
+	// checks the mutations against the constraints of the submitted transactions
+	bool conflictsWithConstraints(const std::vector<Mutation> &mutations);
+
+	// must be called when a transaction is submitted and
+	// when it is committed or rolled back
+	void insert(const std::vector<Mutation> &mutations,
+			const std::vector<Constraint> &constraints);
+	void remove(const std::vector<Mutation> &mutations,
+			const std::vector<Constraint> &constraints);
+
+private:
+	struct Key {
+		int storageIndex;
+		DocumentId documentId;
+
+		bool operator== (const Key &other) const {
+			return storageIndex == other.storageIndex
+					&& documentId == other.documentId;
+		}
+	};
+	struct KeyHash {
+		size_t operator() (const Key &key) const {
+			return std::hash<DocumentId>()(key.documentId)
+					^ (size_t(key.storageIndex) << 48);
+		}
+	};
+	// the values count the transactions that reference the document
+	typedef std::unordered_map<Key, uint32_t, KeyHash> Counts;
+
+	static bool isIndexed(const Mutation &mutation);
+	static bool isIndexed(const Constraint &constraint);
+	static void increment(Counts &counts, const Key &key);
+	static void decrement(Counts &counts, const Key &key);
+
+	Counts p_mutations;
+	Counts p_constraints;
+};
+
+}
+
@@ -0,0 +1,62 @@
+
+#include <unordered_map>
+#include <mutex>
+
+namespace Db {
+
+// caches the latest version of frequently fetched documents.
+// entries share the budget of the CacheHost with the page caches.
+// an entry is valid for all snapshots after its version until a new
+// version of the document is written
+class DocumentCache {
+public:
+	DocumentCache(CacheHost *cache_host);
+
+	// documents up to this size are cached. zero disables the cache
+	void setLimit(size_t limit);
+	size_t getLimit();
+
+	// copies the cached version of the document if it is visible at sequence_id
+	bool lookup(DocumentId document_id, SequenceId sequence_id, FetchData &data);
+	// caches the latest version of a document. processed_id is a sequence
+	// that was processed before the version was read from the storage
+	void insert(DocumentId document_id, SequenceId version_id,
+			SequenceId processed_id, const std::string &buffer);
+	// must be called before a new version of the document is written
+	void invalidate(DocumentId document_id, SequenceId sequence_id);
+
+private:
+	// entries are always deleted as Entry
+	class Entry final : public Cacheable {
+	public:
+		Entry(DocumentCache *cache, DocumentId document_id,
+				SequenceId version_id, const std::string &buffer);
+
+		virtual void acquire();
+		virtual void release();
+		virtual int64_t getFootprint();
+
+		DocumentCache *cache;
+		DocumentId documentId;
+		SequenceId versionId;
+		std::string buffer;
+	};
+
+	enum {
+		// number of buckets that remember the last write to their documents
+		kWriteBuckets = 4096,
+		// memory that is used by an entry in addition to the document
+		kEntryOverhead = 128
+	};
+
+	CacheHost *p_cacheHost;
+	size_t p_limit;
+
+	std::mutex p_mutex;
+	std::unordered_map<DocumentId, Entry *> p_entries;
+	// inserts that raced with a write are rejected
+	SequenceId p_lastWrite[kWriteBuckets];
+};
+
+}
+
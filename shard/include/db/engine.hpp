@@ -3,10 +3,16 @@
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
+#include <set>
+#include <deque>
+#include <atomic>
 
 #include "ll/page-cache.hpp"
 #include "ll/write-ahead.hpp"
 
+#include "db/conflict-index.hpp"
+
 namespace Db {
 
 enum SubmitError {
@@ -41,6 +47,18 @@ public:
 
 	SequenceId currentSequenceId();
 
+	// snapshots pin the document versions that are visible at their sequence id.
+	// pinSnapshot() fails if garbage collection already passed the sequence id
+	SequenceId pinCurrentSnapshot();
+	bool pinSnapshot(SequenceId sequence_id);
+	void unpinSnapshot(SequenceId sequence_id);
+	// oldest sequence id that is visible to a pinned snapshot
+	SequenceId lowWaterMark();
+	// advances the garbage collection horizon to the low-water-mark,
+	// keeping retain sequence ids before the current one. returns the horizon;
+	// versions that are not visible at or after it can be removed
+	SequenceId advanceHorizon(SequenceId retain);
+
 	// begin a transaction. returns a transaction id
 	TransactionId transaction();
 	// add a mutation to an existing transaction
@@ -61,10 +79,22 @@ public:
 	void fetch(FetchRequest *fetch,
 			Async::Callback<void(FetchData &)> on_data,
 			Async::Callback<void(FetchError)> callback);
+	void multiFetch(MultiFetchRequest *fetch,
+			Async::Callback<void(std::vector<FetchData> &)> on_data,
+			Async::Callback<void(FetchError)> callback);
+	void history(HistoryRequest *request,
+			Async::Callback<void(std::vector<VersionData> &)> on_data,
+			Async::Callback<void(FetchError)> callback);
 
 	void query(QueryRequest *request,
 			Async::Callback<void(QueryData &)> report,
 			Async::Callback<void(QueryError)> callback);
+
+	// runs the integrity check of a storage or view driver
+	void checkStorage(int storage,
+			Async::Callback<void(const std::string &)> callback);
+	void checkView(int view,
+			Async::Callback<void(const std::string &)> callback);
 	
 	CacheHost *getCacheHost();
 	TaskPool *getProcessPool();
@@ -108,6 +138,7 @@ private:
 			kStateInCommitOrRollback
 		};
 
+		// takes a transaction from the pool or creates a new one
 		static Transaction *allocate();
 		
 		void refIncrement();
@@ -115,12 +146,43 @@ private:
 
 		std::vector<Mutation> mutations;
 		std::vector<Constraint> constraints;
+		// mutations grouped by storage. filled when the transaction is committed
+		std::unordered_map<int, std::vector<Mutation>> routedMutations;
 		
 		State state;
 	private:
-		Transaction() : p_refCount(1) { }
+		struct Pool {
+			std::mutex mutex;
+			std::vector<Transaction *> transactions;
+		};
+
+		enum {
+			// number of transactions that are kept for reuse
+			kPoolLimit = 1024,
+			// capacity that is reserved for mutations and constraints
+			kReserve = 8,
+			// larger vectors are not kept when a transaction is recycled
+			kRetainCapacity = 256
+		};
+
+		Transaction();
+
+		static Pool &getPool();
+		// clears the transaction and returns it to the pool
+		void release();
+
+		std::atomic<int> p_refCount;
+	};
+
+	// active transactions are distributed over independently locked shards
+	// so that clients do not serialize on p_mutex
+	struct TransactionShard {
+		std::mutex mutex;
+		std::unordered_map<TransactionId, Transaction *> transactions;
+	};
 
-		int p_refCount;
+	enum {
+		kTransactionShards = 64
 	};
 
 	StorageDriver *setupStorage(const std::string &driver,
@@ -129,8 +191,10 @@ private:
 			const std::string &identifier);
 	
 	void writeConfig();
+	// must be called when storages or views are added or removed
+	void updateRoutes();
 
-	bool compatible(Mutation &mutation, Constraint &constraint);
+	TransactionShard &getTransactionShard(TransactionId transaction_id);
 
 	CacheHost p_cacheHost;
 	TaskPool p_processPool;
@@ -138,11 +202,17 @@ private:
 	
 	std::unique_ptr<Linux::EventFd> p_eventFd;
 	std::deque<QueueItem> p_submitQueue;
+	// protects p_submitQueue
+	std::mutex p_queueMutex;
 
-	TransactionId p_nextTransactId;
+	std::atomic<TransactionId> p_nextTransactId;
 	SequenceId p_currentSequenceId;
-	std::unordered_map<TransactionId, Transaction *> p_activeTransactions;
-	std::vector<TransactionId> p_submittedTransactions;
+	TransactionShard p_transactionShards[kTransactionShards];
+	std::unordered_set<TransactionId> p_submittedTransactions;
+	// mutations and constraints of the submitted transactions
+	ConflictIndex p_conflictIndex;
+	std::multiset<SequenceId> p_pinnedSnapshots;
+	SequenceId p_horizon;
 	std::mutex p_mutex;
 
 	Ll::WriteAhead p_writeAhead;
@@ -150,37 +220,85 @@ private:
 	std::string p_path;
 	std::vector<StorageDriver*> p_storages;
 	std::vector<ViewDriver*> p_views;
+	// views that depend on each storage
+	std::vector<std::vector<int>> p_storageViews;
+
+	// queue item that passed validation
+	struct LogItem {
+		QueueItem queueItem;
+		Transaction *transaction;
+		SequenceId sequenceId;
+		Proto::LogEntry logEntry;
+	};
+
+	// writes validated items to the write-ahead log in the order in which
+	// they were validated. items that are queued while a batch is written
+	// make up the next batch. the batches are written on the I/O pool;
+	// all other methods run on the engine thread
+	class WriteAheadClosure {
+	public:
+		WriteAheadClosure(Engine *engine);
+
+		// the item is written once flush() is called
+		LogItem &append();
+		void flush();
 
+	private:
+		void writeBatch();
+		void onLogged(Error error);
+		void afterWrite();
+		void submitComplete(LogItem &item);
+		void commitComplete(LogItem &item);
+
+		Engine *p_engine;
+		LocalTaskQueue *p_taskQueue;
+
+		std::deque<LogItem> p_queue;
+		// only accessed by writeBatch() while p_writing is set
+		std::deque<LogItem> p_batch;
+		bool p_writing;
+	};
+
+	// validates queued items and assigns their sequence ids. an item is
+	// handed to the WriteAheadClosure once it is validated, so that
+	// validation of the next item overlaps the write of the previous one
 	class ProcessQueueClosure {
 	public:
-		ProcessQueueClosure(Engine *engine, Async::Callback<void()> callback);
+		ProcessQueueClosure(Engine *engine, WriteAheadClosure *write_ahead,
+				Async::Callback<void()> callback);
 
 		void process();
 
 	private:
+		// checks the state of a single document.
+		// the checks of a transaction run in parallel
+		struct StateCheck {
+			void onData(FetchData &data);
+			void onFetch(FetchError error);
+
+			ProcessQueueClosure *closure;
+			Constraint *constraint;
+			FetchRequest fetch;
+		};
+
 		void processSubmit();
-		void submitCheckConstraint();
-		void checkStateOnData(FetchData &data);
-		void checkStateOnFetch(FetchError error);
-		void submitComplete();
+		void checkConstraints();
+		void onCheckComplete();
+		void submitValidated();
 		void submitFailure(SubmitError error);
 		void processCommit();
-		void commitComplete();
-		void writeAhead();
-		void afterWriteAhead(Error error);
+		void writeAhead(SequenceId sequence_id);
 		void processRollback();
 
 		Engine *p_engine;
+		WriteAheadClosure *p_writeAhead;
 		
 		QueueItem p_queueItem;
 		Transaction *p_transaction;
-		SequenceId p_sequenceId;
-		Proto::LogEntry p_logEntry;
-		int p_index;
+		std::vector<StateCheck> p_checks;
+		size_t p_pendingChecks;
 		bool p_checkOkay;
 
-		FetchRequest p_fetch;
-
 		Async::Callback<void()> p_callback;
 	};
 
@@ -223,8 +341,9 @@ private:
 
 	class ReplayDataClosure : public ReplayClosure {
 	public:
+		// only mutations of the given storage are replayed
 		ReplayDataClosure(Engine *engine,
-				Sequenceable *sequenceable);
+				Sequenceable *sequenceable, int storage);
 
 	protected:
 		virtual void onTransaction(TransactionId id,
@@ -235,6 +354,7 @@ private:
 	
 	private:
 		Sequenceable *p_sequenceable;
+		int p_storage;
 	};
 };
 
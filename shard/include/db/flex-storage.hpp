@@ -3,6 +3,10 @@
 
 #include "ll/random-access-file.hpp"
 #include "ll/btree.hpp"
+#include "ll/compression.hpp"
+#include "ll/bloom-filter.hpp"
+
+#include "db/document-cache.hpp"
 
 namespace Db {
 
@@ -17,22 +21,33 @@ public:
 	
 	FlexStorage(Engine *engine);
 
-	virtual void createStorage();
+	virtual void createStorage(const Proto::StorageConfig &config);
 	virtual void loadStorage();
 
 	virtual DocumentId allocate();
 	
 	virtual void reinspect(Mutation &mutation);
+
+	virtual void checkIntegrity(Async::Callback<void(const std::string &)> callback);
 	
 protected:
 	virtual void processInsert(SequenceId sequence_id,
 			Mutation &mutation, Async::Callback<void(Error)> callback);
 	virtual void processModify(SequenceId sequence_id,
 			Mutation &mutation, Async::Callback<void(Error)> callback);
+	virtual void processDelete(SequenceId sequence_id,
+			Mutation &mutation, Async::Callback<void(Error)> callback);
+	virtual void afterSequence(SequenceId sequence_id);
 
 	virtual void processFetch(FetchRequest *fetch,
 			Async::Callback<void(FetchData &)> on_data,
 			Async::Callback<void(FetchError)> callback);
+	virtual void processMultiFetch(MultiFetchRequest *fetch,
+			Async::Callback<void(std::vector<FetchData> &)> on_data,
+			Async::Callback<void(FetchError)> callback);
+	virtual void processHistory(HistoryRequest *request,
+			Async::Callback<void(std::vector<VersionData> &)> on_data,
+			Async::Callback<void(FetchError)> callback);
 
 private:
 	struct Index {
@@ -50,22 +65,140 @@ private:
 		enum Fields {
 			kOffset = 0,
 			kLength = 8,
+			kRawLength = 12,
+			kSegment = 16,
+			kCodec = 20,
 			// size of the whole structure
-			kStructSize = 16
+			kStructSize = 24
 		};
 		
 		size_t offset;
+		// length of the stored record
 		size_t length;
+		// length of the document before compression
+		size_t rawLength;
+		int segment;
+		Ll::Compressor::Codec codec;
 	};
 
-	void writeIndex(void *buffer, const Index &index);
-	Index readIndex(const void *buffer);
+	// documents are appended to the active data segment. compaction copies
+	// the live records of the active segment to the other one
+	struct DataSegment {
+		DataSegment(const std::string &name,
+				CacheHost *cache_host, TaskPool *io_pool);
+
+		Ll::RandomAccessFile file;
+		// end of the data. compaction allocates concurrently to inserts
+		std::atomic<size_t> pointer;
+		// size of the records that were removed from the index
+		std::atomic<int64_t> garbage;
+	};
+
+	// index keys have a fixed size; the codec is inlined into the Btree
+	struct IndexCodec {
+		static constexpr size_t keySize() {
+			return Index::kStructSize;
+		}
+		static size_t keyLength(const Index &index) {
+			return Index::kStructSize;
+		}
+		static void writeKey(void *buffer, const Index &index) {
+			OS::packLe64((char*)buffer + Index::kDocumentId, index.documentId);
+			OS::packLe64((char*)buffer + Index::kSequenceId, index.sequenceId);
+		}
+		static Index readKey(const void *buffer, size_t length) {
+			assert(length == Index::kStructSize);
+			Index index;
+			index.documentId = OS::unpackLe64((char*)buffer + Index::kDocumentId);
+			index.sequenceId = OS::unpackLe64((char*)buffer + Index::kSequenceId);
+			return index;
+		}
+	};
+	typedef Btree<Index, IndexCodec> IndexTree;
+
+	int compareIndex(const Index &a, const Index &b);
+	static void packReference(char *buffer, const Reference &reference);
+	static Reference unpackReference(char *buffer);
+
+	enum {
+		// obsolete index entries are removed in batches of this size
+		kGcBatchSize = 256,
+		// segment of records that are stored inline in the index value
+		// directly after their reference
+		kInlineSegment = 2,
+		// segment of entries that mark a document as deleted
+		kTombstoneSegment = 3,
+		// multi fetches search the index again instead of iterating
+		// over more entries than this
+		kMultiFetchSkip = 64,
+		// number of documents or versions that are reported together
+		kReportBatch = 64,
+		// number of documents the first bloom filter is sized for
+		kFilterCapacity = 4096
+	};
+
+	void configure(const Proto::StorageConfig &config);
+	void startGc();
+	void finishGc();
+	void maybeCompact();
+	void finishCompaction(int source);
+	void dropSegment(int source);
+	// readers that do not keep the index latched while they read records
+	// must prevent compaction from dropping a segment
+	void acquireSegments();
+	void releaseSegments();
+	// new_document is false if the document might already be in the filter
+	void addToFilter(DocumentId document_id, bool new_document);
+	// false if the document certainly does not exist
+	bool mayExist(DocumentId document_id);
+	// starts a pending rebuild once all mutations of a batch are indexed
+	void maybeRebuildFilter();
+	void finishFilterRebuild();
 	
 	std::atomic<DocumentId> p_lastDocumentId;
-	size_t p_dataPointer;
+	// all versions up to this sequence are in the index
+	std::atomic<SequenceId> p_processedSequenceId;
 	
-	Btree<Index> p_indexTree;
-	Ll::RandomAccessFile p_dataFile;
+	IndexTree p_indexTree;
+	Ll::Compressor p_compressor;
+	DocumentCache p_documentCache;
+	DataSegment p_segments[2];
+	// only accessed by the sequencing closure
+	int p_activeSegment;
+
+	uint32_t p_gcInterval;
+	SequenceId p_retainSequences;
+	uint32_t p_retainVersions;
+	// only accessed by the sequencing closure
+	uint32_t p_batchesSinceGc;
+	bool p_gcRunning;
+	// another pass was requested while a pass was running
+	bool p_gcPending;
+	std::mutex p_gcMutex;
+
+	// documents up to this size are stored inline
+	size_t p_inlineThreshold;
+
+	uint32_t p_compactThreshold;
+	uint32_t p_compactBatch;
+	std::atomic<bool> p_compactRunning;
+	std::mutex p_segmentMutex;
+	int p_segmentReaders;
+	// segment that is dropped once the last reader is done or -1
+	int p_dropPending;
+
+	// contains the ids of all documents in the index. only accessed
+	// via std::atomic_load() and std::atomic_store()
+	std::shared_ptr<Ll::BloomFilter> p_filter;
+	uint32_t p_filterBitsPerKey;
+	// the following fields are protected by p_filterMutex
+	std::mutex p_filterMutex;
+	// number of documents in the index
+	size_t p_filterKeys;
+	// larger filter that replaces the current one after it was rebuilt
+	std::shared_ptr<Ll::BloomFilter> p_rebuiltFilter;
+	// the filter is full and must be rebuilt after the current batch
+	bool p_filterRebuildPending;
 
 	class InsertClosure {
 	public:
@@ -74,6 +207,8 @@ private:
 				Async::Callback<void(Error)> callback);
 
 		void apply();
+		// inserts an index entry without data that hides older versions
+		void applyTombstone();
 	
 	private:
 		void compareToInserted(const Index &other,
@@ -88,8 +223,10 @@ private:
 		Async::Callback<void(Error)> p_callback;
 		
 		Index p_index;
-		char p_refBuffer[Reference::kStructSize];
+		// the index value
+		std::string p_value;
 		
+		int p_segment;
 		Ll::RandomAccessFile::WriteClosure p_dataWrite;
 	};
 
@@ -105,21 +242,245 @@ private:
 	private:
 		void compareToFetched(const Index &other,
 				Async::Callback<void(int)> callback);
-		void onIndexFound(Btree<Index>::Ref ref);
+		void onIndexFound(IndexTree::Ref ref);
 		void onSeek();
 		void onDataRead();
+		void onForward();
+		void complete();
 
 		FlexStorage *p_storage;
 		DocumentId p_documentId;
 		SequenceId p_sequenceId;
+		SequenceId p_processedId;
 		Async::Callback<void(FetchData &)> p_onData;
 		Async::Callback<void(FetchError)> p_callback;
 
 		FetchData p_fetchData;
+		std::string p_value;
+		Reference p_reference;
+		// compressed records are read into this buffer
+		std::string p_dataBuffer;
+
+		Ll::RandomAccessFile::ReadClosure p_dataRead;
+		IndexTree::FindClosure p_btreeFind;
+		IndexTree::IterateClosure p_btreeIterate;
+	};
+
+	// fetches several documents in a single pass over the index.
+	// the document ids are sorted; the iterator moves forward from one
+	// document to the next unless they are far apart
+	class MultiFetchClosure {
+	public:
+		MultiFetchClosure(FlexStorage *storage, SequenceId sequence_id,
+				const std::vector<DocumentId> &document_ids,
+				Async::Callback<void(std::vector<FetchData> &)> on_data,
+				Async::Callback<void(FetchError)> callback);
+
+		void process();
+	
+	private:
+		void locate();
+		void compareToTarget(const Index &other,
+				Async::Callback<void(int)> callback);
+		void onFound(IndexTree::Ref ref);
+		void onEntry();
+		void onForward();
+		void finishDocument();
+		void onDataRead();
+		void nextDocument();
+		void complete();
+
+		FlexStorage *p_storage;
+		SequenceId p_sequenceId;
+		Async::Callback<void(std::vector<FetchData> &)> p_onData;
+		Async::Callback<void(FetchError)> p_callback;
+
+		std::vector<DocumentId> p_documentIds;
+		// document that is currently searched
+		size_t p_current;
+		// entries that were visited since the index was searched
+		int p_steps;
+		// the iterator reached the end of the index
+		bool p_exhausted;
+		// latest version of the current document at the snapshot
+		bool p_hasVersion;
+		SequenceId p_versionId;
+		std::string p_value;
+		Reference p_reference;
+		std::string p_dataBuffer;
+		std::vector<FetchData> p_batch;
+
+		Ll::RandomAccessFile::ReadClosure p_dataRead;
+		IndexTree::FindClosure p_btreeFind;
+		IndexTree::IterateClosure p_btreeIterate;
+	};
+
+	// reports the versions of a document. the versions are adjacent in the
+	// index; each record is read while its leaf is latched
+	class HistoryClosure {
+	public:
+		HistoryClosure(FlexStorage *storage, HistoryRequest *request,
+				Async::Callback<void(std::vector<VersionData> &)> on_data,
+				Async::Callback<void(FetchError)> callback);
+
+		void process();
+	
+	private:
+		void compareToFrom(const Index &other,
+				Async::Callback<void(int)> callback);
+		void onFound(IndexTree::Ref ref);
+		void onEntry();
+		void onDataRead();
+		void onForward();
+		void complete();
+
+		FlexStorage *p_storage;
+		HistoryRequest *p_request;
+		Async::Callback<void(std::vector<VersionData> &)> p_onData;
+		Async::Callback<void(FetchError)> p_callback;
+
+		std::string p_value;
+		Reference p_reference;
+		std::string p_dataBuffer;
+		std::vector<VersionData> p_batch;
+
+		Ll::RandomAccessFile::ReadClosure p_dataRead;
+		IndexTree::FindClosure p_btreeFind;
+		IndexTree::IterateClosure p_btreeIterate;
+	};
+
+	// adds the ids of all documents in the index to a new bloom filter.
+	// documents that are inserted during the scan are added by addToFilter()
+	class FilterRebuildClosure {
+	public:
+		FilterRebuildClosure(FlexStorage *storage,
+				std::shared_ptr<Ll::BloomFilter> filter);
+
+		void scan();
+	
+	private:
+		void onFound(IndexTree::Ref ref);
+		void onEntry();
+		void onForward();
+
+		FlexStorage *p_storage;
+		std::shared_ptr<Ll::BloomFilter> p_filter;
+
+		IndexTree::FindClosure p_btreeFind;
+		IndexTree::IterateClosure p_btreeIterate;
+	};
+
+	// removes index entries of versions that are invisible to all snapshots
+	// after the horizon. scans the index in batches and releases the
+	// leaf latches before the collected entries are removed.
+	// the index is compacted once a pass removed any entries
+	class GcClosure {
+	public:
+		GcClosure(FlexStorage *storage);
+
+		void collect();
+	
+	private:
+		void scan();
+		void compareToResume(const Index &other,
+				Async::Callback<void(int)> callback);
+		void onFound(IndexTree::Ref ref);
+		void onEntry();
+		void onForward();
+		void collectDocument();
+		void onRelease();
+		void removeNext();
+		void compareToRemoved(const Index &other,
+				Async::Callback<void(int)> callback);
+		void onRemove(bool removed);
+		void onCompact();
+
+		struct Version {
+			Index index;
+			Reference reference;
+		};
+
+		FlexStorage *p_storage;
+		SequenceId p_horizon;
+		// versions of the current document in ascending order
+		std::vector<Version> p_versions;
+		// obsolete versions of the current batch
+		std::vector<Version> p_obsolete;
+		size_t p_removeIndex;
+		Index p_removeKey;
+		std::string p_value;
+		// the next batch starts at this document
+		DocumentId p_resumeDocument;
+		bool p_finished;
+		// number of entries that this pass removed
+		size_t p_removedCount;
+
+		IndexTree::FindClosure p_btreeFind;
+		IndexTree::IterateClosure p_btreeIterate;
+		IndexTree::CompactClosure p_btreeCompact;
+	};
+
+	// moves the records of the source segment to the target segment.
+	// the index is scanned in batches; each record is copied before its
+	// reference is updated. yields to other tasks after every batch
+	class CompactClosure {
+	public:
+		CompactClosure(FlexStorage *storage, int source, int target);
+
+		void scan();
+	
+	private:
+		void compareToResume(const Index &other,
+				Async::Callback<void(int)> callback);
+		void onFound(IndexTree::Ref ref);
+		void onEntry();
+		void onForward();
+		void onRelease();
+		void copyNext();
+		void onDataRead();
+		void onDataWrite();
+		void compareToUpdated(const Index &other,
+				Async::Callback<void(int)> callback);
+		void onUpdate(bool updated);
+
+		struct Record {
+			Index index;
+			Reference reference;
+		};
+
+		FlexStorage *p_storage;
+		int p_source;
+		int p_target;
+		// records of the current batch
+		std::vector<Record> p_records;
+		size_t p_copyIndex;
+		std::string p_buffer;
+		Index p_updateKey;
+		std::string p_value;
+		// the next batch starts after this entry
+		Index p_resumeIndex;
+		bool p_finished;
 
 		Ll::RandomAccessFile::ReadClosure p_dataRead;
-		Btree<Index>::FindClosure p_btreeFind;
-		Btree<Index>::IterateClosure p_btreeIterate;
+		Ll::RandomAccessFile::WriteClosure p_dataWrite;
+		IndexTree::FindClosure p_btreeFind;
+		IndexTree::IterateClosure p_btreeIterate;
+	};
+
+	class CheckClosure {
+	public:
+		CheckClosure(FlexStorage *storage,
+				Async::Callback<void(const std::string &)> callback);
+
+		void check();
+	
+	private:
+		void onComplete();
+
+		FlexStorage *p_storage;
+		Async::Callback<void(const std::string &)> p_callback;
+
+		IndexTree::IntegrityClosure p_btreeCheck;
 	};
 };
 
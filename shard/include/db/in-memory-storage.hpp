@@ -0,0 +1,97 @@
+
+#include <atomic>
+#include <unordered_map>
+
+namespace Db {
+
+// keeps all versions in memory. documents are distributed over shards;
+// each shard maps document ids to their version chains.
+// the storage starts empty and is rebuilt by replaying the write-ahead log
+class InMemoryStorage : public QueuedStorageDriver {
+public:
+	class Factory : public StorageDriver::Factory {
+	public:
+		Factory();
+
+		virtual StorageDriver *newDriver(Engine *engine);
+	};
+
+	InMemoryStorage(Engine *engine);
+
+	virtual void createStorage(const Proto::StorageConfig &config);
+	virtual void loadStorage();
+
+	virtual DocumentId allocate();
+
+	virtual void reinspect(Mutation &mutation);
+
+protected:
+	virtual void processInsert(SequenceId sequence_id,
+			Mutation &mutation, Async::Callback<void(Error)> callback);
+	virtual void processModify(SequenceId sequence_id,
+			Mutation &mutation, Async::Callback<void(Error)> callback);
+	virtual void processDelete(SequenceId sequence_id,
+			Mutation &mutation, Async::Callback<void(Error)> callback);
+	virtual void afterSequence(SequenceId sequence_id);
+
+	virtual void processFetch(FetchRequest *fetch,
+			Async::Callback<void(FetchData &)> on_data,
+			Async::Callback<void(FetchError)> callback);
+	virtual void processMultiFetch(MultiFetchRequest *fetch,
+			Async::Callback<void(std::vector<FetchData> &)> on_data,
+			Async::Callback<void(FetchError)> callback);
+	virtual void processHistory(HistoryRequest *request,
+			Async::Callback<void(std::vector<VersionData> &)> on_data,
+			Async::Callback<void(FetchError)> callback);
+
+private:
+	struct Version {
+		SequenceId sequenceId;
+		bool deleted;
+		std::string buffer;
+	};
+	// versions in ascending order
+	typedef std::vector<Version> Chain;
+
+	struct Shard {
+		std::mutex mutex;
+		std::unordered_map<DocumentId, Chain> chains;
+	};
+
+	enum {
+		// number of independently locked shards
+		kShards = 64,
+		// number of documents or versions that are reported together
+		kReportBatch = 64
+	};
+
+	void configure(const Proto::StorageConfig &config);
+	Shard &getShard(DocumentId document_id);
+	void insertVersion(DocumentId document_id, SequenceId sequence_id,
+			bool deleted, const std::string &buffer);
+	// removes the versions that are invisible to all snapshots after
+	// the horizon. returns false if the document can be removed completely
+	bool pruneChain(Chain &chain, SequenceId horizon);
+	// finds the newest version up to the sequence id. must be called
+	// with the shard locked
+	static Version *findVersion(Chain &chain, SequenceId sequence_id);
+	// prunes all chains; runs on the process pool
+	void collectGarbage();
+
+	std::atomic<DocumentId> p_lastDocumentId;
+
+	uint32_t p_gcInterval;
+	SequenceId p_retainSequences;
+	uint32_t p_retainVersions;
+	// only accessed by the sequencing closure
+	uint32_t p_batchesSinceGc;
+	std::atomic<bool> p_gcRunning;
+	// horizon of the last garbage collection pass. chains are also
+	// pruned when a new version is inserted
+	std::atomic<SequenceId> p_horizon;
+
+	Shard p_shards[kShards];
+};
+
+}
+
@@ -1,6 +1,8 @@
 
 #include <cassert>
 #include <cstring>
+#include <atomic>
+#include <unordered_map>
 #include <v8.h>
 
 #include "ll/random-access-file.hpp"
@@ -21,14 +23,22 @@ public:
 
 	virtual void createView(const Proto::ViewConfig &config);
 	virtual void loadView();
+
+	virtual int getBaseStorage();
 	
 	virtual void reinspect(Mutation &mutation);
+
+	virtual void checkIntegrity(Async::Callback<void(const std::string &)> callback);
 	
 protected:
 	virtual void processInsert(SequenceId sequence_id,
 			Mutation &mutation, Async::Callback<void(Error)> callback);
 	virtual void processModify(SequenceId sequence_id,
 			Mutation &mutation, Async::Callback<void(Error)> callback);
+	virtual void processDelete(SequenceId sequence_id,
+			Mutation &mutation, Async::Callback<void(Error)> callback);
+	virtual void afterSequence(SequenceId sequence_id);
+	virtual bool requiresSnapshot(QueryRequest *query);
 	
 	virtual void processQuery(QueryRequest *request,
 			Async::Callback<void(QueryData &)> report,
@@ -38,18 +48,6 @@ private:
 	class JsInstance;
 	class JsScope;
 	
-	struct KeyRef {
-		enum Fields {
-			kOffset = 0,
-			kLength = 8,
-			// overall size of this struct
-			kStructSize = 12
-		};
-
-		int64_t offset;
-		int32_t length;
-	};
-
 	struct Link {
 		enum Fields {
 			kDocumentId = 0,
@@ -62,22 +60,67 @@ private:
 		SequenceId sequenceId;
 	};
 
-	void writeKeyRef(void *buffer, const KeyRef &key);
-	KeyRef readKeyRef(const void *buffer);
+	// orders entries with equal keys
+	static int compareLinks(const char *a, const char *b);
+
+	// serialized keys are stored inline in the order tree. each stored key
+	// ends with the link of its entry so that entries are unique and can be
+	// removed even if other documents have an equal key
+	typedef Btree<std::string, BtreeStringCodec> OrderTree;
+
+	// keys that exceed the maximal key length of the order tree are
+	// appended to the overflow file and replaced by a reference.
+	// serialized keys are UTF-8 so they never start with kOverflowTag
+	struct OverflowRef {
+		enum Fields {
+			kTag = 0,
+			kOffset = 1,
+			kLength = 9,
+			// overall size of this struct
+			kStructSize = 13
+		};
+	};
+	static const char kOverflowTag = '\xFF';
+
+	enum {
+		// the order tree is compacted after this many entries were removed
+		kCompactRemovals = 1024
+	};
 
 	void grabInstance(Async::Callback<void(JsInstance *)> callback);
 	void releaseInstance(JsInstance *instance);
 
+	void openOverflow();
+	// returns the key that is stored in the order tree for the given link
+	std::string storeKey(const std::string &key, const char *link);
+	v8::Local<v8::Value> deserializeStored(JsInstance *instance,
+			const std::string &stored);
+
+	void compactOrderTree();
+	void finishCompaction();
+
 	std::string p_scriptFile;
 	std::string p_storageName;
+	double p_prefetchFraction;
+	int p_prefetchDistance;
 
 	int p_storage;
-	Ll::RandomAccessFile p_keyFile;
-	Btree<KeyRef> p_orderTree;
+	OrderTree p_orderTree;
+	std::unique_ptr<Linux::File> p_overflowFile;
+	Linux::off_type p_overflowLength;
+	std::mutex p_overflowMutex;
+	OrderTree::CompactClosure p_compactClosure;
+	std::atomic<uint64_t> p_removedSinceCompact;
+	std::atomic<bool> p_compactRunning;
+	std::atomic<uint64_t> p_compactions;
+	// stored keys of the entries that the current batch inserted. later
+	// mutations of the same document in the batch must remove them
+	// because all versions of a batch share the same link
+	std::unordered_map<DocumentId, std::string> p_batchKeys;
+	std::mutex p_batchMutex;
 	std::stack<JsInstance *> p_idleInstances;
 	std::queue<Async::Callback<void(JsInstance *)>> p_waitForInstance;
 	std::mutex p_mutex;
-	size_t p_keyPointer;
 
 	class JsInstance {
 	friend class JsScope;
@@ -133,11 +176,21 @@ private:
 	
 	private:
 		void acquireInstance(JsInstance *instance);
-		void compareToBegin(const KeyRef &id,
+		void compareToBegin(const std::string &key,
+				Async::Callback<void(int)> callback);
+		void compareToCursor(const std::string &key,
+				Async::Callback<void(int)> callback);
+		int compareTo(const std::string &key, v8::Global<v8::Value> &bound);
+		void compareBeforeBegin(const std::string &key,
 				Async::Callback<void(int)> callback);
-		void doCompareToBegin();
-		void onFindBegin(Btree<KeyRef>::Ref ref);
+		void compareToEnd(const std::string &key,
+				Async::Callback<void(int)> callback);
+		void onCountBegin(uint64_t rank);
+		void onCountEnd(uint64_t rank);
+		void onOffsetRank(uint64_t rank);
+		void onFindBegin(OrderTree::Ref ref);
 		void fetchItem();
+		void nextItem();
 		void fetchItemLoop();
 		void onFetchData(FetchData &data);
 		void onFetchComplete(FetchError error);
@@ -149,53 +202,113 @@ private:
 		Async::Callback<void(QueryError)> p_onComplete;
 
 		JsInstance *p_instance;
-		char *p_compareBuffer;
-		int32_t p_compareLength;
-		Async::Callback<void(int)> p_compareCallback;
 		v8::Global<v8::Value> p_beginKey;
 		v8::Global<v8::Value> p_endKey;
+		// key of the current entry of descending queries
+		std::string p_cursorKey;
+		uint64_t p_beginRank;
 		SequenceId p_expectedSequenceId;
 		FetchRequest p_fetch;
 		QueryData p_queryData;
 		int p_fetchedCount;
 
-		Ll::RandomAccessFile::ReadClosure p_keyRead;
-		Btree<KeyRef>::FindClosure p_btreeFind;
-		Btree<KeyRef>::IterateClosure p_btreeIterate;
+		OrderTree::FindClosure p_btreeFind;
+		OrderTree::IterateClosure p_btreeIterate;
 	};
 
 	class InsertClosure {
 	public:
 		InsertClosure(JsView *view, DocumentId document_id,
-			SequenceId sequence_id, std::string buffer,
+			SequenceId sequence_id, std::string buffer, bool supersedes,
 			Async::Callback<void(Error)> callback);
 		
 		void apply();
 
 	private:
+		void onRemoved(Error error);
 		void acquireInstance(JsInstance *instance);
-		void afterWriteKey();
-		void compareToNew(const KeyRef &id,
+		void compareToNew(const std::string &key,
 				Async::Callback<void(int)> callback);
-		void doCompareToNew();
 		void onComplete();
 
 		JsView *p_view;
 		DocumentId p_documentId;
 		SequenceId p_sequenceId;
 		std::string p_buffer;
+		// the entry of the previous version is removed before inserting
+		bool p_supersedes;
 		Async::Callback<void(Error)> p_callback;
 
 		JsInstance *p_instance;
-		char *p_compareBuffer;
-		int32_t p_compareLength;
-		Async::Callback<void(int)> p_compareCallback;
 		v8::Global<v8::Value> p_newKey;
 		char p_linkBuffer[Link::kStructSize];
-		KeyRef p_insertKey;
+		std::string p_insertKey;
+	};
+
+	// removes the entry of the latest version before the deletion or
+	// modification. if an earlier mutation of the same batch inserted
+	// that entry its stored key is known already. otherwise the version
+	// is fetched from a pinned snapshot; if the snapshot is behind
+	// the horizon already the order tree is scanned for its link
+	class DeleteClosure {
+	public:
+		DeleteClosure(JsView *view, DocumentId document_id,
+			SequenceId sequence_id, Async::Callback<void(Error)> callback);
+		
+		void apply();
+
+	private:
+		void onFetchData(FetchData &data);
+		void onFetchComplete(FetchError error);
+		void scan();
+		void onScanFirst(OrderTree::Ref ref);
+		void onScanEntry();
+		void onScanForward();
+		void onScanComplete();
+		void acquireInstance(JsInstance *instance);
+		void compareToOld(const std::string &key,
+				Async::Callback<void(int)> callback);
+		void onRemove(bool removed);
+
+		JsView *p_view;
+		DocumentId p_documentId;
+		SequenceId p_sequenceId;
+		Async::Callback<void(Error)> p_callback;
+
+		FetchRequest p_fetch;
+		bool p_found;
+		SequenceId p_versionId;
+		std::string p_buffer;
+		// stored key of the entry if it was inserted by the same batch
+		// or if it was found by a scan
+		std::string p_storedKey;
+
+		JsInstance *p_instance;
+		v8::Global<v8::Value> p_oldKey;
+		std::string p_removeKey;
+		char p_linkBuffer[Link::kStructSize];
+
+		OrderTree::FindClosure p_btreeFind;
+		OrderTree::IterateClosure p_btreeIterate;
+	};
+
+	class CheckClosure {
+	public:
+		CheckClosure(JsView *view,
+				Async::Callback<void(const std::string &)> callback);
 		
-		Ll::RandomAccessFile::WriteClosure p_keyWrite;
-		Ll::RandomAccessFile::ReadClosure p_keyRead;
+		void check();
+
+	private:
+		void acquireInstance(JsInstance *instance);
+		int compareKeys(const std::string &a, const std::string &b);
+		void onComplete();
+
+		JsView *p_view;
+		Async::Callback<void(const std::string &)> p_callback;
+
+		JsInstance *p_instance;
+		OrderTree::IntegrityClosure p_btreeCheck;
 	};
 };
 
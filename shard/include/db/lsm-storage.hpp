@@ -0,0 +1,346 @@
+
+#include <atomic>
+#include <map>
+
+#include "ll/random-access-file.hpp"
+#include "ll/bloom-filter.hpp"
+
+namespace Db {
+
+// log-structured storage. sequenced versions are collected in a memtable
+// that is written to an immutable segment file once it is full.
+// segments are organized in levels; level 0 contains flushed memtables
+// that may overlap, deeper levels are sorted and do not overlap.
+// background compaction merges a level into the next one and drops
+// versions that are hidden behind the garbage collection horizon
+class LsmStorage : public QueuedStorageDriver {
+public:
+	class Factory : public StorageDriver::Factory {
+	public:
+		Factory();
+
+		virtual StorageDriver *newDriver(Engine *engine);
+	};
+
+	LsmStorage(Engine *engine);
+
+	virtual void createStorage(const Proto::StorageConfig &config);
+	virtual void loadStorage();
+
+	virtual DocumentId allocate();
+
+	virtual void reinspect(Mutation &mutation);
+
+protected:
+	virtual void processInsert(SequenceId sequence_id,
+			Mutation &mutation, Async::Callback<void(Error)> callback);
+	virtual void processModify(SequenceId sequence_id,
+			Mutation &mutation, Async::Callback<void(Error)> callback);
+	virtual void processDelete(SequenceId sequence_id,
+			Mutation &mutation, Async::Callback<void(Error)> callback);
+	virtual void afterSequence(SequenceId sequence_id);
+
+	virtual void processFetch(FetchRequest *fetch,
+			Async::Callback<void(FetchData &)> on_data,
+			Async::Callback<void(FetchError)> callback);
+	virtual void processMultiFetch(MultiFetchRequest *fetch,
+			Async::Callback<void(std::vector<FetchData> &)> on_data,
+			Async::Callback<void(FetchError)> callback);
+	virtual void processHistory(HistoryRequest *request,
+			Async::Callback<void(std::vector<VersionData> &)> on_data,
+			Async::Callback<void(FetchError)> callback);
+
+private:
+	struct Key {
+		DocumentId documentId;
+		SequenceId sequenceId;
+
+		bool operator< (const Key &other) const {
+			if(documentId != other.documentId)
+				return documentId < other.documentId;
+			return sequenceId < other.sequenceId;
+		}
+	};
+	struct Version {
+		bool deleted;
+		std::string buffer;
+	};
+	typedef std::pair<Key, Version> Entry;
+
+	// records are stored in key order. a segment is divided into blocks
+	// of roughly the block size; records do not cross block boundaries
+	// unless they are larger than a block
+	struct Record {
+		enum Fields {
+			kDocumentId = 0,
+			kSequenceId = 8,
+			kFlags = 16,
+			kLength = 20,
+			// size of the header that precedes the document
+			kHeaderSize = 24
+		};
+		enum Flags {
+			kFlagDeleted = 1
+		};
+	};
+
+	struct Memtable {
+		Memtable() : size(0) { }
+
+		std::map<Key, Version> entries;
+		// approximate memory usage of the entries
+		size_t size;
+	};
+
+	// first key of a block and its offset in the segment
+	struct Fence {
+		Key key;
+		int64_t offset;
+	};
+
+	struct Segment {
+		Ll::RandomAccessFile *file;
+		int64_t size;
+		// segments never split the versions of a document
+		DocumentId minDocument;
+		DocumentId maxDocument;
+		std::vector<Fence> fences;
+		// null if filters are disabled
+		std::unique_ptr<Ll::BloomFilter> filter;
+	};
+
+	// sources of versions at some point in time. the storage replaces
+	// the whole structure when a memtable is flushed or compaction finishes
+	struct Tree {
+		// memtables that are being flushed, newest first
+		std::vector<std::shared_ptr<Memtable>> frozen;
+		// level 0 is ordered from newest to oldest;
+		// the other levels are ordered by document id
+		std::vector<std::vector<std::shared_ptr<Segment>>> levels;
+	};
+
+	// contents of a segment that is being built
+	struct SegmentImage {
+		SegmentImage() : blockStart(0) { }
+
+		std::string data;
+		std::vector<Fence> fences;
+		std::vector<DocumentId> documents;
+		int64_t blockStart;
+	};
+
+	enum {
+		// memory that is used by a memtable entry in addition to the document
+		kEntryOverhead = 64,
+		// number of documents or versions that are reported together
+		kReportBatch = 64
+	};
+
+	void configure(const Proto::StorageConfig &config);
+	void insertVersion(DocumentId document_id, SequenceId sequence_id,
+			bool deleted, const std::string &buffer);
+	void appendRecord(SegmentImage &image, const Key &key, const Version &version);
+	static void decodeRecords(const char *data, size_t length,
+			std::vector<Entry> &entries);
+	// finds the newest version of the document up to the sequence id
+	static bool findInMemtable(Memtable &memtable, DocumentId document_id,
+			SequenceId sequence_id, Key &key, Version &version);
+	static bool findInBlock(const char *data, size_t length,
+			DocumentId document_id, SequenceId sequence_id,
+			Key &key, Version &version);
+	// searches the active memtable and returns the tree that contains
+	// all other versions. the frozen memtables are searched too
+	std::shared_ptr<Tree> snapshot(DocumentId document_id,
+			SequenceId sequence_id, bool &found, Key &key, Version &version);
+	// segments that might contain the document, newest first
+	void collectSegments(Tree &tree, DocumentId document_id,
+			std::vector<Segment *> &segments);
+	// returns the range of blocks that contain the keys
+	static void locateBlocks(Segment *segment, const Key &first,
+			const Key &last, int64_t &offset, int64_t &length);
+
+	// takes a file from the free list or creates a new one
+	Ll::RandomAccessFile *allocateFile();
+	// recycles the file once no snapshot references the segment
+	std::shared_ptr<Segment> manageSegment(Segment *segment);
+	void freeSegment(Segment *segment);
+
+	// the following methods must be called with p_treeMutex locked
+	void startFlush();
+	void maybeCompact();
+	int64_t levelLimit(int level);
+
+	std::atomic<DocumentId> p_lastDocumentId;
+
+	size_t p_blockSize;
+	size_t p_memtableLimit;
+	size_t p_segmentSize;
+	uint32_t p_levelRatio;
+	uint32_t p_level0Segments;
+	uint32_t p_filterBitsPerKey;
+	SequenceId p_retainSequences;
+	uint32_t p_retainVersions;
+
+	// protects p_memtable. a frozen memtable is moved to p_tree with the
+	// mutex locked so that snapshots always see it in one of them
+	std::mutex p_memtableMutex;
+	std::shared_ptr<Memtable> p_memtable;
+	// only accessed via std::atomic_load() and std::atomic_store()
+	std::shared_ptr<Tree> p_tree;
+
+	// the following fields are protected by p_treeMutex
+	std::mutex p_treeMutex;
+	bool p_flushRunning;
+	bool p_compactRunning;
+	// compaction of a level continues after the last compacted document
+	std::vector<DocumentId> p_compactCursor;
+
+	std::mutex p_fileMutex;
+	std::vector<std::unique_ptr<Ll::RandomAccessFile>> p_files;
+	std::vector<Ll::RandomAccessFile *> p_freeFiles;
+
+	// finds the latest version of a document at a snapshot
+	class LookupClosure {
+	public:
+		LookupClosure(LsmStorage *storage);
+
+		void lookup(DocumentId document_id, SequenceId sequence_id,
+				Async::Callback<void(bool)> callback);
+
+		Key &getKey();
+		Version &getVersion();
+
+	private:
+		void readBlock();
+		void onBlockRead();
+
+		LsmStorage *p_storage;
+		DocumentId p_documentId;
+		SequenceId p_sequenceId;
+		Async::Callback<void(bool)> p_callback;
+
+		Key p_key;
+		Version p_version;
+		std::shared_ptr<Tree> p_tree;
+		std::vector<Segment *> p_segments;
+		size_t p_index;
+		std::string p_buffer;
+
+		Ll::RandomAccessFile::ReadClosure p_dataRead;
+	};
+
+	class FetchClosure {
+	public:
+		FetchClosure(LsmStorage *storage, FetchRequest *fetch,
+				Async::Callback<void(FetchData &)> on_data,
+				Async::Callback<void(FetchError)> callback);
+
+		void process();
+
+	private:
+		void onLookup(bool found);
+
+		LsmStorage *p_storage;
+		FetchRequest *p_fetch;
+		Async::Callback<void(FetchData &)> p_onData;
+		Async::Callback<void(FetchError)> p_callback;
+
+		LookupClosure p_lookup;
+	};
+
+	// looks up the documents one after another in ascending order
+	class MultiFetchClosure {
+	public:
+		MultiFetchClosure(LsmStorage *storage, MultiFetchRequest *fetch,
+				Async::Callback<void(std::vector<FetchData> &)> on_data,
+				Async::Callback<void(FetchError)> callback);
+
+		void process();
+
+	private:
+		void nextDocument();
+		void onLookup(bool found);
+		void complete();
+
+		LsmStorage *p_storage;
+		SequenceId p_sequenceId;
+		Async::Callback<void(std::vector<FetchData> &)> p_onData;
+		Async::Callback<void(FetchError)> p_callback;
+
+		std::vector<DocumentId> p_documentIds;
+		size_t p_current;
+		std::vector<FetchData> p_batch;
+
+		LookupClosure p_lookup;
+	};
+
+	// collects the versions of a document from all sources.
+	// the versions of a segment are read in one piece
+	class HistoryClosure {
+	public:
+		HistoryClosure(LsmStorage *storage, HistoryRequest *request,
+				Async::Callback<void(std::vector<VersionData> &)> on_data,
+				Async::Callback<void(FetchError)> callback);
+
+		void process();
+
+	private:
+		void collect(const Key &key, const Version &version);
+		void readBlocks();
+		void onBlocksRead();
+		void complete();
+
+		LsmStorage *p_storage;
+		HistoryRequest *p_request;
+		Async::Callback<void(std::vector<VersionData> &)> p_onData;
+		Async::Callback<void(FetchError)> p_callback;
+
+		std::shared_ptr<Tree> p_tree;
+		std::vector<Segment *> p_segments;
+		size_t p_index;
+		std::string p_buffer;
+		std::vector<VersionData> p_versions;
+
+		Ll::RandomAccessFile::ReadClosure p_dataRead;
+	};
+
+	// writes a frozen memtable to a level 0 segment or merges segments
+	// into the next level. the inputs are merged in memory; versions that
+	// are invisible to all snapshots after the horizon are dropped
+	class CompactClosure {
+	public:
+		CompactClosure(LsmStorage *storage, std::shared_ptr<Memtable> memtable,
+				std::vector<std::shared_ptr<Segment>> inputs,
+				int output_level, bool bottom);
+
+		void run();
+
+	private:
+		void readNext();
+		void onRead();
+		void merge();
+		void writeNext();
+		void onWrite();
+		void install();
+
+		LsmStorage *p_storage;
+		std::shared_ptr<Memtable> p_memtable;
+		std::vector<std::shared_ptr<Segment>> p_inputs;
+		int p_outputLevel;
+		// no older segment can contain versions of the merged documents.
+		// deleted documents are dropped completely in that case
+		bool p_bottom;
+
+		size_t p_index;
+		std::string p_buffer;
+		std::vector<Entry> p_entries;
+		std::vector<SegmentImage> p_images;
+		std::vector<std::shared_ptr<Segment>> p_outputs;
+
+		Ll::RandomAccessFile::ReadClosure p_dataRead;
+		Ll::RandomAccessFile::WriteClosure p_dataWrite;
+	};
+};
+
+}
+
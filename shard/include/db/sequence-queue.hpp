@@ -0,0 +1,137 @@
+#include <map>
+
+namespace Db {
+
+// applies the mutations that a SequenceQueue hands out
+class MutationProcessor {
+public:
+	virtual void processInsert(SequenceId sequence_id,
+			Mutation &mutation, Async::Callback<void(Error)> callback) = 0;
+	virtual void processModify(SequenceId sequence_id,
+			Mutation &mutation, Async::Callback<void(Error)> callback) = 0;
+	virtual void processDelete(SequenceId sequence_id,
+			Mutation &mutation, Async::Callback<void(Error)> callback) = 0;
+	// exclusive mutations are applied while no other mutation
+	// of the batch is in flight
+	virtual bool isExclusive(Mutation &mutation) = 0;
+	// called after all mutations of a batch have been applied
+	virtual void afterSequence(SequenceId sequence_id) = 0;
+};
+
+// applies sequenced mutations one batch at a time on behalf of a
+// queued storage or view driver. mutations of the same document are
+// applied in order; different documents are applied concurrently
+class SequenceQueue {
+public:
+	SequenceQueue(MutationProcessor *processor);
+
+	// starts applying batches; must be called once the driver is set up
+	void process();
+
+	void sequence(SequenceId sequence_id,
+			std::vector<Mutation> &mutations,
+			Async::Callback<void()> callback);
+	void advance(SequenceId sequence_id);
+
+	// returns true if all batches up to the sequence id have been applied
+	bool isApplied(SequenceId sequence_id);
+	// calls the callback once all batches up to the sequence id have been
+	// applied. requests use this to wait until their snapshot is complete
+	void waitFor(SequenceId sequence_id, Async::Callback<void()> callback);
+	// like waitFor() but no further batch is applied until releaseSnapshot()
+	// is called, so the data of the driver reflects exactly this snapshot.
+	// *held is set to false and no hold is taken if a batch after the
+	// snapshot has been applied already
+	void holdSnapshot(SequenceId sequence_id, bool *held,
+			Async::Callback<void()> callback);
+	void releaseSnapshot();
+
+private:
+	struct SequenceQueueItem {
+		SequenceId sequenceId;
+		std::vector<Mutation> *mutations;
+		Async::Callback<void()> callback;
+		// value of p_advancedSequenceId when the batch was queued
+		SequenceId advancedBefore;
+	};
+
+	struct Waiter {
+		Async::Callback<void()> callback;
+		// nullptr unless the waiter holds the snapshot
+		bool *held;
+	};
+
+	enum {
+		// number of documents whose mutations are applied concurrently
+		kParallelChains = 64
+	};
+
+	// applies the mutations of a batch in phases. a phase contains a single
+	// exclusive mutation or a run of other mutations
+	class ProcessClosure {
+	public:
+		ProcessClosure(SequenceQueue *queue);
+
+		void process();
+
+	private:
+		class ChainClosure {
+		public:
+			ChainClosure(ProcessClosure *process);
+
+			void apply();
+
+			// mutations of the document in sequence order
+			std::vector<size_t> indices;
+
+		private:
+			void onItem(Error error);
+
+			ProcessClosure *p_process;
+			size_t p_position;
+		};
+
+		void processSequence();
+		void onChainComplete();
+		void finishSequence();
+
+		SequenceQueue *p_queue;
+
+		SequenceQueueItem p_sequenceItem;
+		// first mutation of the next phase
+		size_t p_index;
+		std::vector<std::unique_ptr<ChainClosure>> p_chains;
+		// the following fields are protected by p_chainMutex
+		std::mutex p_chainMutex;
+		size_t p_nextChain;
+		size_t p_pendingChains;
+	};
+
+	// raises p_currentSequenceId and hands the waiters that
+	// became ready to the local task queue. unlocks the mutex
+	void applied(std::unique_lock<std::mutex> &lock, SequenceId sequence_id);
+	// must be called with p_mutex locked
+	bool tryHold(SequenceId sequence_id);
+
+	MutationProcessor *p_processor;
+
+	// all sequence ids up to this one have been applied
+	SequenceId p_currentSequenceId;
+	// latest sequence id that was passed to advance()
+	SequenceId p_advancedSequenceId;
+	// sequence id of the last batch that was applied
+	SequenceId p_lastBatchSequenceId;
+	// a batch is being applied
+	bool p_sequencing;
+	// number of held snapshots; batches are not started while it is non-zero
+	int p_holds;
+
+	std::queue<SequenceQueueItem> p_sequenceQueue;
+	// callbacks of waitFor() and holdSnapshot() by the sequence id they wait for
+	std::multimap<SequenceId, Waiter> p_waiters;
+	std::unique_ptr<Linux::EventFd> p_eventFd;
+	std::mutex p_mutex;
+};
+
+};
+
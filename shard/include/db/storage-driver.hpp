@@ -3,6 +3,8 @@
 
 #include <Config.pb.h>
 
+#include "db/sequence-queue.hpp"
+
 namespace Db {
 
 class Engine;
@@ -19,6 +21,27 @@ struct FetchData {
 	std::string buffer;
 };
 
+// fetches several documents at the same snapshot
+struct MultiFetchRequest {
+	int storageIndex;
+	SequenceId sequenceId;
+	std::vector<DocumentId> documentIds;
+};
+
+// lists the versions of a document in a range of sequence ids
+struct HistoryRequest {
+	int storageIndex;
+	DocumentId documentId;
+	SequenceId fromSequenceId;
+	SequenceId toSequenceId;
+};
+
+struct VersionData {
+	SequenceId sequenceId;
+	bool deleted;
+	std::string buffer;
+};
+
 enum FetchError {
 	kFetchNone = 0,
 	kFetchSuccess = 1,
@@ -44,7 +67,7 @@ public:
 
 	StorageDriver(Engine *engine) : p_engine(engine) { };
 
-	virtual void createStorage() = 0;
+	virtual void createStorage(const Proto::StorageConfig &config) = 0;
 	virtual void loadStorage() = 0;
 	
 	// returns an unused and unique document id.
@@ -55,6 +78,19 @@ public:
 	virtual void fetch(FetchRequest *fetch,
 			Async::Callback<void(FetchData &)> on_data,
 			Async::Callback<void(FetchError)> callback) = 0;
+	// reports the documents in batches ordered by id.
+	// documents that do not exist are skipped
+	virtual void multiFetch(MultiFetchRequest *fetch,
+			Async::Callback<void(std::vector<FetchData> &)> on_data,
+			Async::Callback<void(FetchError)> callback) = 0;
+	// reports the retained versions in ascending order, including deletions
+	virtual void history(HistoryRequest *request,
+			Async::Callback<void(std::vector<VersionData> &)> on_data,
+			Async::Callback<void(FetchError)> callback) = 0;
+	
+	// verifies the data structures of the storage while requests
+	// are being processed. the callback receives a human readable report
+	virtual void checkIntegrity(Async::Callback<void(const std::string &)> callback);
 
 	inline Engine *getEngine() {
 		return p_engine;
@@ -98,17 +134,27 @@ private:
 	std::vector<StorageDriver::Factory*> p_drivers;
 };
 
-class QueuedStorageDriver : public StorageDriver {
+// applies sequenced mutations one batch at a time.
+// requests are processed concurrently to the mutations;
+// drivers must synchronize access to their data structures themselves
+class QueuedStorageDriver : public StorageDriver, protected MutationProcessor {
 public:
 	QueuedStorageDriver(Engine *engine);
 
 	virtual void sequence(SequenceId sequence_id,
 			std::vector<Mutation> &mutations,
 			Async::Callback<void()> callback);
+	virtual void advance(SequenceId sequence_id);
 
 	virtual void fetch(FetchRequest *fetch,
 			Async::Callback<void(FetchData &)> on_data,
 			Async::Callback<void(FetchError)> callback);
+	virtual void multiFetch(MultiFetchRequest *fetch,
+			Async::Callback<void(std::vector<FetchData> &)> on_data,
+			Async::Callback<void(FetchError)> callback);
+	virtual void history(HistoryRequest *request,
+			Async::Callback<void(std::vector<VersionData> &)> on_data,
+			Async::Callback<void(FetchError)> callback);
 
 protected:
 	void processQueue();
@@ -119,50 +165,54 @@ protected:
 			Mutation &mutation, Async::Callback<void(Error)> callback) = 0;
 	virtual void processModify(SequenceId sequence_id,
 			Mutation &mutation, Async::Callback<void(Error)> callback) = 0;
+	virtual void processDelete(SequenceId sequence_id,
+			Mutation &mutation, Async::Callback<void(Error)> callback) = 0;
+	virtual bool isExclusive(Mutation &mutation);
+	virtual void afterSequence(SequenceId sequence_id);
 
 	virtual void processFetch(FetchRequest *fetch,
 			Async::Callback<void(FetchData &)> on_data,
 			Async::Callback<void(FetchError)> callback) = 0;
+	virtual void processMultiFetch(MultiFetchRequest *fetch,
+			Async::Callback<void(std::vector<FetchData> &)> on_data,
+			Async::Callback<void(FetchError)> callback) = 0;
+	virtual void processHistory(HistoryRequest *request,
+			Async::Callback<void(std::vector<VersionData> &)> on_data,
+			Async::Callback<void(FetchError)> callback) = 0;
 
 private:
-	struct SequenceQueueItem {
-		SequenceId sequenceId;
-		std::vector<Mutation> *mutations;
-		Async::Callback<void()> callback;
-	};
-	struct FetchQueueItem {
+	// a request that waits until the batches of its snapshot are applied
+	class DeferredClosure {
+	public:
+		enum Type {
+			kTypeFetch,
+			kTypeMultiFetch,
+			kTypeHistory
+		};
+
+		DeferredClosure(QueuedStorageDriver *driver, Type type);
+
+		void resume();
+
+		Type type;
 		FetchRequest *fetch;
-		Async::Callback<void(FetchData &)> onData;
+		MultiFetchRequest *multiFetch;
+		HistoryRequest *history;
+		Async::Callback<void(FetchData &)> onFetchData;
+		Async::Callback<void(std::vector<FetchData> &)> onMultiFetchData;
+		Async::Callback<void(std::vector<VersionData> &)> onHistoryData;
 		Async::Callback<void(FetchError)> callback;
-	};
-	
-	SequenceId p_currentSequenceId;
 
-	std::queue<SequenceQueueItem> p_sequenceQueue;
-	std::queue<FetchQueueItem> p_fetchQueue;
-	std::unique_ptr<Linux::EventFd> p_eventFd;
-	std::mutex p_mutex;
-	int p_activeRequests;
-	bool p_requestPhase;
-	
-	class ProcessClosure {
-	public:
-		ProcessClosure(QueuedStorageDriver *storage);
-
-		void process();
-	
 	private:
-		void endRequestPhase();
-		void sequencePhase();
-		void unqueueRequest();
-		void processSequence();
-		void onSequenceItem(Error error);
+		QueuedStorageDriver *p_driver;
+	};
 
-		QueuedStorageDriver *p_storage;
+	// requests cannot see sequence ids that the engine has not assigned yet
+	SequenceId snapshotOf(SequenceId sequence_id);
 
-		SequenceQueueItem p_sequenceItem;
-		int p_index;
-	};
+	SequenceQueue p_sequenceQueue;
+	std::mutex p_mutex;
+	int p_activeRequests;
 };
 
 extern StorageRegistry globStorageRegistry;
@@ -7,7 +7,7 @@ typedef int64_t SequenceId;
 
 struct Mutation {
 	enum Type {
-		kTypeNone, kTypeInsert, kTypeModify
+		kTypeNone, kTypeInsert, kTypeModify, kTypeDelete
 	};
 
 	Type type;
@@ -40,6 +40,9 @@ public:
 	virtual void sequence(SequenceId sequence_id,
 			std::vector<Mutation> &mutations,
 			Async::Callback<void()> callback) = 0;
+	// called instead of sequence() for sequence ids
+	// that do not contain a mutation that affects the driver
+	virtual void advance(SequenceId sequence_id) = 0;
 };
 
 }
@@ -15,8 +15,19 @@ struct QueryRequest {
 	std::string fromKey;
 	std::string toKey;
 	int limit;
-
-	QueryRequest() : useFromKey(false), useToKey(false), limit(-1) { }
+	// returns the entries in descending key order.
+	// the from key is the largest key that is returned in this case
+	bool descending;
+	// skipping entries and counting them requires order statistics.
+	// such queries fail with kQuerySnapshotTooOld if the view
+	// has already applied batches after their sequence id
+	uint64_t offset;
+	bool countOnly;
+	// result of countOnly queries
+	uint64_t count;
+
+	QueryRequest() : useFromKey(false), useToKey(false), limit(-1),
+			descending(false), offset(0), countOnly(false), count(0) { }
 };
 
 struct QueryData {
@@ -25,7 +36,9 @@ struct QueryData {
 
 enum QueryError {
 	kQueryNone = 0,
-	kQuerySuccess = 1
+	kQuerySuccess = 1,
+	kQueryIllegalRequest = 2,
+	kQuerySnapshotTooOld = 3
 };
 
 class ViewDriver : public Sequenceable {
@@ -52,9 +65,16 @@ public:
 	virtual void createView(const Proto::ViewConfig &config) = 0;
 	virtual void loadView() = 0;
 
+	// index of the storage whose mutations affect the view
+	virtual int getBaseStorage() = 0;
+
 	virtual void query(QueryRequest *request,
 			Async::Callback<void(QueryData &)> report,
 			Async::Callback<void(QueryError)> callback) = 0;
+	
+	// verifies the data structures of the view while requests
+	// are being processed. the callback receives a human readable report
+	virtual void checkIntegrity(Async::Callback<void(const std::string &)> callback);
 
 	inline Engine *getEngine() {
 		return p_engine;
@@ -98,13 +118,17 @@ private:
 	std::vector<ViewDriver::Factory*> p_drivers;
 };
 
-class QueuedViewDriver : public ViewDriver {
+// applies sequenced mutations one batch at a time.
+// requests are processed concurrently to the mutations;
+// drivers must synchronize access to their data structures themselves
+class QueuedViewDriver : public ViewDriver, protected MutationProcessor {
 public:
 	QueuedViewDriver(Engine *engine);
 
 	virtual void sequence(SequenceId sequence_id,
 			std::vector<Mutation> &mutations,
 			Async::Callback<void()> callback);
+	virtual void advance(SequenceId sequence_id);
 
 	virtual void query(QueryRequest *query,
 			Async::Callback<void(QueryData &)> on_data,
@@ -119,50 +143,45 @@ protected:
 			Mutation &mutation, Async::Callback<void(Error)> callback) = 0;
 	virtual void processModify(SequenceId sequence_id,
 			Mutation &mutation, Async::Callback<void(Error)> callback) = 0;
+	virtual void processDelete(SequenceId sequence_id,
+			Mutation &mutation, Async::Callback<void(Error)> callback) = 0;
+	virtual bool isExclusive(Mutation &mutation);
+	virtual void afterSequence(SequenceId sequence_id);
+
+	// returns true if the query must see the view exactly at its
+	// snapshot. no batch is applied while such a query is processed
+	virtual bool requiresSnapshot(QueryRequest *query);
 
 	virtual void processQuery(QueryRequest *query,
 			Async::Callback<void(QueryData &)> on_data,
 			Async::Callback<void(QueryError)> callback) = 0;
 
 private:
-	struct SequenceQueueItem {
-		SequenceId sequenceId;
-		std::vector<Mutation> *mutations;
-		Async::Callback<void()> callback;
-	};
-	struct QueryQueueItem {
-		QueryRequest *query;
-		Async::Callback<void(QueryData &)> onData;
-		Async::Callback<void(QueryError)> callback;
-	};
-	
-	SequenceId p_currentSequenceId;
-
-	std::queue<SequenceQueueItem> p_sequenceQueue;
-	std::queue<QueryQueueItem> p_queryQueue;
-	std::unique_ptr<Linux::EventFd> p_eventFd;
-	std::mutex p_mutex;
-	int p_activeRequests;
-	bool p_requestPhase;
-	
-	class ProcessClosure {
+	// a query that waits until the batches of its snapshot are applied
+	class DeferredClosure {
 	public:
-		ProcessClosure(QueuedViewDriver *view);
-
-		void process();
-	
-	private:
-		void endRequestPhase();
-		void sequencePhase();
-		void unqueueRequest();
-		void processSequence();
-		void onSequenceItem(Error error);
+		DeferredClosure(QueuedViewDriver *driver, QueryRequest *query,
+				Async::Callback<void(QueryData &)> on_data,
+				Async::Callback<void(QueryError)> callback);
 
-		QueuedViewDriver *p_view;
+		void resume();
+		// processes the query while the snapshot is held
+		void hold(SequenceId snapshot);
 
-		SequenceQueueItem p_sequenceItem;
-		int p_index;
+	private:
+		void onHeld();
+		void onComplete(QueryError error);
+
+		QueuedViewDriver *p_driver;
+		QueryRequest *p_query;
+		Async::Callback<void(QueryData &)> p_onData;
+		Async::Callback<void(QueryError)> p_callback;
+		bool p_held;
 	};
+
+	SequenceQueue p_sequenceQueue;
+	std::mutex p_mutex;
+	int p_activeRequests;
 };
 
 extern ViewRegistry globViewRegistry;
@@ -0,0 +1,37 @@
+#ifndef D3B_LL_BLOOM_FILTER_HPP
+#define D3B_LL_BLOOM_FILTER_HPP
+
+#include <cstdint>
+#include <atomic>
+#include <memory>
+
+namespace Ll {
+
+// approximate set of 64 bit keys without false negatives.
+// insert() and mayContain() can be called concurrently; a key is
+// visible to all lookups that start after insert() returned.
+// keys cannot be removed; the filter is rebuilt instead
+class BloomFilter {
+public:
+	// the false positive rate stays low until more than capacity
+	// keys are inserted
+	BloomFilter(size_t capacity, int bits_per_key);
+
+	size_t getCapacity() {
+		return p_capacity;
+	}
+
+	void insert(uint64_t key);
+	bool mayContain(uint64_t key);
+
+private:
+	size_t p_capacity;
+	size_t p_numBits;
+	int p_numProbes;
+	std::unique_ptr<std::atomic<uint64_t>[]> p_words;
+};
+
+} // namespace Ll
+
+#endif
+
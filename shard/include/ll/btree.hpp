@@ -3,32 +3,200 @@
 #define D3B_LL_BTREE_HPP
 
 #include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <atomic>
 
 #include <libchain/all.hpp>
 
 #include "ll/page-cache.hpp"
+#include "ll/latch.hpp"
+
+// result of Btree::IntegrityClosure.
+// the statistics are gathered while the tree is being modified;
+// they are only exact if there are no concurrent writers
+struct BtreeIntegrityReport {
+	enum {
+		// further errors are only counted
+		kMaxErrors = 100
+	};
+
+	BtreeIntegrityReport() : depth(0), numBlocks(0), freeBlocks(0),
+			innerBlocks(0), leafBlocks(0), entries(0),
+			innerBytesUsed(0), innerCapacity(0), leafBytesUsed(0), leafCapacity(0),
+			underfullBlocks(0), emptyLeaves(0), discontiguousLinks(0),
+			keysChecked(false), countsChecked(false), errorCount(0) { }
+
+	void addError(const std::string &error) {
+		if(errors.size() < kMaxErrors)
+			errors.push_back(error);
+		errorCount++;
+	}
+	bool ok() const {
+		return errorCount == 0;
+	}
+
+	std::string format() const {
+		auto percent = [] (uint64_t used, uint64_t capacity) {
+			return std::to_string(capacity != 0 ? used * 100 / capacity : 0) + "%";
+		};
+
+		std::string text;
+		text += "depth: " + std::to_string(depth) + "\n";
+		text += "blocks: " + std::to_string(numBlocks)
+				+ " (inner: " + std::to_string(innerBlocks)
+				+ ", leaves: " + std::to_string(leafBlocks)
+				+ ", free: " + std::to_string(freeBlocks) + ")\n";
+		text += "entries: " + std::to_string(entries) + "\n";
+		text += "inner fill factor: " + percent(innerBytesUsed, innerCapacity) + "\n";
+		text += "leaf fill factor: " + percent(leafBytesUsed, leafCapacity) + "\n";
+		text += "underfull blocks: " + std::to_string(underfullBlocks) + "\n";
+		text += "empty leaves: " + std::to_string(emptyLeaves) + "\n";
+		text += "discontiguous leaf links: " + std::to_string(discontiguousLinks)
+				+ " of " + std::to_string(leafBlocks > 0 ? leafBlocks - 1 : 0) + "\n";
+		if(!keysChecked)
+			text += "key order was not checked\n";
+		if(!countsChecked)
+			text += "subtree counts were not checked\n";
+		text += "errors: " + std::to_string(errorCount) + "\n";
+		for(auto it = errors.begin(); it != errors.end(); ++it)
+			text += "  " + *it + "\n";
+		if(errorCount > errors.size())
+			text += "  ...\n";
+		return text;
+	}
+
+	int32_t depth;
+	// number of blocks in the file including the file head
+	int32_t numBlocks;
+	int32_t freeBlocks;
+	int32_t innerBlocks;
+	int32_t leafBlocks;
+	uint64_t entries;
+	
+	uint64_t innerBytesUsed;
+	uint64_t innerCapacity;
+	uint64_t leafBytesUsed;
+	uint64_t leafCapacity;
+	// blocks (except for the root) that could be merged by a compaction
+	int32_t underfullBlocks;
+	int32_t emptyLeaves;
+	// leaves whose right neighbor is not the next block of the file
+	int32_t discontiguousLinks;
+	
+	bool keysChecked;
+	bool countsChecked;
+	std::vector<std::string> errors;
+	size_t errorCount;
+};
+
+// key codecs convert keys from and to their binary representation.
+// they provide keySize() (0 selects variable length keys),
+// keyLength(), writeKey() and readKey().
+// codecs with static inline members allow the compiler to
+// inline key accesses into the Btree code
 
+// codec that forwards to callbacks that are set at runtime
 template<typename KeyType>
+class BtreeCallbackCodec {
+public:
+	typedef Async::Callback<void(void *, const KeyType &)> WriteKeyCallback;
+	typedef Async::Callback<KeyType(const void*, size_t)> ReadKeyCallback;
+	typedef Async::Callback<size_t(const KeyType &)> KeyLengthCallback;
+
+	BtreeCallbackCodec(size_t key_size = 0) : p_keySize(key_size) { }
+
+	void setWriteKey(WriteKeyCallback write_key) {
+		p_writeKey = write_key;
+	}
+	void setReadKey(ReadKeyCallback read_key) {
+		p_readKey = read_key;
+	}
+	// only required for variable length keys
+	void setKeyLength(KeyLengthCallback key_length) {
+		p_keyLength = key_length;
+	}
+
+	size_t keySize() const {
+		return p_keySize;
+	}
+	size_t keyLength(const KeyType &key) {
+		return p_keySize != 0 ? p_keySize : p_keyLength(key);
+	}
+	void writeKey(void *buffer, const KeyType &key) {
+		p_writeKey(buffer, key);
+	}
+	KeyType readKey(const void *buffer, size_t length) {
+		return p_readKey(buffer, length);
+	}
+
+private:
+	size_t p_keySize;
+	ReadKeyCallback p_readKey;
+	WriteKeyCallback p_writeKey;
+	KeyLengthCallback p_keyLength;
+};
+
+// codec for variable length keys that are stored verbatim
+struct BtreeStringCodec {
+	static constexpr size_t keySize() {
+		return 0;
+	}
+	static size_t keyLength(const std::string &key) {
+		return key.size();
+	}
+	static void writeKey(void *buffer, const std::string &key) {
+		memcpy(buffer, key.data(), key.size());
+	}
+	static std::string readKey(const void *buffer, size_t length) {
+		return std::string((const char *)buffer, length);
+	}
+};
+
+template<typename KeyType, typename Codec = BtreeCallbackCodec<KeyType>>
 class Btree {
 public:
 	typedef int32_t BlkIndexType;
 
-	typedef Async::Callback<void(void *, const KeyType &)> WriteKeyCallback;
-	typedef Async::Callback<KeyType(const void*)> ReadKeyCallback;
+private:
+	// uncompressed copies of node entries.
+	// used to rebuild nodes during splits and prefix changes
+	struct LeafEntry {
+		std::string key;
+		std::string value;
+	};
+	struct InnerEntry {
+		std::string key;
+		BlkIndexType ref;
+		// number of entries in the subtree; only used with order statistics
+		uint64_t count;
+	};
+	// an inner block on the path of a writer and the index of the next child
+	struct PathEntry {
+		BlkIndexType number;
+		char *buffer;
+		BlkIndexType index;
+	};
+
+public:
 	typedef Async::Callback<void(const KeyType &, Async::Callback<void(int)>)> UnaryCompareCallback;
 	typedef Async::Callback<int(const KeyType &, const KeyType &)> BinaryCompareCallback;
 
 	Btree(std::string name,
 			size_t block_size,
-			size_t key_size,
 			size_t val_size,
 			CacheHost *cache_host,
-			TaskPool *io_pool);
+			TaskPool *io_pool,
+			Codec codec = Codec());
 
+	// refs returned by FindClosure keep their leaf latched.
+	// they must be passed to IterateClosure::seek() or releaseRef()
 	class Ref {
 	friend class Btree;
 	public:
-		Ref() : block(-1), entry(-1) {
+		Ref() : block(-1), entry(-1), buffer(nullptr) {
 		}
 		
 		bool valid() const {
@@ -44,24 +212,44 @@ public:
 		}
 		
 	private:
-		Ref(BlkIndexType block, BlkIndexType entry)
-				: block(block), entry(entry) {
+		Ref(BlkIndexType block, BlkIndexType entry, char *buffer = nullptr)
+				: block(block), entry(entry), buffer(buffer) {
 		}
 		
 		BlkIndexType block;
 		BlkIndexType entry;
+		// non-null if the ref holds the leaf's page and latch
+		char *buffer;
 	};
 
+	class FindClosure;
+
 	// FIXME: IterateClosure should properly deallocate memory
 	class IterateClosure {
 	public:
 		IterateClosure(Btree *tree) : p_tree(tree), p_block(0), p_entry(0),
-				p_buffer(nullptr) { }
+				p_buffer(nullptr), p_findClosure(new FindClosure(tree)),
+				p_nextBuffer(nullptr), p_nextEntry(0),
+				p_prefetchFraction(0), p_prefetchDistance(0), p_prefetchedFrom(0) { }
 		~IterateClosure();
+
+		// prefetches the neighbor in the direction of iteration once the iterator
+		// has passed the given fraction of the current leaf. if the leaves are
+		// stored contiguously up to distance leaves are read ahead.
+		// a distance of zero disables prefetching
+		void setPrefetch(double fraction, int distance) {
+			p_prefetchFraction = fraction;
+			p_prefetchDistance = distance;
+		}
 		
 		Ref position();
 		void seek(Ref ref, Async::Callback<void()> callback);
 		void forward(Async::Callback<void()> callback);
+		// moves to the previous entry. compare must compare keys to the
+		// current key; it is used to search for the previous entry again
+		// if the left neighbor cannot be latched without waiting
+		void backward(UnaryCompareCallback compare,
+				Async::Callback<void()> callback);
 		
 		bool valid() const {
 			return p_block > 0 && p_entry >= 0;
@@ -72,15 +260,48 @@ public:
 		void setValue(void *value);
 		
 	private:
+		void seekOnLatch();
 		void seekOnRead(char *buffer);
+		void forwardLoop();
+		void forwardOnLatch();
 		void forwardOnRead(char *buffer);
+		void backwardLoop();
+		void backwardOnRead(char *buffer);
+		// releases the current leaf and searches for its first entry's predecessor
+		void backwardReseek();
+		void backwardCompare(const KeyType &key, Async::Callback<void(int)> callback);
+		void backwardOnCompare(int result);
+		void backwardOnFind(Ref ref);
+		void backwardOnFirst(Ref ref);
+		void reseekLoop();
+		void reseekOnLatch();
+		void reseekOnRead(char *buffer);
+		void reseekOnCompare(int result);
+		void reseekFinish();
+		void prefetch(bool forward);
 
 		Btree *p_tree;
 		Async::Callback<void()> p_callback;
 
 		BlkIndexType p_block;
 		BlkIndexType p_entry;
+		BlkIndexType p_nextBlock;
 		char *p_buffer;
+
+		UnaryCompareCallback p_compare;
+		Async::Callback<void(int)> p_compareCallback;
+		FindClosure *p_findClosure;
+		// value of the entry that backward() started from and the
+		// leaf that contains the successor of the current entry
+		// while the iterator searches for that entry again
+		std::string p_seekValue;
+		char *p_nextBuffer;
+		BlkIndexType p_nextEntry;
+
+		double p_prefetchFraction;
+		int p_prefetchDistance;
+		// leaf that the last prefetch was issued from
+		BlkIndexType p_prefetchedFrom;
 	};
 
 	class SearchNodeClosure {
@@ -120,6 +341,7 @@ public:
 	private:
 		void splitLeaf();
 		void splitLeafOnInitialize(char *child_buffer);
+		void onLatchRightLink();
 		void onReadRightLink(char *link_buffer);
 		void splitInner();
 		void splitInnerOnInitialize(char *child_buffer);
@@ -132,13 +354,57 @@ public:
 		BlkIndexType p_blockNumber;
 		BlkIndexType p_blockIndex;
 		BlkIndexType p_leftSize;
-		BlkIndexType p_rightSize;
+		// entry counts of both halves; only used with order statistics
+		uint64_t p_leftCount;
+		uint64_t p_rightCount;
 		BlkIndexType p_splitNumber;
 		BlkIndexType p_rightLinkNumber;
 		BlkIndexType p_newRootNumber;
 		char *p_blockBuffer;
 		char *p_parentBuffer;
-		KeyType p_splitKey;
+		std::string p_splitKey;
+
+		std::vector<LeafEntry> p_leafEntries;
+		std::vector<InnerEntry> p_innerEntries;
+	};
+
+	class MergeClosure {
+	public:
+		MergeClosure(Btree *tree) : p_tree(tree) { }
+
+		// merges the child at child_index of an exclusively latched parent
+		// with one of its siblings or moves entries between them
+		void rebalance(BlkIndexType parent_num, char *parent_buf,
+				BlkIndexType child_index, Async::Callback<void()> on_complete);
+	
+	private:
+		void onLatchLeft();
+		void onReadLeft(char *buffer);
+		void onLatchRight();
+		void onReadRight(char *buffer);
+		void rebalanceLeaves();
+		void rebalanceInner();
+		void onLatchRightLink();
+		void onReadRightLink(char *link_buffer);
+		// recomputes the entry counts of both blocks in the parent
+		void updateCounts(bool has_right);
+		void complete();
+
+		Btree *p_tree;
+		Async::Callback<void()> p_onComplete;
+
+		BlkIndexType p_parentNumber;
+		char *p_parentBuffer;
+		// index of the separator between the two blocks in the parent
+		BlkIndexType p_sepIndex;
+		BlkIndexType p_leftNumber;
+		BlkIndexType p_rightNumber;
+		BlkIndexType p_rightLinkNumber;
+		char *p_leftBuffer;
+		char *p_rightBuffer;
+
+		std::vector<LeafEntry> p_leafEntries;
+		std::vector<InnerEntry> p_innerEntries;
 	};
 
 	template<typename CompareVs>
@@ -152,7 +418,7 @@ public:
 					// there are still items we need to look through
 					libchain::await<void(int)>([this, buffer, compare, index] (auto callback) {
 						// TODO: why do we need this-> here?
-						KeyType ent_key = p_readKey(buffer + this->p_keyOffInner(*index - 1));
+						KeyType ent_key = this->p_innerGetKey(buffer, *index - 1);
 						compare(ent_key, Async::transition(callback));
 					})
 					+ libchain::apply([index] (int result) {
@@ -183,7 +449,7 @@ public:
 					// there are still items we need to look through
 					libchain::await<void(int)>([this, buffer, compare, index] (auto callback) {
 						// TODO: why do we need this-> here?
-						KeyType ent_key = p_readKey(buffer + this->p_keyOffLeaf(*index - 1));
+						KeyType ent_key = this->p_leafGetKey(buffer, *index - 1);
 						compare(ent_key, Async::transition(callback));
 					})
 					+ libchain::apply([index] (int result) {
@@ -208,6 +474,7 @@ public:
 		struct Context {
 			Context(Btree *self, KeyType *key, void *value, CompareVs compare)
 			: self(self), key(key), value(value), compare(compare),
+					keyBytes(self->p_encodeKey(*key)), headLatched(false),
 					parentNumber(-1), parentBuffer(nullptr), indexInParent(0),
 					splitClosure(self) { }
 
@@ -215,6 +482,8 @@ public:
 			KeyType *key;
 			void *value;
 			CompareVs compare;
+			std::string keyBytes;
+			bool headLatched;
 
 			BlkIndexType parentNumber;
 			char *parentBuffer;
@@ -222,6 +491,7 @@ public:
 			BlkIndexType indexInParent;
 			BlkIndexType currentNumber;
 			char *currentBuffer;
+			std::vector<PathEntry> path;
 
 			SplitClosure splitClosure;
 		};
@@ -232,8 +502,23 @@ public:
 				return c->parentNumber == -1;
 			})
 			+ libchain::branch(
-				// we are at the root of the tree
-				libchain::apply([c] () {
+				// we are at the root of the tree. the file head stays latched
+				// until we know that the root is not going to be split
+				libchain::apply([c] () -> bool {
+					return !c->headLatched;
+				})
+				+ libchain::branch(
+					libchain::await<void()>([c] (auto callback) {
+						c->self->p_latches.acquireExclusive(kHeadLatch,
+								Async::transition(callback));
+					})
+					+ libchain::apply([c] () {
+						c->headLatched = true;
+					}),
+
+					libchain::apply([c] () { })
+				)
+				+ libchain::apply([c] () {
 					c->currentNumber = c->self->p_curFileHead.rootBlock;
 				}),
 
@@ -244,13 +529,17 @@ public:
 				+ libchain::apply([c] (int index) {
 					c->indexInParent = index;
 
-					char *ref_ptr = c->parentBuffer + (c->indexInParent >= 0
-							? c->self->p_refOffInner(c->indexInParent)
-							: c->self->p_lrefOffInner());
-					
-					c->currentNumber = OS::fromLeU32(*((BlkIndexType*)ref_ptr));
+					c->currentNumber = c->indexInParent >= 0
+							? c->self->p_innerGetRef(c->parentBuffer, c->indexInParent)
+							: c->self->p_innerGetLref(c->parentBuffer);
 				})
 			)
+			// writers latch all blocks exclusively.
+			// the parent block is still latched at this point
+			+ libchain::await<void()>([c] (auto callback) {
+				c->self->p_latches.acquireExclusive(c->currentNumber,
+						Async::transition(callback));
+			})
 			+ libchain::await<void(char *)>([c] (auto callback) {
 				c->self->p_pageCache.readPage(c->currentNumber,
 						Async::transition(callback));
@@ -262,7 +551,7 @@ public:
 			auto maybe_split_block =
 			read_block
 			+ libchain::apply([c] () -> bool {
-				return c->self->blockIsFull(c->currentBuffer);
+				return c->self->blockIsFull(c->currentBuffer, c->keyBytes);
 			})
 			+ libchain::branch(
 				// the current block is full: split it
@@ -275,12 +564,15 @@ public:
 					if(c->parentNumber != -1)
 						c->self->p_pageCache.writePage(c->parentNumber);
 					c->self->p_pageCache.writePage(c->currentNumber);
-					c->self->p_pageCache.releasePage(c->currentNumber);
+					c->self->p_releaseBlock(c->currentNumber);
 				})
 				// the correct block might have changed; re-read it
 				+ read_block
 				+ libchain::apply([c] () {
-					assert(!c->self->blockIsFull(c->currentBuffer));
+					// inner blocks always have room for a maximal entry after a split.
+					// leaves might still be too full if the new key breaks their prefix
+					assert((c->self->p_headGetFlags(c->currentBuffer) & BlockHead::kFlagIsLeaf)
+							|| !c->self->blockIsFull(c->currentBuffer, c->keyBytes));
 				}),
 
 				libchain::apply([c] () { })
@@ -289,40 +581,63 @@ public:
 			auto insert_or_descend =
 			maybe_split_block
 			+ libchain::apply([c] () -> bool {
-				int flags = c->self->p_headGetFlags(c->currentBuffer);
-				// TODO: remove those assertions
-				if(flags & BlockHead::kFlagIsLeaf) {
-					assert(c->self->p_leafGetEntCount(c->currentBuffer)
-							< c->self->p_entsPerLeaf());
-				}else{
-					assert(c->self->p_innerGetEntCount(c->currentBuffer)
-							< c->self->p_entsPerInner());
+				// the current block is not split anymore so the root cannot change
+				if(c->headLatched) {
+					c->self->p_latches.release(kHeadLatch);
+					c->headLatched = false;
 				}
+
+				int flags = c->self->p_headGetFlags(c->currentBuffer);
 				return flags & BlockHead::kFlagIsLeaf;
 			})
 			+ libchain::branch(
-				// it is a leaf: insert an entry here
-				libchain::compose([c] () {
-					return c->self->lowerBoundLeaf(c->currentBuffer, c->compare);
+				libchain::apply([c] () -> bool {
+					return !c->self->blockIsFull(c->currentBuffer, c->keyBytes);
 				})
-				+ libchain::apply([c] (int index) -> bool {
-					if(index >= 0) {
-						c->self->p_insertAtLeaf(c->currentBuffer, index + 1, *c->key, c->value);
-					}else{
-						c->self->p_insertAtLeaf(c->currentBuffer, 0, *c->key, c->value);
-					}
-					if(c->parentNumber != -1)
-						c->self->p_pageCache.releasePage(c->parentNumber);
-					c->self->p_pageCache.writePage(c->currentNumber);
-					c->self->p_pageCache.releasePage(c->currentNumber);
-					
-					return false;
-				}),
+				+ libchain::branch(
+					// it is a leaf: insert an entry here
+					libchain::compose([c] () {
+						return c->self->lowerBoundLeaf(c->currentBuffer, c->compare);
+					})
+					+ libchain::apply([c] (int index) -> bool {
+						if(index >= 0) {
+							c->self->p_insertAtLeaf(c->currentBuffer, index + 1,
+									c->keyBytes, c->value);
+						}else{
+							c->self->p_insertAtLeaf(c->currentBuffer, 0,
+									c->keyBytes, c->value);
+						}
+						if(c->parentNumber != -1)
+							c->self->p_retainOrRelease(c->path, c->parentNumber,
+									c->parentBuffer, c->indexInParent);
+						c->self->p_releasePath(c->path, 1);
+						c->self->p_pageCache.writePage(c->currentNumber);
+						c->self->p_releaseBlock(c->currentNumber);
+						
+						return false;
+					}),
+
+					// the leaf is still too full: restart at the root.
+					// the next pass splits the leaf again
+					libchain::apply([c] () -> bool {
+						if(c->parentNumber != -1)
+							c->self->p_retainOrRelease(c->path, c->parentNumber,
+									c->parentBuffer, c->indexInParent);
+						c->self->p_releasePath(c->path, 0);
+						c->self->p_releaseBlock(c->currentNumber);
+						c->parentNumber = -1;
+						c->parentBuffer = nullptr;
+						c->indexInParent = 0;
+
+						return true;
+					})
+				),
 
 				// it is an inner block: descent to the next block
 				libchain::apply([c] () -> bool {
 					if(c->parentNumber != -1)
-						c->self->p_pageCache.releasePage(c->parentNumber);
+						c->self->p_retainOrRelease(c->path, c->parentNumber,
+								c->parentBuffer, c->indexInParent);
 					c->parentBuffer = c->currentBuffer;
 					c->parentNumber = c->currentNumber;
 
@@ -334,189 +649,802 @@ public:
 		}, Context(this, key, value, compare));
 	}
 
-	class FindClosure {
-	public:
-		FindClosure(Btree *tree) : p_tree(tree), p_searchClosure(tree) { }
+	// removes the entry that compares equal to key.
+	// keys are expected to be unique. yields true if an entry was removed.
+	// underfull blocks on the path are merged with their siblings before descending
+	template<typename CompareVs>
+	auto remove(KeyType *key, CompareVs compare) {
+		struct Context {
+			Context(Btree *self, KeyType *key, CompareVs compare)
+			: self(self), key(key), compare(compare), headLatched(false),
+					parentNumber(-1), parentBuffer(nullptr), indexInParent(0),
+					found(false), mergeClosure(self) { }
 
-		void findFirst(Async::Callback<void(Ref)> on_complete);
-		void findNext(UnaryCompareCallback compare,
-				Async::Callback<void(Ref)> on_complete);
-		void findPrev(UnaryCompareCallback compare,
-				Async::Callback<void(Ref)> on_complete);
+			Btree *self;
+			KeyType *key;
+			CompareVs compare;
+			bool headLatched;
 
-	private:
-		void findFirstDescend();
-		void findFirstOnRead(char *buffer);
-		void findNextDescend();
-		void findNextOnRead(char *buffer);
-		void findNextOnFoundChild(int index);
-		void findNextInLeaf(int index);
-		void findPrevDescend();
-		void findPrevOnRead(char *buffer);
-		void findPrevOnFoundChild(int index);
-		void findPrevInLeaf(int index);
-		void findPrevReadLeft(char *buffer);
+			BlkIndexType parentNumber;
+			char *parentBuffer;
+		
+			BlkIndexType indexInParent;
+			BlkIndexType currentNumber;
+			char *currentBuffer;
+			std::vector<PathEntry> path;
+			BlkIndexType entryIndex;
+			bool found;
 
-		Btree *p_tree;
-		UnaryCompareCallback p_compare;
-		Async::Callback<void(Ref)> p_onComplete;
+			MergeClosure mergeClosure;
+		};
 
-		BlkIndexType p_blockNumber;
-		char *p_blockBuffer;
+		return libchain::contextify([] (auto c) {
+			auto read_block =
+			libchain::apply([c] () -> bool {
+				return c->parentNumber == -1;
+			})
+			+ libchain::branch(
+				// we are at the root of the tree. the file head stays latched
+				// until we know that the root is not going to be collapsed
+				libchain::apply([c] () -> bool {
+					return !c->headLatched;
+				})
+				+ libchain::branch(
+					libchain::await<void()>([c] (auto callback) {
+						c->self->p_latches.acquireExclusive(kHeadLatch,
+								Async::transition(callback));
+					})
+					+ libchain::apply([c] () {
+						c->headLatched = true;
+					}),
 
-		SearchNodeClosure p_searchClosure;
-	};
-	
-	void setPath(const std::string &path) {
-		p_path = path;
-	}
-	std::string getPath() {
-		return p_path;
-	}
-	
-	void setCompare(BinaryCompareCallback compare) {
-		p_compare = compare;
-	}
-	void setWriteKey(WriteKeyCallback write_key) {
-		p_writeKey = write_key;
-	}
-	void setReadKey(ReadKeyCallback read_key) {
-		p_readKey = read_key;
-	}
+					libchain::apply([c] () { })
+				)
+				+ libchain::apply([c] () {
+					c->currentNumber = c->self->p_curFileHead.rootBlock;
+				}),
 
-	void createTree() {
-		p_pageCache.open(p_path + "/" + p_name + ".btree");
+				libchain::compose([c] () {
+					return c->self->lowerBoundInner(c->parentBuffer, c->compare);
+				})
+				+ libchain::apply([c] (int index) {
+					c->indexInParent = index;
 
-		p_curFileHead.rootBlock = 1;
-		p_curFileHead.numBlocks = 2;
-		p_curFileHead.depth = 1;
+					c->currentNumber = c->indexInParent >= 0
+							? c->self->p_innerGetRef(c->parentBuffer, c->indexInParent)
+							: c->self->p_innerGetLref(c->parentBuffer);
+				})
+			)
+			+ libchain::await<void()>([c] (auto callback) {
+				c->self->p_latches.acquireExclusive(c->currentNumber,
+						Async::transition(callback));
+			})
+			+ libchain::await<void(char *)>([c] (auto callback) {
+				c->self->p_pageCache.readPage(c->currentNumber,
+						Async::transition(callback));
+			})
+			+ libchain::apply([c] (char *buffer) {
+				c->currentBuffer = buffer;
+			});
 
-		p_pageCache.initializePage(1, ASYNC_MEMBER(this, &Btree::createOnInitialize));
-	}
-	void createOnInitialize(char *root_block) {
-		p_headSetFlags(root_block, BlockHead::kFlagIsLeaf);
-		p_leafSetEntCount(root_block, 0);
-		p_leafSetLeftLink(root_block, 0);
-		p_leafSetRightLink(root_block, 0);
-		p_pageCache.writePage(1);
-		p_pageCache.releasePage(1);
-	}
+			auto maybe_merge_block =
+			read_block
+			+ libchain::apply([c] () -> bool {
+				return c->parentNumber != -1
+						&& c->self->p_innerGetEntCount(c->parentBuffer) > 0
+						&& c->self->blockIsUnderfull(c->currentBuffer);
+			})
+			+ libchain::branch(
+				// the current block is underfull: rebalance it
+				libchain::apply([c] () {
+					c->self->p_releaseBlock(c->currentNumber);
+				})
+				+ libchain::await<void()>([c] (auto callback) {
+					c->mergeClosure.rebalance(c->parentNumber, c->parentBuffer,
+							c->indexInParent, Async::transition(callback));
+				})
+				// the correct block might have changed; re-read it
+				+ read_block,
 
-//FIXME: this function should either be asynchronous
-// or there should be a synchronous read block function
-/*	void loadTree() {
-		p_pageCache.open(p_path + "/" + p_name + ".btree");
-		
-		readBlockSync(0, ASYNC_MEMBER(this, &Btree::onLoadFileHead));
-	}
-	void onLoadFileHead(char *desc_block) {
-		FileHead *file_head = (FileHead*)desc_block;
-		p_curFileHead.rootBlock = OS::fromLeU32(file_head->rootBlock);
-		p_curFileHead.numBlocks = OS::fromLeU32(file_head->numBlocks);
-		p_curFileHead.depth = OS::fromLeU32(file_head->depth);
-		p_pageCache.releasePage(0);
-	}*/
-	
-	void closeTree() {
+				libchain::apply([c] () { })
+			);
 
-	}
-	
-	void integrity(KeyType min, KeyType max) {
-		p_blockIntegrity(p_curFileHead.rootBlock, min, max);
-	}
-	
-	int32_t getDepth() {
-		return p_curFileHead.depth;
-	}
+			auto remove_or_descend =
+			maybe_merge_block
+			+ libchain::apply([c] () -> bool {
+				return c->parentNumber == -1
+						&& !(c->self->p_headGetFlags(c->currentBuffer) & BlockHead::kFlagIsLeaf)
+						&& c->self->p_innerGetEntCount(c->currentBuffer) == 0;
+			})
+			+ libchain::branch(
+				// the root only has a single child: make that child the new root
+				libchain::apply([c] () -> bool {
+					assert(c->headLatched);
+					c->self->p_curFileHead.rootBlock
+							= c->self->p_innerGetLref(c->currentBuffer);
+					c->self->p_curFileHead.depth--;
+					c->self->p_freeBlock(c->currentNumber);
 
-private:
-	typedef uint32_t flags_type;
-	struct FileHead {
-		BlkIndexType rootBlock;
-		BlkIndexType numBlocks;
-		BlkIndexType depth;
-	};
-	struct BlockHead {
-		enum {
-			kFlagIsLeaf = 1
-		};
+					return true;
+				}),
 
-		flags_type flags;
-	};
-	struct InnerHead {
-		BlockHead blockHead;
+				libchain::apply([c] () -> bool {
+					// the root cannot change anymore
+					if(c->headLatched) {
+						c->self->p_latches.release(kHeadLatch);
+						c->headLatched = false;
+					}
+
+					int flags = c->self->p_headGetFlags(c->currentBuffer);
+					return flags & BlockHead::kFlagIsLeaf;
+				})
+				+ libchain::branch(
+					// it is a leaf: remove the entry if it exists
+					libchain::compose([c] () {
+						return c->self->lowerBoundLeaf(c->currentBuffer, c->compare);
+					})
+					+ libchain::apply([c] (int index) -> bool {
+						c->entryIndex = index;
+						return index >= 0;
+					})
+					+ libchain::branch(
+						libchain::await<void(int)>([c] (auto callback) {
+							KeyType ent_key = c->self->p_leafGetKey(c->currentBuffer,
+									c->entryIndex);
+							c->compare(ent_key, Async::transition(callback));
+						})
+						+ libchain::apply([c] (int result) {
+							if(result != 0)
+								return;
+							c->self->p_removeAtLeaf(c->currentBuffer, c->entryIndex);
+							c->self->p_pageCache.writePage(c->currentNumber);
+							c->found = true;
+						}),
+
+						libchain::apply([c] () { })
+					)
+					+ libchain::apply([c] () -> bool {
+						if(c->parentNumber != -1)
+							c->self->p_retainOrRelease(c->path, c->parentNumber,
+									c->parentBuffer, c->indexInParent);
+						c->self->p_releasePath(c->path, c->found ? -1 : 0);
+						c->self->p_releaseBlock(c->currentNumber);
+						
+						return false;
+					}),
+
+					// it is an inner block: descent to the next block
+					libchain::apply([c] () -> bool {
+						if(c->parentNumber != -1)
+							c->self->p_retainOrRelease(c->path, c->parentNumber,
+									c->parentBuffer, c->indexInParent);
+						c->parentBuffer = c->currentBuffer;
+						c->parentNumber = c->currentNumber;
+
+						return true;
+					})
+				)
+			);
+
+			return libchain::repeat(remove_or_descend)
+			+ libchain::apply([c] () { return c->found; });
+		}, Context(this, key, compare));
+	}
+
+	// replaces the value of the entry that compares equal to key.
+	// yields true if the entry was found. the structure of the tree does not
+	// change so inner blocks are only latched shared; the leaf is latched exclusively
+	template<typename CompareVs>
+	auto update(KeyType *key, void *value, CompareVs compare) {
+		struct Context {
+			Context(Btree *self, KeyType *key, void *value, CompareVs compare)
+			: self(self), key(key), value(value), compare(compare),
+					level(0), found(false) { }
+
+			Btree *self;
+			KeyType *key;
+			void *value;
+			CompareVs compare;
+
+			// level of the block that is latched next; leaves are at level 1.
+			// levels do not change as the tree only grows and shrinks at the root
+			int level;
+			BlkIndexType currentNumber;
+			char *currentBuffer;
+			BlkIndexType childNumber;
+			BlkIndexType entryIndex;
+			bool found;
+		};
+
+		return libchain::contextify([] (auto c) {
+			auto read_child =
+			libchain::await<void()>([c] (auto callback) {
+				if(c->level == 1) {
+					c->self->p_latches.acquireExclusive(c->childNumber,
+							Async::transition(callback));
+				}else{
+					c->self->p_latches.acquireShared(c->childNumber,
+							Async::transition(callback));
+				}
+			})
+			+ libchain::apply([c] () {
+				// latch coupling: the parent is released once the child is latched
+				if(c->currentNumber == kHeadLatch) {
+					c->self->p_latches.release(kHeadLatch);
+				}else{
+					c->self->p_releaseBlock(c->currentNumber);
+				}
+				c->currentNumber = c->childNumber;
+			})
+			+ libchain::await<void(char *)>([c] (auto callback) {
+				c->self->p_pageCache.readPage(c->currentNumber,
+						Async::transition(callback));
+			})
+			+ libchain::apply([c] (char *buffer) {
+				c->currentBuffer = buffer;
+			});
+
+			auto update_or_descend =
+			read_child
+			+ libchain::apply([c] () -> bool {
+				int flags = c->self->p_headGetFlags(c->currentBuffer);
+				assert(!(flags & BlockHead::kFlagIsLeaf) || c->level == 1);
+				return flags & BlockHead::kFlagIsLeaf;
+			})
+			+ libchain::branch(
+				// it is a leaf: update the entry if it exists
+				libchain::compose([c] () {
+					return c->self->lowerBoundLeaf(c->currentBuffer, c->compare);
+				})
+				+ libchain::apply([c] (int index) -> bool {
+					c->entryIndex = index;
+					return index >= 0;
+				})
+				+ libchain::branch(
+					libchain::await<void(int)>([c] (auto callback) {
+						KeyType ent_key = c->self->p_leafGetKey(c->currentBuffer,
+								c->entryIndex);
+						c->compare(ent_key, Async::transition(callback));
+					})
+					+ libchain::apply([c] (int result) {
+						if(result != 0)
+							return;
+						std::memcpy(c->self->p_leafGetValue(c->currentBuffer, c->entryIndex),
+								c->value, c->self->p_valSize);
+						c->self->p_pageCache.writePage(c->currentNumber);
+						c->found = true;
+					}),
+
+					libchain::apply([c] () { })
+				)
+				+ libchain::apply([c] () -> bool {
+					c->self->p_releaseBlock(c->currentNumber);
+					return false;
+				}),
+
+				// it is an inner block: descent to the next block
+				libchain::compose([c] () {
+					return c->self->lowerBoundInner(c->currentBuffer, c->compare);
+				})
+				+ libchain::apply([c] (int index) -> bool {
+					c->childNumber = index >= 0
+							? c->self->p_innerGetRef(c->currentBuffer, index)
+							: c->self->p_innerGetLref(c->currentBuffer);
+					c->level--;
+					return true;
+				})
+			);
+
+			return libchain::await<void()>([c] (auto callback) {
+				c->self->p_latches.acquireShared(kHeadLatch,
+						Async::transition(callback));
+			})
+			+ libchain::apply([c] () {
+				c->currentNumber = kHeadLatch;
+				c->childNumber = c->self->p_curFileHead.rootBlock;
+				c->level = c->self->p_curFileHead.depth;
+			})
+			+ libchain::repeat(update_or_descend)
+			+ libchain::apply([c] () { return c->found; });
+		}, Context(this, key, value, compare));
+	}
+
+	// replaces the value at a position that was obtained from
+	// IterateClosure::position(). the entry must not have moved in the
+	// meantime, i.e. the caller must be the only writer of the tree
+	auto updateAt(Ref ref, void *value) {
+		struct Context {
+			Context(Btree *self, Ref ref, void *value)
+			: self(self), ref(ref), value(value) { }
+
+			Btree *self;
+			Ref ref;
+			void *value;
+		};
+
+		return libchain::contextify([] (auto c) {
+			return libchain::await<void()>([c] (auto callback) {
+				c->self->p_latches.acquireExclusive(c->ref.block,
+						Async::transition(callback));
+			})
+			+ libchain::await<void(char *)>([c] (auto callback) {
+				c->self->p_pageCache.readPage(c->ref.block,
+						Async::transition(callback));
+			})
+			+ libchain::apply([c] (char *buffer) {
+				assert(c->ref.entry < c->self->p_leafGetEntCount(buffer));
+				std::memcpy(c->self->p_leafGetValue(buffer, c->ref.entry),
+						c->value, c->self->p_valSize);
+				c->self->p_pageCache.writePage(c->ref.block);
+				c->self->p_releaseBlock(c->ref.block);
+			});
+		}, Context(this, ref, value));
+	}
+
+	class FindClosure {
+	public:
+		FindClosure(Btree *tree) : p_tree(tree), p_searchClosure(tree) { }
+
+		void findFirst(Async::Callback<void(Ref)> on_complete);
+		void findLast(Async::Callback<void(Ref)> on_complete);
+		void findNext(UnaryCompareCallback compare,
+				Async::Callback<void(Ref)> on_complete);
+		void findPrev(UnaryCompareCallback compare,
+				Async::Callback<void(Ref)> on_complete);
+
+		// the following functions require order statistics.
+		// rank() yields the number of entries that compare less or equal to the key
+		void rank(UnaryCompareCallback compare,
+				Async::Callback<void(uint64_t)> on_complete);
+		void count(Async::Callback<void(uint64_t)> on_complete);
+		// finds the entry with the given zero-based rank
+		void seekToRank(uint64_t rank, Async::Callback<void(Ref)> on_complete);
+
+	private:
+		// latch coupling: the child is latched before its parent is released
+		void descendFromRoot(Async::Callback<void(char *)> on_read);
+		void descendOnHeadLatch();
+		void descend(BlkIndexType child_number);
+		void descendOnLatch();
+		
+		void findFirstOnRead(char *buffer);
+		void findLastCompare(const KeyType &key, Async::Callback<void(int)> callback);
+		void findNextOnRead(char *buffer);
+		void findNextOnFoundChild(int index);
+		void findNextInLeaf(int index);
+		void findPrevOnRead(char *buffer);
+		void findPrevOnFoundChild(int index);
+		void findPrevInLeaf(int index);
+		void findPrevOnLatchLeft();
+		void findPrevReadLeft(char *buffer);
+		void findPrevRestart();
+		void rankOnRead(char *buffer);
+		void rankOnFoundChild(int index);
+		void rankInLeaf(int index);
+		void seekToRankOnRead(char *buffer);
+
+		Btree *p_tree;
+		UnaryCompareCallback p_compare;
+		Async::Callback<void(Ref)> p_onComplete;
+		Async::Callback<void(uint64_t)> p_onRank;
+		uint64_t p_rank;
+		Async::Callback<void(char *)> p_onRead;
+
+		BlkIndexType p_blockNumber;
+		BlkIndexType p_childNumber;
+		BlkIndexType p_rightNumber;
+		uint64_t p_epoch;
+		char *p_blockBuffer;
+
+		SearchNodeClosure p_searchClosure;
+	};
+
+	// merges underfull blocks of the whole tree.
+	// the tree is processed one inner block at a time so that concurrent
+	// requests are only blocked for short periods of time
+	class CompactClosure {
+	public:
+		CompactClosure(Btree *tree) : p_tree(tree), p_mergeClosure(tree) { }
+
+		void compact(Async::Callback<void()> on_complete);
+
+	private:
+		void step();
+		void onHeadLatch();
+		void onRootLatch();
+		void onRead(char *buffer);
+		void onChildLatch();
+		void rebalanceLoop();
+		void onCheckLatch();
+		void onCheckRead(char *buffer);
+		void onRebalance();
+		void finishBlock();
+		void advance();
+
+		Btree *p_tree;
+		Async::Callback<void()> p_onComplete;
+
+		// child indices that lead from the root to the current block
+		std::vector<BlkIndexType> p_path;
+		size_t p_level;
+		bool p_headLatched;
+		bool p_childrenAreLeaves;
+
+		BlkIndexType p_blockNumber;
+		BlkIndexType p_childNumber;
+		BlkIndexType p_childIndex;
+		char *p_blockBuffer;
+
+		MergeClosure p_mergeClosure;
+	};
+
+	// verifies the structure of the whole tree and gathers statistics.
+	// blocks are checked in parallel on a task pool while they are latched shared.
+	// inner blocks stay latched until all of their children are latched;
+	// this keeps the key bounds and entry counts passed to the children valid
+	// while writers modify other parts of the tree
+	class IntegrityClosure {
+	public:
+		IntegrityClosure(Btree *tree) : p_tree(tree), p_hasCompare(false) { }
+
+		// enables checking the key order.
+		// compare is called concurrently from the threads of the pool
+		void setCompare(BinaryCompareCallback compare) {
+			p_compare = compare;
+			p_hasCompare = true;
+		}
+
+		void check(TaskPool *pool, Async::Callback<void()> on_complete);
+
+		const BtreeIntegrityReport &getReport() {
+			return p_report;
+		}
+
+	private:
+		class BlockCheck {
+		public:
+			BlockCheck(IntegrityClosure *closure, BlockCheck *parent,
+					BlkIndexType number, int32_t level);
+
+			void run();
+
+			// bounds of the keys in this block; empty if unbounded
+			std::string lowerBound;
+			bool hasLowerBound;
+			std::string upperBound;
+			bool hasUpperBound;
+			// entry count of the subtree as stored in the parent
+			uint64_t expectedCount;
+
+		private:
+			void onLatch();
+			void onRead(char *buffer);
+			// validates the slot array and the heap. keys must
+			// not be accessed if this returns false
+			bool checkLayout(char *buffer, bool report_errors);
+			bool validRef(BlkIndexType number);
+			void checkKeys(const std::vector<std::string> &keys);
+			void checkLeaf();
+			void onRightLatch();
+			void onRightRead(char *buffer);
+			void checkInner();
+			void onChildLatch();
+			void finish();
+			void error(const std::string &message);
+
+			IntegrityClosure *p_closure;
+			Btree *p_tree;
+			BlockCheck *p_parent;
+			BlkIndexType p_number;
+			int32_t p_level;
+			char *p_buffer;
+
+			BlkIndexType p_rightNumber;
+			std::string p_lastKey;
+			// number of children that have not been latched yet
+			size_t p_pendingChildren;
+		};
+
+		void onHeadLatch();
+		void onBlockDone();
+
+		Btree *p_tree;
+		TaskPool *p_pool;
+		LocalTaskQueue *p_queue;
+		Async::Callback<void()> p_onComplete;
+
+		BinaryCompareCallback p_compare;
+		bool p_hasCompare;
+
+		// protects the report and the counters of all BlockChecks
+		std::mutex p_mutex;
+		size_t p_pendingBlocks;
+		BtreeIntegrityReport p_report;
+	};
+	
+	void setPath(const std::string &path) {
+		p_path = path;
+	}
+	std::string getPath() {
+		return p_path;
+	}
+	
+	void setCompare(BinaryCompareCallback compare) {
+		p_compare = compare;
+	}
+	Codec &getCodec() {
+		return p_codec;
+	}
+	// must be called before the tree is created
+	void setBlockSize(size_t block_size) {
+		p_blockSize = block_size;
+		p_pageCache.setPageSize(block_size);
+		p_checkBlockSize();
+	}
+	// slots store 16-bit offsets which limits the size of blocks
+	static bool isValidBlockSize(size_t block_size) {
+		return block_size >= 1024 && block_size <= 0x10000
+				&& (block_size & (block_size - 1)) == 0;
+	}
+	size_t getBlockSize() {
+		return p_blockSize;
+	}
+	// must be called before the tree is created
+	void setValueSize(size_t val_size) {
+		p_valSize = val_size;
+		p_checkBlockSize();
+	}
+	size_t getValueSize() {
+		return p_valSize;
+	}
+	// maintains the number of entries of each subtree in inner blocks.
+	// enables rank queries at the cost of holding all latches
+	// on the path of an insert or remove until the leaf is updated.
+	// must be called before the tree is created
+	void setOrderStatistics(bool enable) {
+		p_orderStatistics = enable;
+		assert(p_codec.keySize() <= getMaxKeyLength());
+	}
+	bool hasOrderStatistics() {
+		return p_orderStatistics;
+	}
+
+	void createTree() {
+		p_pageCache.open(p_path + "/" + p_name + ".btree");
+
+		p_curFileHead.rootBlock = 1;
+		p_curFileHead.numBlocks = 2;
+		p_curFileHead.depth = 1;
+
+		p_pageCache.initializePage(1, ASYNC_MEMBER(this, &Btree::createOnInitialize));
+	}
+	void createOnInitialize(char *root_block) {
+		p_headSetFlags(root_block, BlockHead::kFlagIsLeaf);
+		p_leafSetLeftLink(root_block, 0);
+		p_leafSetRightLink(root_block, 0);
+		p_leafBuild(root_block, std::vector<LeafEntry>(), 0, 0);
+		p_pageCache.writePage(1);
+		p_pageCache.releasePage(1);
+	}
+
+//FIXME: this function should either be asynchronous
+// or there should be a synchronous read block function
+/*	void loadTree() {
+		p_pageCache.open(p_path + "/" + p_name + ".btree");
+		
+		readBlockSync(0, ASYNC_MEMBER(this, &Btree::onLoadFileHead));
+	}
+	void onLoadFileHead(char *desc_block) {
+		FileHead *file_head = (FileHead*)desc_block;
+		p_curFileHead.rootBlock = OS::fromLeU32(file_head->rootBlock);
+		p_curFileHead.numBlocks = OS::fromLeU32(file_head->numBlocks);
+		p_curFileHead.depth = OS::fromLeU32(file_head->depth);
+		p_pageCache.releasePage(0);
+	}*/
+	
+	void closeTree() {
+
+	}
+	
+	int32_t getDepth() {
+		return p_curFileHead.depth;
+	}
+
+	// releases a ref that was not passed to IterateClosure::seek()
+	void releaseRef(Ref &ref) {
+		if(ref.buffer == nullptr)
+			return;
+		p_releaseBlock(ref.block);
+		ref.buffer = nullptr;
+	}
+
+	// longest key that can be stored in this tree
+	size_t getMaxKeyLength() {
+		size_t leaf_limit = (p_blockSize - sizeof(LeafHead)) / 4
+				- kSlotSize - p_valSize;
+		size_t inner_limit = (p_blockSize - sizeof(InnerHead) - p_refSizeInner()) / 4
+				- kSlotSize - p_refSizeInner();
+		return std::min(leaf_limit, inner_limit);
+	}
+
+private:
+	typedef uint32_t flags_type;
+	struct FileHead {
+		BlkIndexType rootBlock;
+		BlkIndexType numBlocks;
+		BlkIndexType depth;
+	};
+	struct BlockHead {
+		enum {
+			kFlagIsLeaf = 1
+		};
+
+		flags_type flags;
+	};
+	// blocks are slotted pages: a slot array grows from the front of the block
+	// while the entries themselves are allocated from a heap at the end of the block.
+	// inner blocks contain: InnerHead, leftmost child reference, slots, heap
+	// leaves contain: LeafHead, common key prefix, slots, heap
+	struct InnerHead {
+		BlockHead blockHead;
 		BlkIndexType entCount2;
+		BlkIndexType heapOffset2;
 	};
 	struct LeafHead {
 		BlockHead blockHead;
 		BlkIndexType entCount2;
 		BlkIndexType leftLink2;
 		BlkIndexType rightLink2;
+		BlkIndexType prefixLength2;
+		BlkIndexType heapOffset2;
+	};
+	// each slot stores the 16-bit heap offset and the 16-bit key length of an entry.
+	// for leaves the key length only covers the suffix that follows the prefix
+	enum {
+		kSlotSize = 4
+	};
+	// prefixed keys up to this length are reassembled on the stack
+	enum {
+		kKeyBufferSize = 64
+	};
+
+	// latch 0 protects the file head (i.e. the root block number and depth).
+	// the remaining latches protect the block with the same number
+	enum {
+		kHeadLatch = 0
 	};
 
 	BinaryCompareCallback p_compare;
-	ReadKeyCallback p_readKey;
-	WriteKeyCallback p_writeKey;
+	Codec p_codec;
 
 	std::string p_path;
 	std::string p_name;
 	PageCache p_pageCache;
 	
 	size_t p_blockSize;
-	size_t p_keySize;
 	size_t p_valSize;
+	bool p_orderStatistics;
 
 	FileHead p_curFileHead;
 
-	size_t p_entsPerInner() {
-		return (p_blockSize - sizeof(InnerHead) - sizeof(BlkIndexType))
-			/ (p_keySize + sizeof(BlkIndexType));
+	LatchTable p_latches;
+	std::mutex p_allocMutex;
+	// blocks that were freed by merges. they are reused by p_allocBlock()
+	std::vector<BlkIndexType> p_freeBlocks;
+	// incremented whenever a block is freed. readers that follow
+	// links without holding a latch use this to detect stale links
+	std::atomic<uint64_t> p_freeEpoch;
+
+	// releases the page and the latch of a block
+	void p_releaseBlock(BlkIndexType number) {
+		p_pageCache.releasePage(number);
+		p_latches.release(number);
 	}
-	size_t p_entsPerLeaf() {
-		return (p_blockSize - sizeof(LeafHead))
-			/ (p_keySize + p_valSize);
+	// writers have to keep their path latched if the tree maintains order
+	// statistics as the counts are only updated once the leaf is modified
+	void p_retainOrRelease(std::vector<PathEntry> &path, BlkIndexType number,
+			char *buffer, BlkIndexType index) {
+		if(p_orderStatistics) {
+			path.push_back(PathEntry{ number, buffer, index });
+		}else{
+			p_releaseBlock(number);
+		}
 	}
+	// adds delta to the counts along a retained path and releases it
+	void p_releasePath(std::vector<PathEntry> &path, int64_t delta) {
+		for(auto it = path.begin(); it != path.end(); ++it) {
+			if(delta != 0) {
+				p_childSetCount(it->buffer, it->index,
+						p_childGetCount(it->buffer, it->index) + delta);
+				p_pageCache.writePage(it->number);
+			}
+			p_releaseBlock(it->number);
+		}
+		path.clear();
+	}
+
+	void p_checkBlockSize();
 
-	// size of an entry in an inner node
-	// entries consist of key + reference to child block
-	size_t p_entSizeInner() {
-		return p_keySize + sizeof(BlkIndexType);
+	// size of a child reference in an inner node.
+	// with order statistics each reference is followed by the subtree's entry count
+	size_t p_refSizeInner() {
+		return sizeof(BlkIndexType) + (p_orderStatistics ? sizeof(uint64_t) : 0);
 	}
-	// offset of an entry in an inner node
-	size_t p_entOffInner(int i) {
-		return sizeof(InnerHead) + sizeof(BlkIndexType)
-				+ p_entSizeInner() * i;
+	// size of the largest possible entry in an inner node
+	// entries consist of slot + reference to child block + key
+	size_t p_maxEntSizeInner() {
+		return kSlotSize + p_refSizeInner() + getMaxKeyLength();
 	}
 	// offset of the leftmost child reference
 	// it does not belong to an entry and thus must be special cased
 	size_t p_lrefOffInner() {
 		return sizeof(InnerHead);
 	}
-	size_t p_keyOffInner(int i) {
-		return p_entOffInner(i);
+	size_t p_slotOffInner(int i) {
+		return sizeof(InnerHead) + p_refSizeInner() + kSlotSize * i;
+	}
+
+	size_t p_prefixOffLeaf() {
+		return sizeof(LeafHead);
 	}
-	size_t p_refOffInner(int i) {
-		return p_entOffInner(i) + p_keySize;
+	size_t p_slotOffLeaf(char *block_buf, int i) {
+		return sizeof(LeafHead) + p_leafGetPrefixLength(block_buf) + kSlotSize * i;
 	}
 
-	size_t p_entSizeLeaf() {
-		return p_keySize + p_valSize;
+	static size_t p_slotGetOffset(const char *slot) {
+		return (size_t)(uint8_t)slot[0] | ((size_t)(uint8_t)slot[1] << 8);
 	}
-	size_t p_entOffLeaf(int i) {
-		return sizeof(LeafHead) + p_entSizeLeaf() * i;
+	static size_t p_slotGetLength(const char *slot) {
+		return (size_t)(uint8_t)slot[2] | ((size_t)(uint8_t)slot[3] << 8);
 	}
-	size_t p_valOffLeaf(int i) {
-		return p_entOffLeaf(i);
+	static void p_slotSet(char *slot, size_t offset, size_t length) {
+		slot[0] = offset & 0xFF;
+		slot[1] = (offset >> 8) & 0xFF;
+		slot[2] = length & 0xFF;
+		slot[3] = (length >> 8) & 0xFF;
 	}
-	size_t p_keyOffLeaf(int i) {
-		return p_entOffLeaf(i) + p_valSize;
+	static size_t p_commonPrefix(const char *a, size_t a_length,
+			const char *b, size_t b_length) {
+		size_t n = 0;
+		while(n < a_length && n < b_length && a[n] == b[n])
+			n++;
+		return n;
 	}
+
+	std::string p_encodeKey(const KeyType &key);
+
+	// key, value and reference accessors
+	// leaf keys are reassembled from the block's prefix and the entry's suffix
+	void p_leafGetKeyBytes(char *block_buf, int i, std::string &bytes);
+	KeyType p_leafGetKey(char *block_buf, int i);
+	char *p_leafGetValue(char *block_buf, int i);
+	void p_innerGetKeyBytes(char *block_buf, int i, std::string &bytes);
+	KeyType p_innerGetKey(char *block_buf, int i);
+	BlkIndexType p_innerGetRef(char *block_buf, int i);
+	BlkIndexType p_innerGetLref(char *block_buf);
+	void p_innerSetLref(char *block_buf, BlkIndexType ref);
+
+	// subtree entry counts; only available with order statistics.
+	// child index -1 refers to the leftmost child
+	uint64_t p_innerGetCount(char *block_buf, int i);
+	void p_innerSetCount(char *block_buf, int i, uint64_t count);
+	uint64_t p_innerGetLrefCount(char *block_buf);
+	void p_innerSetLrefCount(char *block_buf, uint64_t count);
+	uint64_t p_childGetCount(char *block_buf, int index);
+	void p_childSetCount(char *block_buf, int index, uint64_t count);
+	// number of entries in the subtree rooted at a block
+	uint64_t p_blockCount(char *block_buf);
+
+	size_t p_leafFreeSpace(char *block_buf);
+	size_t p_innerFreeSpace(char *block_buf);
 	
 	flags_type p_headGetFlags(char *block_buf);
 	void p_headSetFlags(char *block_buf, flags_type flags);
 
 	BlkIndexType p_innerGetEntCount(char *block_buf);
 	void p_innerSetEntCount(char *block_buf, BlkIndexType ent_count);
+	BlkIndexType p_innerGetHeapOffset(char *block_buf);
+	void p_innerSetHeapOffset(char *block_buf, BlkIndexType offset);
 	
 	BlkIndexType p_leafGetEntCount(char *block_buf);
 	void p_leafSetEntCount(char *block_buf, BlkIndexType ent_count);
@@ -524,22 +1452,73 @@ private:
 	void p_leafSetLeftLink(char *block_buf, BlkIndexType link);
 	BlkIndexType p_leafGetRightLink(char *block_buf);
 	void p_leafSetRightLink(char *block_buf, BlkIndexType link);
+	BlkIndexType p_leafGetPrefixLength(char *block_buf);
+	void p_leafSetPrefixLength(char *block_buf, BlkIndexType length);
+	BlkIndexType p_leafGetHeapOffset(char *block_buf);
+	void p_leafSetHeapOffset(char *block_buf, BlkIndexType offset);
+
+	// copy all entries of a block into uncompressed entry vectors
+	void p_leafExtract(char *block_buf, std::vector<LeafEntry> &entries);
+	void p_innerExtract(char *block_buf, std::vector<InnerEntry> &entries);
+	// rewrite the entries of a block from a range of an entry vector.
+	// the leaf prefix is recomputed; flags and links are not touched
+	void p_leafBuild(char *block_buf, const std::vector<LeafEntry> &entries,
+			size_t begin, size_t end);
+	void p_innerBuild(char *block_buf, BlkIndexType lref, uint64_t lref_count,
+			const std::vector<InnerEntry> &entries, size_t begin, size_t end);
 
 	void p_insertAtLeaf(char *block, BlkIndexType i,
-			const KeyType &key, void *value);
+			const std::string &key, void *value);
 	void p_insertAtInnerR(char *block, int i,
-			const KeyType &key, BlkIndexType ref);
+			const std::string &key, BlkIndexType ref);
 	
 	BlkIndexType p_allocBlock() {	
+		std::lock_guard<std::mutex> lock(p_allocMutex);
+		if(!p_freeBlocks.empty()) {
+			BlkIndexType number = p_freeBlocks.back();
+			p_freeBlocks.pop_back();
+			return number;
+		}
 		BlkIndexType number = p_curFileHead.numBlocks;
 		p_curFileHead.numBlocks++;
 		return number;
 	}
+	// releases the page and the latch of an exclusively latched block
+	// and allows the block to be reused
+	void p_freeBlock(BlkIndexType number) {
+		p_pageCache.releasePage(number);
+		{
+			std::lock_guard<std::mutex> lock(p_allocMutex);
+			p_freeBlocks.push_back(number);
+			p_freeEpoch++;
+		}
+		p_latches.release(number);
+	}
 
-	bool blockIsFull(char *block_buf);
+	// returns true if the block has to be split before key can be inserted.
+	// inner blocks must be able to take a separator of maximal length
+	bool blockIsFull(char *block_buf, const std::string &key);
+	// returns true if less than a quarter of the block is in use
+	bool blockIsUnderfull(char *block_buf);
+
+	size_t p_leafCapacity() {
+		return p_blockSize - sizeof(LeafHead);
+	}
+	size_t p_innerCapacity() {
+		return p_blockSize - sizeof(InnerHead) - p_refSizeInner();
+	}
+	size_t p_entSizeLeaf(size_t key_length) {
+		return kSlotSize + p_valSize + key_length;
+	}
+	size_t p_entSizeInner(size_t key_length) {
+		return kSlotSize + p_refSizeInner() + key_length;
+	}
+
+	void p_removeAtLeaf(char *block, BlkIndexType i);
+	void p_removeAtInner(char *block, BlkIndexType i);
+	// returns false if the new key does not fit into the block
+	bool p_replaceKeyInner(char *block, BlkIndexType i, const std::string &key);
 
-	void p_blockIntegrity(BlkIndexType block_num,
-			KeyType min, KeyType max);
 	
 	//FIXME: write file head on close
 	void p_writeFileHead() {
@@ -555,105 +1534,360 @@ private:
 	}
 };
 
-template<typename KeyType>
-Btree<KeyType>::Btree(std::string name, size_t block_size,
-		size_t key_size, size_t val_size,
-		CacheHost *cache_host, TaskPool *io_pool)
-	: p_name(name), p_pageCache(cache_host, block_size, io_pool), p_blockSize(block_size),
-		p_keySize(key_size), p_valSize(val_size) {
+template<typename KeyType, typename Codec>
+Btree<KeyType, Codec>::Btree(std::string name, size_t block_size,
+		size_t val_size, CacheHost *cache_host, TaskPool *io_pool, Codec codec)
+	: p_codec(codec), p_name(name), p_pageCache(cache_host, block_size, io_pool),
+		p_blockSize(block_size), p_valSize(val_size), p_orderStatistics(false),
+		p_freeEpoch(0) {
+	p_checkBlockSize();
+
+//	std::cout << "max key length: " << getMaxKeyLength() << std::endl;
+}
+
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::p_checkBlockSize() {
 	assert(p_blockSize > sizeof(FileHead)
 			&& p_blockSize > sizeof(InnerHead)
 			&& p_blockSize > sizeof(LeafHead));
-	assert(p_entsPerInner() >= 4);
-	assert(p_entsPerLeaf() >= 4);
-
-//	std::cout << "ents per inner: " << p_entsPerInner()
-//			<< ", leaf: " << p_entsPerLeaf() << std::endl;
+	// slots store 16-bit offsets
+	assert(p_blockSize <= 0x10000);
+	assert(p_blockSize / 4 > kSlotSize + p_valSize + sizeof(LeafHead));
+	assert(p_codec.keySize() <= getMaxKeyLength());
 }
 
 /* ------------------------------------------------------------------------- *
  * REF AND SEQUENCE FUNCTIONS                                                 *
  * ------------------------------------------------------------------------- */
 
-template<typename KeyType>
-Btree<KeyType>::IterateClosure::~IterateClosure() {
+template<typename KeyType, typename Codec>
+Btree<KeyType, Codec>::IterateClosure::~IterateClosure() {
 	if(p_block > 0)
-		p_tree->p_pageCache.releasePage(p_block);
+		p_tree->p_releaseBlock(p_block);
+	delete p_findClosure;
 }
 
-template<typename KeyType>
-typename Btree<KeyType>::Ref Btree<KeyType>::IterateClosure::position() {
+template<typename KeyType, typename Codec>
+typename Btree<KeyType, Codec>::Ref Btree<KeyType, Codec>::IterateClosure::position() {
 	return Ref(p_block, p_entry);
 }
 
-template<typename KeyType>
-void Btree<KeyType>::IterateClosure::seek(Ref ref, Async::Callback<void()> callback) {
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IterateClosure::seek(Ref ref, Async::Callback<void()> callback) {
 	p_callback = callback;
 	
 	if(p_block > 0)
-		p_tree->p_pageCache.releasePage(p_block);
+		p_tree->p_releaseBlock(p_block);
 	p_block = ref.block;
 	p_entry = ref.entry;
 
-	if(ref.block > 0) {
-		p_tree->p_pageCache.readPage(ref.block,
-				ASYNC_MEMBER(this, &IterateClosure::seekOnRead));
+	if(ref.buffer != nullptr) {
+		// the ref already holds the leaf; take over its page and latch
+		p_buffer = ref.buffer;
+		p_callback();
+	}else if(ref.block > 0) {
+		p_tree->p_latches.acquireShared(ref.block,
+				ASYNC_MEMBER(this, &IterateClosure::seekOnLatch));
 	}else{
 		p_callback();
 	}
 }
-template<typename KeyType>
-void Btree<KeyType>::IterateClosure::seekOnRead(char *buffer) {
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IterateClosure::seekOnLatch() {
+	p_tree->p_pageCache.readPage(p_block,
+			ASYNC_MEMBER(this, &IterateClosure::seekOnRead));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IterateClosure::seekOnRead(char *buffer) {
 	p_buffer = buffer;
 	p_callback();
 }
-template<typename KeyType>
-void Btree<KeyType>::IterateClosure::forward(Async::Callback<void()> callback) {
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IterateClosure::forward(Async::Callback<void()> callback) {
 	p_callback = callback;
 
 	assert(p_block > 0 && p_entry < p_tree->p_leafGetEntCount(p_buffer));
 	p_entry++;
 
+	forwardLoop();
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IterateClosure::forwardLoop() {
+	// NOTE: leaves might be empty after entries have been removed
 	BlkIndexType right_link = p_tree->p_leafGetRightLink(p_buffer);
 	if(p_entry == p_tree->p_leafGetEntCount(p_buffer)) {
 		if(right_link != 0) {
-			p_tree->p_pageCache.releasePage(p_block);
-			p_block = right_link;
-			p_entry = 0;
-			p_tree->p_pageCache.readPage(right_link,
-					ASYNC_MEMBER(this, &IterateClosure::forwardOnRead));
+			// latch the right neighbor before the current leaf is released
+			p_nextBlock = right_link;
+			p_tree->p_latches.acquireShared(right_link,
+					ASYNC_MEMBER(this, &IterateClosure::forwardOnLatch));
 		}else{
-			p_tree->p_pageCache.releasePage(p_block);
+			p_tree->p_releaseBlock(p_block);
 			p_block = -1;
 			p_entry = -1;
 			p_callback();
 		}
 	}else{
+		prefetch(true);
 		p_callback();
 	}
 }
-template<typename KeyType>
-void Btree<KeyType>::IterateClosure::forwardOnRead(char *buffer) {
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IterateClosure::forwardOnLatch() {
+	p_tree->p_releaseBlock(p_block);
+	p_block = p_nextBlock;
+	p_entry = 0;
+	p_tree->p_pageCache.readPage(p_block,
+			ASYNC_MEMBER(this, &IterateClosure::forwardOnRead));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IterateClosure::forwardOnRead(char *buffer) {
+	p_buffer = buffer;
+	forwardLoop();
+}
+
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IterateClosure::backward(UnaryCompareCallback compare,
+		Async::Callback<void()> callback) {
+	p_compare = compare;
+	p_callback = callback;
+
+	assert(p_block > 0 && p_entry >= 0);
+	p_entry--;
+
+	backwardLoop();
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IterateClosure::backwardLoop() {
+	if(p_entry >= 0) {
+		prefetch(false);
+		p_callback();
+		return;
+	}
+	
+	BlkIndexType left_link = p_tree->p_leafGetLeftLink(p_buffer);
+	if(left_link == 0) {
+		p_tree->p_releaseBlock(p_block);
+		p_block = -1;
+		p_entry = -1;
+		p_callback();
+		return;
+	}
+	
+	// latches are only coupled from left to right: waiting for the left
+	// neighbor while the current leaf is latched could deadlock with a split.
+	// merges free a leaf only after its right neighbor's left link was
+	// updated, but that update waits for our latch. the left block is
+	// therefore validated after it is read
+	if(p_tree->p_latches.tryAcquireShared(left_link)) {
+		p_nextBlock = left_link;
+		p_tree->p_pageCache.readPage(p_nextBlock,
+				ASYNC_MEMBER(this, &IterateClosure::backwardOnRead));
+	}else{
+		backwardReseek();
+	}
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IterateClosure::backwardOnRead(char *buffer) {
+	// the block might have been freed and reused since the link was written
+	if(!(p_tree->p_headGetFlags(buffer) & BlockHead::kFlagIsLeaf)
+			|| p_tree->p_leafGetRightLink(buffer) != p_block) {
+		p_tree->p_releaseBlock(p_nextBlock);
+		backwardReseek();
+		return;
+	}
+
+	p_tree->p_releaseBlock(p_block);
+	p_block = p_nextBlock;
 	p_buffer = buffer;
+	p_entry = p_tree->p_leafGetEntCount(p_buffer) - 1;
+	backwardLoop();
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IterateClosure::backwardReseek() {
+	// entries might be moved to other leaves in the meantime so we
+	// remember the value that identifies the entry among equal keys
+	p_seekValue.assign(p_tree->p_leafGetValue(p_buffer, 0), p_tree->p_valSize);
+	p_tree->p_releaseBlock(p_block);
+	p_block = -1;
+	p_entry = -1;
+	p_findClosure->findPrev(ASYNC_MEMBER(this, &IterateClosure::backwardCompare),
+			ASYNC_MEMBER(this, &IterateClosure::backwardOnFind));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IterateClosure::backwardCompare(const KeyType &key,
+		Async::Callback<void(int)> callback) {
+	p_compareCallback = callback;
+	p_compare(key, ASYNC_MEMBER(this, &IterateClosure::backwardOnCompare));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IterateClosure::backwardOnCompare(int result) {
+	// treat the current key as greater so that findPrev() finds
+	// the last entry before all entries that are equal to it
+	p_compareCallback(result < 0 ? -1 : 1);
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IterateClosure::backwardOnFind(Ref ref) {
+	if(!ref.valid()) {
+		// there is no smaller key; search from the beginning of the tree
+		p_findClosure->findFirst(ASYNC_MEMBER(this, &IterateClosure::backwardOnFirst));
+		return;
+	}
+	
+	// the ref holds its leaf; the entry is a candidate for the previous entry
+	p_block = ref.block;
+	p_entry = ref.entry;
+	p_buffer = ref.buffer;
+	reseekLoop();
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IterateClosure::backwardOnFirst(Ref ref) {
+	if(!ref.valid()) {
+		p_callback();
+		return;
+	}
+
+	// position the iterator before the first entry
+	p_block = ref.block;
+	p_entry = -1;
+	p_buffer = ref.buffer;
+	reseekLoop();
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IterateClosure::reseekLoop() {
+	// move forward over entries that are equal to the current key until
+	// we reach the entry that we started from. the candidate stays latched
+	// while its successor is inspected
+	if(p_entry + 1 < p_tree->p_leafGetEntCount(p_buffer)) {
+		p_nextBlock = p_block;
+		p_nextBuffer = p_buffer;
+		p_nextEntry = p_entry + 1;
+		p_compare(p_tree->p_leafGetKey(p_nextBuffer, p_nextEntry),
+				ASYNC_MEMBER(this, &IterateClosure::reseekOnCompare));
+		return;
+	}
+	
+	p_nextBlock = p_tree->p_leafGetRightLink(p_buffer);
+	if(p_nextBlock == 0) {
+		reseekFinish();
+		return;
+	}
+	// latches are coupled from left to right
+	p_tree->p_latches.acquireShared(p_nextBlock,
+			ASYNC_MEMBER(this, &IterateClosure::reseekOnLatch));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IterateClosure::reseekOnLatch() {
+	p_tree->p_pageCache.readPage(p_nextBlock,
+			ASYNC_MEMBER(this, &IterateClosure::reseekOnRead));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IterateClosure::reseekOnRead(char *buffer) {
+	p_nextBuffer = buffer;
+
+	if(p_tree->p_leafGetEntCount(p_nextBuffer) == 0) {
+		// skip leaves that became empty while the candidate stays latched
+		BlkIndexType right_link = p_tree->p_leafGetRightLink(p_nextBuffer);
+		p_tree->p_releaseBlock(p_nextBlock);
+		if(right_link == 0) {
+			reseekFinish();
+			return;
+		}
+		p_nextBlock = right_link;
+		p_tree->p_latches.acquireShared(p_nextBlock,
+				ASYNC_MEMBER(this, &IterateClosure::reseekOnLatch));
+		return;
+	}
+
+	p_nextEntry = 0;
+	p_compare(p_tree->p_leafGetKey(p_nextBuffer, p_nextEntry),
+			ASYNC_MEMBER(this, &IterateClosure::reseekOnCompare));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IterateClosure::reseekOnCompare(int result) {
+	// stop at the entry that we started from or if it was removed
+	bool found = result > 0 || (result == 0 && !std::memcmp(p_seekValue.data(),
+			p_tree->p_leafGetValue(p_nextBuffer, p_nextEntry), p_tree->p_valSize));
+	if(found) {
+		if(p_nextBlock != p_block)
+			p_tree->p_releaseBlock(p_nextBlock);
+		reseekFinish();
+		return;
+	}
+
+	// the successor becomes the new candidate
+	if(p_nextBlock != p_block) {
+		p_tree->p_releaseBlock(p_block);
+		p_block = p_nextBlock;
+		p_buffer = p_nextBuffer;
+	}
+	p_entry = p_nextEntry;
+	LocalTaskQueue::get()->submit(ASYNC_MEMBER(this, &IterateClosure::reseekLoop));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IterateClosure::reseekFinish() {
+	if(p_entry < 0) {
+		// the entry that we started from was the first one
+		p_tree->p_releaseBlock(p_block);
+		p_block = -1;
+	}
 	p_callback();
 }
 
-template<typename KeyType>
-KeyType Btree<KeyType>::IterateClosure::getKey() {
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IterateClosure::prefetch(bool forward) {
+	if(p_prefetchDistance == 0 || p_prefetchedFrom == p_block)
+		return;
+	
+	BlkIndexType ent_count = p_tree->p_leafGetEntCount(p_buffer);
+	BlkIndexType passed = forward ? p_entry + 1 : ent_count - p_entry;
+	if(passed < p_prefetchFraction * ent_count)
+		return;
+	p_prefetchedFrom = p_block;
+
+	// the link cannot change while we hold the current leaf.
+	// prefetches do not need a latch as they do not access the page
+	BlkIndexType link = forward ? p_tree->p_leafGetRightLink(p_buffer)
+			: p_tree->p_leafGetLeftLink(p_buffer);
+	if(link == 0)
+		return;
+	p_tree->p_pageCache.prefetchPage(link);
+	
+	// we do not know the links of the following leaves.
+	// guess them if the current leaf and its neighbor are adjacent
+	BlkIndexType step = forward ? 1 : -1;
+	if(p_prefetchDistance == 1 || link != p_block + step)
+		return;
+
+	BlkIndexType num_blocks;
+	{
+		std::lock_guard<std::mutex> lock(p_tree->p_allocMutex);
+		num_blocks = p_tree->p_curFileHead.numBlocks;
+	}
+	for(int i = 1; i < p_prefetchDistance; i++) {
+		BlkIndexType number = link + i * step;
+		if(number <= 0 || number >= num_blocks)
+			break;
+		p_tree->p_pageCache.prefetchPage(number);
+	}
+}
+
+template<typename KeyType, typename Codec>
+KeyType Btree<KeyType, Codec>::IterateClosure::getKey() {
 	assert(p_block > 0 && p_entry >= 0);
-	return p_tree->p_readKey(p_buffer + p_tree->p_keyOffLeaf(p_entry));
+	return p_tree->p_leafGetKey(p_buffer, p_entry);
 }
 
-template<typename KeyType>
-void Btree<KeyType>::IterateClosure::getValue(void *value) {
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IterateClosure::getValue(void *value) {
 	assert(p_block > 0 && p_entry >= 0);
-	std::memcpy(value, p_buffer + p_tree->p_valOffLeaf(p_entry),
+	std::memcpy(value, p_tree->p_leafGetValue(p_buffer, p_entry),
 			p_tree->p_valSize);
 }
-template<typename KeyType>
-void Btree<KeyType>::IterateClosure::setValue(void *value) {
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IterateClosure::setValue(void *value) {
 	assert(p_block > 0 && p_entry >= 0);
-	std::memcpy(p_buffer + p_tree->p_valOffLeaf(p_entry), value,
+	std::memcpy(p_tree->p_leafGetValue(p_buffer, p_entry), value,
 			p_tree->p_valSize);
 	p_tree->p_pageCache.writePage(p_block);
 }
@@ -662,128 +1896,130 @@ void Btree<KeyType>::IterateClosure::setValue(void *value) {
  * INSERT AND FIND FUNCTIONS                                                 *
  * ------------------------------------------------------------------------- */
 
-template<typename KeyType>
-void Btree<KeyType>::FindClosure::findFirst(Async::Callback<void(Ref)> on_complete) {
-	p_onComplete = on_complete;
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::FindClosure::descendFromRoot(Async::Callback<void(char *)> on_read) {
+	p_onRead = on_read;
+	
+	p_blockNumber = kHeadLatch;
+	p_tree->p_latches.acquireShared(kHeadLatch,
+			ASYNC_MEMBER(this, &FindClosure::descendOnHeadLatch));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::FindClosure::descendOnHeadLatch() {
+	descend(p_tree->p_curFileHead.rootBlock);
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::FindClosure::descend(BlkIndexType child_number) {
+	p_childNumber = child_number;
+	p_tree->p_latches.acquireShared(p_childNumber,
+			ASYNC_MEMBER(this, &FindClosure::descendOnLatch));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::FindClosure::descendOnLatch() {
+	if(p_blockNumber == kHeadLatch) {
+		p_tree->p_latches.release(kHeadLatch);
+	}else{
+		p_tree->p_releaseBlock(p_blockNumber);
+	}
+	p_blockNumber = p_childNumber;
+	
+	p_tree->p_pageCache.readPage(p_blockNumber, p_onRead);
+}
 
-	p_blockNumber = p_tree->p_curFileHead.rootBlock;
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::FindClosure::findFirst(Async::Callback<void(Ref)> on_complete) {
+	p_onComplete = on_complete;
 
-	findFirstDescend();
-}
-template<typename KeyType>
-void Btree<KeyType>::FindClosure::findFirstDescend() {
-	p_tree->p_pageCache.readPage(p_blockNumber,
-			ASYNC_MEMBER(this, &FindClosure::findFirstOnRead));
+	descendFromRoot(ASYNC_MEMBER(this, &FindClosure::findFirstOnRead));
 }
-template<typename KeyType>
-void Btree<KeyType>::FindClosure::findFirstOnRead(char *buffer) {
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::FindClosure::findFirstOnRead(char *buffer) {
 	p_blockBuffer = buffer;
 
 	flags_type flags = p_tree->p_headGetFlags(p_blockBuffer);
 	if((flags & BlockHead::kFlagIsLeaf) != 0) {
+		BlkIndexType right_link = p_tree->p_leafGetRightLink(p_blockBuffer);
 		if(p_tree->p_leafGetEntCount(p_blockBuffer) != 0) {
-			p_tree->p_pageCache.releasePage(p_blockNumber);
-
-			Ref result;
-			result.block = p_blockNumber;
-			result.entry = 0;
-			
-			p_onComplete(result);
-			return;
+			p_onComplete(Ref(p_blockNumber, 0, p_blockBuffer));
+		}else if(right_link != 0) {
+			// the leaf became empty after its entries were removed
+			descend(right_link);
 		}else{
-			p_tree->p_pageCache.releasePage(p_blockNumber);
-
+			p_tree->p_releaseBlock(p_blockNumber);
 			p_onComplete(Ref());
-			return;
 		}
+		return;
 	}
 	
-	char *ref_ptr = p_blockBuffer + p_tree->p_lrefOffInner();
-	BlkIndexType child_number = OS::fromLeU32(*((BlkIndexType*)ref_ptr));
-	p_tree->p_pageCache.releasePage(p_blockNumber);
-	p_blockNumber = child_number;
-
-	findFirstDescend();
+	descend(p_tree->p_innerGetLref(p_blockBuffer));
 }
-template<typename KeyType>
-void Btree<KeyType>::FindClosure::findNext(UnaryCompareCallback compare,
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::FindClosure::findLast(Async::Callback<void(Ref)> on_complete) {
+	// every key is smaller than the search key
+	findPrev(ASYNC_MEMBER(this, &FindClosure::findLastCompare), on_complete);
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::FindClosure::findLastCompare(const KeyType &key,
+		Async::Callback<void(int)> callback) {
+	callback(-1);
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::FindClosure::findNext(UnaryCompareCallback compare,
 		Async::Callback<void(Ref)> on_complete) {
 	p_compare = compare;
 	p_onComplete = on_complete;
 
-	p_blockNumber = p_tree->p_curFileHead.rootBlock;
-
-	findNextDescend();
+	descendFromRoot(ASYNC_MEMBER(this, &FindClosure::findNextOnRead));
 }
-template<typename KeyType>
-void Btree<KeyType>::FindClosure::findNextDescend() {
-	p_tree->p_pageCache.readPage(p_blockNumber,
-			ASYNC_MEMBER(this, &FindClosure::findNextOnRead));
-}
-template<typename KeyType>
-void Btree<KeyType>::FindClosure::findNextOnRead(char *buffer) {
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::FindClosure::findNextOnRead(char *buffer) {
 	p_blockBuffer = buffer;
 
 	flags_type flags = p_tree->p_headGetFlags(p_blockBuffer);
 	if((flags & BlockHead::kFlagIsLeaf) != 0) {
-		std::cout << "nextInLeaf()" << std::endl;
 		p_searchClosure.nextInLeaf(p_blockBuffer, p_compare,
 				ASYNC_MEMBER(this, &FindClosure::findNextInLeaf));
 		return;
 	}
 
-	std::cout << "nextInInner()" << std::endl;
 	p_searchClosure.nextInInner(p_blockBuffer, p_compare,
 			ASYNC_MEMBER(this, &FindClosure::findNextOnFoundChild));
 }
-template<typename KeyType>
-void Btree<KeyType>::FindClosure::findNextOnFoundChild(int index) {
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::FindClosure::findNextOnFoundChild(int index) {
 	if(index == -1) {
 		BlkIndexType ent_count = p_tree->p_innerGetEntCount(p_blockBuffer);
-		char *ref_ptr = p_blockBuffer + p_tree->p_refOffInner(ent_count - 1);
-		BlkIndexType child_num = OS::fromLeU32(*((BlkIndexType*)ref_ptr));
-		p_tree->p_pageCache.releasePage(p_blockNumber);
-		p_blockNumber = child_num;
+		descend(p_tree->p_innerGetRef(p_blockBuffer, ent_count - 1));
 	}else if(index == 0) {
-		char *ref_ptr = p_blockBuffer + p_tree->p_lrefOffInner();
-		BlkIndexType child_num = OS::fromLeU32(*((BlkIndexType*)ref_ptr));
-		p_tree->p_pageCache.releasePage(p_blockNumber);
-		p_blockNumber = child_num;
+		descend(p_tree->p_innerGetLref(p_blockBuffer));
 	}else{
-		char *ref_ptr = p_blockBuffer + p_tree->p_refOffInner(index - 1);
-		BlkIndexType child_num = OS::fromLeU32(*((BlkIndexType*)ref_ptr));
-		p_blockNumber = child_num;
+		descend(p_tree->p_innerGetRef(p_blockBuffer, index - 1));
 	}
-
-	findNextDescend();
 }
-template<typename KeyType>
-void Btree<KeyType>::FindClosure::findNextInLeaf(int index) {
-	p_tree->p_pageCache.releasePage(p_blockNumber);
-
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::FindClosure::findNextInLeaf(int index) {
+	BlkIndexType right_link = p_tree->p_leafGetRightLink(p_blockBuffer);
 	if(index >= 0) {
-		p_onComplete(Ref(p_blockNumber, index));
+		p_onComplete(Ref(p_blockNumber, index, p_blockBuffer));
+	}else if(right_link != 0) {
+		// all entries of this leaf are smaller than the key.
+		// the next entry is in one of the following leaves
+		descend(right_link);
 	}else{
+		p_tree->p_releaseBlock(p_blockNumber);
 		p_onComplete(Ref());
 	}
 }
-template<typename KeyType>
-void Btree<KeyType>::FindClosure::findPrev(UnaryCompareCallback compare,
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::FindClosure::findPrev(UnaryCompareCallback compare,
 		Async::Callback<void(Ref)> on_complete) {
 	p_compare = compare;
 	p_onComplete = on_complete;
 
-	p_blockNumber = p_tree->p_curFileHead.rootBlock;
-
-	findPrevDescend();
+	descendFromRoot(ASYNC_MEMBER(this, &FindClosure::findPrevOnRead));
 }
-template<typename KeyType>
-void Btree<KeyType>::FindClosure::findPrevDescend() {
-	p_tree->p_pageCache.readPage(p_blockNumber,
-			ASYNC_MEMBER(this, &FindClosure::findPrevOnRead));
-}
-template<typename KeyType>
-void Btree<KeyType>::FindClosure::findPrevOnRead(char *buffer) {
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::FindClosure::findPrevOnRead(char *buffer) {
 	p_blockBuffer = buffer;
 
 	flags_type flags = p_tree->p_headGetFlags(p_blockBuffer);
@@ -795,72 +2031,201 @@ void Btree<KeyType>::FindClosure::findPrevOnRead(char *buffer) {
 		libchain::run(action, ASYNC_MEMBER(this, &FindClosure::findPrevOnFoundChild));
 	}
 }
-template<typename KeyType>
-void Btree<KeyType>::FindClosure::findPrevOnFoundChild(int index) {
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::FindClosure::findPrevOnFoundChild(int index) {
 	if(index == -1) {
-		char *ref_ptr = p_blockBuffer + p_tree->p_lrefOffInner();
-		BlkIndexType child_num = OS::fromLeU32(*((BlkIndexType*)ref_ptr));
-		p_tree->p_pageCache.releasePage(p_blockNumber);
-		p_blockNumber = child_num;
+		descend(p_tree->p_innerGetLref(p_blockBuffer));
 	}else{
-		char *ref_ptr = p_blockBuffer + p_tree->p_refOffInner(index);
-		BlkIndexType child_num = OS::fromLeU32(*((BlkIndexType*)ref_ptr));
-		p_tree->p_pageCache.releasePage(p_blockNumber);
-		p_blockNumber = child_num;
+		descend(p_tree->p_innerGetRef(p_blockBuffer, index));
 	}
-
-	findPrevDescend();
 }
-template<typename KeyType>
-void Btree<KeyType>::FindClosure::findPrevInLeaf(int index) {
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::FindClosure::findPrevInLeaf(int index) {
 	if(index == -1) {
 		BlkIndexType left_link = p_tree->p_leafGetLeftLink(p_blockBuffer);
+		p_epoch = p_tree->p_freeEpoch;
+		p_tree->p_releaseBlock(p_blockNumber);
 		if(left_link != 0) {
-			p_tree->p_pageCache.releasePage(p_blockNumber);
+			// latches are only coupled from left to right.
+			// release the current leaf before moving to the left
+			p_rightNumber = p_blockNumber;
 			p_blockNumber = left_link;
-			p_tree->p_pageCache.readPage(p_blockNumber,
-					ASYNC_MEMBER(this, &FindClosure::findPrevReadLeft));
+			p_tree->p_latches.acquireShared(p_blockNumber,
+					ASYNC_MEMBER(this, &FindClosure::findPrevOnLatchLeft));
 		}else{
-			p_tree->p_pageCache.releasePage(p_blockNumber);
 			p_onComplete(Ref());
 		}
 	}else{
-		p_tree->p_pageCache.releasePage(p_blockNumber);
-		p_onComplete(Ref(p_blockNumber, index));
+		p_onComplete(Ref(p_blockNumber, index, p_blockBuffer));
 	}
 }
-template<typename KeyType>
-void Btree<KeyType>::FindClosure::findPrevReadLeft(char *buffer) {
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::FindClosure::findPrevOnLatchLeft() {
+	// the left link might refer to a block that was freed in the meantime
+	if(p_tree->p_freeEpoch != p_epoch) {
+		p_tree->p_latches.release(p_blockNumber);
+		findPrevRestart();
+		return;
+	}
+
+	p_tree->p_pageCache.readPage(p_blockNumber,
+			ASYNC_MEMBER(this, &FindClosure::findPrevReadLeft));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::FindClosure::findPrevReadLeft(char *buffer) {
 	p_blockBuffer = buffer;
 
+	if(p_tree->p_freeEpoch != p_epoch) {
+		p_tree->p_releaseBlock(p_blockNumber);
+		findPrevRestart();
+		return;
+	}
+
+	// the left neighbor might have been split while no latch was held.
+	// in that case the predecessor is in the rightmost of its new siblings
+	BlkIndexType right_link = p_tree->p_leafGetRightLink(p_blockBuffer);
+	if(right_link != p_rightNumber) {
+		p_onRead = ASYNC_MEMBER(this, &FindClosure::findPrevReadLeft);
+		descend(right_link);
+		return;
+	}
+
 	BlkIndexType ent_count = p_tree->p_leafGetEntCount(p_blockBuffer);
-	assert(ent_count > 0);
+	if(ent_count == 0) {
+		// skip leaves that became empty
+		findPrevInLeaf(-1);
+		return;
+	}
+
+	p_onComplete(Ref(p_blockNumber, ent_count - 1, p_blockBuffer));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::FindClosure::findPrevRestart() {
+	descendFromRoot(ASYNC_MEMBER(this, &FindClosure::findPrevOnRead));
+}
+
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::FindClosure::rank(UnaryCompareCallback compare,
+		Async::Callback<void(uint64_t)> on_complete) {
+	if(!p_tree->p_orderStatistics)
+		throw std::logic_error("Btree does not maintain order statistics");
+	p_compare = compare;
+	p_onRank = on_complete;
+	p_rank = 0;
+
+	descendFromRoot(ASYNC_MEMBER(this, &FindClosure::rankOnRead));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::FindClosure::count(Async::Callback<void(uint64_t)> on_complete) {
+	rank(ASYNC_MEMBER(this, &FindClosure::findLastCompare), on_complete);
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::FindClosure::rankOnRead(char *buffer) {
+	p_blockBuffer = buffer;
+
+	flags_type flags = p_tree->p_headGetFlags(p_blockBuffer);
+	if(flags & BlockHead::kFlagIsLeaf) {
+		auto action = p_tree->lowerBoundLeaf(p_blockBuffer, p_compare);
+		libchain::run(action, ASYNC_MEMBER(this, &FindClosure::rankInLeaf));
+	}else{
+		auto action = p_tree->lowerBoundInner(p_blockBuffer, p_compare);
+		libchain::run(action, ASYNC_MEMBER(this, &FindClosure::rankOnFoundChild));
+	}
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::FindClosure::rankOnFoundChild(int index) {
+	// all entries left of the child are less or equal to the key
+	for(int i = -1; i < index; i++)
+		p_rank += p_tree->p_childGetCount(p_blockBuffer, i);
+
+	descend(index >= 0 ? p_tree->p_innerGetRef(p_blockBuffer, index)
+			: p_tree->p_innerGetLref(p_blockBuffer));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::FindClosure::rankInLeaf(int index) {
+	p_rank += index + 1;
+	p_tree->p_releaseBlock(p_blockNumber);
+	p_onRank(p_rank);
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::FindClosure::seekToRank(uint64_t rank,
+		Async::Callback<void(Ref)> on_complete) {
+	if(!p_tree->p_orderStatistics)
+		throw std::logic_error("Btree does not maintain order statistics");
+	p_onComplete = on_complete;
+	p_rank = rank;
 
-	p_tree->p_pageCache.releasePage(p_blockNumber);
-	p_onComplete(Ref(p_blockNumber, ent_count - 1));
+	descendFromRoot(ASYNC_MEMBER(this, &FindClosure::seekToRankOnRead));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::FindClosure::seekToRankOnRead(char *buffer) {
+	p_blockBuffer = buffer;
+
+	flags_type flags = p_tree->p_headGetFlags(p_blockBuffer);
+	if(flags & BlockHead::kFlagIsLeaf) {
+		BlkIndexType ent_count = p_tree->p_leafGetEntCount(p_blockBuffer);
+		BlkIndexType right_link = p_tree->p_leafGetRightLink(p_blockBuffer);
+		if(p_rank < (uint64_t)ent_count) {
+			p_onComplete(Ref(p_blockNumber, p_rank, p_blockBuffer));
+		}else if(right_link != 0) {
+			p_rank -= ent_count;
+			descend(right_link);
+		}else{
+			p_tree->p_releaseBlock(p_blockNumber);
+			p_onComplete(Ref());
+		}
+		return;
+	}
+
+	BlkIndexType ent_count = p_tree->p_innerGetEntCount(p_blockBuffer);
+	for(int i = -1; i < ent_count; i++) {
+		uint64_t count = p_tree->p_childGetCount(p_blockBuffer, i);
+		if(p_rank < count) {
+			descend(i >= 0 ? p_tree->p_innerGetRef(p_blockBuffer, i)
+					: p_tree->p_innerGetLref(p_blockBuffer));
+			return;
+		}
+		p_rank -= count;
+	}
+
+	// the rank is larger than the number of entries
+	p_tree->p_releaseBlock(p_blockNumber);
+	p_onComplete(Ref());
 }
 
 /* ------------------------------------------------------------------------- *
  * NODE SPLITTING FUNCTIONS                                                  *
  * ------------------------------------------------------------------------- */
 
-template<typename KeyType>
-bool Btree<KeyType>::blockIsFull(char *block_buf) {
+template<typename KeyType, typename Codec>
+bool Btree<KeyType, Codec>::blockIsFull(char *block_buf, const std::string &key) {
 	flags_type flags = OS::fromLeU32(*((flags_type*)block_buf));
 	if((flags & BlockHead::kFlagIsLeaf) != 0) {
-		if(p_leafGetEntCount(block_buf) >= p_entsPerLeaf() - 1) {
+		BlkIndexType ent_count = p_leafGetEntCount(block_buf);
+		if(ent_count == 0)
+			return false;
+
+		// the stored prefix is shared by all entries of the leaf
+		// so only the new key can shorten it
+		size_t prefix_length = p_leafGetPrefixLength(block_buf);
+		size_t shared = p_commonPrefix(block_buf + p_prefixOffLeaf(), prefix_length,
+				key.data(), key.size());
+		
+		// if the key does not share the whole prefix the prefix must be shortened.
+		// this moves (prefix_length - shared) bytes into each existing entry
+		size_t required = kSlotSize + p_valSize + key.size() - shared
+				+ (prefix_length - shared) * (ent_count - 1);
+		if(required > p_leafFreeSpace(block_buf))
 			return true;
-		}
 	}else{
-		if(p_innerGetEntCount(block_buf) >= p_entsPerInner() - 1) {
+		if(p_innerFreeSpace(block_buf) < p_maxEntSizeInner())
 			return true;
-		}
 	}
 	return false;
 }
 
-template<typename KeyType>
-void Btree<KeyType>::SplitClosure::split(BlkIndexType block_num, char *block_buf,
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::SplitClosure::split(BlkIndexType block_num, char *block_buf,
 		char *parent_buf, BlkIndexType block_index,
 		Async::Callback<void()> on_complete) {
 	p_blockNumber = block_num;
@@ -871,117 +2236,145 @@ void Btree<KeyType>::SplitClosure::split(BlkIndexType block_num, char *block_buf
 
 	flags_type flags = OS::fromLeU32(*((flags_type*)block_buf));
 	if((flags & BlockHead::kFlagIsLeaf) != 0) {
-		if(p_tree->p_leafGetEntCount(block_buf) >= p_tree->p_entsPerLeaf() - 1) {
-			splitLeaf();
-			return;
-		}
+		if(p_tree->p_leafGetEntCount(block_buf) < 2)
+			throw std::logic_error("Leaf is too small to be split");
+		splitLeaf();
 	}else{
-		if(p_tree->p_innerGetEntCount(block_buf) >= p_tree->p_entsPerInner() - 1) {
-			splitInner();
-			return;
-		}
+		if(p_tree->p_innerGetEntCount(block_buf) < 3)
+			throw std::logic_error("Inner block is too small to be split");
+		splitInner();
 	}
-	throw std::logic_error("No need to split");
 }
-template<typename KeyType>
-void Btree<KeyType>::SplitClosure::splitLeaf() {
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::SplitClosure::splitLeaf() {
 //	std::cout << "split leaf" << std::endl;
 	p_splitNumber = p_tree->p_allocBlock();
-
-	BlkIndexType ent_count = p_tree->p_leafGetEntCount(p_blockBuffer);
 	p_rightLinkNumber = p_tree->p_leafGetRightLink(p_blockBuffer);
-	p_leftSize = ent_count / 2;
-	p_rightSize = ent_count - p_leftSize;
-	assert(p_leftSize > 0 && p_rightSize > 0
-			&& p_leftSize < p_tree->p_entsPerLeaf() - 1
-			&& p_rightSize < p_tree->p_entsPerLeaf() - 1);
-	p_tree->p_leafSetEntCount(p_blockBuffer, p_leftSize);
+
+	p_leafEntries.clear();
+	p_tree->p_leafExtract(p_blockBuffer, p_leafEntries);
+
+	/* split the entries so that both halves occupy about the same space */
+	size_t total_size = 0;
+	for(size_t i = 0; i < p_leafEntries.size(); i++)
+		total_size += p_leafEntries[i].key.size();
+	size_t left_size = 0;
+	p_leftSize = 0;
+	while(p_leftSize < p_leafEntries.size() - 1
+			&& (p_leftSize == 0 || 2 * left_size < total_size)) {
+		left_size += p_leafEntries[p_leftSize].key.size();
+		p_leftSize++;
+	}
+	assert(p_leftSize > 0 && p_leftSize < p_leafEntries.size());
+//		std::cout << "split leaf into: " << p_leftSize << ", "
+//				<< (p_leafEntries.size() - p_leftSize) << std::endl;
+	
+	// the separator is the smallest key of the right block
+	p_splitKey = p_leafEntries[p_leftSize].key;
+	p_leftCount = p_leftSize;
+	p_rightCount = p_leafEntries.size() - p_leftSize;
+	p_tree->p_leafBuild(p_blockBuffer, p_leafEntries, 0, p_leftSize);
 	p_tree->p_leafSetRightLink(p_blockBuffer, p_splitNumber);
-//		std::cout << "split leaf into: " << p_leftSize << ", " << p_rightSize << std::endl;
 	
 	p_tree->p_pageCache.initializePage(p_splitNumber,
 			ASYNC_MEMBER(this, &SplitClosure::splitLeafOnInitialize));
 }
-template<typename KeyType>
-void Btree<KeyType>::SplitClosure::splitLeafOnInitialize(char *split_block) {
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::SplitClosure::splitLeafOnInitialize(char *split_block) {
 	p_tree->p_headSetFlags(split_block, BlockHead::kFlagIsLeaf);
-	p_tree->p_leafSetEntCount(split_block, p_rightSize);
 	p_tree->p_leafSetLeftLink(split_block, p_blockNumber);
 	p_tree->p_leafSetRightLink(split_block, p_rightLinkNumber);
 
 	/* setup the entries of the new block */
-	p_splitKey = p_tree->p_readKey(p_blockBuffer + p_tree->p_keyOffLeaf(p_leftSize - 1));
-	std::memcpy(split_block + p_tree->p_entOffLeaf(0),
-			p_blockBuffer + p_tree->p_entOffLeaf(p_leftSize),
-			p_rightSize * p_tree->p_entSizeLeaf());
-	/* FIXME: for debugging only! */
-	std::memset(p_blockBuffer + p_tree->p_entOffLeaf(p_leftSize), 0, p_rightSize * p_tree->p_entSizeLeaf());
+	p_tree->p_leafBuild(split_block, p_leafEntries, p_leftSize, p_leafEntries.size());
+	p_leafEntries.clear();
 	p_tree->p_pageCache.writePage(p_splitNumber);
 	p_tree->p_pageCache.releasePage(p_splitNumber);
 
 	if(p_rightLinkNumber != 0) {
-		p_tree->p_pageCache.readPage(p_rightLinkNumber,
-				ASYNC_MEMBER(this, &SplitClosure::onReadRightLink));
+		// leaves are always latched from left to right
+		p_tree->p_latches.acquireExclusive(p_rightLinkNumber,
+				ASYNC_MEMBER(this, &SplitClosure::onLatchRightLink));
 	}else{
 		fixParent();
 	}
 }
-template<typename KeyType>
-void Btree<KeyType>::SplitClosure::onReadRightLink(char *link_buffer) {
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::SplitClosure::onLatchRightLink() {
+	p_tree->p_pageCache.readPage(p_rightLinkNumber,
+			ASYNC_MEMBER(this, &SplitClosure::onReadRightLink));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::SplitClosure::onReadRightLink(char *link_buffer) {
 	p_tree->p_leafSetLeftLink(link_buffer, p_splitNumber);
 	p_tree->p_pageCache.writePage(p_rightLinkNumber);
-	p_tree->p_pageCache.releasePage(p_rightLinkNumber);
+	p_tree->p_releaseBlock(p_rightLinkNumber);
 
 	fixParent();
 }
-template<typename KeyType>
-void Btree<KeyType>::SplitClosure::splitInner() {
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::SplitClosure::splitInner() {
 //	std::cout << "split inner" << std::endl;
 	p_splitNumber = p_tree->p_allocBlock();
 
-	/* note: p_leftSize + p_rightSize = ent_count - 1
-		because one of the keys moves to the parent node */
-	BlkIndexType ent_count = p_tree->p_innerGetEntCount(p_blockBuffer);
-	p_leftSize = ent_count / 2;
-	p_rightSize = ent_count - p_leftSize - 1;
-	assert(p_leftSize > 0 && p_rightSize > 0
-			&& p_leftSize < p_tree->p_entsPerInner() - 2
-			&& p_rightSize < p_tree->p_entsPerInner() - 1);
-	p_tree->p_innerSetEntCount(p_blockBuffer, p_leftSize);
-//		std::cout << "split inner into: " << p_leftSize << ", " << p_rightSize << std::endl;
+	p_innerEntries.clear();
+	p_tree->p_innerExtract(p_blockBuffer, p_innerEntries);
+
+	/* note: the entry at p_leftSize moves to the parent node.
+		both remaining halves must contain at least one entry */
+	size_t total_size = 0;
+	for(size_t i = 0; i < p_innerEntries.size(); i++)
+		total_size += p_innerEntries[i].key.size();
+	size_t left_size = 0;
+	p_leftSize = 0;
+	while(p_leftSize < p_innerEntries.size() - 2
+			&& (p_leftSize == 0 || 2 * left_size < total_size)) {
+		left_size += p_innerEntries[p_leftSize].key.size();
+		p_leftSize++;
+	}
+	assert(p_leftSize > 0 && p_leftSize < p_innerEntries.size() - 1);
+//		std::cout << "split inner into: " << p_leftSize << ", "
+//				<< (p_innerEntries.size() - p_leftSize - 1) << std::endl;
+	
+	p_splitKey = p_innerEntries[p_leftSize].key;
+	p_leftCount = p_tree->p_innerGetLrefCount(p_blockBuffer);
+	for(size_t i = 0; i < p_leftSize; i++)
+		p_leftCount += p_innerEntries[i].count;
+	p_rightCount = 0;
+	for(size_t i = p_leftSize; i < p_innerEntries.size(); i++)
+		p_rightCount += p_innerEntries[i].count;
+
+	p_tree->p_innerBuild(p_blockBuffer, p_tree->p_innerGetLref(p_blockBuffer),
+			p_tree->p_innerGetLrefCount(p_blockBuffer), p_innerEntries, 0, p_leftSize);
 	
 	p_tree->p_pageCache.initializePage(p_splitNumber,
 			ASYNC_MEMBER(this, &SplitClosure::splitInnerOnInitialize));
 }
-template<typename KeyType>
-void Btree<KeyType>::SplitClosure::splitInnerOnInitialize(char *split_block) {
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::SplitClosure::splitInnerOnInitialize(char *split_block) {
 	p_tree->p_headSetFlags(split_block, 0);
-	p_tree->p_innerSetEntCount(split_block, p_rightSize);	
 	
-	/* setup the leftmost child reference of the new block */
-	char *block_rref = p_blockBuffer + p_tree->p_refOffInner(p_leftSize);
-	char *split_lref = split_block + p_tree->p_lrefOffInner();
-	*(BlkIndexType*)split_lref = *(BlkIndexType*)block_rref;
-	p_splitKey = p_tree->p_readKey(p_blockBuffer + p_tree->p_keyOffInner(p_leftSize));
-
-	/* setup the remaining entries of the new block */
-	std::memcpy(split_block + p_tree->p_entOffInner(0),
-			p_blockBuffer + p_tree->p_entOffInner(p_leftSize + 1),
-			p_rightSize * p_tree->p_entSizeInner());
-	/* FIXME: for debugging only! */
-	std::memset(p_blockBuffer + p_tree->p_entOffInner(p_leftSize), 0, (p_rightSize + 1) * p_tree->p_entSizeInner());
+	/* the child of the middle entry becomes the leftmost child of the new block */
+	p_tree->p_innerBuild(split_block, p_innerEntries[p_leftSize].ref,
+			p_innerEntries[p_leftSize].count,
+			p_innerEntries, p_leftSize + 1, p_innerEntries.size());
+	p_innerEntries.clear();
 	p_tree->p_pageCache.writePage(p_splitNumber);
 	p_tree->p_pageCache.releasePage(p_splitNumber);
 	
 	fixParent();
 }
-template<typename KeyType>
-void Btree<KeyType>::SplitClosure::fixParent() {
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::SplitClosure::fixParent() {
 	if(p_parentBuffer != nullptr) {
-		BlkIndexType parent_count = p_tree->p_innerGetEntCount(p_parentBuffer);
-		assert(parent_count < p_tree->p_entsPerInner());
+		assert(p_tree->p_innerFreeSpace(p_parentBuffer)
+				>= p_tree->p_entSizeInner(p_splitKey.size()));
 
 		p_tree->p_insertAtInnerR(p_parentBuffer, p_blockIndex + 1, p_splitKey, p_splitNumber);
+		if(p_tree->p_orderStatistics) {
+			p_tree->p_childSetCount(p_parentBuffer, p_blockIndex, p_leftCount);
+			p_tree->p_innerSetCount(p_parentBuffer, p_blockIndex + 1, p_rightCount);
+		}
 		
 		p_onComplete();
 	}else{
@@ -993,16 +2386,14 @@ void Btree<KeyType>::SplitClosure::fixParent() {
 				ASYNC_MEMBER(this, &SplitClosure::fixParentOnInitialize));
 	}
 }
-template<typename KeyType>
-void Btree<KeyType>::SplitClosure::fixParentOnInitialize(char *new_root_buffer) {
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::SplitClosure::fixParentOnInitialize(char *new_root_buffer) {
 	p_tree->p_headSetFlags(new_root_buffer, 0);
-	p_tree->p_innerSetEntCount(new_root_buffer, 1);
-	
-	char *lref = new_root_buffer + p_tree->p_lrefOffInner();
-	char *ref0 = new_root_buffer + p_tree->p_refOffInner(0);
-	*((BlkIndexType*)lref) = OS::toLeU32(p_blockNumber);
-	*((BlkIndexType*)ref0) = OS::toLeU32(p_splitNumber);
-	p_tree->p_writeKey(new_root_buffer + p_tree->p_keyOffInner(0), p_splitKey);
+	p_tree->p_innerBuild(new_root_buffer, p_blockNumber, p_leftCount,
+			std::vector<InnerEntry>(), 0, 0);
+	p_tree->p_insertAtInnerR(new_root_buffer, 0, p_splitKey, p_splitNumber);
+	if(p_tree->p_orderStatistics)
+		p_tree->p_innerSetCount(new_root_buffer, 0, p_rightCount);
 
 	p_tree->p_pageCache.writePage(p_newRootNumber);
 	p_tree->p_pageCache.releasePage(p_newRootNumber);
@@ -1010,12 +2401,393 @@ void Btree<KeyType>::SplitClosure::fixParentOnInitialize(char *new_root_buffer)
 	p_onComplete();
 }
 
+/* ------------------------------------------------------------------------- *
+ * NODE MERGING FUNCTIONS                                                    *
+ * ------------------------------------------------------------------------- */
+
+template<typename KeyType, typename Codec>
+bool Btree<KeyType, Codec>::blockIsUnderfull(char *block_buf) {
+	flags_type flags = p_headGetFlags(block_buf);
+	if((flags & BlockHead::kFlagIsLeaf) != 0) {
+		size_t used = p_leafCapacity() - p_leafFreeSpace(block_buf);
+		return used < p_leafCapacity() / 4;
+	}else{
+		size_t used = p_innerCapacity() - p_innerFreeSpace(block_buf);
+		return used < p_innerCapacity() / 4;
+	}
+}
+
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::MergeClosure::rebalance(BlkIndexType parent_num, char *parent_buf,
+		BlkIndexType child_index, Async::Callback<void()> on_complete) {
+	p_parentNumber = parent_num;
+	p_parentBuffer = parent_buf;
+	p_onComplete = on_complete;
+
+	// pair the block with its right sibling; the last child is paired with its left one
+	BlkIndexType ent_count = p_tree->p_innerGetEntCount(parent_buf);
+	assert(ent_count > 0);
+	p_sepIndex = (child_index < ent_count - 1) ? child_index + 1 : child_index;
+	
+	p_leftNumber = (p_sepIndex > 0) ? p_tree->p_innerGetRef(parent_buf, p_sepIndex - 1)
+			: p_tree->p_innerGetLref(parent_buf);
+	p_rightNumber = p_tree->p_innerGetRef(parent_buf, p_sepIndex);
+
+	// siblings are always latched from left to right
+	p_tree->p_latches.acquireExclusive(p_leftNumber,
+			ASYNC_MEMBER(this, &MergeClosure::onLatchLeft));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::MergeClosure::onLatchLeft() {
+	p_tree->p_pageCache.readPage(p_leftNumber,
+			ASYNC_MEMBER(this, &MergeClosure::onReadLeft));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::MergeClosure::onReadLeft(char *buffer) {
+	p_leftBuffer = buffer;
+	p_tree->p_latches.acquireExclusive(p_rightNumber,
+			ASYNC_MEMBER(this, &MergeClosure::onLatchRight));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::MergeClosure::onLatchRight() {
+	p_tree->p_pageCache.readPage(p_rightNumber,
+			ASYNC_MEMBER(this, &MergeClosure::onReadRight));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::MergeClosure::onReadRight(char *buffer) {
+	p_rightBuffer = buffer;
+	
+	flags_type flags = p_tree->p_headGetFlags(p_leftBuffer);
+	if((flags & BlockHead::kFlagIsLeaf) != 0) {
+		rebalanceLeaves();
+	}else{
+		rebalanceInner();
+	}
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::MergeClosure::rebalanceLeaves() {
+	p_leafEntries.clear();
+	p_tree->p_leafExtract(p_leftBuffer, p_leafEntries);
+	size_t left_count = p_leafEntries.size();
+	p_tree->p_leafExtract(p_rightBuffer, p_leafEntries);
+
+	size_t total_size = 0;
+	for(size_t i = 0; i < p_leafEntries.size(); i++)
+		total_size += p_tree->p_entSizeLeaf(p_leafEntries[i].key.size());
+	
+	// only merge if the result is not full immediately
+	size_t max_size = p_tree->p_leafCapacity()
+			- p_tree->p_entSizeLeaf(p_tree->getMaxKeyLength());
+	if(total_size <= max_size) {
+		p_rightLinkNumber = p_tree->p_leafGetRightLink(p_rightBuffer);
+		p_tree->p_leafBuild(p_leftBuffer, p_leafEntries, 0, p_leafEntries.size());
+		p_tree->p_leafSetRightLink(p_leftBuffer, p_rightLinkNumber);
+		p_leafEntries.clear();
+
+		p_tree->p_removeAtInner(p_parentBuffer, p_sepIndex);
+		updateCounts(false);
+		p_tree->p_pageCache.writePage(p_parentNumber);
+		
+		// the right block is freed once no left link refers to it anymore.
+		// backward iterators that hold the next leaf cannot latch it until then
+		if(p_rightLinkNumber != 0) {
+			p_tree->p_latches.acquireExclusive(p_rightLinkNumber,
+					ASYNC_MEMBER(this, &MergeClosure::onLatchRightLink));
+		}else{
+			p_tree->p_freeBlock(p_rightNumber);
+			p_tree->p_pageCache.writePage(p_leftNumber);
+			p_tree->p_releaseBlock(p_leftNumber);
+			complete();
+		}
+		return;
+	}
+
+	/* move entries so that both blocks occupy about the same space */
+	size_t new_left = 0;
+	size_t left_size = 0;
+	while(new_left < p_leafEntries.size() - 1
+			&& (new_left == 0 || 2 * left_size < total_size)) {
+		left_size += p_tree->p_entSizeLeaf(p_leafEntries[new_left].key.size());
+		new_left++;
+	}
+
+	if(new_left != left_count && p_tree->p_replaceKeyInner(p_parentBuffer,
+			p_sepIndex, p_leafEntries[new_left].key)) {
+		p_tree->p_leafBuild(p_leftBuffer, p_leafEntries, 0, new_left);
+		p_tree->p_leafBuild(p_rightBuffer, p_leafEntries, new_left, p_leafEntries.size());
+		updateCounts(true);
+		p_tree->p_pageCache.writePage(p_parentNumber);
+		p_tree->p_pageCache.writePage(p_leftNumber);
+		p_tree->p_pageCache.writePage(p_rightNumber);
+	}
+	p_leafEntries.clear();
+	
+	p_tree->p_releaseBlock(p_leftNumber);
+	p_tree->p_releaseBlock(p_rightNumber);
+	complete();
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::MergeClosure::onLatchRightLink() {
+	p_tree->p_pageCache.readPage(p_rightLinkNumber,
+			ASYNC_MEMBER(this, &MergeClosure::onReadRightLink));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::MergeClosure::onReadRightLink(char *link_buffer) {
+	p_tree->p_leafSetLeftLink(link_buffer, p_leftNumber);
+	p_tree->p_pageCache.writePage(p_rightLinkNumber);
+	p_tree->p_releaseBlock(p_rightLinkNumber);
+	p_tree->p_freeBlock(p_rightNumber);
+
+	p_tree->p_pageCache.writePage(p_leftNumber);
+	p_tree->p_releaseBlock(p_leftNumber);
+	complete();
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::MergeClosure::rebalanceInner() {
+	// the separator moves down from the parent and
+	// becomes the entry of the right block's leftmost child
+	InnerEntry separator;
+	p_tree->p_innerGetKeyBytes(p_parentBuffer, p_sepIndex, separator.key);
+	separator.ref = p_tree->p_innerGetLref(p_rightBuffer);
+	separator.count = p_tree->p_innerGetLrefCount(p_rightBuffer);
+	
+	p_innerEntries.clear();
+	p_tree->p_innerExtract(p_leftBuffer, p_innerEntries);
+	size_t left_count = p_innerEntries.size();
+	p_innerEntries.push_back(separator);
+	p_tree->p_innerExtract(p_rightBuffer, p_innerEntries);
+	
+	size_t total_size = 0;
+	for(size_t i = 0; i < p_innerEntries.size(); i++)
+		total_size += p_tree->p_entSizeInner(p_innerEntries[i].key.size());
+	
+	BlkIndexType left_lref = p_tree->p_innerGetLref(p_leftBuffer);
+	uint64_t left_lref_count = p_tree->p_innerGetLrefCount(p_leftBuffer);
+	if(total_size <= p_tree->p_innerCapacity() - p_tree->p_maxEntSizeInner()) {
+		p_tree->p_innerBuild(p_leftBuffer, left_lref, left_lref_count,
+				p_innerEntries, 0, p_innerEntries.size());
+		p_innerEntries.clear();
+
+		p_tree->p_removeAtInner(p_parentBuffer, p_sepIndex);
+		updateCounts(false);
+		p_tree->p_pageCache.writePage(p_parentNumber);
+		p_tree->p_pageCache.writePage(p_leftNumber);
+		p_tree->p_releaseBlock(p_leftNumber);
+		p_tree->p_freeBlock(p_rightNumber);
+		complete();
+		return;
+	}
+
+	/* the entry at new_left moves up to the parent.
+		both remaining halves must contain at least one entry */
+	size_t new_left = 0;
+	size_t left_size = 0;
+	while(new_left < p_innerEntries.size() - 2
+			&& (new_left == 0 || 2 * left_size < total_size)) {
+		left_size += p_tree->p_entSizeInner(p_innerEntries[new_left].key.size());
+		new_left++;
+	}
+
+	if(new_left != left_count && p_tree->p_replaceKeyInner(p_parentBuffer,
+			p_sepIndex, p_innerEntries[new_left].key)) {
+		p_tree->p_innerBuild(p_leftBuffer, left_lref, left_lref_count,
+				p_innerEntries, 0, new_left);
+		p_tree->p_innerBuild(p_rightBuffer, p_innerEntries[new_left].ref,
+				p_innerEntries[new_left].count,
+				p_innerEntries, new_left + 1, p_innerEntries.size());
+		updateCounts(true);
+		p_tree->p_pageCache.writePage(p_parentNumber);
+		p_tree->p_pageCache.writePage(p_leftNumber);
+		p_tree->p_pageCache.writePage(p_rightNumber);
+	}
+	p_innerEntries.clear();
+	
+	p_tree->p_releaseBlock(p_leftNumber);
+	p_tree->p_releaseBlock(p_rightNumber);
+	complete();
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::MergeClosure::updateCounts(bool has_right) {
+	if(!p_tree->p_orderStatistics)
+		return;
+
+	p_tree->p_childSetCount(p_parentBuffer, p_sepIndex - 1,
+			p_tree->p_blockCount(p_leftBuffer));
+	if(has_right)
+		p_tree->p_innerSetCount(p_parentBuffer, p_sepIndex,
+				p_tree->p_blockCount(p_rightBuffer));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::MergeClosure::complete() {
+	p_onComplete();
+}
+
+/* ------------------------------------------------------------------------- *
+ * COMPACTION FUNCTIONS                                                      *
+ * ------------------------------------------------------------------------- */
+
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::CompactClosure::compact(Async::Callback<void()> on_complete) {
+	p_onComplete = on_complete;
+	p_path.clear();
+
+	step();
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::CompactClosure::step() {
+	p_tree->p_latches.acquireExclusive(kHeadLatch,
+			ASYNC_MEMBER(this, &CompactClosure::onHeadLatch));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::CompactClosure::onHeadLatch() {
+	p_headLatched = true;
+	p_level = 0;
+	p_blockNumber = p_tree->p_curFileHead.rootBlock;
+	p_tree->p_latches.acquireExclusive(p_blockNumber,
+			ASYNC_MEMBER(this, &CompactClosure::onRootLatch));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::CompactClosure::onRootLatch() {
+	// keep the file head latched if the root itself might be collapsed
+	if(!p_path.empty()) {
+		p_tree->p_latches.release(kHeadLatch);
+		p_headLatched = false;
+	}
+
+	p_tree->p_pageCache.readPage(p_blockNumber,
+			ASYNC_MEMBER(this, &CompactClosure::onRead));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::CompactClosure::onRead(char *buffer) {
+	p_blockBuffer = buffer;
+	
+	flags_type flags = p_tree->p_headGetFlags(p_blockBuffer);
+	if(p_level == p_path.size()) {
+		if((flags & BlockHead::kFlagIsLeaf) != 0) {
+			// either the root is a leaf or the tree shrunk since
+			// the path was computed: there is nothing to merge here
+			p_tree->p_releaseBlock(p_blockNumber);
+			if(p_headLatched) {
+				p_tree->p_latches.release(kHeadLatch);
+				p_headLatched = false;
+			}
+			advance();
+			return;
+		}
+		
+		if(p_headLatched) {
+			if(p_tree->p_innerGetEntCount(p_blockBuffer) == 0) {
+				// the root only has a single child: make that child the new root
+				p_tree->p_curFileHead.rootBlock = p_tree->p_innerGetLref(p_blockBuffer);
+				p_tree->p_curFileHead.depth--;
+				p_tree->p_freeBlock(p_blockNumber);
+				p_tree->p_latches.release(kHeadLatch);
+				LocalTaskQueue::get()->submit(ASYNC_MEMBER(this, &CompactClosure::step));
+				return;
+			}
+			p_tree->p_latches.release(kHeadLatch);
+			p_headLatched = false;
+		}
+
+		p_childIndex = -1;
+		rebalanceLoop();
+		return;
+	}
+	
+	// the tree might have changed since the path was computed
+	BlkIndexType index = p_path[p_level];
+	if((flags & BlockHead::kFlagIsLeaf) != 0
+			|| index >= p_tree->p_innerGetEntCount(p_blockBuffer)) {
+		p_tree->p_releaseBlock(p_blockNumber);
+		p_path.resize(p_level);
+		advance();
+		return;
+	}
+	
+	p_childNumber = (index >= 0) ? p_tree->p_innerGetRef(p_blockBuffer, index)
+			: p_tree->p_innerGetLref(p_blockBuffer);
+	p_tree->p_latches.acquireExclusive(p_childNumber,
+			ASYNC_MEMBER(this, &CompactClosure::onChildLatch));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::CompactClosure::onChildLatch() {
+	p_tree->p_releaseBlock(p_blockNumber);
+	p_blockNumber = p_childNumber;
+	p_level++;
+
+	p_tree->p_pageCache.readPage(p_blockNumber,
+			ASYNC_MEMBER(this, &CompactClosure::onRead));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::CompactClosure::rebalanceLoop() {
+	if(p_childIndex >= p_tree->p_innerGetEntCount(p_blockBuffer)) {
+		finishBlock();
+		return;
+	}
+	
+	p_childNumber = (p_childIndex >= 0)
+			? p_tree->p_innerGetRef(p_blockBuffer, p_childIndex)
+			: p_tree->p_innerGetLref(p_blockBuffer);
+	p_tree->p_latches.acquireExclusive(p_childNumber,
+			ASYNC_MEMBER(this, &CompactClosure::onCheckLatch));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::CompactClosure::onCheckLatch() {
+	p_tree->p_pageCache.readPage(p_childNumber,
+			ASYNC_MEMBER(this, &CompactClosure::onCheckRead));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::CompactClosure::onCheckRead(char *buffer) {
+	flags_type flags = p_tree->p_headGetFlags(buffer);
+	p_childrenAreLeaves = (flags & BlockHead::kFlagIsLeaf) != 0;
+	
+	bool underfull = p_tree->blockIsUnderfull(buffer);
+	p_tree->p_releaseBlock(p_childNumber);
+	
+	if(underfull && p_tree->p_innerGetEntCount(p_blockBuffer) > 0) {
+		p_mergeClosure.rebalance(p_blockNumber, p_blockBuffer, p_childIndex,
+				ASYNC_MEMBER(this, &CompactClosure::onRebalance));
+	}else{
+		p_childIndex++;
+		rebalanceLoop();
+	}
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::CompactClosure::onRebalance() {
+	// NOTE: a merge removes an entry from the current block.
+	// we always advance to make sure that this loop terminates
+	p_childIndex++;
+	LocalTaskQueue::get()->submit(ASYNC_MEMBER(this, &CompactClosure::rebalanceLoop));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::CompactClosure::finishBlock() {
+	p_tree->p_releaseBlock(p_blockNumber);
+
+	if(!p_childrenAreLeaves) {
+		// continue with the leftmost child of this block
+		p_path.push_back(-1);
+		LocalTaskQueue::get()->submit(ASYNC_MEMBER(this, &CompactClosure::step));
+	}else{
+		advance();
+	}
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::CompactClosure::advance() {
+	if(p_path.empty()) {
+		p_onComplete();
+		return;
+	}
+
+	p_path.back()++;
+	LocalTaskQueue::get()->submit(ASYNC_MEMBER(this, &CompactClosure::step));
+}
+
 /* ------------------------------------------------------------------------- *
  * INTERNAL UTILITY FUNCTIONS                                                *
  * ------------------------------------------------------------------------- */
 
-template<typename KeyType>
-void Btree<KeyType>::SearchNodeClosure::nextInLeaf(char *block,
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::SearchNodeClosure::nextInLeaf(char *block,
 		UnaryCompareCallback compare,
 		Async::Callback<void(int)> callback) {
 	p_blockBuffer = block;
@@ -1027,18 +2799,17 @@ void Btree<KeyType>::SearchNodeClosure::nextInLeaf(char *block,
 
 	nextInLeafLoop();
 }
-template<typename KeyType>
-void Btree<KeyType>::SearchNodeClosure::nextInLeafLoop() {
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::SearchNodeClosure::nextInLeafLoop() {
 	if(p_entryIndex < p_entryCount) {
-		KeyType ent_key = p_tree->p_readKey(p_blockBuffer
-				+ p_tree->p_keyOffLeaf(p_entryIndex));
+		KeyType ent_key = p_tree->p_leafGetKey(p_blockBuffer, p_entryIndex);
 		p_compare(ent_key, ASYNC_MEMBER(this, &SearchNodeClosure::nextInLeafCheck));
 	}else{
 		p_callback(-1);
 	}
 }
-template<typename KeyType>
-void Btree<KeyType>::SearchNodeClosure::nextInLeafCheck(int result) {
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::SearchNodeClosure::nextInLeafCheck(int result) {
 	if(result >= 0) {
 		p_callback(p_entryIndex);
 	}else{
@@ -1047,8 +2818,8 @@ void Btree<KeyType>::SearchNodeClosure::nextInLeafCheck(int result) {
 		nextInLeafLoop();
 	}
 }
-template<typename KeyType>
-void Btree<KeyType>::SearchNodeClosure::nextInInner(char *block,
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::SearchNodeClosure::nextInInner(char *block,
 		UnaryCompareCallback compare,
 		Async::Callback<void(int)> callback) {
 	p_blockBuffer = block;
@@ -1060,18 +2831,17 @@ void Btree<KeyType>::SearchNodeClosure::nextInInner(char *block,
 
 	nextInInnerLoop();
 }
-template<typename KeyType>
-void Btree<KeyType>::SearchNodeClosure::nextInInnerLoop() {
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::SearchNodeClosure::nextInInnerLoop() {
 	if(p_entryIndex < p_entryCount) {
-		KeyType ent_key = p_tree->p_readKey(p_blockBuffer
-				+ p_tree->p_keyOffInner(p_entryIndex));
+		KeyType ent_key = p_tree->p_innerGetKey(p_blockBuffer, p_entryIndex);
 		p_compare(ent_key, ASYNC_MEMBER(this, &SearchNodeClosure::nextInInnerCheck));
 	}else{
 		p_callback(-1);
 	}
 }
-template<typename KeyType>
-void Btree<KeyType>::SearchNodeClosure::nextInInnerCheck(int result) {
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::SearchNodeClosure::nextInInnerCheck(int result) {
 	if(result >= 0) {
 		p_callback(p_entryIndex);
 		return;
@@ -1082,78 +2852,498 @@ void Btree<KeyType>::SearchNodeClosure::nextInInnerCheck(int result) {
 	}
 }
 
-template<typename KeyType>
-void Btree<KeyType>::p_insertAtLeaf(char *block, BlkIndexType i,
-		const KeyType &key, void *value) {
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::p_insertAtLeaf(char *block, BlkIndexType i,
+		const std::string &key, void *value) {
 	BlkIndexType ent_count = p_leafGetEntCount(block);
-	std::memmove(block + p_entOffLeaf(i + 1), block + p_entOffLeaf(i),
-		(ent_count - i) * p_entSizeLeaf());
-	p_writeKey(block + p_keyOffLeaf(i), key);
-	std::memcpy(block + p_valOffLeaf(i), value, p_valSize);
+	size_t prefix_length = p_leafGetPrefixLength(block);
+	size_t shared = p_commonPrefix(block + p_prefixOffLeaf(), prefix_length,
+			key.data(), key.size());
+	if(shared < prefix_length) {
+		// the key does not match the prefix: rebuild the block with a shorter one
+		std::vector<LeafEntry> entries;
+		p_leafExtract(block, entries);
+		LeafEntry entry;
+		entry.key = key;
+		entry.value.assign((const char*)value, p_valSize);
+		entries.insert(entries.begin() + i, entry);
+		p_leafBuild(block, entries, 0, entries.size());
+		return;
+	}
+
+	// the key shares the whole prefix, hence it is at least as long as the prefix
+	size_t suffix_length = key.size() - prefix_length;
+	assert(p_leafFreeSpace(block) >= kSlotSize + p_valSize + suffix_length);
+	std::memmove(block + p_slotOffLeaf(block, i + 1), block + p_slotOffLeaf(block, i),
+		(ent_count - i) * kSlotSize);
+	
+	size_t heap_offset = p_leafGetHeapOffset(block) - p_valSize - suffix_length;
+	std::memcpy(block + heap_offset, value, p_valSize);
+	std::memcpy(block + heap_offset + p_valSize, key.data() + prefix_length, suffix_length);
+	p_slotSet(block + p_slotOffLeaf(block, i), heap_offset, suffix_length);
+	p_leafSetHeapOffset(block, heap_offset);
 	p_leafSetEntCount(block, ent_count + 1);
 }
-template<typename KeyType>
-void Btree<KeyType>::p_insertAtInnerR(char *block, int i,
-		const KeyType &key, BlkIndexType ref) {
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::p_insertAtInnerR(char *block, int i,
+		const std::string &key, BlkIndexType ref) {
 	BlkIndexType ent_count = p_innerGetEntCount(block);
-	std::memmove(block + p_entOffInner(i + 1), block + p_entOffInner(i),
-		(ent_count - i) * p_entSizeInner());
-	p_writeKey(block + p_keyOffInner(i), key);
-	char *refi = block + p_refOffInner(i);
-	*((BlkIndexType*)refi) = ref;
+	assert(p_innerFreeSpace(block) >= p_entSizeInner(key.size()));
+	std::memmove(block + p_slotOffInner(i + 1), block + p_slotOffInner(i),
+		(ent_count - i) * kSlotSize);
+	
+	size_t heap_offset = p_innerGetHeapOffset(block) - p_refSizeInner() - key.size();
+	*((BlkIndexType*)(block + heap_offset)) = OS::toLeU32(ref);
+	if(p_orderStatistics)
+		OS::packLe64(block + heap_offset + sizeof(BlkIndexType), 0);
+	std::memcpy(block + heap_offset + p_refSizeInner(), key.data(), key.size());
+	p_slotSet(block + p_slotOffInner(i), heap_offset, key.size());
+	p_innerSetHeapOffset(block, heap_offset);
 	p_innerSetEntCount(block, ent_count + 1);
 }
 
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::p_removeAtLeaf(char *block, BlkIndexType i) {
+	// rebuild the block to keep its heap compact
+	std::vector<LeafEntry> entries;
+	p_leafExtract(block, entries);
+	entries.erase(entries.begin() + i);
+	p_leafBuild(block, entries, 0, entries.size());
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::p_removeAtInner(char *block, BlkIndexType i) {
+	std::vector<InnerEntry> entries;
+	p_innerExtract(block, entries);
+	entries.erase(entries.begin() + i);
+	p_innerBuild(block, p_innerGetLref(block), p_innerGetLrefCount(block),
+			entries, 0, entries.size());
+}
+template<typename KeyType, typename Codec>
+bool Btree<KeyType, Codec>::p_replaceKeyInner(char *block, BlkIndexType i,
+		const std::string &key) {
+	std::vector<InnerEntry> entries;
+	p_innerExtract(block, entries);
+	entries[i].key = key;
+
+	size_t total_size = 0;
+	for(size_t j = 0; j < entries.size(); j++)
+		total_size += p_entSizeInner(entries[j].key.size());
+	if(total_size > p_innerCapacity())
+		return false;
+
+	p_innerBuild(block, p_innerGetLref(block), p_innerGetLrefCount(block),
+			entries, 0, entries.size());
+	return true;
+}
+
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::p_leafExtract(char *block_buf, std::vector<LeafEntry> &entries) {
+	BlkIndexType ent_count = p_leafGetEntCount(block_buf);
+	for(int i = 0; i < ent_count; i++) {
+		LeafEntry entry;
+		p_leafGetKeyBytes(block_buf, i, entry.key);
+		entry.value.assign(p_leafGetValue(block_buf, i), p_valSize);
+		entries.push_back(std::move(entry));
+	}
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::p_innerExtract(char *block_buf, std::vector<InnerEntry> &entries) {
+	BlkIndexType ent_count = p_innerGetEntCount(block_buf);
+	for(int i = 0; i < ent_count; i++) {
+		InnerEntry entry;
+		p_innerGetKeyBytes(block_buf, i, entry.key);
+		entry.ref = p_innerGetRef(block_buf, i);
+		entry.count = p_orderStatistics ? p_innerGetCount(block_buf, i) : 0;
+		entries.push_back(std::move(entry));
+	}
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::p_leafBuild(char *block_buf, const std::vector<LeafEntry> &entries,
+		size_t begin, size_t end) {
+	// entries are sorted by the comparator which need not match byte order
+	// (e.g. decimal numbers or little-endian integers). the prefix must
+	// therefore be shared by every key, not just by the first and last one
+	size_t prefix_length = 0;
+	if(end > begin) {
+		const std::string &first = entries[begin].key;
+		prefix_length = first.size();
+		for(size_t i = begin + 1; i < end && prefix_length > 0; i++)
+			prefix_length = p_commonPrefix(first.data(), prefix_length,
+					entries[i].key.data(), entries[i].key.size());
+		std::memcpy(block_buf + p_prefixOffLeaf(), first.data(), prefix_length);
+	}
+	p_leafSetPrefixLength(block_buf, prefix_length);
+
+	size_t heap_offset = p_blockSize;
+	for(size_t i = begin; i < end; i++) {
+		assert(entries[i].key.size() >= prefix_length);
+		size_t suffix_length = entries[i].key.size() - prefix_length;
+		heap_offset -= p_valSize + suffix_length;
+		std::memcpy(block_buf + heap_offset, entries[i].value.data(), p_valSize);
+		std::memcpy(block_buf + heap_offset + p_valSize,
+				entries[i].key.data() + prefix_length, suffix_length);
+		p_slotSet(block_buf + p_slotOffLeaf(block_buf, i - begin),
+				heap_offset, suffix_length);
+	}
+	p_leafSetHeapOffset(block_buf, heap_offset);
+	p_leafSetEntCount(block_buf, end - begin);
+	assert(p_slotOffLeaf(block_buf, end - begin) <= heap_offset);
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::p_innerBuild(char *block_buf, BlkIndexType lref, uint64_t lref_count,
+		const std::vector<InnerEntry> &entries, size_t begin, size_t end) {
+	p_innerSetLref(block_buf, lref);
+	if(p_orderStatistics)
+		p_innerSetLrefCount(block_buf, lref_count);
+
+	size_t heap_offset = p_blockSize;
+	for(size_t i = begin; i < end; i++) {
+		heap_offset -= p_refSizeInner() + entries[i].key.size();
+		*((BlkIndexType*)(block_buf + heap_offset)) = OS::toLeU32(entries[i].ref);
+		if(p_orderStatistics)
+			OS::packLe64(block_buf + heap_offset + sizeof(BlkIndexType), entries[i].count);
+		std::memcpy(block_buf + heap_offset + p_refSizeInner(),
+				entries[i].key.data(), entries[i].key.size());
+		p_slotSet(block_buf + p_slotOffInner(i - begin),
+				heap_offset, entries[i].key.size());
+	}
+	p_innerSetHeapOffset(block_buf, heap_offset);
+	p_innerSetEntCount(block_buf, end - begin);
+	assert(p_slotOffInner(end - begin) <= heap_offset);
+}
+
 /* ------------------------------------------------------------------------- *
- * DEBUGGING FUNCTIONS                                                       *
+ * INTEGRITY CHECKING FUNCTIONS                                              *
  * ------------------------------------------------------------------------- */
 
-template<typename KeyType>
-void Btree<KeyType>::p_blockIntegrity(BlkIndexType block_num,
-		KeyType min, KeyType max) {
-	char *block_buf = new char[p_blockSize];
-	//FIXME: use async read instead
-	//p_readBlock(block_num, block_buf);
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IntegrityClosure::check(TaskPool *pool,
+		Async::Callback<void()> on_complete) {
+	p_pool = pool;
+	p_queue = LocalTaskQueue::get();
+	p_onComplete = on_complete;
+
+	p_report = BtreeIntegrityReport();
+	p_report.keysChecked = p_hasCompare;
+	p_report.countsChecked = p_tree->p_orderStatistics;
+
+	p_tree->p_latches.acquireShared(kHeadLatch,
+			ASYNC_MEMBER(this, &IntegrityClosure::onHeadLatch));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IntegrityClosure::onHeadLatch() {
+	p_report.depth = p_tree->p_curFileHead.depth;
+	{
+		std::lock_guard<std::mutex> lock(p_tree->p_allocMutex);
+		p_report.numBlocks = p_tree->p_curFileHead.numBlocks;
+		p_report.freeBlocks = p_tree->p_freeBlocks.size();
+	}
 	
-	flags_type flags = OS::fromLeU32(*(flags_type*)block_buf);
-	if((flags & BlockHead::kFlagIsLeaf) != 0) {
-		BlkIndexType ent_count = p_innerGetEntCount(block_buf);
-		KeyType prev_key = min;
-		for(int i = 0; i < ent_count; i++) {
-			KeyType key = p_readKey(block_buf + p_keyOffLeaf(i));
-			if(p_compare(key, prev_key) < 0)
-				throw std::logic_error(std::string("Integrity violated!"
-						" (1.1), block: ") + std::to_string(block_num));
-			prev_key = key;
+	// the file head is released as soon as the root is latched
+	p_pendingBlocks = 1;
+	auto root = new BlockCheck(this, nullptr, p_tree->p_curFileHead.rootBlock, 0);
+	root->run();
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IntegrityClosure::onBlockDone() {
+	bool done;
+	{
+		std::lock_guard<std::mutex> lock(p_mutex);
+		assert(p_pendingBlocks > 0);
+		p_pendingBlocks--;
+		done = (p_pendingBlocks == 0);
+	}
+	if(done)
+		p_queue->submit(p_onComplete);
+}
+
+template<typename KeyType, typename Codec>
+Btree<KeyType, Codec>::IntegrityClosure::BlockCheck::BlockCheck(IntegrityClosure *closure,
+		BlockCheck *parent, BlkIndexType number, int32_t level)
+	: hasLowerBound(false), hasUpperBound(false), expectedCount(0),
+		p_closure(closure), p_tree(closure->p_tree), p_parent(parent),
+		p_number(number), p_level(level), p_buffer(nullptr),
+		p_rightNumber(0), p_pendingChildren(0) { }
+
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IntegrityClosure::BlockCheck::run() {
+	p_tree->p_latches.acquireShared(p_number,
+			ASYNC_MEMBER(this, &BlockCheck::onLatch));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IntegrityClosure::BlockCheck::onLatch() {
+	// the bounds and the count that were read from the parent
+	// cannot change while this block is latched
+	if(p_parent != nullptr) {
+		p_parent->onChildLatch();
+	}else{
+		p_tree->p_latches.release(kHeadLatch);
+	}
+	p_parent = nullptr;
+
+	p_tree->p_pageCache.readPage(p_number,
+			ASYNC_MEMBER(this, &BlockCheck::onRead));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IntegrityClosure::BlockCheck::onRead(char *buffer) {
+	p_buffer = buffer;
+
+	int32_t depth = p_closure->p_report.depth;
+	bool is_leaf = (p_tree->p_headGetFlags(p_buffer) & BlockHead::kFlagIsLeaf) != 0;
+	if(is_leaf != (p_level == depth - 1))
+		error(std::string(is_leaf ? "leaf" : "inner block")
+				+ " at level " + std::to_string(p_level)
+				+ " in a tree of depth " + std::to_string(depth));
+	
+	if(!checkLayout(p_buffer, true)) {
+		finish();
+		return;
+	}
+	
+	if(p_level > 0 && p_closure->p_report.countsChecked
+			&& p_tree->p_blockCount(p_buffer) != expectedCount)
+		error("subtree contains " + std::to_string(p_tree->p_blockCount(p_buffer))
+				+ " entries but the parent counts " + std::to_string(expectedCount));
+
+	if(is_leaf) {
+		checkLeaf();
+	}else if(p_level < depth - 1) {
+		checkInner();
+	}else{
+		// do not descend any further; this also prevents cycles
+		finish();
+	}
+}
+template<typename KeyType, typename Codec>
+bool Btree<KeyType, Codec>::IntegrityClosure::BlockCheck::checkLayout(char *buffer,
+		bool report_errors) {
+	size_t block_size = p_tree->p_blockSize;
+	size_t key_size = p_tree->p_codec.keySize();
+	
+	bool is_leaf = (p_tree->p_headGetFlags(buffer) & BlockHead::kFlagIsLeaf) != 0;
+	BlkIndexType ent_count = is_leaf ? p_tree->p_leafGetEntCount(buffer)
+			: p_tree->p_innerGetEntCount(buffer);
+	BlkIndexType heap_offset = is_leaf ? p_tree->p_leafGetHeapOffset(buffer)
+			: p_tree->p_innerGetHeapOffset(buffer);
+	BlkIndexType prefix_length = is_leaf ? p_tree->p_leafGetPrefixLength(buffer) : 0;
+	
+	if(ent_count < 0 || heap_offset < 0 || prefix_length < 0
+			|| (size_t)heap_offset > block_size || (size_t)prefix_length > block_size) {
+		if(report_errors)
+			error("corrupted block header");
+		return false;
+	}
+	size_t slots_end = is_leaf ? p_tree->p_slotOffLeaf(buffer, ent_count)
+			: p_tree->p_slotOffInner(ent_count);
+	if(slots_end > (size_t)heap_offset) {
+		if(report_errors)
+			error("slot array overlaps the heap");
+		return false;
+	}
+
+	size_t ent_head = is_leaf ? p_tree->p_valSize : p_tree->p_refSizeInner();
+	for(int i = 0; i < ent_count; i++) {
+		const char *slot = buffer + (is_leaf ? p_tree->p_slotOffLeaf(buffer, i)
+				: p_tree->p_slotOffInner(i));
+		size_t offset = p_slotGetOffset(slot);
+		size_t length = p_slotGetLength(slot);
+		if(offset < (size_t)heap_offset || offset + ent_head + length > block_size) {
+			if(report_errors)
+				error("entry " + std::to_string(i) + " lies outside of the heap");
+			return false;
+		}
+		if(key_size != 0 && prefix_length + length != key_size) {
+			if(report_errors)
+				error("entry " + std::to_string(i) + " has a key of length "
+						+ std::to_string(prefix_length + length));
+			return false;
 		}
-		if(p_compare(max, prev_key) < 0)
-			throw std::logic_error(std::string("Integrity violated!"
-					" (1.2), block: ") + std::to_string(block_num));
+	}
+	return true;
+}
+template<typename KeyType, typename Codec>
+bool Btree<KeyType, Codec>::IntegrityClosure::BlockCheck::validRef(BlkIndexType number) {
+	std::lock_guard<std::mutex> lock(p_tree->p_allocMutex);
+	return number > 0 && number < p_tree->p_curFileHead.numBlocks;
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IntegrityClosure::BlockCheck::checkKeys(
+		const std::vector<std::string> &keys) {
+	if(!p_closure->p_hasCompare || keys.empty())
+		return;
+
+	BinaryCompareCallback compare = p_closure->p_compare;
+	KeyType previous = p_tree->p_codec.readKey(keys[0].data(), keys[0].size());
+	if(hasLowerBound && compare(p_tree->p_codec.readKey(lowerBound.data(),
+			lowerBound.size()), previous) > 0)
+		error("first key is smaller than the separator in the parent");
+	for(size_t i = 1; i < keys.size(); i++) {
+		KeyType key = p_tree->p_codec.readKey(keys[i].data(), keys[i].size());
+		if(compare(previous, key) > 0)
+			error("entries " + std::to_string(i - 1) + " and "
+					+ std::to_string(i) + " are out of order");
+		previous = key;
+	}
+	if(hasUpperBound && compare(previous, p_tree->p_codec.readKey(upperBound.data(),
+			upperBound.size())) > 0)
+		error("last key is larger than the next separator in the parent");
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IntegrityClosure::BlockCheck::checkLeaf() {
+	BlkIndexType ent_count = p_tree->p_leafGetEntCount(p_buffer);
+	std::vector<std::string> keys(ent_count);
+	for(int i = 0; i < ent_count; i++)
+		p_tree->p_leafGetKeyBytes(p_buffer, i, keys[i]);
+	checkKeys(keys);
+	if(ent_count > 0)
+		p_lastKey = keys.back();
+
+	BlkIndexType left_link = p_tree->p_leafGetLeftLink(p_buffer);
+	BlkIndexType right_link = p_tree->p_leafGetRightLink(p_buffer);
+	{
+		std::lock_guard<std::mutex> lock(p_closure->p_mutex);
+		BtreeIntegrityReport &report = p_closure->p_report;
+		report.leafBlocks++;
+		report.entries += ent_count;
+		report.leafBytesUsed += p_tree->p_leafCapacity() - p_tree->p_leafFreeSpace(p_buffer);
+		report.leafCapacity += p_tree->p_leafCapacity();
+		if(p_level > 0 && p_tree->blockIsUnderfull(p_buffer))
+			report.underfullBlocks++;
+		if(p_level > 0 && ent_count == 0)
+			report.emptyLeaves++;
+		if(right_link != 0 && right_link != p_number + 1)
+			report.discontiguousLinks++;
+	}
+
+	if(left_link != 0 && !validRef(left_link))
+		error("left link references invalid block " + std::to_string(left_link));
+	if(right_link == 0) {
+		finish();
+	}else if(!validRef(right_link)) {
+		error("right link references invalid block " + std::to_string(right_link));
+		finish();
 	}else{
-		BlkIndexType ent_count = p_innerGetEntCount(block_buf);
-		KeyType prev_key = min;
-		for(int i = 0; i < ent_count; i++) {
-			KeyType key = p_readKey(block_buf + p_keyOffInner(i));
-			if(p_compare(key, prev_key) < 0)
-				throw std::logic_error(std::string("Integrity violated!"
-						" (2.1), block: ") + std::to_string(block_num));
-			prev_key = key;
+		// latches are coupled from left to right just like forward iteration does
+		p_rightNumber = right_link;
+		p_tree->p_latches.acquireShared(p_rightNumber,
+				ASYNC_MEMBER(this, &BlockCheck::onRightLatch));
+	}
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IntegrityClosure::BlockCheck::onRightLatch() {
+	p_tree->p_pageCache.readPage(p_rightNumber,
+			ASYNC_MEMBER(this, &BlockCheck::onRightRead));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IntegrityClosure::BlockCheck::onRightRead(char *buffer) {
+	if(!(p_tree->p_headGetFlags(buffer) & BlockHead::kFlagIsLeaf)) {
+		error("right link references inner block " + std::to_string(p_rightNumber));
+	}else if(p_tree->p_leafGetLeftLink(buffer) != p_number) {
+		error("right neighbor " + std::to_string(p_rightNumber)
+				+ " links back to block "
+				+ std::to_string(p_tree->p_leafGetLeftLink(buffer)));
+	}else if(p_closure->p_hasCompare && p_tree->p_leafGetEntCount(p_buffer) > 0
+			&& p_tree->p_leafGetEntCount(buffer) > 0
+			&& checkLayout(buffer, false)) {
+		// the neighbor reports its own layout errors
+		std::string first_key;
+		p_tree->p_leafGetKeyBytes(buffer, 0, first_key);
+		if(p_closure->p_compare(p_tree->p_codec.readKey(p_lastKey.data(), p_lastKey.size()),
+				p_tree->p_codec.readKey(first_key.data(), first_key.size())) > 0)
+			error("last key is larger than the first key of right neighbor "
+					+ std::to_string(p_rightNumber));
+	}
+	
+	p_tree->p_releaseBlock(p_rightNumber);
+	finish();
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IntegrityClosure::BlockCheck::checkInner() {
+	BlkIndexType ent_count = p_tree->p_innerGetEntCount(p_buffer);
+	std::vector<std::string> keys(ent_count);
+	for(int i = 0; i < ent_count; i++)
+		p_tree->p_innerGetKeyBytes(p_buffer, i, keys[i]);
+	checkKeys(keys);
+	
+	{
+		std::lock_guard<std::mutex> lock(p_closure->p_mutex);
+		BtreeIntegrityReport &report = p_closure->p_report;
+		report.innerBlocks++;
+		report.innerBytesUsed += p_tree->p_innerCapacity() - p_tree->p_innerFreeSpace(p_buffer);
+		report.innerCapacity += p_tree->p_innerCapacity();
+		if(p_level > 0 && p_tree->blockIsUnderfull(p_buffer))
+			report.underfullBlocks++;
+	}
+	
+	// child index -1 refers to the leftmost child
+	std::vector<BlockCheck *> children;
+	for(int i = -1; i < ent_count; i++) {
+		BlkIndexType number = (i >= 0) ? p_tree->p_innerGetRef(p_buffer, i)
+				: p_tree->p_innerGetLref(p_buffer);
+		if(!validRef(number)) {
+			error("child " + std::to_string(i) + " references invalid block "
+					+ std::to_string(number));
+			continue;
 		}
-		if(p_compare(max, prev_key) < 0)
-			throw std::logic_error(std::string("Integrity violated!"
-					" (2.2), block: ") + std::to_string(block_num));
-		
-		char *lref = block_buf + p_lrefOffInner();
-		p_blockIntegrity(*(BlkIndexType*)lref, min,
-				p_readKey(block_buf + p_keyOffInner(0)));
-		for(int i = 0; i < ent_count; i++) {
-			KeyType ckey = p_readKey(block_buf + p_keyOffInner(i));
-			KeyType nkey = (i == ent_count - 1 ? max
-				: p_readKey(block_buf + p_keyOffInner(i + 1)));
-			char *refi = block_buf + p_refOffInner(i);
-			p_blockIntegrity(*(BlkIndexType*)refi, ckey, nkey);
+
+		auto child = new BlockCheck(p_closure, this, number, p_level + 1);
+		if(i >= 0) {
+			child->lowerBound = keys[i];
+			child->hasLowerBound = true;
+		}else{
+			child->lowerBound = lowerBound;
+			child->hasLowerBound = hasLowerBound;
 		}
+		if(i + 1 < ent_count) {
+			child->upperBound = keys[i + 1];
+			child->hasUpperBound = true;
+		}else{
+			child->upperBound = upperBound;
+			child->hasUpperBound = hasUpperBound;
+		}
+		if(p_closure->p_report.countsChecked)
+			child->expectedCount = p_tree->p_childGetCount(p_buffer, i);
+		children.push_back(child);
+	}
+	if(children.empty()) {
+		finish();
+		return;
+	}
+
+	IntegrityClosure *closure = p_closure;
+	{
+		std::lock_guard<std::mutex> lock(closure->p_mutex);
+		p_pendingChildren = children.size();
+		closure->p_pendingBlocks += children.size();
+	}
+	// NOTE: this object is deleted as soon as the last child is latched
+	for(auto it = children.begin(); it != children.end(); ++it)
+		closure->p_pool->submit(ASYNC_MEMBER(*it, &BlockCheck::run));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IntegrityClosure::BlockCheck::onChildLatch() {
+	bool done;
+	{
+		std::lock_guard<std::mutex> lock(p_closure->p_mutex);
+		assert(p_pendingChildren > 0);
+		p_pendingChildren--;
+		done = (p_pendingChildren == 0);
 	}
+	if(done)
+		finish();
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IntegrityClosure::BlockCheck::finish() {
+	p_tree->p_releaseBlock(p_number);
+
+	IntegrityClosure *closure = p_closure;
+	delete this;
+	closure->onBlockDone();
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::IntegrityClosure::BlockCheck::error(const std::string &message) {
+	std::lock_guard<std::mutex> lock(p_closure->p_mutex);
+	p_closure->p_report.addError("block " + std::to_string(p_number) + ": " + message);
 }
 
 
@@ -1161,65 +3351,227 @@ void Btree<KeyType>::p_blockIntegrity(BlkIndexType block_num,
  * INTERNAL TECHNICAL UTILITY FUNCTIONS                                      *
  * ------------------------------------------------------------------------- */
 
-template<typename KeyType>
-typename Btree<KeyType>::flags_type Btree<KeyType>::p_headGetFlags(char *block_buf) {
+template<typename KeyType, typename Codec>
+std::string Btree<KeyType, Codec>::p_encodeKey(const KeyType &key) {
+	size_t length = p_codec.keyLength(key);
+	if(length > getMaxKeyLength())
+		throw std::runtime_error("Key exceeds maximal key length");
+	std::string bytes(length, 0);
+	p_codec.writeKey(&bytes[0], key);
+	return bytes;
+}
+
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::p_leafGetKeyBytes(char *block_buf, int i, std::string &bytes) {
+	const char *slot = block_buf + p_slotOffLeaf(block_buf, i);
+	size_t prefix_length = p_leafGetPrefixLength(block_buf);
+	bytes.assign(block_buf + p_prefixOffLeaf(), prefix_length);
+	bytes.append(block_buf + p_slotGetOffset(slot) + p_valSize, p_slotGetLength(slot));
+}
+template<typename KeyType, typename Codec>
+KeyType Btree<KeyType, Codec>::p_leafGetKey(char *block_buf, int i) {
+	const char *slot = block_buf + p_slotOffLeaf(block_buf, i);
+	size_t prefix_length = p_leafGetPrefixLength(block_buf);
+	if(prefix_length == 0)
+		return p_codec.readKey(block_buf + p_slotGetOffset(slot) + p_valSize,
+				p_slotGetLength(slot));
+	
+	size_t length = prefix_length + p_slotGetLength(slot);
+	if(length <= kKeyBufferSize) {
+		char buffer[kKeyBufferSize];
+		memcpy(buffer, block_buf + p_prefixOffLeaf(), prefix_length);
+		memcpy(buffer + prefix_length, block_buf + p_slotGetOffset(slot) + p_valSize,
+				p_slotGetLength(slot));
+		return p_codec.readKey(buffer, length);
+	}
+
+	std::string bytes;
+	p_leafGetKeyBytes(block_buf, i, bytes);
+	return p_codec.readKey(bytes.data(), bytes.size());
+}
+template<typename KeyType, typename Codec>
+char *Btree<KeyType, Codec>::p_leafGetValue(char *block_buf, int i) {
+	const char *slot = block_buf + p_slotOffLeaf(block_buf, i);
+	return block_buf + p_slotGetOffset(slot);
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::p_innerGetKeyBytes(char *block_buf, int i, std::string &bytes) {
+	const char *slot = block_buf + p_slotOffInner(i);
+	bytes.assign(block_buf + p_slotGetOffset(slot) + p_refSizeInner(),
+			p_slotGetLength(slot));
+}
+template<typename KeyType, typename Codec>
+KeyType Btree<KeyType, Codec>::p_innerGetKey(char *block_buf, int i) {
+	const char *slot = block_buf + p_slotOffInner(i);
+	return p_codec.readKey(block_buf + p_slotGetOffset(slot) + p_refSizeInner(),
+			p_slotGetLength(slot));
+}
+template<typename KeyType, typename Codec>
+typename Btree<KeyType, Codec>::BlkIndexType Btree<KeyType, Codec>::p_innerGetRef(char *block_buf, int i) {
+	const char *slot = block_buf + p_slotOffInner(i);
+	return OS::fromLeU32(*((BlkIndexType*)(block_buf + p_slotGetOffset(slot))));
+}
+template<typename KeyType, typename Codec>
+typename Btree<KeyType, Codec>::BlkIndexType Btree<KeyType, Codec>::p_innerGetLref(char *block_buf) {
+	return OS::fromLeU32(*((BlkIndexType*)(block_buf + p_lrefOffInner())));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::p_innerSetLref(char *block_buf, BlkIndexType ref) {
+	*((BlkIndexType*)(block_buf + p_lrefOffInner())) = OS::toLeU32(ref);
+}
+
+template<typename KeyType, typename Codec>
+uint64_t Btree<KeyType, Codec>::p_innerGetCount(char *block_buf, int i) {
+	const char *slot = block_buf + p_slotOffInner(i);
+	return OS::unpackLe64(block_buf + p_slotGetOffset(slot) + sizeof(BlkIndexType));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::p_innerSetCount(char *block_buf, int i, uint64_t count) {
+	const char *slot = block_buf + p_slotOffInner(i);
+	OS::packLe64(block_buf + p_slotGetOffset(slot) + sizeof(BlkIndexType), count);
+}
+template<typename KeyType, typename Codec>
+uint64_t Btree<KeyType, Codec>::p_innerGetLrefCount(char *block_buf) {
+	if(!p_orderStatistics)
+		return 0;
+	return OS::unpackLe64(block_buf + p_lrefOffInner() + sizeof(BlkIndexType));
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::p_innerSetLrefCount(char *block_buf, uint64_t count) {
+	OS::packLe64(block_buf + p_lrefOffInner() + sizeof(BlkIndexType), count);
+}
+template<typename KeyType, typename Codec>
+uint64_t Btree<KeyType, Codec>::p_childGetCount(char *block_buf, int index) {
+	if(index == -1)
+		return p_innerGetLrefCount(block_buf);
+	return p_innerGetCount(block_buf, index);
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::p_childSetCount(char *block_buf, int index, uint64_t count) {
+	if(index == -1) {
+		p_innerSetLrefCount(block_buf, count);
+	}else{
+		p_innerSetCount(block_buf, index, count);
+	}
+}
+template<typename KeyType, typename Codec>
+uint64_t Btree<KeyType, Codec>::p_blockCount(char *block_buf) {
+	if(p_headGetFlags(block_buf) & BlockHead::kFlagIsLeaf)
+		return p_leafGetEntCount(block_buf);
+
+	uint64_t count = p_innerGetLrefCount(block_buf);
+	BlkIndexType ent_count = p_innerGetEntCount(block_buf);
+	for(int i = 0; i < ent_count; i++)
+		count += p_innerGetCount(block_buf, i);
+	return count;
+}
+
+template<typename KeyType, typename Codec>
+size_t Btree<KeyType, Codec>::p_leafFreeSpace(char *block_buf) {
+	return p_leafGetHeapOffset(block_buf)
+			- p_slotOffLeaf(block_buf, p_leafGetEntCount(block_buf));
+}
+template<typename KeyType, typename Codec>
+size_t Btree<KeyType, Codec>::p_innerFreeSpace(char *block_buf) {
+	return p_innerGetHeapOffset(block_buf)
+			- p_slotOffInner(p_innerGetEntCount(block_buf));
+}
+
+template<typename KeyType, typename Codec>
+typename Btree<KeyType, Codec>::flags_type Btree<KeyType, Codec>::p_headGetFlags(char *block_buf) {
 	BlockHead *bhead = (BlockHead*)block_buf;
 	return OS::fromLeU32(bhead->flags);
 }
-template<typename KeyType>
-void Btree<KeyType>::p_headSetFlags(char *block_buf,
-		typename Btree<KeyType>::flags_type flags) {
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::p_headSetFlags(char *block_buf,
+		typename Btree<KeyType, Codec>::flags_type flags) {
 	BlockHead *bhead = (BlockHead*)block_buf;
 	bhead->flags = OS::toLeU32(flags);
 }
 
-template<typename KeyType>
-typename Btree<KeyType>::BlkIndexType Btree<KeyType>::p_innerGetEntCount(char *block_buf) {
+template<typename KeyType, typename Codec>
+typename Btree<KeyType, Codec>::BlkIndexType Btree<KeyType, Codec>::p_innerGetEntCount(char *block_buf) {
 	InnerHead *head = (InnerHead*)block_buf;
 	return OS::fromLeU32(head->entCount2);
 }
-template<typename KeyType>
-void Btree<KeyType>::p_innerSetEntCount(char *block_buf,
-		typename Btree<KeyType>::BlkIndexType ent_count) {
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::p_innerSetEntCount(char *block_buf,
+		typename Btree<KeyType, Codec>::BlkIndexType ent_count) {
 	InnerHead *head = (InnerHead*)block_buf;
 	head->entCount2 = OS::toLeU32(ent_count);
 }
 
-template<typename KeyType>
-typename Btree<KeyType>::BlkIndexType Btree<KeyType>::p_leafGetEntCount(char *block_buf) {
+template<typename KeyType, typename Codec>
+typename Btree<KeyType, Codec>::BlkIndexType Btree<KeyType, Codec>::p_leafGetEntCount(char *block_buf) {
 	LeafHead *head = (LeafHead*)block_buf;
 	return OS::fromLeU32(head->entCount2);
 }
-template<typename KeyType>
-void Btree<KeyType>::p_leafSetEntCount(char *block_buf,
-		typename Btree<KeyType>::BlkIndexType ent_count) {
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::p_leafSetEntCount(char *block_buf,
+		typename Btree<KeyType, Codec>::BlkIndexType ent_count) {
 	LeafHead *head = (LeafHead*)block_buf;
 	head->entCount2 = OS::toLeU32(ent_count);
 }
 
-template<typename KeyType>
-typename Btree<KeyType>::BlkIndexType Btree<KeyType>::p_leafGetLeftLink(char *block_buf) {
+template<typename KeyType, typename Codec>
+typename Btree<KeyType, Codec>::BlkIndexType Btree<KeyType, Codec>::p_leafGetLeftLink(char *block_buf) {
 	LeafHead *head = (LeafHead*)block_buf;
 	return OS::fromLeU32(head->leftLink2);
 }
-template<typename KeyType>
-void Btree<KeyType>::p_leafSetLeftLink(char *block_buf,
-		typename Btree<KeyType>::BlkIndexType ent_count) {
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::p_leafSetLeftLink(char *block_buf,
+		typename Btree<KeyType, Codec>::BlkIndexType ent_count) {
 	LeafHead *head = (LeafHead*)block_buf;
 	head->leftLink2 = OS::toLeU32(ent_count);
 }
 
-template<typename KeyType>
-typename Btree<KeyType>::BlkIndexType Btree<KeyType>::p_leafGetRightLink(char *block_buf) {
+template<typename KeyType, typename Codec>
+typename Btree<KeyType, Codec>::BlkIndexType Btree<KeyType, Codec>::p_leafGetRightLink(char *block_buf) {
 	LeafHead *head = (LeafHead*)block_buf;
 	return OS::fromLeU32(head->rightLink2);
 }
-template<typename KeyType>
-void Btree<KeyType>::p_leafSetRightLink(char *block_buf,
-		typename Btree<KeyType>::BlkIndexType ent_count) {
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::p_leafSetRightLink(char *block_buf,
+		typename Btree<KeyType, Codec>::BlkIndexType ent_count) {
 	LeafHead *head = (LeafHead*)block_buf;
 	head->rightLink2 = OS::toLeU32(ent_count);
 }
 
+template<typename KeyType, typename Codec>
+typename Btree<KeyType, Codec>::BlkIndexType Btree<KeyType, Codec>::p_innerGetHeapOffset(char *block_buf) {
+	InnerHead *head = (InnerHead*)block_buf;
+	return OS::fromLeU32(head->heapOffset2);
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::p_innerSetHeapOffset(char *block_buf,
+		typename Btree<KeyType, Codec>::BlkIndexType offset) {
+	InnerHead *head = (InnerHead*)block_buf;
+	head->heapOffset2 = OS::toLeU32(offset);
+}
+
+template<typename KeyType, typename Codec>
+typename Btree<KeyType, Codec>::BlkIndexType Btree<KeyType, Codec>::p_leafGetPrefixLength(char *block_buf) {
+	LeafHead *head = (LeafHead*)block_buf;
+	return OS::fromLeU32(head->prefixLength2);
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::p_leafSetPrefixLength(char *block_buf,
+		typename Btree<KeyType, Codec>::BlkIndexType length) {
+	LeafHead *head = (LeafHead*)block_buf;
+	head->prefixLength2 = OS::toLeU32(length);
+}
+
+template<typename KeyType, typename Codec>
+typename Btree<KeyType, Codec>::BlkIndexType Btree<KeyType, Codec>::p_leafGetHeapOffset(char *block_buf) {
+	LeafHead *head = (LeafHead*)block_buf;
+	return OS::fromLeU32(head->heapOffset2);
+}
+template<typename KeyType, typename Codec>
+void Btree<KeyType, Codec>::p_leafSetHeapOffset(char *block_buf,
+		typename Btree<KeyType, Codec>::BlkIndexType offset) {
+	LeafHead *head = (LeafHead*)block_buf;
+	head->heapOffset2 = OS::toLeU32(offset);
+}
+
 #endif
 
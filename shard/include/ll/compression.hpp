@@ -0,0 +1,42 @@
+#ifndef D3B_LL_COMPRESSION_HPP
+#define D3B_LL_COMPRESSION_HPP
+
+struct ZSTD_CDict_s;
+struct ZSTD_DDict_s;
+
+namespace Ll {
+
+// compresses small records independently of each other.
+// zstd can use a dictionary that was trained on sample records
+class Compressor {
+public:
+	enum Codec {
+		kCodecNone = 0,
+		kCodecLz4 = 1,
+		kCodecZstd = 2
+	};
+
+	Compressor();
+	~Compressor();
+
+	// must be called before any record is compressed
+	void configure(Codec codec, int level, const std::string &dictionary);
+
+	// returns the codec that was actually used.
+	// records that do not shrink are not compressed
+	Codec compress(const char *data, size_t length, std::string &output);
+	// raw_length is the length of the uncompressed record
+	void decompress(Codec codec, const char *data, size_t length,
+			char *output, size_t raw_length);
+
+private:
+	Codec p_codec;
+	int p_level;
+	ZSTD_CDict_s *p_compressDict;
+	ZSTD_DDict_s *p_decompressDict;
+};
+
+} // namespace Ll
+
+#endif
+
@@ -0,0 +1,48 @@
+
+#ifndef D3B_LL_LATCH_HPP
+#define D3B_LL_LATCH_HPP
+
+#include <unordered_map>
+#include <deque>
+#include <mutex>
+
+// asynchronous shared/exclusive latches identified by a number.
+// latches are created on demand and destroyed once they are idle.
+// acquire() calls its callback directly if the latch is available;
+// otherwise the callback is resubmitted to the waiting thread once it is granted
+class LatchTable {
+public:
+	typedef int64_t LatchId;
+
+	void acquireShared(LatchId id, Async::Callback<void()> callback);
+	void acquireExclusive(LatchId id, Async::Callback<void()> callback);
+	// acquires a shared latch only if that is possible without waiting
+	bool tryAcquireShared(LatchId id);
+	// releases a shared or exclusive latch
+	void release(LatchId id);
+
+private:
+	struct Waiter {
+		Waiter(bool exclusive, TaskCallback callback)
+			: exclusive(exclusive), callback(callback) { }
+
+		bool exclusive;
+		TaskCallback callback;
+	};
+
+	struct Latch {
+		Latch() : sharedCount(0), exclusive(false) { }
+
+		int sharedCount;
+		bool exclusive;
+		std::deque<Waiter> waitQueue;
+	};
+
+	void grantWaiters(Latch &latch);
+
+	std::mutex p_mutex;
+	std::unordered_map<LatchId, Latch> p_latches;
+};
+
+#endif
+
@@ -11,6 +11,8 @@ class Cacheable {
 friend class CacheHost;
 public:
 	Cacheable();
+	// items may be deleted through pointers to this class
+	virtual ~Cacheable() = default;
 	
 	// called when the resources of this item may be acquired
 	virtual void acquire() = 0;
@@ -36,6 +38,9 @@ public:
 	void onAccess(Cacheable *item);
 	// signals that the resources belonging to an item have been successfully released
 	void afterRelease(Cacheable *item);
+	// removes an item without calling release(). returns false if
+	// the item is not alive, e.g. because it is being released
+	bool forget(Cacheable *item);
 	
 	void setLimit(int64_t limit);
 
@@ -101,14 +106,21 @@ public:
 
 	PageCache(CacheHost *cache_host, int page_size, TaskPool *io_pool);
 	
+	// the page size must not change while pages are present
+	void setPageSize(int page_size);
 	void open(const std::string &path);
 
 	void initializePage(PageNumber number,
 			Async::Callback<void(char *)> callback);
 	void readPage(PageNumber number,
 			Async::Callback<void(char *)> callback);
+	// starts loading a page without referencing it.
+	// the page can be evicted again before it is read
+	void prefetchPage(PageNumber number);
 	void writePage(PageNumber number);
 	void releasePage(PageNumber number);
+	// discards the contents of the file. no page may be in use
+	void truncate();
 
 	int getPageSize();
 	int getUsedCount();
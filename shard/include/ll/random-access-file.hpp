@@ -13,8 +13,12 @@ public:
 			CacheHost *cache_host, TaskPool *io_pool);
 
 	void setPath(const std::string &path);
+	// must be called before the file is created
+	void setPageSize(int page_size);
 	
 	void createFile();
+	// discards the contents of the file. it must not be accessed concurrently
+	void truncate();
 
 	class ReadClosure {
 	public:
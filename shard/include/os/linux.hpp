@@ -125,6 +125,7 @@ public:
 		void seekEnd();
 		void fsyncSync();
 		void fdatasyncSync();
+		void truncateSync(off_type length);
 		void closeSync();
 		size_type lengthSync();
 
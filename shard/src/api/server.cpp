@@ -149,6 +149,12 @@ void Server::Connection::processMessage() {
 	if(p_curPacket.opcode == Proto::kCqFetch) {
 		auto closure = new FetchClosure(engine, this, p_curPacket.seqNumber);
 		closure->execute(p_curPacket.length, p_bodyBuffer);
+	}else if(p_curPacket.opcode == Proto::kCqMultiFetch) {
+		auto closure = new MultiFetchClosure(engine, this, p_curPacket.seqNumber);
+		closure->execute(p_curPacket.length, p_bodyBuffer);
+	}else if(p_curPacket.opcode == Proto::kCqHistory) {
+		auto closure = new HistoryClosure(engine, this, p_curPacket.seqNumber);
+		closure->execute(p_curPacket.length, p_bodyBuffer);
 	}else if(p_curPacket.opcode == Proto::kCqQuery) {
 		auto closure = new QueryClosure(engine, this, p_curPacket.seqNumber);
 		closure->execute(p_curPacket.length, p_bodyBuffer);
@@ -301,6 +307,9 @@ void Server::Connection::processMessage() {
 		
 		Proto::SrFin fin_resp;
 		postResponse(Proto::kSrFin, seq_number, fin_resp);
+	}else if(p_curPacket.opcode == Proto::kCqCheckIntegrity) {
+		auto closure = new CheckIntegrityClosure(engine, this, p_curPacket.seqNumber);
+		closure->execute(p_curPacket.length, p_bodyBuffer);
 	}else if(p_curPacket.opcode == Proto::kCqShutdown) {
 		p_server->p_shutdownCallback();
 	}else{
@@ -321,6 +330,10 @@ void Server::Connection::parseMutation(Db::Mutation &mutation, const Proto::Muta
 		mutation.storageIndex = engine->getStorage(pb_mutation.storage_name());
 		mutation.documentId = pb_mutation.document_id();
 		mutation.buffer = pb_mutation.buffer();
+	}else if(pb_mutation.type() == Proto::Mutation::kTypeDelete) {
+		mutation.type = Db::Mutation::kTypeDelete;
+		mutation.storageIndex = engine->getStorage(pb_mutation.storage_name());
+		mutation.documentId = pb_mutation.document_id();
 	}else throw std::runtime_error("Illegal mutation type");
 }
 
@@ -375,10 +388,19 @@ void Server::FetchClosure::execute(size_t packet_size, const void *packet_buffer
 	
 	p_request.storageIndex = p_engine->getStorage(request.storage_name());
 	p_request.documentId = request.document_id();
+	// the snapshot stays pinned until the fetch completes
 	if(request.has_sequence_id()) {
 		p_request.sequenceId = request.sequence_id();
+		if(!p_engine->pinSnapshot(p_request.sequenceId)) {
+			Proto::SrFin response;
+			response.set_error(Proto::kCodeSnapshotTooOld);
+			p_connection->postResponse(Proto::kSrFin, p_responseId, response);
+			
+			delete this;
+			return;
+		}
 	}else{
-		p_request.sequenceId = p_engine->currentSequenceId();
+		p_request.sequenceId = p_engine->pinCurrentSnapshot();
 	}
 	p_engine->fetch(&p_request, ASYNC_MEMBER(this, &FetchClosure::onData),
 			ASYNC_MEMBER(this, &FetchClosure::complete));
@@ -389,6 +411,8 @@ void Server::FetchClosure::onData(Db::FetchData &data) {
 	p_connection->postResponse(Proto::kSrBlob, p_responseId, response);
 }
 void Server::FetchClosure::complete(Db::FetchError error) {
+	p_engine->unpinSnapshot(p_request.sequenceId);
+
 	if(error == Db::kFetchSuccess) {
 		Proto::SrFin response;
 		response.set_error(Proto::kCodeSuccess);
@@ -398,6 +422,123 @@ void Server::FetchClosure::complete(Db::FetchError error) {
 	delete this;
 }
 
+// --------------------------------------------------------
+// MultiFetchClosure
+// --------------------------------------------------------
+
+Server::MultiFetchClosure::MultiFetchClosure(Db::Engine *engine,
+		Connection *connection, ResponseId response_id)
+	: p_engine(engine), p_connection(connection), p_responseId(response_id) { }
+
+void Server::MultiFetchClosure::execute(size_t packet_size,
+		const void *packet_buffer) {
+	Proto::CqMultiFetch request;
+	if(!request.ParseFromArray(packet_buffer, packet_size)) {
+		Proto::SrFin response;
+		response.set_error(Proto::kCodeParseError);
+		p_connection->postResponse(Proto::kSrFin, p_responseId, response);
+		
+		delete this;
+		return;
+	}
+	
+	p_request.storageIndex = p_engine->getStorage(request.storage_name());
+	for(int i = 0; i < request.document_ids_size(); i++)
+		p_request.documentIds.push_back(request.document_ids(i));
+	// the snapshot stays pinned until the fetch completes
+	if(request.has_sequence_id()) {
+		p_request.sequenceId = request.sequence_id();
+		if(!p_engine->pinSnapshot(p_request.sequenceId)) {
+			Proto::SrFin response;
+			response.set_error(Proto::kCodeSnapshotTooOld);
+			p_connection->postResponse(Proto::kSrFin, p_responseId, response);
+			
+			delete this;
+			return;
+		}
+	}else{
+		p_request.sequenceId = p_engine->pinCurrentSnapshot();
+	}
+	p_engine->multiFetch(&p_request, ASYNC_MEMBER(this, &MultiFetchClosure::onData),
+			ASYNC_MEMBER(this, &MultiFetchClosure::complete));
+}
+void Server::MultiFetchClosure::onData(std::vector<Db::FetchData> &batch) {
+	Proto::SrDocuments response;
+	for(auto it = batch.begin(); it != batch.end(); ++it) {
+		Proto::SrDocuments::Document *document = response.add_documents();
+		document->set_document_id(it->documentId);
+		document->set_sequence_id(it->sequenceId);
+		document->set_buffer(it->buffer);
+	}
+	p_connection->postResponse(Proto::kSrDocuments, p_responseId, response);
+}
+void Server::MultiFetchClosure::complete(Db::FetchError error) {
+	p_engine->unpinSnapshot(p_request.sequenceId);
+
+	if(error == Db::kFetchSuccess) {
+		Proto::SrFin response;
+		response.set_error(Proto::kCodeSuccess);
+		p_connection->postResponse(Proto::kSrFin, p_responseId, response);
+	}else throw std::logic_error("Unexpected error during fetch");
+
+	delete this;
+}
+
+// --------------------------------------------------------
+// HistoryClosure
+// --------------------------------------------------------
+
+Server::HistoryClosure::HistoryClosure(Db::Engine *engine,
+		Connection *connection, ResponseId response_id)
+	: p_engine(engine), p_connection(connection), p_responseId(response_id) { }
+
+void Server::HistoryClosure::execute(size_t packet_size,
+		const void *packet_buffer) {
+	Proto::CqHistory request;
+	if(!request.ParseFromArray(packet_buffer, packet_size)) {
+		Proto::SrFin response;
+		response.set_error(Proto::kCodeParseError);
+		p_connection->postResponse(Proto::kSrFin, p_responseId, response);
+		
+		delete this;
+		return;
+	}
+	
+	// versions behind the garbage collection horizon are not reported
+	p_request.storageIndex = p_engine->getStorage(request.storage_name());
+	p_request.documentId = request.document_id();
+	p_request.fromSequenceId = request.from_sequence_id();
+	if(request.has_to_sequence_id()) {
+		p_request.toSequenceId = request.to_sequence_id();
+	}else{
+		p_request.toSequenceId = p_engine->currentSequenceId();
+	}
+	p_engine->history(&p_request, ASYNC_MEMBER(this, &HistoryClosure::onData),
+			ASYNC_MEMBER(this, &HistoryClosure::complete));
+}
+void Server::HistoryClosure::onData(std::vector<Db::VersionData> &batch) {
+	Proto::SrVersions response;
+	for(auto it = batch.begin(); it != batch.end(); ++it) {
+		Proto::SrVersions::Version *version = response.add_versions();
+		version->set_sequence_id(it->sequenceId);
+		if(it->deleted) {
+			version->set_deleted(true);
+		}else{
+			version->set_buffer(it->buffer);
+		}
+	}
+	p_connection->postResponse(Proto::kSrVersions, p_responseId, response);
+}
+void Server::HistoryClosure::complete(Db::FetchError error) {
+	if(error == Db::kFetchSuccess) {
+		Proto::SrFin response;
+		response.set_error(Proto::kCodeSuccess);
+		p_connection->postResponse(Proto::kSrFin, p_responseId, response);
+	}else throw std::logic_error("Unexpected error during history request");
+
+	delete this;
+}
+
 // --------------------------------------------------------
 // QueryClosure
 // --------------------------------------------------------
@@ -420,19 +561,33 @@ void Server::QueryClosure::execute(size_t packet_size, const void *packet_buffer
 	p_request.viewIndex = p_engine->getView(request.view_name());
 	if(request.has_sequence_id()) {
 		p_request.sequenceId = request.sequence_id();
+		if(!p_engine->pinSnapshot(p_request.sequenceId)) {
+			Proto::SrFin response;
+			response.set_error(Proto::kCodeSnapshotTooOld);
+			p_connection->postResponse(Proto::kSrFin, p_responseId, response);
+			
+			delete this;
+			return;
+		}
 	}else{
-		p_request.sequenceId = p_engine->currentSequenceId();
+		p_request.sequenceId = p_engine->pinCurrentSnapshot();
 	}
 	if(request.has_from_key()) {
 		p_request.useFromKey = true;
 		p_request.fromKey = request.from_key();
 	}
 	if(request.has_to_key()) {
-		p_request.useFromKey = true;
-		p_request.fromKey = request.to_key();
+		p_request.useToKey = true;
+		p_request.toKey = request.to_key();
 	}
 	if(request.has_limit())
 		p_request.limit = request.limit();
+	if(request.has_descending())
+		p_request.descending = request.descending();
+	if(request.has_count_only())
+		p_request.countOnly = request.count_only();
+	if(request.has_offset())
+		p_request.offset = request.offset();
 
 	p_engine->query(&p_request, ASYNC_MEMBER(this, &QueryClosure::onData),
 			ASYNC_MEMBER(this, &QueryClosure::complete));
@@ -444,9 +599,21 @@ void Server::QueryClosure::onData(Db::QueryData &rows) {
 	p_connection->postResponse(Proto::kSrRows, p_responseId, response);
 }
 void Server::QueryClosure::complete(Db::QueryError error) {
+	p_engine->unpinSnapshot(p_request.sequenceId);
+
 	if(error == Db::kQuerySuccess) {
 		Proto::SrFin response;
 		response.set_error(Proto::kCodeSuccess);
+		if(p_request.countOnly)
+			response.set_count(p_request.count);
+		p_connection->postResponse(Proto::kSrFin, p_responseId, response);
+	}else if(error == Db::kQueryIllegalRequest) {
+		Proto::SrFin response;
+		response.set_error(Proto::kCodeIllegalRequest);
+		p_connection->postResponse(Proto::kSrFin, p_responseId, response);
+	}else if(error == Db::kQuerySnapshotTooOld) {
+		Proto::SrFin response;
+		response.set_error(Proto::kCodeSnapshotTooOld);
 		p_connection->postResponse(Proto::kSrFin, p_responseId, response);
 	}else throw std::logic_error("Unexpected error during query");
 
@@ -601,5 +768,69 @@ void Server::ApplyClosure::onRollback() {
 	delete this;
 }
 
+// --------------------------------------------------------
+// CheckIntegrityClosure
+// --------------------------------------------------------
+
+Server::CheckIntegrityClosure::CheckIntegrityClosure(Db::Engine *engine,
+		Connection *connection, ResponseId response_id)
+	: p_engine(engine), p_connection(connection), p_responseId(response_id) { }
+
+void Server::CheckIntegrityClosure::execute(size_t packet_size,
+		const void *packet_buffer) {
+	Proto::CqCheckIntegrity request;
+	if(!request.ParseFromArray(packet_buffer, packet_size)) {
+		Proto::SrFin response;
+		response.set_error(Proto::kCodeParseError);
+		p_connection->postResponse(Proto::kSrFin, p_responseId, response);
+		
+		delete this;
+		return;
+	}
+
+	if(request.has_storage_name()) {
+		int storage = p_engine->getStorage(request.storage_name());
+		if(storage == -1) {
+			Proto::SrFin response;
+			response.set_error(Proto::kCodeIllegalStorage);
+			p_connection->postResponse(Proto::kSrFin, p_responseId, response);
+			
+			delete this;
+			return;
+		}
+		p_engine->checkStorage(storage,
+				ASYNC_MEMBER(this, &CheckIntegrityClosure::complete));
+	}else if(request.has_view_name()) {
+		int view = p_engine->getView(request.view_name());
+		if(view == -1) {
+			Proto::SrFin response;
+			response.set_error(Proto::kCodeIllegalView);
+			p_connection->postResponse(Proto::kSrFin, p_responseId, response);
+			
+			delete this;
+			return;
+		}
+		p_engine->checkView(view,
+				ASYNC_MEMBER(this, &CheckIntegrityClosure::complete));
+	}else{
+		Proto::SrFin response;
+		response.set_error(Proto::kCodeIllegalRequest);
+		p_connection->postResponse(Proto::kSrFin, p_responseId, response);
+		
+		delete this;
+	}
+}
+void Server::CheckIntegrityClosure::complete(const std::string &report) {
+	Proto::SrBlob blob_resp;
+	blob_resp.set_buffer(report);
+	p_connection->postResponse(Proto::kSrBlob, p_responseId, blob_resp);
+
+	Proto::SrFin fin_resp;
+	fin_resp.set_error(Proto::kCodeSuccess);
+	p_connection->postResponse(Proto::kSrFin, p_responseId, fin_resp);
+	
+	delete this;
+}
+
 } // namespace Api
 
@@ -0,0 +1,256 @@
+
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+#include <string>
+#include <chrono>
+#include <iostream>
+
+#include "async.hpp"
+#include "os/linux.hpp"
+#include "ll/tasks.hpp"
+#include "ll/page-cache.hpp"
+#include "ll/btree.hpp"
+
+// compares the runtime callback key codec to an inlined codec.
+// both trees store the same keys (laid out like FlexStorage's index);
+// only the codec differs.
+// usage: bench-btree-codec <path> [count]
+
+struct Key {
+	enum Fields {
+		kHigh = 0,
+		kLow = 8,
+		// size of the whole structure
+		kStructSize = 16
+	};
+
+	uint64_t high;
+	uint64_t low;
+};
+
+enum {
+	kValueSize = 16
+};
+
+void writeKey(void *buffer, const Key &key) {
+	OS::packLe64((char*)buffer + Key::kHigh, key.high);
+	OS::packLe64((char*)buffer + Key::kLow, key.low);
+}
+Key readKey(const void *buffer, size_t length) {
+	assert(length == Key::kStructSize);
+	Key key;
+	key.high = OS::unpackLe64((char*)buffer + Key::kHigh);
+	key.low = OS::unpackLe64((char*)buffer + Key::kLow);
+	return key;
+}
+
+struct StaticKeyCodec {
+	static constexpr size_t keySize() {
+		return Key::kStructSize;
+	}
+	static size_t keyLength(const Key &key) {
+		return Key::kStructSize;
+	}
+	static void writeKey(void *buffer, const Key &key) {
+		::writeKey(buffer, key);
+	}
+	static Key readKey(const void *buffer, size_t length) {
+		return ::readKey(buffer, length);
+	}
+};
+
+int compareKeys(const Key &a, const Key &b) {
+	if(a.high != b.high)
+		return a.high < b.high ? -1 : 1;
+	if(a.low != b.low)
+		return a.low < b.low ? -1 : 1;
+	return 0;
+}
+
+// --------------------------------------------------------
+// BenchClosure
+// --------------------------------------------------------
+
+// inserts count keys, looks up each of them and scans the whole tree.
+// operations that complete synchronously are driven by a loop
+// instead of recursion to keep the stack flat
+template<typename Tree>
+class BenchClosure {
+public:
+	BenchClosure(Tree *tree, uint64_t count, Async::Callback<void()> callback)
+		: p_tree(tree), p_count(count), p_callback(callback),
+			p_find(tree), p_iterate(tree), p_checksum(0) { }
+
+	void run() {
+		p_phase = kPhaseInsert;
+		p_beginPhase();
+		p_loop();
+	}
+
+private:
+	enum Phase {
+		kPhaseInsert,
+		kPhaseFind,
+		kPhaseScan,
+		kPhaseDone
+	};
+
+	void p_beginPhase() {
+		p_index = 0;
+		p_start = std::chrono::steady_clock::now();
+	}
+	void p_endPhase(const char *name) {
+		auto elapsed = std::chrono::steady_clock::now() - p_start;
+		auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+		std::cout << "  " << name << ": "
+				<< (ns / 1000000) << " ms, "
+				<< (p_count > 0 ? ns / p_count : 0) << " ns/op" << std::endl;
+	}
+
+	void p_loop() {
+		p_inLoop = true;
+		while(true) {
+			if(p_phase == kPhaseInsert && p_index == p_count) {
+				p_endPhase("insert");
+				p_phase = kPhaseFind;
+				p_beginPhase();
+			}
+			if(p_phase == kPhaseFind && p_index == p_count) {
+				p_endPhase("find");
+				p_phase = kPhaseScan;
+				p_beginPhase();
+			}
+			if(p_phase == kPhaseScan && p_index > 0 && !p_iterate.valid()) {
+				if(p_index - 1 != p_count)
+					std::cout << "  scan returned " << (p_index - 1) << " keys" << std::endl;
+				p_endPhase("scan");
+				p_phase = kPhaseDone;
+			}
+			if(p_phase == kPhaseDone) {
+				p_callback();
+				return;
+			}
+
+			p_pending = true;
+			p_step();
+			if(p_pending) {
+				// the operation completes asynchronously; p_onStep() resumes the loop
+				p_inLoop = false;
+				return;
+			}
+		}
+	}
+	void p_step() {
+		p_key.high = p_index + 1;
+		p_key.low = 1;
+
+		if(p_phase == kPhaseInsert) {
+			auto action = p_tree->insert(&p_key, p_value,
+					ASYNC_MEMBER(this, &BenchClosure::p_compareToCurrent));
+			libchain::run(action, ASYNC_MEMBER(this, &BenchClosure::p_onStep));
+		}else if(p_phase == kPhaseFind) {
+			p_find.findNext(ASYNC_MEMBER(this, &BenchClosure::p_compareToCurrent),
+					ASYNC_MEMBER(this, &BenchClosure::p_onFind));
+		}else if(p_index == 0) {
+			p_find.findFirst(ASYNC_MEMBER(this, &BenchClosure::p_onFirst));
+		}else{
+			p_checksum += p_iterate.getKey().high;
+			p_iterate.forward(ASYNC_MEMBER(this, &BenchClosure::p_onStep));
+		}
+	}
+	void p_compareToCurrent(const Key &other, Async::Callback<void(int)> callback) {
+		callback(compareKeys(other, p_key));
+	}
+	void p_onFind(typename Tree::Ref ref) {
+		assert(ref.valid());
+		p_tree->releaseRef(ref);
+		p_onStep();
+	}
+	void p_onFirst(typename Tree::Ref ref) {
+		p_iterate.seek(ref, ASYNC_MEMBER(this, &BenchClosure::p_onStep));
+	}
+	void p_onStep() {
+		p_index++;
+		p_pending = false;
+		if(!p_inLoop)
+			p_loop();
+	}
+
+	Tree *p_tree;
+	uint64_t p_count;
+	Async::Callback<void()> p_callback;
+	typename Tree::FindClosure p_find;
+	typename Tree::IterateClosure p_iterate;
+
+	Phase p_phase;
+	uint64_t p_index;
+	bool p_inLoop;
+	bool p_pending;
+	std::chrono::steady_clock::time_point p_start;
+
+	Key p_key;
+	char p_value[kValueSize];
+	uint64_t p_checksum;
+};
+
+// --------------------------------------------------------
+// main()
+// --------------------------------------------------------
+
+volatile bool running;
+
+void onBenchDone() {
+	running = false;
+}
+
+template<typename Tree>
+void runBench(Tree &tree, const std::string &path, uint64_t count) {
+	tree.setPath(path);
+	tree.createTree();
+
+	running = true;
+	BenchClosure<Tree> closure(&tree, count,
+			Async::Callback<void()>::make<&onBenchDone>());
+	closure.run();
+	while(running)
+		OS::LocalAsyncHost::get()->process();
+}
+
+int main(int argc, char **argv) {
+	if(argc < 2) {
+		std::cout << "Usage: " << argv[0] << " <path> [count]" << std::endl;
+		return EXIT_FAILURE;
+	}
+	std::string path = argv[1];
+	uint64_t count = argc > 2 ? std::stoull(argv[2]) : 1000000;
+
+	OS::LocalAsyncHost::set(new OS::LocalAsyncHost());
+	LocalTaskQueue::set(new LocalTaskQueue(OS::LocalAsyncHost::get()));
+	LocalTaskQueue::get()->process();
+
+	WorkerThread worker;
+	TaskPool io_pool;
+	io_pool.addWorker(worker.getTaskQueue());
+
+	// keep both trees in memory; we want to measure the cpu path
+	CacheHost cache_host;
+	cache_host.setLimit(int64_t(1) << 32);
+
+	BtreeCallbackCodec<Key> callback_codec(Key::kStructSize);
+	callback_codec.setWriteKey(Async::Callback<void(void *, const Key &)>::make<&writeKey>());
+	callback_codec.setReadKey(Async::Callback<Key(const void *, size_t)>::make<&readKey>());
+	Btree<Key> callback_tree("callback", 4096, kValueSize,
+			&cache_host, &io_pool, callback_codec);
+	Btree<Key, StaticKeyCodec> static_tree("static", 4096, kValueSize,
+			&cache_host, &io_pool);
+
+	std::cout << "callback codec (" << count << " keys)" << std::endl;
+	runBench(callback_tree, path, count);
+	std::cout << "static codec (" << count << " keys)" << std::endl;
+	runBench(static_tree, path, count);
+
+	worker.shutdown();
+	worker.getThread().join();
+}
+
@@ -0,0 +1,153 @@
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <iostream>
+
+#include "async.hpp"
+
+#include "db/types.hpp"
+#include "db/conflict-index.hpp"
+
+// compares the conflict check of the submit path against the pairwise
+// comparison with every submitted transaction that it replaced.
+// a fixed number of transactions stays submitted; each submit
+// replaces the oldest one.
+// usage: bench-conflict-index [submitted] [submits]
+
+using namespace Db;
+
+enum {
+	kMutationsPerTransaction = 4,
+	kConstraintsPerTransaction = 4,
+	kStorages = 2
+};
+
+struct Transaction {
+	std::vector<Mutation> mutations;
+	std::vector<Constraint> constraints;
+};
+
+// most transactions do not conflict; the document space is much
+// larger than the number of referenced documents
+Transaction generate(std::mt19937_64 &random) {
+	std::uniform_int_distribution<DocumentId> documents(1, DocumentId(1) << 24);
+	std::uniform_int_distribution<int> storages(1, kStorages);
+
+	Transaction transaction;
+	for(int i = 0; i < kMutationsPerTransaction; i++) {
+		Mutation mutation;
+		mutation.type = Mutation::kTypeModify;
+		mutation.storageIndex = storages(random);
+		mutation.documentId = documents(random);
+		transaction.mutations.push_back(std::move(mutation));
+	}
+	for(int i = 0; i < kConstraintsPerTransaction; i++) {
+		Constraint constraint;
+		constraint.type = Constraint::kTypeDocumentState;
+		constraint.storageIndex = storages(random);
+		constraint.documentId = documents(random);
+		constraint.sequenceId = 0;
+		constraint.mustExist = true;
+		constraint.matchSequenceId = true;
+		transaction.constraints.push_back(std::move(constraint));
+	}
+	return transaction;
+}
+
+// --------------------------------------------------------
+// pairwise checks
+// --------------------------------------------------------
+
+bool pairwiseConflict(const std::vector<Transaction> &submitted,
+		const Transaction &transaction) {
+	for(auto &other : submitted) {
+		for(auto &mutation : other.mutations)
+			for(auto &constraint : transaction.constraints)
+				if(ConflictIndex::conflicts(mutation, constraint))
+					return true;
+		for(auto &constraint : other.constraints)
+			for(auto &mutation : transaction.mutations)
+				if(ConflictIndex::conflicts(mutation, constraint))
+					return true;
+	}
+	return false;
+}
+
+uint64_t runPairwise(uint64_t submitted_count, uint64_t submit_count) {
+	std::mt19937_64 random(42);
+	std::vector<Transaction> submitted;
+	for(uint64_t i = 0; i < submitted_count; i++)
+		submitted.push_back(generate(random));
+
+	uint64_t conflicts = 0;
+	for(uint64_t i = 0; i < submit_count; i++) {
+		Transaction transaction = generate(random);
+		if(pairwiseConflict(submitted, transaction))
+			conflicts++;
+		submitted[i % submitted_count] = std::move(transaction);
+	}
+	return conflicts;
+}
+
+// --------------------------------------------------------
+// indexed checks
+// --------------------------------------------------------
+
+uint64_t runIndexed(uint64_t submitted_count, uint64_t submit_count) {
+	std::mt19937_64 random(42);
+	ConflictIndex index;
+	std::vector<Transaction> submitted;
+	for(uint64_t i = 0; i < submitted_count; i++) {
+		submitted.push_back(generate(random));
+		index.insert(submitted.back().mutations, submitted.back().constraints);
+	}
+
+	uint64_t conflicts = 0;
+	for(uint64_t i = 0; i < submit_count; i++) {
+		Transaction transaction = generate(random);
+		if(index.conflictsWithMutations(transaction.constraints)
+				|| index.conflictsWithConstraints(transaction.mutations))
+			conflicts++;
+
+		Transaction &oldest = submitted[i % submitted_count];
+		index.remove(oldest.mutations, oldest.constraints);
+		index.insert(transaction.mutations, transaction.constraints);
+		oldest = std::move(transaction);
+	}
+	return conflicts;
+}
+
+// --------------------------------------------------------
+// main()
+// --------------------------------------------------------
+
+template<typename Function>
+void runBench(const std::string &name, Function function,
+		uint64_t submitted_count, uint64_t submit_count) {
+	auto start = std::chrono::steady_clock::now();
+	uint64_t conflicts = function(submitted_count, submit_count);
+	auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - start).count();
+
+	std::cout << name << ": " << submit_count << " submits in "
+			<< (elapsed / 1000) << " ms, "
+			<< (elapsed * 1000 / submit_count) << " ns per submit, "
+			<< conflicts << " conflicts" << std::endl;
+}
+
+int main(int argc, char **argv) {
+	uint64_t submitted_count = argc > 1 ? std::stoull(argv[1]) : 4096;
+	uint64_t submit_count = argc > 2 ? std::stoull(argv[2]) : 10000;
+	if(submitted_count == 0 || submit_count == 0) {
+		std::cout << "Usage: " << argv[0] << " [submitted] [submits]" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	std::cout << "submitted transactions: " << submitted_count << std::endl;
+	runBench("pairwise", &runPairwise, submitted_count, submit_count);
+	runBench("indexed", &runIndexed, submitted_count, submit_count);
+}
+
@@ -0,0 +1,83 @@
+
+#include <cstdint>
+#include <cassert>
+#include <string>
+#include <vector>
+
+#include "async.hpp"
+
+#include "db/types.hpp"
+
+#include "db/conflict-index.hpp"
+
+namespace Db {
+
+bool ConflictIndex::conflicts(const Mutation &mutation,
+		const Constraint &constraint) {
+	return isIndexed(mutation) && isIndexed(constraint)
+			&& mutation.storageIndex == constraint.storageIndex
+			&& mutation.documentId == constraint.documentId;
+}
+
+bool ConflictIndex::conflictsWithMutations(const std::vector<Constraint> &constraints) {
+	for(auto it = constraints.begin(); it != constraints.end(); ++it) {
+		if(!isIndexed(*it))
+			continue;
+		if(p_mutations.find(Key{ it->storageIndex, it->documentId })
+				!= p_mutations.end())
+			return true;
+	}
+	return false;
+}
+bool ConflictIndex::conflictsWithConstraints(const std::vector<Mutation> &mutations) {
+	for(auto it = mutations.begin(); it != mutations.end(); ++it) {
+		if(!isIndexed(*it))
+			continue;
+		if(p_constraints.find(Key{ it->storageIndex, it->documentId })
+				!= p_constraints.end())
+			return true;
+	}
+	return false;
+}
+
+void ConflictIndex::insert(const std::vector<Mutation> &mutations,
+		const std::vector<Constraint> &constraints) {
+	for(auto it = mutations.begin(); it != mutations.end(); ++it)
+		if(isIndexed(*it))
+			increment(p_mutations, Key{ it->storageIndex, it->documentId });
+	for(auto it = constraints.begin(); it != constraints.end(); ++it)
+		if(isIndexed(*it))
+			increment(p_constraints, Key{ it->storageIndex, it->documentId });
+}
+void ConflictIndex::remove(const std::vector<Mutation> &mutations,
+		const std::vector<Constraint> &constraints) {
+	for(auto it = mutations.begin(); it != mutations.end(); ++it)
+		if(isIndexed(*it))
+			decrement(p_mutations, Key{ it->storageIndex, it->documentId });
+	for(auto it = constraints.begin(); it != constraints.end(); ++it)
+		if(isIndexed(*it))
+			decrement(p_constraints, Key{ it->storageIndex, it->documentId });
+}
+
+bool ConflictIndex::isIndexed(const Mutation &mutation) {
+	// inserted documents cannot be referenced by other transactions yet
+	return mutation.type == Mutation::kTypeModify
+			|| mutation.type == Mutation::kTypeDelete;
+}
+bool ConflictIndex::isIndexed(const Constraint &constraint) {
+	return constraint.type == Constraint::kTypeDocumentState
+			&& constraint.matchSequenceId;
+}
+
+void ConflictIndex::increment(Counts &counts, const Key &key) {
+	counts[key]++;
+}
+void ConflictIndex::decrement(Counts &counts, const Key &key) {
+	auto iterator = counts.find(key);
+	assert(iterator != counts.end());
+	if(--iterator->second == 0)
+		counts.erase(iterator);
+}
+
+}; // namespace Db
+
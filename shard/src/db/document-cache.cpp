@@ -0,0 +1,117 @@
+
+#include <cstdint>
+#include <string>
+
+#include "async.hpp"
+#include "os/linux.hpp"
+#include "ll/tasks.hpp"
+#include "ll/page-cache.hpp"
+
+#include "db/types.hpp"
+#include "db/storage-driver.hpp"
+
+#include "db/document-cache.hpp"
+
+namespace Db {
+
+DocumentCache::DocumentCache(CacheHost *cache_host)
+		: p_cacheHost(cache_host), p_limit(0) {
+	for(int i = 0; i < kWriteBuckets; i++)
+		p_lastWrite[i] = 0;
+}
+
+void DocumentCache::setLimit(size_t limit) {
+	p_limit = limit;
+}
+size_t DocumentCache::getLimit() {
+	return p_limit;
+}
+
+bool DocumentCache::lookup(DocumentId document_id, SequenceId sequence_id,
+		FetchData &data) {
+	std::lock_guard<std::mutex> lock(p_mutex);
+
+	auto iterator = p_entries.find(document_id);
+	if(iterator == p_entries.end())
+		return false;
+	Entry *entry = iterator->second;
+	if(sequence_id < entry->versionId)
+		return false;
+
+	data.documentId = document_id;
+	data.sequenceId = entry->versionId;
+	data.buffer = entry->buffer;
+	p_cacheHost->onAccess(entry);
+	return true;
+}
+
+void DocumentCache::insert(DocumentId document_id, SequenceId version_id,
+		SequenceId processed_id, const std::string &buffer) {
+	if(buffer.size() > p_limit)
+		return;
+
+	std::unique_lock<std::mutex> lock(p_mutex);
+
+	// the document might have been written after the version was read.
+	// existing entries are the latest version already
+	if(p_lastWrite[(uint64_t)document_id % kWriteBuckets] > processed_id
+			|| p_entries.find(document_id) != p_entries.end())
+		return;
+
+	Entry *entry = new Entry(this, document_id, version_id, buffer);
+	p_entries.insert(std::make_pair(document_id, entry));
+
+	lock.unlock();
+	p_cacheHost->requestAcquire(entry);
+}
+
+void DocumentCache::invalidate(DocumentId document_id, SequenceId sequence_id) {
+	std::lock_guard<std::mutex> lock(p_mutex);
+
+	SequenceId &last_write = p_lastWrite[(uint64_t)document_id % kWriteBuckets];
+	if(last_write < sequence_id)
+		last_write = sequence_id;
+
+	auto iterator = p_entries.find(document_id);
+	if(iterator == p_entries.end())
+		return;
+	Entry *entry = iterator->second;
+	p_entries.erase(iterator);
+
+	// otherwise the cache host is releasing the entry or has not
+	// acquired it yet; release() deletes it in that case
+	if(p_cacheHost->forget(entry))
+		delete entry;
+}
+
+// --------------------------------------------------------
+// DocumentCache::Entry
+// --------------------------------------------------------
+
+DocumentCache::Entry::Entry(DocumentCache *cache, DocumentId document_id,
+		SequenceId version_id, const std::string &buffer)
+	: cache(cache), documentId(document_id), versionId(version_id),
+		buffer(buffer) { }
+
+void DocumentCache::Entry::acquire() {
+	// the document is already in memory
+}
+
+void DocumentCache::Entry::release() {
+	std::unique_lock<std::mutex> lock(cache->p_mutex);
+
+	auto iterator = cache->p_entries.find(documentId);
+	if(iterator != cache->p_entries.end() && iterator->second == this)
+		cache->p_entries.erase(iterator);
+
+	lock.unlock();
+	cache->p_cacheHost->afterRelease(this);
+	delete this;
+}
+
+int64_t DocumentCache::Entry::getFootprint() {
+	return buffer.size() + kEntryOverhead;
+}
+
+}; // namespace Db
+
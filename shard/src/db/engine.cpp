@@ -16,13 +16,15 @@ namespace Db {
 StorageRegistry globStorageRegistry;
 ViewRegistry globViewRegistry;
 
-Engine::Engine() : p_nextTransactId(1), p_currentSequenceId(0) {
+Engine::Engine() : p_nextTransactId(1), p_currentSequenceId(0), p_horizon(0) {
 	p_storages.push_back(nullptr);
 	p_views.push_back(nullptr);
+	p_storageViews.emplace_back();
 
 	p_eventFd = osIntf->createEventFd();
 
-	p_cacheHost.setLimit(16 * 4096);
+	// the cache must be able to hold a few blocks of the largest size (64 KiB)
+	p_cacheHost.setLimit(16 * 65536);
 }
 
 CacheHost *Engine::getCacheHost() {
@@ -79,23 +81,34 @@ void Engine::loadConfig() {
 	p_writeAhead.setIdentifier("transact");
 	p_writeAhead.loadLog();
 
+	updateRoutes();
+
 	ReplayMetaClosure meta_closure = ReplayMetaClosure(this);
 	meta_closure.replay();
 	
-	for(auto it = p_storages.begin(); it != p_storages.end(); ++it) {
-		StorageDriver *driver = *it;
+	for(int i = 1; i < p_storages.size(); i++) {
+		StorageDriver *driver = p_storages[i];
 		if(driver == nullptr)
 			continue;
-		ReplayDataClosure data_closure = ReplayDataClosure(this, driver);
+		ReplayDataClosure data_closure = ReplayDataClosure(this, driver, i);
 		data_closure.replay();
 	}
 	for(auto it = p_views.begin(); it != p_views.end(); ++it) {
 		ViewDriver *driver = *it;
 		if(driver == nullptr)
 			continue;
-		ReplayDataClosure data_closure = ReplayDataClosure(this, driver);
+		ReplayDataClosure data_closure = ReplayDataClosure(this, driver,
+				driver->getBaseStorage());
 		data_closure.replay();
 	}
+
+	// requests wait until the drivers reach the snapshot they read
+	for(int i = 1; i < p_storages.size(); i++)
+		if(p_storages[i] != nullptr)
+			p_storages[i]->advance(p_currentSequenceId);
+	for(int i = 1; i < p_views.size(); i++)
+		if(p_views[i] != nullptr)
+			p_views[i]->advance(p_currentSequenceId);
 }
 
 void Engine::createStorage(const std::string &driver,
@@ -104,7 +117,9 @@ void Engine::createStorage(const std::string &driver,
 		throw std::runtime_error("Storage exists already!");
 	osIntf->mkDir(p_path + "/storages/" + identifier);
 	StorageDriver *instance = setupStorage(driver, identifier);
-	instance->createStorage();
+	instance->createStorage(config);
+	// the new storage does not contain any earlier sequence id
+	instance->advance(currentSequenceId());
 	
 	auto desc_path = p_path + "/storages/" + identifier + "/descriptor";
 	Proto::StorageDescriptor descriptor;
@@ -112,6 +127,7 @@ void Engine::createStorage(const std::string &driver,
 	OS::writeFileSync(desc_path, descriptor.SerializeAsString());
 
 	writeConfig();
+	updateRoutes();
 }
 int Engine::getStorage(const std::string &identifier) {
 	for(int i = 1; i < p_storages.size(); i++) {
@@ -130,6 +146,7 @@ void Engine::unlinkStorage(int storage) {
 		throw std::runtime_error("Requested storage does not exist");
 	p_storages[storage] = nullptr;
 	writeConfig();
+	updateRoutes();
 }
 
 void Engine::createView(const std::string &driver,
@@ -139,6 +156,7 @@ void Engine::createView(const std::string &driver,
 	osIntf->mkDir(p_path + "/views/" + identifier);
 	ViewDriver *instance = setupView(driver, identifier);
 	instance->createView(config);
+	instance->advance(currentSequenceId());
 	
 	auto desc_path = p_path + "/views/" + identifier + "/descriptor";
 	Proto::ViewDescriptor descriptor;
@@ -146,6 +164,7 @@ void Engine::createView(const std::string &driver,
 	OS::writeFileSync(desc_path, descriptor.SerializeAsString());
 
 	writeConfig();
+	updateRoutes();
 }
 int Engine::getView(const std::string &identifier) {
 	for(int i = 1; i < p_views.size(); i++) {
@@ -164,6 +183,7 @@ void Engine::unlinkView(int view) {
 		throw std::runtime_error("Requested view does not exist");
 	p_views[view] = nullptr;
 	writeConfig();
+	updateRoutes();
 }
 
 SequenceId Engine::currentSequenceId() {
@@ -172,21 +192,64 @@ SequenceId Engine::currentSequenceId() {
 	return p_currentSequenceId;
 }
 
-TransactionId Engine::transaction() {
+SequenceId Engine::pinCurrentSnapshot() {
+	std::lock_guard<std::mutex> lock(p_mutex);
+
+	p_pinnedSnapshots.insert(p_currentSequenceId);
+	return p_currentSequenceId;
+}
+bool Engine::pinSnapshot(SequenceId sequence_id) {
+	std::lock_guard<std::mutex> lock(p_mutex);
+
+	if(sequence_id < p_horizon)
+		return false;
+	p_pinnedSnapshots.insert(sequence_id);
+	return true;
+}
+void Engine::unpinSnapshot(SequenceId sequence_id) {
+	std::lock_guard<std::mutex> lock(p_mutex);
+
+	auto iterator = p_pinnedSnapshots.find(sequence_id);
+	assert(iterator != p_pinnedSnapshots.end());
+	p_pinnedSnapshots.erase(iterator);
+}
+SequenceId Engine::lowWaterMark() {
 	std::lock_guard<std::mutex> lock(p_mutex);
 
+	if(p_pinnedSnapshots.empty())
+		return p_currentSequenceId;
+	return std::min(*p_pinnedSnapshots.begin(), p_currentSequenceId);
+}
+SequenceId Engine::advanceHorizon(SequenceId retain) {
+	std::lock_guard<std::mutex> lock(p_mutex);
+
+	SequenceId horizon = p_currentSequenceId > retain ? p_currentSequenceId - retain : 0;
+	if(!p_pinnedSnapshots.empty())
+		horizon = std::min(*p_pinnedSnapshots.begin(), horizon);
+	
+	// snapshots before the horizon of any storage cannot be pinned anymore
+	if(p_horizon < horizon)
+		p_horizon = horizon;
+	return horizon;
+}
+
+TransactionId Engine::transaction() {
 	TransactionId transaction_id = p_nextTransactId++;
 
 	Transaction *transaction = Transaction::allocate();
 	transaction->state = Transaction::kStateOpen;
-	p_activeTransactions.insert(std::make_pair(transaction_id, transaction));
+
+	TransactionShard &shard = getTransactionShard(transaction_id);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	shard.transactions.insert(std::make_pair(transaction_id, transaction));
 	return transaction_id;
 }
 void Engine::updateMutation(TransactionId transaction_id, Mutation &mutation) {
-	std::lock_guard<std::mutex> lock(p_mutex);
+	TransactionShard &shard = getTransactionShard(transaction_id);
+	std::lock_guard<std::mutex> lock(shard.mutex);
 
-	auto iterator = p_activeTransactions.find(transaction_id);
-	if(iterator == p_activeTransactions.end())
+	auto iterator = shard.transactions.find(transaction_id);
+	if(iterator == shard.transactions.end())
 		throw std::runtime_error("Illegal transaction");	
 	Transaction *transaction = iterator->second;
 	assert(transaction->state == Transaction::kStateOpen);
@@ -199,10 +262,11 @@ void Engine::updateMutation(TransactionId transaction_id, Mutation &mutation) {
 	transaction->mutations.push_back(std::move(mutation));
 }
 void Engine::updateConstraint(TransactionId transaction_id, Constraint &constraint) {
-	std::lock_guard<std::mutex> lock(p_mutex);
+	TransactionShard &shard = getTransactionShard(transaction_id);
+	std::lock_guard<std::mutex> lock(shard.mutex);
 	
-	auto iterator = p_activeTransactions.find(transaction_id);
-	if(iterator == p_activeTransactions.end())
+	auto iterator = shard.transactions.find(transaction_id);
+	if(iterator == shard.transactions.end())
 		throw std::runtime_error("Illegal transaction");	
 	Transaction *transaction = iterator->second;
 	assert(transaction->state == Transaction::kStateOpen);
@@ -211,98 +275,102 @@ void Engine::updateConstraint(TransactionId transaction_id, Constraint &constrai
 }
 void Engine::submit(TransactionId transaction_id,
 		Async::Callback<void(SubmitError)> callback) {
-	std::unique_lock<std::mutex> lock(p_mutex);
+	TransactionShard &shard = getTransactionShard(transaction_id);
+	std::unique_lock<std::mutex> lock(shard.mutex);
 	
-	auto iterator = p_activeTransactions.find(transaction_id);
-	if(iterator == p_activeTransactions.end())
+	auto iterator = shard.transactions.find(transaction_id);
+	if(iterator == shard.transactions.end())
 		throw std::runtime_error("Illegal transaction");	
 	Transaction *transaction = iterator->second;
 	assert(transaction->state == Transaction::kStateOpen);
 	transaction->state = Transaction::kStateInSubmit;
+	lock.unlock();
 
 	QueueItem queued;
 	queued.type = QueueItem::kTypeSubmit;
 	queued.trid = transaction_id;
 	queued.submitCallback = callback;
-	p_submitQueue.push_back(queued);
 
-	lock.unlock();
+	std::unique_lock<std::mutex> queue_lock(p_queueMutex);
+	p_submitQueue.push_back(queued);
+	queue_lock.unlock();
 	p_eventFd->increment();
 }
 void Engine::submitCommit(TransactionId transaction_id,
 		Async::Callback<void(std::pair<SubmitError, SequenceId>)> callback) {
-	std::unique_lock<std::mutex> lock(p_mutex);
+	TransactionShard &shard = getTransactionShard(transaction_id);
+	std::unique_lock<std::mutex> lock(shard.mutex);
 	
-	auto iterator = p_activeTransactions.find(transaction_id);
-	if(iterator == p_activeTransactions.end())
+	auto iterator = shard.transactions.find(transaction_id);
+	if(iterator == shard.transactions.end())
 		throw std::runtime_error("Illegal transaction");	
 	Transaction *transaction = iterator->second;
 	assert(transaction->state == Transaction::kStateOpen);
 	transaction->state = Transaction::kStateInSubmit;
+	lock.unlock();
 
 	QueueItem queued;
 	queued.type = QueueItem::kTypeSubmitCommit;
 	queued.trid = transaction_id;
 	queued.submitCommitCallback = callback;
-	p_submitQueue.push_back(queued);
 
-	lock.unlock();
+	std::unique_lock<std::mutex> queue_lock(p_queueMutex);
+	p_submitQueue.push_back(queued);
+	queue_lock.unlock();
 	p_eventFd->increment();
 }
 void Engine::commit(TransactionId transaction_id,
 		Async::Callback<void(SequenceId)> callback) {
-	std::unique_lock<std::mutex> lock(p_mutex);
+	TransactionShard &shard = getTransactionShard(transaction_id);
+	std::unique_lock<std::mutex> lock(shard.mutex);
 	
-	auto iterator = p_activeTransactions.find(transaction_id);
-	if(iterator == p_activeTransactions.end())
+	auto iterator = shard.transactions.find(transaction_id);
+	if(iterator == shard.transactions.end())
 		throw std::runtime_error("Illegal transaction");	
 	Transaction *transaction = iterator->second;
 	assert(transaction->state == Transaction::kStateSubmitted);
 	transaction->state = Transaction::kStateInCommitOrRollback;
+	lock.unlock();
 
 	QueueItem queued;
 	queued.type = QueueItem::kTypeCommit;
 	queued.trid = transaction_id;
 	queued.commitCallback = callback;
-	p_submitQueue.push_back(queued);
 
-	lock.unlock();
+	std::unique_lock<std::mutex> queue_lock(p_queueMutex);
+	p_submitQueue.push_back(queued);
+	queue_lock.unlock();
 	p_eventFd->increment();
 }
 void Engine::rollback(TransactionId transaction_id,
 		Async::Callback<void()> callback) {
-	std::unique_lock<std::mutex> lock(p_mutex);
+	TransactionShard &shard = getTransactionShard(transaction_id);
+	std::unique_lock<std::mutex> lock(shard.mutex);
 	
-	auto iterator = p_activeTransactions.find(transaction_id);
-	if(iterator == p_activeTransactions.end())
+	auto iterator = shard.transactions.find(transaction_id);
+	if(iterator == shard.transactions.end())
 		throw std::runtime_error("Illegal transaction");	
 	Transaction *transaction = iterator->second;
 	assert(transaction->state == Transaction::kStateOpen
 			|| transaction->state == Transaction::kStateSubmitted);
 	transaction->state = Transaction::kStateInCommitOrRollback;
+	lock.unlock();
 
 	QueueItem queued;
 	queued.type = QueueItem::kTypeRollback;
 	queued.trid = transaction_id;
 	queued.rollbackCallback = callback;
-	p_submitQueue.push_back(queued);
 
-	lock.unlock();
+	std::unique_lock<std::mutex> queue_lock(p_queueMutex);
+	p_submitQueue.push_back(queued);
+	queue_lock.unlock();
 	p_eventFd->increment();
 }
 
-bool Engine::compatible(Mutation &mutation, Constraint &constraint) {
-	if(constraint.type == Constraint::kTypeDocumentState
-			&& constraint.matchSequenceId
-			&& mutation.type == Mutation::kTypeModify
-			&& mutation.documentId == constraint.documentId)
-		return false;
-	return true;
-}
-
 void Engine::process() {
 	void (*finish)(void *) = [](void *) { std::cout << "fin" << std::endl; };
-	auto op = new ProcessQueueClosure(this,
+	auto write_ahead = new WriteAheadClosure(this);
+	auto op = new ProcessQueueClosure(this, write_ahead,
 			Async::Callback<void()>(nullptr, finish));
 	op->process();
 }
@@ -313,6 +381,18 @@ void Engine::fetch(FetchRequest *fetch,
 	StorageDriver *driver = p_storages[fetch->storageIndex];
 	driver->fetch(fetch, on_data, callback);
 }
+void Engine::multiFetch(MultiFetchRequest *fetch,
+		Async::Callback<void(std::vector<FetchData> &)> on_data,
+		Async::Callback<void(FetchError)> callback) {
+	StorageDriver *driver = p_storages[fetch->storageIndex];
+	driver->multiFetch(fetch, on_data, callback);
+}
+void Engine::history(HistoryRequest *request,
+		Async::Callback<void(std::vector<VersionData> &)> on_data,
+		Async::Callback<void(FetchError)> callback) {
+	StorageDriver *driver = p_storages[request->storageIndex];
+	driver->history(request, on_data, callback);
+}
 
 void Engine::query(QueryRequest *request,
 		Async::Callback<void(QueryData &)> on_data,
@@ -321,6 +401,18 @@ void Engine::query(QueryRequest *request,
 	driver->query(request, on_data, callback);
 }
 
+void Engine::checkStorage(int storage,
+		Async::Callback<void(const std::string &)> callback) {
+	StorageDriver *driver = p_storages[storage];
+	driver->checkIntegrity(callback);
+}
+
+void Engine::checkView(int view,
+		Async::Callback<void(const std::string &)> callback) {
+	ViewDriver *driver = p_views[view];
+	driver->checkIntegrity(callback);
+}
+
 StorageDriver *Engine::setupStorage(const std::string &driver,
 		const std::string &identifier) {
 	StorageDriver::Factory *factory
@@ -334,6 +426,7 @@ StorageDriver *Engine::setupStorage(const std::string &driver,
 	instance->setIdentifier(identifier);
 	instance->setPath(p_path + "/storages/" + identifier);
 	p_storages.push_back(instance);
+	p_storageViews.emplace_back();
 	return instance;
 }
 
@@ -370,21 +463,84 @@ void Engine::writeConfig() {
 	OS::writeFileSync(p_path + "/config", config.SerializeAsString());
 }
 
+Engine::TransactionShard &Engine::getTransactionShard(TransactionId transaction_id) {
+	return p_transactionShards[(uint64_t)transaction_id % kTransactionShards];
+}
+
+void Engine::updateRoutes() {
+	p_storageViews.assign(p_storages.size(), std::vector<int>());
+	for(int i = 1; i < p_views.size(); i++) {
+		if(p_views[i] == nullptr)
+			continue;
+		int storage = p_views[i]->getBaseStorage();
+		if(storage > 0 && storage < p_storageViews.size())
+			p_storageViews[storage].push_back(i);
+	}
+}
+
 // --------------------------------------------------------
 // Engine::Transaction
 // --------------------------------------------------------
 
+Engine::Transaction::Transaction() : state(kStateNone), p_refCount(1) {
+	mutations.reserve(kReserve);
+	constraints.reserve(kReserve);
+}
+
 Engine::Transaction *Engine::Transaction::allocate() {
-	return new Transaction;
+	Pool &pool = getPool();
+	std::unique_lock<std::mutex> lock(pool.mutex);
+	if(pool.transactions.empty()) {
+		lock.unlock();
+		return new Transaction;
+	}
+	Transaction *transaction = pool.transactions.back();
+	pool.transactions.pop_back();
+	lock.unlock();
+
+	transaction->p_refCount = 1;
+	return transaction;
 }
 void Engine::Transaction::refIncrement() {
 	p_refCount++;
 }
 void Engine::Transaction::refDecrement() {
-	assert(p_refCount > 0);
-	p_refCount--;
-	if(p_refCount == 0)
-		delete this;
+	int count = --p_refCount;
+	assert(count >= 0);
+	if(count == 0)
+		release();
+}
+
+Engine::Transaction::Pool &Engine::Transaction::getPool() {
+	static Pool pool;
+	return pool;
+}
+
+void Engine::Transaction::release() {
+	// large vectors are released instead of being kept in the pool
+	if(mutations.capacity() > kRetainCapacity) {
+		std::vector<Mutation>().swap(mutations);
+		mutations.reserve(kReserve);
+	}else{
+		mutations.clear();
+	}
+	if(constraints.capacity() > kRetainCapacity) {
+		std::vector<Constraint>().swap(constraints);
+		constraints.reserve(kReserve);
+	}else{
+		constraints.clear();
+	}
+	routedMutations.clear();
+	state = kStateNone;
+
+	Pool &pool = getPool();
+	std::unique_lock<std::mutex> lock(pool.mutex);
+	if(pool.transactions.size() < kPoolLimit) {
+		pool.transactions.push_back(this);
+		return;
+	}
+	lock.unlock();
+	delete this;
 }
 
 // --------------------------------------------------------
@@ -417,10 +573,15 @@ void Engine::ReplayClosure::onEntry(Proto::LogEntry &log_entry) {
 				mutation.buffer = log_mutation.buffer();
 			}else if(log_mutation.type() == Proto::LogMutation::kTypeModify) {
 				int storage = p_engine->getStorage(log_mutation.storage_name());
-				mutation.type = Mutation::kTypeInsert;
+				mutation.type = Mutation::kTypeModify;
 				mutation.storageIndex = storage;
 				mutation.documentId = log_mutation.document_id();
 				mutation.buffer = log_mutation.buffer();
+			}else if(log_mutation.type() == Proto::LogMutation::kTypeDelete) {
+				int storage = p_engine->getStorage(log_mutation.storage_name());
+				mutation.type = Mutation::kTypeDelete;
+				mutation.storageIndex = storage;
+				mutation.documentId = log_mutation.document_id();
 			}else throw std::logic_error("Illegal log mutation type");
 
 			transaction->mutations.push_back(std::move(mutation));
@@ -445,10 +606,15 @@ void Engine::ReplayClosure::onEntry(Proto::LogEntry &log_entry) {
 				mutation.buffer = log_mutation.buffer();
 			}else if(log_mutation.type() == Proto::LogMutation::kTypeModify) {
 				int storage = p_engine->getStorage(log_mutation.storage_name());
-				mutation.type = Mutation::kTypeInsert;
+				mutation.type = Mutation::kTypeModify;
 				mutation.storageIndex = storage;
 				mutation.documentId = log_mutation.document_id();
 				mutation.buffer = log_mutation.buffer();
+			}else if(log_mutation.type() == Proto::LogMutation::kTypeDelete) {
+				int storage = p_engine->getStorage(log_mutation.storage_name());
+				mutation.type = Mutation::kTypeDelete;
+				mutation.storageIndex = storage;
+				mutation.documentId = log_mutation.document_id();
 			}else throw std::logic_error("Illegal log mutation type");
 
 			transaction->mutations.push_back(std::move(mutation));
@@ -503,27 +669,42 @@ void Engine::ReplayMetaClosure::onSubmitted(TransactionId id,
 
 	transaction->refIncrement();
 	transaction->state = Transaction::kStateSubmitted;
-	engine->p_activeTransactions.insert(std::make_pair(id, transaction));
-	engine->p_submittedTransactions.push_back(id);
+	TransactionShard &shard = engine->getTransactionShard(id);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	shard.transactions.insert(std::make_pair(id, transaction));
+	engine->p_submittedTransactions.insert(id);
+	engine->p_conflictIndex.insert(transaction->mutations,
+			transaction->constraints);
 }
 
 // --------------------------------------------------------
 // Engine::ReplayDataClosure
 // --------------------------------------------------------
 
-Engine::ReplayDataClosure::ReplayDataClosure(Engine *engine, Sequenceable *sequenceable)
-		: ReplayClosure(engine), p_sequenceable(sequenceable) { }
+Engine::ReplayDataClosure::ReplayDataClosure(Engine *engine,
+		Sequenceable *sequenceable, int storage)
+	: ReplayClosure(engine), p_sequenceable(sequenceable), p_storage(storage) { }
 
 void Engine::ReplayDataClosure::onTransaction(TransactionId id,
 		Transaction *transaction) {
 	for(auto it = transaction->mutations.begin();
 			it != transaction->mutations.end(); ++it)
-		p_sequenceable->reinspect(*it);
+		if(it->storageIndex == p_storage)
+			p_sequenceable->reinspect(*it);
 }
 
 void Engine::ReplayDataClosure::onCommit(Transaction *transaction,
 		SequenceId sequence_id) {
-	Engine *engine = getEngine();
+	// the transaction was parsed for this closure only
+	auto &mutations = transaction->mutations;
+	mutations.erase(std::remove_if(mutations.begin(), mutations.end(),
+			[this] (const Mutation &mutation) {
+		return mutation.storageIndex != p_storage;
+	}), mutations.end());
+	if(mutations.empty()) {
+		p_sequenceable->advance(sequence_id);
+		return;
+	}
 
 	transaction->refIncrement();
 	p_sequenceable->sequence(sequence_id, transaction->mutations,
@@ -535,16 +716,141 @@ void Engine::ReplayDataClosure::onSubmitted(TransactionId id,
 	// ignore non-commited transactions
 }
 
+// --------------------------------------------------------
+// Engine::WriteAheadClosure
+// --------------------------------------------------------
+
+Engine::WriteAheadClosure::WriteAheadClosure(Engine *engine)
+	: p_engine(engine), p_taskQueue(LocalTaskQueue::get()), p_writing(false) { }
+
+Engine::LogItem &Engine::WriteAheadClosure::append() {
+	p_queue.emplace_back();
+	return p_queue.back();
+}
+
+void Engine::WriteAheadClosure::flush() {
+	if(p_writing || p_queue.empty())
+		return;
+	p_writing = true;
+
+	assert(p_batch.empty());
+	std::swap(p_batch, p_queue);
+	p_engine->getIoPool()->submit(ASYNC_MEMBER(this, &WriteAheadClosure::writeBatch));
+}
+
+void Engine::WriteAheadClosure::writeBatch() {
+	for(auto it = p_batch.begin(); it != p_batch.end(); ++it)
+		p_engine->p_writeAhead.log(it->logEntry,
+				ASYNC_MEMBER(this, &WriteAheadClosure::onLogged));
+
+	p_taskQueue->submit(ASYNC_MEMBER(this, &WriteAheadClosure::afterWrite));
+}
+void Engine::WriteAheadClosure::onLogged(Error error) {
+	//TODO: handle failure
+}
+
+void Engine::WriteAheadClosure::afterWrite() {
+	// the items complete in the order of their sequence ids
+	for(auto it = p_batch.begin(); it != p_batch.end(); ++it) {
+		if(it->queueItem.type == QueueItem::kTypeSubmit
+				|| it->queueItem.type == QueueItem::kTypeSubmitCommit) {
+			submitComplete(*it);
+		}else if(it->queueItem.type == QueueItem::kTypeCommit) {
+			commitComplete(*it);
+		}else throw std::logic_error("Illegal queue item");
+	}
+	p_batch.clear();
+
+	p_writing = false;
+	flush();
+}
+
+void Engine::WriteAheadClosure::submitComplete(LogItem &item) {
+	TransactionShard &shard = p_engine->getTransactionShard(item.queueItem.trid);
+	std::unique_lock<std::mutex> lock(shard.mutex);
+
+	if(item.queueItem.type == QueueItem::kTypeSubmit) {
+		item.transaction->state = Transaction::kStateSubmitted;
+		lock.unlock();
+
+		item.queueItem.submitCallback(kSubmitSuccess);
+	}else if(item.queueItem.type == QueueItem::kTypeSubmitCommit) {
+		lock.unlock();
+		commitComplete(item);
+	}else throw std::logic_error("Illegal queue item");
+}
+// NOTE: this function is called when kTypeSubmitCommit is handled
+void Engine::WriteAheadClosure::commitComplete(LogItem &item) {
+	Transaction *transaction = item.transaction;
+
+	std::unique_lock<std::mutex> lock(p_engine->p_mutex);
+	size_t erased = p_engine->p_submittedTransactions.erase(item.queueItem.trid);
+	assert(erased == 1);
+	p_engine->p_conflictIndex.remove(transaction->mutations,
+			transaction->constraints);
+	lock.unlock();
+
+	// the mutations are not needed anymore once they are sequenced
+	auto &routes = transaction->routedMutations;
+	for(auto it = transaction->mutations.begin();
+			it != transaction->mutations.end(); ++it)
+		routes[it->storageIndex].push_back(std::move(*it));
+	transaction->mutations.clear();
+
+	// drivers that are not affected by the transaction only advance
+	for(int i = 1; i < p_engine->p_storages.size(); i++) {
+		StorageDriver *driver = p_engine->p_storages[i];
+		if(driver == nullptr)
+			continue;
+		auto &views = p_engine->p_storageViews[i];
+
+		auto route = routes.find(i);
+		if(route == routes.end()) {
+			driver->advance(item.sequenceId);
+			for(int view : views)
+				p_engine->p_views[view]->advance(item.sequenceId);
+			continue;
+		}
+
+		transaction->refIncrement();
+		driver->sequence(item.sequenceId, route->second,
+				ASYNC_MEMBER(transaction, &Transaction::refDecrement));
+		for(int view : views) {
+			transaction->refIncrement();
+			p_engine->p_views[view]->sequence(item.sequenceId, route->second,
+					ASYNC_MEMBER(transaction, &Transaction::refDecrement));
+		}
+	}
+
+	TransactionShard &shard = p_engine->getTransactionShard(item.queueItem.trid);
+	std::unique_lock<std::mutex> shard_lock(shard.mutex);
+	
+	// commit always frees the transaction
+	auto open_iterator = shard.transactions.find(item.queueItem.trid);
+	assert(open_iterator != shard.transactions.end());
+	shard.transactions.erase(open_iterator);
+	shard_lock.unlock();
+
+	transaction->refDecrement();
+
+	if(item.queueItem.type == QueueItem::kTypeCommit) {
+		item.queueItem.commitCallback(item.sequenceId);
+	}else if(item.queueItem.type == QueueItem::kTypeSubmitCommit) {
+		item.queueItem.submitCommitCallback(std::make_pair(kSubmitSuccess,
+				item.sequenceId));
+	}else throw std::logic_error("Illegal queue item");
+}
+
 // --------------------------------------------------------
 // Engine::ProcessQueueClosure
 // --------------------------------------------------------
 
 Engine::ProcessQueueClosure::ProcessQueueClosure(Engine *engine,
-		Async::Callback<void()> callback)
-	: p_engine(engine), p_callback(callback) { }
+		WriteAheadClosure *write_ahead, Async::Callback<void()> callback)
+	: p_engine(engine), p_writeAhead(write_ahead), p_callback(callback) { }
 
 void Engine::ProcessQueueClosure::process() {
-	std::unique_lock<std::mutex> lock(p_engine->p_mutex);
+	std::unique_lock<std::mutex> lock(p_engine->p_queueMutex);
 
 	if(!p_engine->p_submitQueue.empty()) {
 		p_queueItem = p_engine->p_submitQueue.front();
@@ -566,124 +872,118 @@ void Engine::ProcessQueueClosure::process() {
 }
 	
 void Engine::ProcessQueueClosure::processSubmit() {
-	std::unique_lock<std::mutex> lock(p_engine->p_mutex);
+	TransactionShard &shard = p_engine->getTransactionShard(p_queueItem.trid);
+	std::unique_lock<std::mutex> lock(shard.mutex);
 
-	auto transact_it = p_engine->p_activeTransactions.find(p_queueItem.trid);
-	if(transact_it == p_engine->p_activeTransactions.end())
+	auto transact_it = shard.transactions.find(p_queueItem.trid);
+	if(transact_it == shard.transactions.end())
 		throw std::runtime_error("Illegal transaction");
 	p_transaction = transact_it->second;
 
 	lock.unlock();
 
-	for(auto other_it = p_engine->p_submittedTransactions.begin();
-			other_it != p_engine->p_submittedTransactions.end(); ++other_it) {
-		Transaction *other = p_engine->p_activeTransactions.at(*other_it);
-
-		// check conflicts: other's mutation <-> tranasction's constraint
-		for(auto other_mutation_it = other->mutations.begin();
-				other_mutation_it != other->mutations.end(); ++other_mutation_it) {
-			for(auto constraint_it = p_transaction->constraints.begin();
-					constraint_it != p_transaction->constraints.end(); ++constraint_it) {
-				if(!p_engine->compatible(*other_mutation_it, *constraint_it)) {
-					submitFailure(kSubmitConstraintConflict);
-					return;
-				}
-			}
-		}
-		
-		// check conflicts: other's constraint <-> transaction's mutation
-		for(auto other_constraint_it = other->constraints.begin();
-				other_constraint_it != other->constraints.end(); ++ other_constraint_it) {
-			for(auto mutation_it = p_transaction->mutations.begin();
-					mutation_it != p_transaction->mutations.end(); ++mutation_it) {
-				if(!p_engine->compatible(*mutation_it, *other_constraint_it)) {
-					submitFailure(kSubmitMutationConflict);
-					return;
-				}
-			}
-		}
+	// the index is only accessed on the engine thread. it also contains
+	// transactions that are still being written to the write-ahead log
+	if(p_engine->p_conflictIndex.conflictsWithMutations(p_transaction->constraints)) {
+		submitFailure(kSubmitConstraintConflict);
+		return;
+	}
+	if(p_engine->p_conflictIndex.conflictsWithConstraints(p_transaction->mutations)) {
+		submitFailure(kSubmitMutationConflict);
+		return;
 	}
 
-	p_index = 0;
-	submitCheckConstraint();
+	checkConstraints();
 }
-void Engine::ProcessQueueClosure::submitCheckConstraint() {
-	if(p_index == p_transaction->constraints.size()) {
-		// NOTE: this is one of two places where the sequence id is advanced
-		std::unique_lock<std::mutex> lock(p_engine->p_mutex);
-		p_engine->p_currentSequenceId++;
-		p_sequenceId = p_engine->p_currentSequenceId;
-		lock.unlock();
-
-		writeAhead();
-	}else{
-		p_checkOkay = true;
-
-		Constraint &constraint = p_transaction->constraints[p_index];
-		if(constraint.type == Constraint::kTypeDocumentState) {
-			StorageDriver *driver = p_engine->p_storages[constraint.storageIndex];
-
-			p_fetch.documentId = constraint.documentId;
-			p_fetch.sequenceId = p_engine->p_currentSequenceId;
+void Engine::ProcessQueueClosure::checkConstraints() {
+	std::unique_lock<std::mutex> lock(p_engine->p_mutex);
+	SequenceId sequence_id = p_engine->p_currentSequenceId;
+	lock.unlock();
 
-			driver->fetch(&p_fetch,
-					ASYNC_MEMBER(this, &ProcessQueueClosure::checkStateOnData),
-					ASYNC_MEMBER(this, &ProcessQueueClosure::checkStateOnFetch));
-		}else throw std::logic_error("Illegal constraint type");
+	p_checkOkay = true;
+	p_checks.clear();
+	p_checks.resize(p_transaction->constraints.size());
+
+	// one extra reference so that synchronous fetches
+	// cannot complete the checks before all of them are issued
+	p_pendingChecks = p_checks.size() + 1;
+	for(size_t i = 0; i < p_checks.size(); i++) {
+		StateCheck &check = p_checks[i];
+		check.closure = this;
+		check.constraint = &p_transaction->constraints[i];
+		if(check.constraint->type != Constraint::kTypeDocumentState)
+			throw std::logic_error("Illegal constraint type");
+
+		StorageDriver *driver = p_engine->p_storages[check.constraint->storageIndex];
+
+		check.fetch.storageIndex = check.constraint->storageIndex;
+		check.fetch.documentId = check.constraint->documentId;
+		check.fetch.sequenceId = sequence_id;
+
+		driver->fetch(&check.fetch,
+				ASYNC_MEMBER(&check, &StateCheck::onData),
+				ASYNC_MEMBER(&check, &StateCheck::onFetch));
 	}
+	onCheckComplete();
 }
-void Engine::ProcessQueueClosure::checkStateOnData(FetchData &data) {
-	Constraint &constraint = p_transaction->constraints[p_index];
+void Engine::ProcessQueueClosure::StateCheck::onData(FetchData &data) {
 //FIXME:
-//	if(data.sequenceId != constraint.sequenceId)
-//		p_checkOkay = false;
+//	if(data.sequenceId != constraint->sequenceId)
+//		closure->p_checkOkay = false;
 }
-void Engine::ProcessQueueClosure::checkStateOnFetch(FetchError error) {
-	Constraint &constraint = p_transaction->constraints[p_index];
+void Engine::ProcessQueueClosure::StateCheck::onFetch(FetchError error) {
 	if(error == kFetchSuccess) {
 		// everything is okay
 	}else if(error == kFetchDocumentNotFound) {
-		if(constraint.mustExist)
-			p_checkOkay = false;
+		if(constraint->mustExist)
+			closure->p_checkOkay = false;
 	}else throw std::logic_error("Unexpected error during fetch");
 
+	closure->onCheckComplete();
+}
+void Engine::ProcessQueueClosure::onCheckComplete() {
+	assert(p_pendingChecks > 0);
+	if(--p_pendingChecks > 0)
+		return;
+
 	if(!p_checkOkay) {
 		submitFailure(kSubmitConstraintViolation);
 		return;
 	}
-	
-	p_index++;
-	LocalTaskQueue::get()->submit(ASYNC_MEMBER(this, &ProcessQueueClosure::submitCheckConstraint));
+	submitValidated();
 }
-void Engine::ProcessQueueClosure::submitComplete() {
+void Engine::ProcessQueueClosure::submitValidated() {
 	std::unique_lock<std::mutex> lock(p_engine->p_mutex);
-	p_engine->p_submittedTransactions.push_back(p_queueItem.trid);
-
-	if(p_queueItem.type == QueueItem::kTypeSubmit) {
-		p_transaction->state = Transaction::kStateSubmitted;
-		lock.unlock();
+	// later submits must see this transaction even though
+	// it is not written to the write-ahead log yet
+	p_engine->p_submittedTransactions.insert(p_queueItem.trid);
+	p_engine->p_conflictIndex.insert(p_transaction->mutations,
+			p_transaction->constraints);
+
+	SequenceId sequence_id = 0;
+	if(p_queueItem.type == QueueItem::kTypeSubmitCommit) {
+		// NOTE: this is one of two places where the sequence id is advanced
+		p_engine->p_currentSequenceId++;
+		sequence_id = p_engine->p_currentSequenceId;
+	}
+	lock.unlock();
 
-		p_queueItem.submitCallback(kSubmitSuccess);
-		LocalTaskQueue::get()->submit(ASYNC_MEMBER(this, &ProcessQueueClosure::process));
-	}else if(p_queueItem.type == QueueItem::kTypeSubmitCommit) {
-		lock.unlock();
-		commitComplete();
-	}else throw std::logic_error("Illegal queue item");
+	writeAhead(sequence_id);
 }
 void Engine::ProcessQueueClosure::submitFailure(SubmitError error) {
-	std::unique_lock<std::mutex> lock(p_engine->p_mutex);
+	TransactionShard &shard = p_engine->getTransactionShard(p_queueItem.trid);
+	std::unique_lock<std::mutex> lock(shard.mutex);
 
-	auto iterator = p_engine->p_activeTransactions.find(p_queueItem.trid);
-	assert(iterator != p_engine->p_activeTransactions.end());
-	p_engine->p_activeTransactions.erase(iterator);
+	auto iterator = shard.transactions.find(p_queueItem.trid);
+	assert(iterator != shard.transactions.end());
+	shard.transactions.erase(iterator);
+	lock.unlock();
 
 	p_transaction->refDecrement();
 	
 	if(p_queueItem.type == QueueItem::kTypeSubmit) {
-		lock.unlock();
 		p_queueItem.submitCallback(error);
 	}else if(p_queueItem.type == QueueItem::kTypeSubmitCommit) {
-		lock.unlock();
 		p_queueItem.submitCommitCallback(std::make_pair(error, -1));
 	}else throw std::logic_error("Illegal queue item");
 	LocalTaskQueue::get()->submit(ASYNC_MEMBER(this, &ProcessQueueClosure::process));
@@ -691,98 +991,67 @@ void Engine::ProcessQueueClosure::submitFailure(SubmitError error) {
 
 // NOTE: this function is NOT called when kTypeSubmitCommit is handled
 void Engine::ProcessQueueClosure::processCommit() {
-	std::unique_lock<std::mutex> lock(p_engine->p_mutex);
+	TransactionShard &shard = p_engine->getTransactionShard(p_queueItem.trid);
+	std::unique_lock<std::mutex> shard_lock(shard.mutex);
 
-	auto transact_it = p_engine->p_activeTransactions.find(p_queueItem.trid);
-	if(transact_it == p_engine->p_activeTransactions.end())
+	auto transact_it = shard.transactions.find(p_queueItem.trid);
+	if(transact_it == shard.transactions.end())
 		throw std::runtime_error("Illegal transaction");
 	p_transaction = transact_it->second;
+	shard_lock.unlock();
 	
+	std::unique_lock<std::mutex> lock(p_engine->p_mutex);
 	// NOTE: this is one of two places where the sequence id is advanced
 	p_engine->p_currentSequenceId++;
-	p_sequenceId = p_engine->p_currentSequenceId;
+	SequenceId sequence_id = p_engine->p_currentSequenceId;
 
 	lock.unlock();
 	
-	writeAhead();
-}
-// NOTE: this function is called when kTypeSubmitCommit is handled
-void Engine::ProcessQueueClosure::commitComplete() {
-	for(auto it = p_engine->p_storages.begin(); it != p_engine->p_storages.end(); ++it) {
-		StorageDriver *driver = *it;
-		if(driver == nullptr)
-			continue;
-		p_transaction->refIncrement();
-		driver->sequence(p_sequenceId, p_transaction->mutations,
-				ASYNC_MEMBER(p_transaction, &Transaction::refDecrement));
-	}
-	for(auto it = p_engine->p_views.begin(); it != p_engine->p_views.end(); ++it) {
-		ViewDriver *driver = *it;
-		if(driver == nullptr)
-			continue;
-		p_transaction->refIncrement();
-		driver->sequence(p_sequenceId, p_transaction->mutations,
-				ASYNC_MEMBER(p_transaction, &Transaction::refDecrement));
-	}
-
-	std::unique_lock<std::mutex> lock(p_engine->p_mutex);
-	
-	// commit always frees the transaction
-	auto open_iterator = p_engine->p_activeTransactions.find(p_queueItem.trid);
-	assert(open_iterator != p_engine->p_activeTransactions.end());
-	p_engine->p_activeTransactions.erase(open_iterator);
-
-	auto submit_iterator = std::find(p_engine->p_submittedTransactions.begin(),
-			p_engine->p_submittedTransactions.end(), p_queueItem.trid);
-	assert(submit_iterator != p_engine->p_submittedTransactions.end());
-	p_engine->p_submittedTransactions.erase(submit_iterator);
-
-	p_transaction->refDecrement();
-
-	if(p_queueItem.type == QueueItem::kTypeCommit) {
-		lock.unlock();
-		p_queueItem.commitCallback(p_sequenceId);
-	}else if(p_queueItem.type == QueueItem::kTypeSubmitCommit) {
-		lock.unlock();
-		p_queueItem.submitCommitCallback(std::make_pair(kSubmitSuccess, p_sequenceId));
-	}else throw std::logic_error("Illegal queue item");
-	LocalTaskQueue::get()->submit(ASYNC_MEMBER(this, &ProcessQueueClosure::process));
+	writeAhead(sequence_id);
 }
 void Engine::ProcessQueueClosure::processRollback() {
-	std::unique_lock<std::mutex> lock(p_engine->p_mutex);
+	TransactionShard &shard = p_engine->getTransactionShard(p_queueItem.trid);
+	std::unique_lock<std::mutex> shard_lock(shard.mutex);
 	
-	auto open_iterator = p_engine->p_activeTransactions.find(p_queueItem.trid);
-	assert(open_iterator != p_engine->p_activeTransactions.end());
+	auto open_iterator = shard.transactions.find(p_queueItem.trid);
+	assert(open_iterator != shard.transactions.end());
 	p_transaction = open_iterator->second;
 
-	p_engine->p_activeTransactions.erase(open_iterator);
+	shard.transactions.erase(open_iterator);
+	shard_lock.unlock();
 
-	if(p_transaction->state == Transaction::kStateSubmitted) {
-		auto submit_iterator = std::find(p_engine->p_submittedTransactions.begin(),
-				p_engine->p_submittedTransactions.end(), p_queueItem.trid);
-		assert(submit_iterator != p_engine->p_submittedTransactions.end());
-		p_engine->p_submittedTransactions.erase(submit_iterator);
-	}
+	// rollback() already changed the state, so the
+	// submitted set decides if the transaction was submitted
+	std::unique_lock<std::mutex> lock(p_engine->p_mutex);
+	if(p_engine->p_submittedTransactions.erase(p_queueItem.trid) == 1)
+		p_engine->p_conflictIndex.remove(p_transaction->mutations,
+				p_transaction->constraints);
+	lock.unlock();
 
 	p_transaction->refDecrement();
 	
-	lock.unlock();
 	p_queueItem.rollbackCallback();
 	LocalTaskQueue::get()->submit(ASYNC_MEMBER(this, &ProcessQueueClosure::process));
 }
 
-void Engine::ProcessQueueClosure::writeAhead() {
+void Engine::ProcessQueueClosure::writeAhead(SequenceId sequence_id) {
+	LogItem &item = p_writeAhead->append();
+	item.queueItem = p_queueItem;
+	item.transaction = p_transaction;
+	item.sequenceId = sequence_id;
+
+	Proto::LogEntry &log_entry = item.logEntry;
 	if(p_queueItem.type == QueueItem::kTypeSubmit) {
-		p_logEntry.set_type(Proto::LogEntry::kTypeSubmit);
-		p_logEntry.set_transaction_id(p_queueItem.trid);
+		log_entry.set_type(Proto::LogEntry::kTypeSubmit);
+		log_entry.set_transaction_id(p_queueItem.trid);
 	}else if(p_queueItem.type == QueueItem::kTypeSubmitCommit) {
-		p_logEntry.set_type(Proto::LogEntry::kTypeSubmitCommit);
-		p_logEntry.set_transaction_id(p_queueItem.trid);
-		p_logEntry.set_sequence_id(p_engine->p_currentSequenceId);
+		log_entry.set_type(Proto::LogEntry::kTypeSubmitCommit);
+		log_entry.set_transaction_id(p_queueItem.trid);
+		log_entry.set_sequence_id(sequence_id);
 	}else if(p_queueItem.type == QueueItem::kTypeCommit) {
-		p_logEntry.set_type(Proto::LogEntry::kTypeCommit);
-		p_logEntry.set_transaction_id(p_queueItem.trid);
-		p_logEntry.set_sequence_id(p_engine->p_currentSequenceId);
+		log_entry.set_type(Proto::LogEntry::kTypeCommit);
+		log_entry.set_transaction_id(p_queueItem.trid);
+		log_entry.set_sequence_id(sequence_id);
 	}else throw std::logic_error("Illegal queue item");
 
 	if(p_queueItem.type == QueueItem::kTypeSubmit
@@ -791,7 +1060,7 @@ void Engine::ProcessQueueClosure::writeAhead() {
 				it != p_transaction->mutations.end(); ++it) {
 			Mutation &mutation = *it;
 
-			Proto::LogMutation *log_mutation = p_logEntry.add_mutations();
+			Proto::LogMutation *log_mutation = log_entry.add_mutations();
 			if(mutation.type == Mutation::kTypeInsert) {
 				StorageDriver *driver = p_engine->p_storages[mutation.storageIndex];
 				
@@ -806,24 +1075,19 @@ void Engine::ProcessQueueClosure::writeAhead() {
 				log_mutation->set_storage_name(driver->getIdentifier());
 				log_mutation->set_document_id(mutation.documentId);
 				log_mutation->set_buffer(mutation.buffer);
+			}else if(mutation.type == Mutation::kTypeDelete) {
+				StorageDriver *driver = p_engine->p_storages[mutation.storageIndex];
+				
+				log_mutation->set_type(Proto::LogMutation::kTypeDelete);
+				log_mutation->set_storage_name(driver->getIdentifier());
+				log_mutation->set_document_id(mutation.documentId);
 			}else throw std::logic_error("Illegal mutation type");
 		}
 	}
 
-	p_engine->p_writeAhead.log(p_logEntry,
-			ASYNC_MEMBER(this, &ProcessQueueClosure::afterWriteAhead));
-}
-void Engine::ProcessQueueClosure::afterWriteAhead(Error error) {
-	//TODO: handle failure
-	
-	p_logEntry.Clear();
-
-	if(p_queueItem.type == QueueItem::kTypeSubmit
-			|| p_queueItem.type == QueueItem::kTypeSubmitCommit) {
-		submitComplete();
-	}else if(p_queueItem.type == QueueItem::kTypeCommit) {
-		commitComplete();
-	}else throw std::logic_error("Illegal queue item");
+	// the next item is validated while this one is written
+	p_writeAhead->flush();
+	LocalTaskQueue::get()->submit(ASYNC_MEMBER(this, &ProcessQueueClosure::process));
 }
 
 };
@@ -2,6 +2,7 @@
 #include <cstdint>
 #include <string>
 #include <iostream>
+#include <algorithm>
 
 #include "async.hpp"
 #include "os/linux.hpp"
@@ -17,36 +18,88 @@
 namespace Db {
 
 FlexStorage::FlexStorage(Engine *engine)
-		: QueuedStorageDriver(engine), p_lastDocumentId(0), p_dataPointer(0),
-			p_indexTree("index", 4096, Index::kStructSize, Reference::kStructSize,
+		: QueuedStorageDriver(engine), p_lastDocumentId(0),
+			p_processedSequenceId(0),
+			p_indexTree("index", 4096, Reference::kStructSize,
 				engine->getCacheHost(), engine->getIoPool()),
-			p_dataFile("data", engine->getCacheHost(), engine->getIoPool()) {
-	p_indexTree.setWriteKey(ASYNC_MEMBER(this, &FlexStorage::writeIndex));
-	p_indexTree.setReadKey(ASYNC_MEMBER(this, &FlexStorage::readIndex));
+			p_documentCache(engine->getCacheHost()),
+			p_segments{ { "data-0", engine->getCacheHost(), engine->getIoPool() },
+				{ "data-1", engine->getCacheHost(), engine->getIoPool() } },
+			p_activeSegment(0),
+			p_gcInterval(0), p_retainSequences(0), p_retainVersions(1),
+			p_batchesSinceGc(0), p_gcRunning(false), p_gcPending(false),
+			p_inlineThreshold(0), p_compactThreshold(0), p_compactBatch(64), p_compactRunning(false),
+			p_segmentReaders(0), p_dropPending(-1),
+			p_filterBitsPerKey(0), p_filterKeys(0), p_filterRebuildPending(false) {
 }
 
-void FlexStorage::createStorage() {
+FlexStorage::DataSegment::DataSegment(const std::string &name,
+		CacheHost *cache_host, TaskPool *io_pool)
+	: file(name, cache_host, io_pool), pointer(0), garbage(0) { }
+
+void FlexStorage::createStorage(const Proto::StorageConfig &config) {
+	configure(config);
+
+	OS::writeFileSync(getPath() + "/config", config.SerializeAsString());
+
 	p_indexTree.setPath(getPath());
 	p_indexTree.createTree();
 
-	p_dataFile.setPath(p_path);
-	p_dataFile.createFile();
+	for(auto &segment : p_segments) {
+		segment.file.setPath(p_path);
+		segment.file.createFile();
+	}
 	
 	processQueue();
 }
 
 void FlexStorage::loadStorage() {
+	Proto::StorageConfig config;
+	config.ParseFromString(OS::readFileSync(getPath() + "/config"));
+	configure(config);
+
 	p_indexTree.setPath(getPath());
 	//NOTE: to test the durability implementation we always delete the data on load!
 	p_indexTree.createTree();
 
-	p_dataFile.setPath(p_path);
-	//NOTE: to test the durability implementation we always delete the data on load!
-	p_dataFile.createFile();
+	for(auto &segment : p_segments) {
+		segment.file.setPath(p_path);
+		//NOTE: to test the durability implementation we always delete the data on load!
+		segment.file.createFile();
+	}
 	
 	processQueue();
 }
 
+void FlexStorage::configure(const Proto::StorageConfig &config) {
+	if(!IndexTree::isValidBlockSize(config.block_size())
+			|| config.retain_versions() < 1
+			|| config.compact_batch() < 1
+			|| config.inline_threshold() > config.block_size() / 8)
+		throw std::runtime_error("Illegal configuration for FlexStorage");
+	
+	p_indexTree.setBlockSize(config.block_size());
+	p_inlineThreshold = config.inline_threshold();
+	p_indexTree.setValueSize(Reference::kStructSize + p_inlineThreshold);
+	for(auto &segment : p_segments)
+		segment.file.setPageSize(config.block_size());
+
+	p_gcInterval = config.gc_interval();
+	p_retainSequences = config.retain_sequences();
+	p_retainVersions = config.retain_versions();
+	p_compactThreshold = config.compact_threshold();
+	p_compactBatch = config.compact_batch();
+
+	p_compressor.configure((Ll::Compressor::Codec)config.compression(),
+			config.compression_level(), config.compression_dictionary());
+	p_documentCache.setLimit(config.document_cache_limit());
+
+	p_filterBitsPerKey = config.filter_bits_per_key();
+	if(p_filterBitsPerKey != 0)
+		std::atomic_store(&p_filter, std::make_shared<Ll::BloomFilter>(
+				kFilterCapacity, p_filterBitsPerKey));
+}
+
 DocumentId FlexStorage::allocate() {
 	return ++p_lastDocumentId;
 }
@@ -60,34 +113,243 @@ void FlexStorage::reinspect(Mutation &mutation) {
 
 void FlexStorage::processInsert(SequenceId sequence_id,
 		Mutation &mutation, Async::Callback<void(Error)> callback) {
+	if(p_documentCache.getLimit() != 0)
+		p_documentCache.invalidate(mutation.documentId, sequence_id);
+	if(p_filterBitsPerKey != 0)
+		addToFilter(mutation.documentId, true);
+
 	auto closure = new InsertClosure(this, mutation.documentId,
 			sequence_id, mutation.buffer, callback);
 	closure->apply();
 }
 void FlexStorage::processModify(SequenceId sequence_id,
 		Mutation &mutation, Async::Callback<void(Error)> callback) {
+	if(p_documentCache.getLimit() != 0)
+		p_documentCache.invalidate(mutation.documentId, sequence_id);
+	if(p_filterBitsPerKey != 0)
+		addToFilter(mutation.documentId, false);
+
 	auto closure = new InsertClosure(this, mutation.documentId,
 			sequence_id, mutation.buffer, callback);
 	closure->apply();
 }
 
+void FlexStorage::processDelete(SequenceId sequence_id,
+		Mutation &mutation, Async::Callback<void(Error)> callback) {
+	if(p_documentCache.getLimit() != 0)
+		p_documentCache.invalidate(mutation.documentId, sequence_id);
+
+	auto closure = new InsertClosure(this, mutation.documentId,
+			sequence_id, std::string(), callback);
+	closure->applyTombstone();
+}
+
+void FlexStorage::afterSequence(SequenceId sequence_id) {
+	p_processedSequenceId = sequence_id;
+
+	if(p_gcInterval != 0 && ++p_batchesSinceGc >= p_gcInterval) {
+		p_batchesSinceGc = 0;
+		startGc();
+	}
+	if(p_compactThreshold != 0)
+		maybeCompact();
+	if(p_filterBitsPerKey != 0)
+		maybeRebuildFilter();
+}
+
+void FlexStorage::startGc() {
+	std::unique_lock<std::mutex> lock(p_gcMutex);
+	if(p_gcRunning) {
+		p_gcPending = true;
+		return;
+	}
+	p_gcRunning = true;
+	lock.unlock();
+
+	auto closure = new GcClosure(this);
+	getEngine()->getProcessPool()->submit(ASYNC_MEMBER(closure, &GcClosure::collect));
+}
+void FlexStorage::finishGc() {
+	std::unique_lock<std::mutex> lock(p_gcMutex);
+	p_gcRunning = false;
+	if(!p_gcPending)
+		return;
+	p_gcPending = false;
+	lock.unlock();
+
+	startGc();
+}
+
+void FlexStorage::maybeCompact() {
+	if(p_compactRunning)
+		return;
+	
+	DataSegment &active = p_segments[p_activeSegment];
+	int64_t size = active.pointer;
+	int64_t garbage = active.garbage;
+	if(garbage <= 0 || garbage * 100 < size * p_compactThreshold)
+		return;
+	
+	// all inserts of the batch are complete so none of them is in flight here:
+	// all records of the source segment are already referenced by the index
+	int source = p_activeSegment;
+	p_activeSegment = 1 - source;
+	p_compactRunning = true;
+
+	auto closure = new CompactClosure(this, source, p_activeSegment);
+	getEngine()->getProcessPool()->submit(ASYNC_MEMBER(closure, &CompactClosure::scan));
+}
+void FlexStorage::finishCompaction(int source) {
+	// the index does not reference the source segment anymore and fetches
+	// keep their leaf latched until they have read the record.
+	// multi fetches might still read a record they found earlier
+	std::unique_lock<std::mutex> lock(p_segmentMutex);
+	if(p_segmentReaders > 0) {
+		p_dropPending = source;
+		return;
+	}
+	lock.unlock();
+
+	dropSegment(source);
+}
+void FlexStorage::dropSegment(int source) {
+	DataSegment &segment = p_segments[source];
+	segment.file.truncate();
+	segment.pointer = 0;
+	segment.garbage = 0;
+	p_compactRunning = false;
+}
+
+void FlexStorage::acquireSegments() {
+	std::lock_guard<std::mutex> lock(p_segmentMutex);
+	p_segmentReaders++;
+}
+void FlexStorage::releaseSegments() {
+	std::unique_lock<std::mutex> lock(p_segmentMutex);
+	assert(p_segmentReaders > 0);
+	p_segmentReaders--;
+	if(p_segmentReaders > 0 || p_dropPending < 0)
+		return;
+	int source = p_dropPending;
+	p_dropPending = -1;
+	lock.unlock();
+
+	dropSegment(source);
+}
+
+void FlexStorage::addToFilter(DocumentId document_id, bool new_document) {
+	// the document is added before its index entry is inserted
+	std::unique_lock<std::mutex> lock(p_filterMutex);
+	p_filter->insert(document_id);
+	if(p_rebuiltFilter)
+		p_rebuiltFilter->insert(document_id);
+	if(!new_document)
+		return;
+	
+	p_filterKeys++;
+	if(p_rebuiltFilter || p_filterKeys <= p_filter->getCapacity())
+		return;
+	p_filterRebuildPending = true;
+}
+void FlexStorage::maybeRebuildFilter() {
+	std::unique_lock<std::mutex> lock(p_filterMutex);
+	if(!p_filterRebuildPending)
+		return;
+	p_filterRebuildPending = false;
+
+	// all mutations of the batch are in the index when the scan starts.
+	// later documents are added to the new filter by addToFilter()
+	p_rebuiltFilter = std::make_shared<Ll::BloomFilter>(2 * p_filterKeys,
+			p_filterBitsPerKey);
+
+	auto closure = new FilterRebuildClosure(this, p_rebuiltFilter);
+	lock.unlock();
+	getEngine()->getProcessPool()->submit(ASYNC_MEMBER(closure,
+			&FilterRebuildClosure::scan));
+}
+bool FlexStorage::mayExist(DocumentId document_id) {
+	std::shared_ptr<Ll::BloomFilter> filter = std::atomic_load(&p_filter);
+	return !filter || filter->mayContain(document_id);
+}
+void FlexStorage::finishFilterRebuild() {
+	std::lock_guard<std::mutex> lock(p_filterMutex);
+	std::atomic_store(&p_filter, p_rebuiltFilter);
+	p_rebuiltFilter.reset();
+}
+
 void FlexStorage::processFetch(FetchRequest *fetch,
 		Async::Callback<void(FetchData &)> on_data,
 		Async::Callback<void(FetchError)> callback) {
+	if(!mayExist(fetch->documentId)) {
+		callback(kFetchDocumentNotFound);
+		finishRequest();
+		return;
+	}
+
+	if(p_documentCache.getLimit() != 0) {
+		FetchData data;
+		if(p_documentCache.lookup(fetch->documentId, fetch->sequenceId, data)) {
+			on_data(data);
+			callback(kFetchSuccess);
+			finishRequest();
+			return;
+		}
+	}
+
 	auto closure = new FetchClosure(this, fetch->documentId,
 			fetch->sequenceId, on_data, callback);
 	closure->process();
 }
 
-void FlexStorage::writeIndex(void *buffer, const Index &index) {
-	OS::packLe64((char*)buffer + Index::kDocumentId, index.documentId);
-	OS::packLe64((char*)buffer + Index::kSequenceId, index.sequenceId);
+void FlexStorage::processMultiFetch(MultiFetchRequest *fetch,
+		Async::Callback<void(std::vector<FetchData> &)> on_data,
+		Async::Callback<void(FetchError)> callback) {
+	auto closure = new MultiFetchClosure(this, fetch->sequenceId,
+			fetch->documentIds, on_data, callback);
+	closure->process();
 }
-FlexStorage::Index FlexStorage::readIndex(const void *buffer) {
-	Index index;
-	index.documentId = OS::unpackLe64((char*)buffer + Index::kDocumentId);
-	index.sequenceId = OS::unpackLe64((char*)buffer + Index::kSequenceId);
-	return index;
+
+void FlexStorage::processHistory(HistoryRequest *request,
+		Async::Callback<void(std::vector<VersionData> &)> on_data,
+		Async::Callback<void(FetchError)> callback) {
+	if(!mayExist(request->documentId)) {
+		callback(kFetchSuccess);
+		finishRequest();
+		return;
+	}
+
+	auto closure = new HistoryClosure(this, request, on_data, callback);
+	closure->process();
+}
+
+void FlexStorage::checkIntegrity(Async::Callback<void(const std::string &)> callback) {
+	auto closure = new CheckClosure(this, callback);
+	closure->check();
+}
+
+int FlexStorage::compareIndex(const Index &a, const Index &b) {
+	if(a.documentId != b.documentId)
+		return a.documentId < b.documentId ? -1 : 1;
+	if(a.sequenceId != b.sequenceId)
+		return a.sequenceId < b.sequenceId ? -1 : 1;
+	return 0;
+}
+
+void FlexStorage::packReference(char *buffer, const Reference &reference) {
+	OS::packLe64(buffer + Reference::kOffset, reference.offset);
+	OS::packLe32(buffer + Reference::kLength, reference.length);
+	OS::packLe32(buffer + Reference::kRawLength, reference.rawLength);
+	OS::packLe32(buffer + Reference::kSegment, reference.segment);
+	OS::packLe32(buffer + Reference::kCodec, reference.codec);
+}
+FlexStorage::Reference FlexStorage::unpackReference(char *buffer) {
+	Reference reference;
+	reference.offset = OS::unpackLe64(buffer + Reference::kOffset);
+	reference.length = OS::unpackLe32(buffer + Reference::kLength);
+	reference.rawLength = OS::unpackLe32(buffer + Reference::kRawLength);
+	reference.segment = OS::unpackLe32(buffer + Reference::kSegment);
+	reference.codec = (Ll::Compressor::Codec)OS::unpackLe32(buffer + Reference::kCodec);
+	return reference;
 }
 
 FlexStorage::Factory::Factory()
@@ -107,23 +369,57 @@ FlexStorage::InsertClosure::InsertClosure(FlexStorage *storage,
 		Async::Callback<void(Error)> callback)
 	: p_storage(storage), p_documentId(document_id),
 		p_sequenceId(sequence_id), p_buffer(buffer),
-		p_callback(callback), p_dataWrite(&storage->p_dataFile) { }
+		p_callback(callback), p_value(storage->p_indexTree.getValueSize(), 0),
+		p_segment(storage->p_activeSegment),
+		p_dataWrite(&storage->p_segments[p_segment].file) { }
 
 void FlexStorage::InsertClosure::apply() {
-	size_t data_pointer = p_storage->p_dataPointer;
-	p_storage->p_dataPointer += p_buffer.size();
-	
+	Reference reference;
+	reference.rawLength = p_buffer.size();
+	reference.segment = p_segment;
+
+	std::string compressed;
+	reference.codec = p_storage->p_compressor.compress(p_buffer.data(),
+			p_buffer.size(), compressed);
+	if(reference.codec != Ll::Compressor::kCodecNone)
+		p_buffer.swap(compressed);
+
 	p_index.documentId = p_documentId;
 	p_index.sequenceId = p_sequenceId;
-	
-	OS::packLe64(p_refBuffer + Reference::kOffset, data_pointer);
-	OS::packLe64(p_refBuffer + Reference::kLength, p_buffer.size());
+
+	// small documents are fetched without touching the data file
+	reference.length = p_buffer.size();
+	if(p_buffer.size() <= p_storage->p_inlineThreshold) {
+		reference.offset = 0;
+		reference.segment = kInlineSegment;
+		packReference(&p_value[0], reference);
+		p_value.replace(Reference::kStructSize, p_buffer.size(), p_buffer);
+		onDataWrite();
+		return;
+	}
+
+	size_t data_pointer = p_storage->p_segments[p_segment].pointer.fetch_add(p_buffer.size());
+	reference.offset = data_pointer;
+	packReference(&p_value[0], reference);
 	
 	p_dataWrite.write(data_pointer, p_buffer.size(), p_buffer.data(),
 			ASYNC_MEMBER(this, &InsertClosure::onDataWrite));
 }
+void FlexStorage::InsertClosure::applyTombstone() {
+	Reference reference;
+	reference.offset = 0;
+	reference.length = 0;
+	reference.rawLength = 0;
+	reference.segment = kTombstoneSegment;
+	reference.codec = Ll::Compressor::kCodecNone;
+	packReference(&p_value[0], reference);
+
+	p_index.documentId = p_documentId;
+	p_index.sequenceId = p_sequenceId;
+	onDataWrite();
+}
 void FlexStorage::InsertClosure::onDataWrite() {
-	auto action = p_storage->p_indexTree.insert(&p_index, p_refBuffer,
+	auto action = p_storage->p_indexTree.insert(&p_index, &p_value[0],
 			ASYNC_MEMBER(this, &InsertClosure::compareToInserted));
 	libchain::run(action, ASYNC_MEMBER(this, &InsertClosure::onIndexInsert));
 }
@@ -160,11 +456,13 @@ FlexStorage::FetchClosure::FetchClosure(FlexStorage *storage,
 		Async::Callback<void(FetchError)> callback)
 	: p_storage(storage), p_documentId(document_id), p_sequenceId(sequence_id),
 		p_onData(on_data), p_callback(callback),
-		p_dataRead(&storage->p_dataFile),
+		p_value(storage->p_indexTree.getValueSize(), 0),
+		p_dataRead(nullptr),
 		p_btreeFind(&storage->p_indexTree),
 		p_btreeIterate(&storage->p_indexTree) { }
 
 void FlexStorage::FetchClosure::process() {
+	p_processedId = p_storage->p_processedSequenceId;
 	p_btreeFind.findPrev(ASYNC_MEMBER(this, &FetchClosure::compareToFetched),
 			ASYNC_MEMBER(this, &FetchClosure::onIndexFound));
 }
@@ -186,7 +484,7 @@ void FlexStorage::FetchClosure::compareToFetched(const Index &other,
 	}
 	callback(0);
 }
-void FlexStorage::FetchClosure::onIndexFound(Btree<Index>::Ref ref) {
+void FlexStorage::FetchClosure::onIndexFound(IndexTree::Ref ref) {
 	if(!ref.valid()) {
 		p_callback(kFetchDocumentNotFound);
 		p_storage->finishRequest();
@@ -205,20 +503,59 @@ void FlexStorage::FetchClosure::onSeek() {
 		return;
 	}
 
-	char ref_buffer[Reference::kStructSize];
-	p_btreeIterate.getValue(&ref_buffer);
-
-	size_t offset = OS::unpackLe64(ref_buffer + Reference::kOffset);
-	size_t length = OS::unpackLe64(ref_buffer + Reference::kLength);
+	p_btreeIterate.getValue(&p_value[0]);
+	p_reference = unpackReference(&p_value[0]);
+	if(p_reference.segment == kTombstoneSegment) {
+		p_callback(kFetchDocumentNotFound);
+		p_storage->finishRequest();
+		delete this;
+		return;
+	}
 	
 	p_fetchData.documentId = p_documentId;
 	p_fetchData.sequenceId = index.sequenceId;
-	p_fetchData.buffer.resize(length);
+	p_fetchData.buffer.resize(p_reference.rawLength);
+
+	// uncompressed records are read in place
+	char *target = &p_fetchData.buffer[0];
+	if(p_reference.codec != Ll::Compressor::kCodecNone) {
+		p_dataBuffer.resize(p_reference.length);
+		target = &p_dataBuffer[0];
+	}
+
+	if(p_reference.segment == kInlineSegment) {
+		p_value.copy(target, p_reference.length, Reference::kStructSize);
+		onDataRead();
+		return;
+	}
 
-	p_dataRead.read(offset, length, &p_fetchData.buffer[0],
+	// the leaf stays latched so compaction cannot drop the segment during the read
+	p_dataRead = Ll::RandomAccessFile::ReadClosure(
+			&p_storage->p_segments[p_reference.segment].file);
+	p_dataRead.read(p_reference.offset, p_reference.length, target,
 			ASYNC_MEMBER(this, &FetchClosure::onDataRead));
 }
 void FlexStorage::FetchClosure::onDataRead() {
+	if(p_reference.codec != Ll::Compressor::kCodecNone)
+		p_storage->p_compressor.decompress(p_reference.codec,
+				p_dataBuffer.data(), p_dataBuffer.size(),
+				&p_fetchData.buffer[0], p_fetchData.buffer.size());
+
+	// only the latest version of a document is cached
+	DocumentCache &cache = p_storage->p_documentCache;
+	if(cache.getLimit() != 0 && p_fetchData.buffer.size() <= cache.getLimit()) {
+		p_btreeIterate.forward(ASYNC_MEMBER(this, &FetchClosure::onForward));
+		return;
+	}
+	complete();
+}
+void FlexStorage::FetchClosure::onForward() {
+	if(!p_btreeIterate.valid() || p_btreeIterate.getKey().documentId != p_documentId)
+		p_storage->p_documentCache.insert(p_documentId, p_fetchData.sequenceId,
+				p_processedId, p_fetchData.buffer);
+	complete();
+}
+void FlexStorage::FetchClosure::complete() {
 	p_onData(p_fetchData);
 
 	p_callback(kFetchSuccess);
@@ -226,5 +563,564 @@ void FlexStorage::FetchClosure::onDataRead() {
 	delete this;
 }
 
+// --------------------------------------------------------
+// MultiFetchClosure
+// --------------------------------------------------------
+
+FlexStorage::MultiFetchClosure::MultiFetchClosure(FlexStorage *storage,
+		SequenceId sequence_id, const std::vector<DocumentId> &document_ids,
+		Async::Callback<void(std::vector<FetchData> &)> on_data,
+		Async::Callback<void(FetchError)> callback)
+	: p_storage(storage), p_sequenceId(sequence_id),
+		p_onData(on_data), p_callback(callback),
+		p_documentIds(document_ids), p_current(0), p_steps(0),
+		p_exhausted(false), p_hasVersion(false), p_versionId(0),
+		p_value(storage->p_indexTree.getValueSize(), 0),
+		p_dataRead(nullptr),
+		p_btreeFind(&storage->p_indexTree),
+		p_btreeIterate(&storage->p_indexTree) { }
+
+void FlexStorage::MultiFetchClosure::process() {
+	std::sort(p_documentIds.begin(), p_documentIds.end());
+	p_documentIds.erase(std::unique(p_documentIds.begin(), p_documentIds.end()),
+			p_documentIds.end());
+	p_documentIds.erase(std::remove_if(p_documentIds.begin(), p_documentIds.end(),
+			[this] (DocumentId id) { return !p_storage->mayExist(id); }),
+			p_documentIds.end());
+	
+	p_storage->acquireSegments();
+	nextDocument();
+}
+void FlexStorage::MultiFetchClosure::locate() {
+	p_steps = 0;
+	p_btreeFind.findPrev(ASYNC_MEMBER(this, &MultiFetchClosure::compareToTarget),
+			ASYNC_MEMBER(this, &MultiFetchClosure::onFound));
+}
+void FlexStorage::MultiFetchClosure::compareToTarget(const Index &other,
+		Async::Callback<void(int)> callback) {
+	Index target;
+	target.documentId = p_documentIds[p_current];
+	target.sequenceId = p_sequenceId;
+	callback(p_storage->compareIndex(other, target));
+}
+void FlexStorage::MultiFetchClosure::onFound(IndexTree::Ref ref) {
+	// no entry precedes the document; the first entry is already past it
+	if(!ref.valid()) {
+		p_btreeFind.findFirst(ASYNC_MEMBER(this, &MultiFetchClosure::onFound));
+		return;
+	}
+	p_btreeIterate.seek(ref, ASYNC_MEMBER(this, &MultiFetchClosure::onEntry));
+}
+void FlexStorage::MultiFetchClosure::onEntry() {
+	if(!p_btreeIterate.valid()) {
+		p_exhausted = true;
+		finishDocument();
+		return;
+	}
+
+	Index target;
+	target.documentId = p_documentIds[p_current];
+	target.sequenceId = p_sequenceId;
+
+	Index index = p_btreeIterate.getKey();
+	if(p_storage->compareIndex(index, target) > 0) {
+		finishDocument();
+		return;
+	}
+	
+	// versions are ordered so the last one up to the snapshot is visible
+	if(index.documentId == target.documentId) {
+		p_hasVersion = true;
+		p_versionId = index.sequenceId;
+		p_btreeIterate.getValue(&p_value[0]);
+	}else if(++p_steps > kMultiFetchSkip) {
+		p_btreeIterate.seek(IndexTree::Ref(),
+				ASYNC_MEMBER(this, &MultiFetchClosure::locate));
+		return;
+	}
+	p_btreeIterate.forward(ASYNC_MEMBER(this, &MultiFetchClosure::onForward));
+}
+void FlexStorage::MultiFetchClosure::onForward() {
+	LocalTaskQueue::get()->submit(ASYNC_MEMBER(this, &MultiFetchClosure::onEntry));
+}
+void FlexStorage::MultiFetchClosure::finishDocument() {
+	if(p_hasVersion)
+		p_reference = unpackReference(&p_value[0]);
+	if(!p_hasVersion || p_reference.segment == kTombstoneSegment) {
+		p_current++;
+		nextDocument();
+		return;
+	}
+
+	p_batch.emplace_back();
+	FetchData &data = p_batch.back();
+	data.documentId = p_documentIds[p_current];
+	data.sequenceId = p_versionId;
+	data.buffer.resize(p_reference.rawLength);
+
+	char *target = &data.buffer[0];
+	if(p_reference.codec != Ll::Compressor::kCodecNone) {
+		p_dataBuffer.resize(p_reference.length);
+		target = &p_dataBuffer[0];
+	}
+
+	if(p_reference.segment == kInlineSegment) {
+		p_value.copy(target, p_reference.length, Reference::kStructSize);
+		onDataRead();
+		return;
+	}
+
+	// the version might be in a leaf that is not latched anymore;
+	// acquireSegments() keeps the record readable
+	p_dataRead = Ll::RandomAccessFile::ReadClosure(
+			&p_storage->p_segments[p_reference.segment].file);
+	p_dataRead.read(p_reference.offset, p_reference.length, target,
+			ASYNC_MEMBER(this, &MultiFetchClosure::onDataRead));
+}
+void FlexStorage::MultiFetchClosure::onDataRead() {
+	FetchData &data = p_batch.back();
+	if(p_reference.codec != Ll::Compressor::kCodecNone)
+		p_storage->p_compressor.decompress(p_reference.codec,
+				p_dataBuffer.data(), p_dataBuffer.size(),
+				&data.buffer[0], data.buffer.size());
+	
+	p_current++;
+	nextDocument();
+}
+void FlexStorage::MultiFetchClosure::nextDocument() {
+	DocumentCache &cache = p_storage->p_documentCache;
+	p_hasVersion = false;
+
+	// the index is only searched for documents that are not cached
+	while(true) {
+		if(p_batch.size() >= kReportBatch) {
+			p_onData(p_batch);
+			p_batch.clear();
+		}
+
+		if(p_current == p_documentIds.size() || p_exhausted) {
+			complete();
+			return;
+		}
+
+		FetchData data;
+		if(cache.getLimit() == 0 || !cache.lookup(p_documentIds[p_current],
+				p_sequenceId, data))
+			break;
+		p_batch.push_back(std::move(data));
+		p_current++;
+	}
+
+	// the iterator is positioned at the first entry after the previous document
+	if(p_btreeIterate.valid()) {
+		p_steps = 0;
+		LocalTaskQueue::get()->submit(ASYNC_MEMBER(this, &MultiFetchClosure::onEntry));
+	}else{
+		locate();
+	}
+}
+void FlexStorage::MultiFetchClosure::complete() {
+	if(!p_batch.empty())
+		p_onData(p_batch);
+	
+	p_storage->releaseSegments();
+
+	p_callback(kFetchSuccess);
+	p_storage->finishRequest();
+	delete this;
+}
+
+// --------------------------------------------------------
+// HistoryClosure
+// --------------------------------------------------------
+
+FlexStorage::HistoryClosure::HistoryClosure(FlexStorage *storage,
+		HistoryRequest *request,
+		Async::Callback<void(std::vector<VersionData> &)> on_data,
+		Async::Callback<void(FetchError)> callback)
+	: p_storage(storage), p_request(request),
+		p_onData(on_data), p_callback(callback),
+		p_value(storage->p_indexTree.getValueSize(), 0),
+		p_dataRead(nullptr),
+		p_btreeFind(&storage->p_indexTree),
+		p_btreeIterate(&storage->p_indexTree) { }
+
+void FlexStorage::HistoryClosure::process() {
+	p_btreeFind.findNext(ASYNC_MEMBER(this, &HistoryClosure::compareToFrom),
+			ASYNC_MEMBER(this, &HistoryClosure::onFound));
+}
+void FlexStorage::HistoryClosure::compareToFrom(const Index &other,
+		Async::Callback<void(int)> callback) {
+	Index from;
+	from.documentId = p_request->documentId;
+	from.sequenceId = p_request->fromSequenceId;
+	// never report equality so that we find the first version in the range
+	callback(p_storage->compareIndex(other, from) < 0 ? -1 : 1);
+}
+void FlexStorage::HistoryClosure::onFound(IndexTree::Ref ref) {
+	p_btreeIterate.seek(ref, ASYNC_MEMBER(this, &HistoryClosure::onEntry));
+}
+void FlexStorage::HistoryClosure::onEntry() {
+	if(!p_btreeIterate.valid()) {
+		complete();
+		return;
+	}
+	Index index = p_btreeIterate.getKey();
+	if(index.documentId != p_request->documentId
+			|| index.sequenceId > p_request->toSequenceId) {
+		complete();
+		return;
+	}
+
+	p_btreeIterate.getValue(&p_value[0]);
+	p_reference = unpackReference(&p_value[0]);
+
+	p_batch.emplace_back();
+	VersionData &data = p_batch.back();
+	data.sequenceId = index.sequenceId;
+	data.deleted = (p_reference.segment == kTombstoneSegment);
+	if(data.deleted) {
+		onDataRead();
+		return;
+	}
+	data.buffer.resize(p_reference.rawLength);
+
+	char *target = &data.buffer[0];
+	if(p_reference.codec != Ll::Compressor::kCodecNone) {
+		p_dataBuffer.resize(p_reference.length);
+		target = &p_dataBuffer[0];
+	}
+
+	if(p_reference.segment == kInlineSegment) {
+		p_value.copy(target, p_reference.length, Reference::kStructSize);
+		onDataRead();
+		return;
+	}
+
+	p_dataRead = Ll::RandomAccessFile::ReadClosure(
+			&p_storage->p_segments[p_reference.segment].file);
+	p_dataRead.read(p_reference.offset, p_reference.length, target,
+			ASYNC_MEMBER(this, &HistoryClosure::onDataRead));
+}
+void FlexStorage::HistoryClosure::onDataRead() {
+	VersionData &data = p_batch.back();
+	if(!data.deleted && p_reference.codec != Ll::Compressor::kCodecNone)
+		p_storage->p_compressor.decompress(p_reference.codec,
+				p_dataBuffer.data(), p_dataBuffer.size(),
+				&data.buffer[0], data.buffer.size());
+
+	if(p_batch.size() >= kReportBatch) {
+		p_onData(p_batch);
+		p_batch.clear();
+	}
+	p_btreeIterate.forward(ASYNC_MEMBER(this, &HistoryClosure::onForward));
+}
+void FlexStorage::HistoryClosure::onForward() {
+	LocalTaskQueue::get()->submit(ASYNC_MEMBER(this, &HistoryClosure::onEntry));
+}
+void FlexStorage::HistoryClosure::complete() {
+	if(!p_batch.empty())
+		p_onData(p_batch);
+
+	p_callback(kFetchSuccess);
+	p_storage->finishRequest();
+	delete this;
+}
+
+// --------------------------------------------------------
+// FilterRebuildClosure
+// --------------------------------------------------------
+
+FlexStorage::FilterRebuildClosure::FilterRebuildClosure(FlexStorage *storage,
+		std::shared_ptr<Ll::BloomFilter> filter)
+	: p_storage(storage), p_filter(filter),
+		p_btreeFind(&storage->p_indexTree),
+		p_btreeIterate(&storage->p_indexTree) { }
+
+void FlexStorage::FilterRebuildClosure::scan() {
+	p_btreeFind.findFirst(ASYNC_MEMBER(this, &FilterRebuildClosure::onFound));
+}
+void FlexStorage::FilterRebuildClosure::onFound(IndexTree::Ref ref) {
+	p_btreeIterate.seek(ref, ASYNC_MEMBER(this, &FilterRebuildClosure::onEntry));
+}
+void FlexStorage::FilterRebuildClosure::onEntry() {
+	if(!p_btreeIterate.valid()) {
+		p_storage->finishFilterRebuild();
+		delete this;
+		return;
+	}
+
+	p_filter->insert(p_btreeIterate.getKey().documentId);
+	p_btreeIterate.forward(ASYNC_MEMBER(this, &FilterRebuildClosure::onForward));
+}
+void FlexStorage::FilterRebuildClosure::onForward() {
+	LocalTaskQueue::get()->submit(ASYNC_MEMBER(this, &FilterRebuildClosure::onEntry));
+}
+
+// --------------------------------------------------------
+// GcClosure
+// --------------------------------------------------------
+
+FlexStorage::GcClosure::GcClosure(FlexStorage *storage)
+	: p_storage(storage), p_horizon(0), p_removeIndex(0),
+		p_value(storage->p_indexTree.getValueSize(), 0),
+		p_resumeDocument(0), p_finished(false), p_removedCount(0),
+		p_btreeFind(&storage->p_indexTree),
+		p_btreeIterate(&storage->p_indexTree),
+		p_btreeCompact(&storage->p_indexTree) { }
+
+void FlexStorage::GcClosure::collect() {
+	p_horizon = p_storage->getEngine()->advanceHorizon(p_storage->p_retainSequences);
+	scan();
+}
+void FlexStorage::GcClosure::scan() {
+	p_btreeFind.findNext(ASYNC_MEMBER(this, &GcClosure::compareToResume),
+			ASYNC_MEMBER(this, &GcClosure::onFound));
+}
+void FlexStorage::GcClosure::compareToResume(const Index &other,
+		Async::Callback<void(int)> callback) {
+	// never report equality so that we find the first version of the document
+	callback(other.documentId < p_resumeDocument ? -1 : 1);
+}
+void FlexStorage::GcClosure::onFound(IndexTree::Ref ref) {
+	p_btreeIterate.seek(ref, ASYNC_MEMBER(this, &GcClosure::onEntry));
+}
+void FlexStorage::GcClosure::onEntry() {
+	if(!p_btreeIterate.valid()) {
+		collectDocument();
+		p_finished = true;
+		onRelease();
+		return;
+	}
+
+	Version version;
+	version.index = p_btreeIterate.getKey();
+	if(!p_versions.empty() && p_versions.back().index.documentId != version.index.documentId) {
+		collectDocument();
+
+		// entries can only be removed after the leaf latch is released
+		if(p_obsolete.size() >= kGcBatchSize) {
+			p_resumeDocument = version.index.documentId;
+			p_btreeIterate.seek(IndexTree::Ref(), ASYNC_MEMBER(this, &GcClosure::onRelease));
+			return;
+		}
+	}
+
+	p_btreeIterate.getValue(&p_value[0]);
+	version.reference = unpackReference(&p_value[0]);
+	p_versions.push_back(version);
+	p_btreeIterate.forward(ASYNC_MEMBER(this, &GcClosure::onForward));
+}
+void FlexStorage::GcClosure::onForward() {
+	LocalTaskQueue::get()->submit(ASYNC_MEMBER(this, &GcClosure::onEntry));
+}
+void FlexStorage::GcClosure::collectDocument() {
+	// the newest version at the horizon hides all older versions from current snapshots
+	size_t visible = p_versions.size();
+	for(size_t i = 0; i < p_versions.size(); i++)
+		if(p_versions[i].index.sequenceId <= p_horizon)
+			visible = i;
+	
+	if(visible < p_versions.size()) {
+		size_t retained = p_versions.size() > p_storage->p_retainVersions
+				? p_versions.size() - p_storage->p_retainVersions : 0;
+		size_t limit = std::min(visible, retained);
+		// deleted documents are removed completely once no snapshot sees them
+		if(visible == p_versions.size() - 1
+				&& p_versions.back().reference.segment == kTombstoneSegment)
+			limit = p_versions.size();
+		p_obsolete.insert(p_obsolete.end(), p_versions.begin(),
+				p_versions.begin() + limit);
+	}
+	p_versions.clear();
+}
+void FlexStorage::GcClosure::onRelease() {
+	p_removeIndex = 0;
+	removeNext();
+}
+void FlexStorage::GcClosure::removeNext() {
+	if(p_removeIndex == p_obsolete.size()) {
+		p_obsolete.clear();
+		if(!p_finished) {
+			scan();
+			return;
+		}
+
+		if(p_removedCount > 0) {
+			p_btreeCompact.compact(ASYNC_MEMBER(this, &GcClosure::onCompact));
+			return;
+		}
+		p_storage->finishGc();
+		delete this;
+		return;
+	}
+
+	p_removeKey = p_obsolete[p_removeIndex].index;
+	auto action = p_storage->p_indexTree.remove(&p_removeKey,
+			ASYNC_MEMBER(this, &GcClosure::compareToRemoved));
+	libchain::run(action, ASYNC_MEMBER(this, &GcClosure::onRemove));
+}
+void FlexStorage::GcClosure::compareToRemoved(const Index &other,
+		Async::Callback<void(int)> callback) {
+	callback(p_storage->compareIndex(other, p_removeKey));
+}
+void FlexStorage::GcClosure::onRemove(bool removed) {
+	// the reference might be outdated if compaction moved the record.
+	// the garbage counters only decide when to compact so this is fine
+	const Reference &reference = p_obsolete[p_removeIndex].reference;
+	if(removed && reference.segment != kInlineSegment
+			&& reference.segment != kTombstoneSegment)
+		p_storage->p_segments[reference.segment].garbage += reference.length;
+	if(removed)
+		p_removedCount++;
+	p_removeIndex++;
+	LocalTaskQueue::get()->submit(ASYNC_MEMBER(this, &GcClosure::removeNext));
+}
+void FlexStorage::GcClosure::onCompact() {
+	p_storage->finishGc();
+	delete this;
+}
+
+// --------------------------------------------------------
+// CompactClosure
+// --------------------------------------------------------
+
+FlexStorage::CompactClosure::CompactClosure(FlexStorage *storage,
+		int source, int target)
+	: p_storage(storage), p_source(source), p_target(target),
+		p_copyIndex(0), p_value(storage->p_indexTree.getValueSize(), 0),
+		p_finished(false),
+		p_dataRead(&storage->p_segments[source].file),
+		p_dataWrite(&storage->p_segments[target].file),
+		p_btreeFind(&storage->p_indexTree),
+		p_btreeIterate(&storage->p_indexTree) {
+	// document ids start at one so the first scan starts at the first entry
+	p_resumeIndex.documentId = 0;
+	p_resumeIndex.sequenceId = 0;
+}
+
+void FlexStorage::CompactClosure::scan() {
+	p_btreeFind.findNext(ASYNC_MEMBER(this, &CompactClosure::compareToResume),
+			ASYNC_MEMBER(this, &CompactClosure::onFound));
+}
+void FlexStorage::CompactClosure::compareToResume(const Index &other,
+		Async::Callback<void(int)> callback) {
+	callback(p_storage->compareIndex(other, p_resumeIndex) <= 0 ? -1 : 1);
+}
+void FlexStorage::CompactClosure::onFound(IndexTree::Ref ref) {
+	p_btreeIterate.seek(ref, ASYNC_MEMBER(this, &CompactClosure::onEntry));
+}
+void FlexStorage::CompactClosure::onEntry() {
+	if(!p_btreeIterate.valid()) {
+		p_finished = true;
+		onRelease();
+		return;
+	}
+
+	Record record;
+	record.index = p_btreeIterate.getKey();
+	p_btreeIterate.getValue(&p_value[0]);
+	record.reference = unpackReference(&p_value[0]);
+
+	// records that were inserted after compaction started are already in place
+	if(record.reference.segment == p_source) {
+		p_records.push_back(record);
+
+		// references can only be updated after the leaf latch is released
+		if(p_records.size() >= p_storage->p_compactBatch) {
+			p_resumeIndex = record.index;
+			p_btreeIterate.seek(IndexTree::Ref(),
+					ASYNC_MEMBER(this, &CompactClosure::onRelease));
+			return;
+		}
+	}
+
+	p_btreeIterate.forward(ASYNC_MEMBER(this, &CompactClosure::onForward));
+}
+void FlexStorage::CompactClosure::onForward() {
+	LocalTaskQueue::get()->submit(ASYNC_MEMBER(this, &CompactClosure::onEntry));
+}
+void FlexStorage::CompactClosure::onRelease() {
+	p_copyIndex = 0;
+	copyNext();
+}
+void FlexStorage::CompactClosure::copyNext() {
+	if(p_copyIndex == p_records.size()) {
+		p_records.clear();
+		if(!p_finished) {
+			// yield to foreground requests before the next batch
+			p_storage->getEngine()->getProcessPool()->submit(
+					ASYNC_MEMBER(this, &CompactClosure::scan));
+			return;
+		}
+
+		p_storage->finishCompaction(p_source);
+		delete this;
+		return;
+	}
+
+	const Reference &reference = p_records[p_copyIndex].reference;
+	p_buffer.resize(reference.length);
+	p_dataRead.read(reference.offset, reference.length, &p_buffer[0],
+			ASYNC_MEMBER(this, &CompactClosure::onDataRead));
+}
+void FlexStorage::CompactClosure::onDataRead() {
+	// records are copied as they are stored, i.e. still compressed
+	Reference reference = p_records[p_copyIndex].reference;
+	reference.offset = p_storage->p_segments[p_target].pointer.fetch_add(p_buffer.size());
+	reference.segment = p_target;
+	packReference(&p_value[0], reference);
+
+	p_dataWrite.write(reference.offset, reference.length, p_buffer.data(),
+			ASYNC_MEMBER(this, &CompactClosure::onDataWrite));
+}
+void FlexStorage::CompactClosure::onDataWrite() {
+	p_updateKey = p_records[p_copyIndex].index;
+	auto action = p_storage->p_indexTree.update(&p_updateKey, &p_value[0],
+			ASYNC_MEMBER(this, &CompactClosure::compareToUpdated));
+	libchain::run(action, ASYNC_MEMBER(this, &CompactClosure::onUpdate));
+}
+void FlexStorage::CompactClosure::compareToUpdated(const Index &other,
+		Async::Callback<void(int)> callback) {
+	callback(p_storage->compareIndex(other, p_updateKey));
+}
+void FlexStorage::CompactClosure::onUpdate(bool updated) {
+	// the entry was garbage collected in the meantime
+	if(!updated)
+		p_storage->p_segments[p_target].garbage += p_buffer.size();
+
+	p_copyIndex++;
+	LocalTaskQueue::get()->submit(ASYNC_MEMBER(this, &CompactClosure::copyNext));
+}
+
+// --------------------------------------------------------
+// CheckClosure
+// --------------------------------------------------------
+
+FlexStorage::CheckClosure::CheckClosure(FlexStorage *storage,
+		Async::Callback<void(const std::string &)> callback)
+	: p_storage(storage), p_callback(callback),
+		p_btreeCheck(&storage->p_indexTree) { }
+
+void FlexStorage::CheckClosure::check() {
+	p_btreeCheck.setCompare(ASYNC_MEMBER(p_storage, &FlexStorage::compareIndex));
+	p_btreeCheck.check(p_storage->getEngine()->getProcessPool(),
+			ASYNC_MEMBER(this, &CheckClosure::onComplete));
+}
+void FlexStorage::CheckClosure::onComplete() {
+	// appended bytes include garbage that was not compacted yet.
+	// inline records and tombstones do not occupy data segment space
+	size_t data_bytes = 0;
+	int64_t garbage_bytes = 0;
+	for(auto &segment : p_storage->p_segments) {
+		data_bytes += segment.pointer;
+		garbage_bytes += segment.garbage;
+	}
+	p_callback("data bytes: " + std::to_string(data_bytes) + "\n"
+			+ "garbage bytes: " + std::to_string(garbage_bytes) + "\n"
+			+ "index tree\n" + p_btreeCheck.getReport().format());
+	delete this;
+}
+
 }; // namespace Db
 
@@ -0,0 +1,264 @@
+#include <cstdint>
+#include <string>
+#include <algorithm>
+
+#include "async.hpp"
+#include "os/linux.hpp"
+#include "ll/tasks.hpp"
+
+#include "db/types.hpp"
+#include "db/storage-driver.hpp"
+#include "db/view-driver.hpp"
+#include "db/engine.hpp"
+
+#include "db/in-memory-storage.hpp"
+
+namespace Db {
+
+InMemoryStorage::InMemoryStorage(Engine *engine)
+		: QueuedStorageDriver(engine), p_lastDocumentId(0),
+			p_gcInterval(0), p_retainSequences(0), p_retainVersions(1),
+			p_batchesSinceGc(0), p_gcRunning(false), p_horizon(0) {
+}
+
+void InMemoryStorage::createStorage(const Proto::StorageConfig &config) {
+	configure(config);
+
+	OS::writeFileSync(getPath() + "/config", config.SerializeAsString());
+
+	processQueue();
+}
+
+void InMemoryStorage::loadStorage() {
+	Proto::StorageConfig config;
+	config.ParseFromString(OS::readFileSync(getPath() + "/config"));
+	configure(config);
+
+	// the versions are restored by replaying the write-ahead log
+	processQueue();
+}
+
+void InMemoryStorage::configure(const Proto::StorageConfig &config) {
+	if(config.retain_versions() < 1)
+		throw std::runtime_error("Illegal configuration for InMemoryStorage");
+
+	p_gcInterval = config.gc_interval();
+	p_retainSequences = config.retain_sequences();
+	p_retainVersions = config.retain_versions();
+}
+
+DocumentId InMemoryStorage::allocate() {
+	return ++p_lastDocumentId;
+}
+
+void InMemoryStorage::reinspect(Mutation &mutation) {
+	if(mutation.type == Mutation::kTypeInsert) {
+		if(p_lastDocumentId < mutation.documentId)
+			p_lastDocumentId = mutation.documentId;
+	}
+}
+
+void InMemoryStorage::processInsert(SequenceId sequence_id,
+		Mutation &mutation, Async::Callback<void(Error)> callback) {
+	insertVersion(mutation.documentId, sequence_id, false, mutation.buffer);
+	callback(Error(true));
+}
+void InMemoryStorage::processModify(SequenceId sequence_id,
+		Mutation &mutation, Async::Callback<void(Error)> callback) {
+	insertVersion(mutation.documentId, sequence_id, false, mutation.buffer);
+	callback(Error(true));
+}
+void InMemoryStorage::processDelete(SequenceId sequence_id,
+		Mutation &mutation, Async::Callback<void(Error)> callback) {
+	insertVersion(mutation.documentId, sequence_id, true, std::string());
+	callback(Error(true));
+}
+
+InMemoryStorage::Shard &InMemoryStorage::getShard(DocumentId document_id) {
+	return p_shards[(uint64_t)document_id % kShards];
+}
+
+void InMemoryStorage::insertVersion(DocumentId document_id, SequenceId sequence_id,
+		bool deleted, const std::string &buffer) {
+	Shard &shard = getShard(document_id);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	Chain &chain = shard.chains[document_id];
+	chain.push_back(Version{ sequence_id, deleted, buffer });
+	// the new version is newer than the horizon so the chain stays
+	if(p_gcInterval != 0)
+		pruneChain(chain, p_horizon);
+}
+
+bool InMemoryStorage::pruneChain(Chain &chain, SequenceId horizon) {
+	// the newest version up to the horizon hides all older versions
+	size_t visible = 0;
+	bool hidden = false;
+	for(size_t i = 0; i < chain.size() && chain[i].sequenceId <= horizon; i++) {
+		visible = i;
+		hidden = true;
+	}
+	if(!hidden)
+		return true;
+	if(visible + 1 == chain.size() && chain.back().deleted)
+		return false;
+
+	size_t first = visible;
+	if(!chain.back().deleted && chain.size() - first < p_retainVersions)
+		first = chain.size() - std::min(chain.size(), size_t(p_retainVersions));
+	chain.erase(chain.begin(), chain.begin() + first);
+	return true;
+}
+
+InMemoryStorage::Version *InMemoryStorage::findVersion(Chain &chain,
+		SequenceId sequence_id) {
+	for(auto it = chain.rbegin(); it != chain.rend(); ++it)
+		if(it->sequenceId <= sequence_id)
+			return &*it;
+	return nullptr;
+}
+
+void InMemoryStorage::afterSequence(SequenceId sequence_id) {
+	if(p_gcInterval == 0 || ++p_batchesSinceGc < p_gcInterval)
+		return;
+	p_batchesSinceGc = 0;
+
+	if(p_gcRunning.exchange(true))
+		return;
+	getEngine()->getProcessPool()->submit(ASYNC_MEMBER(this,
+			&InMemoryStorage::collectGarbage));
+}
+
+void InMemoryStorage::collectGarbage() {
+	SequenceId horizon = getEngine()->advanceHorizon(p_retainSequences);
+	p_horizon = horizon;
+
+	// locks one shard at a time so that requests are not blocked for long
+	for(auto &shard : p_shards) {
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		for(auto it = shard.chains.begin(); it != shard.chains.end(); ) {
+			if(pruneChain(it->second, horizon)) {
+				++it;
+			}else{
+				it = shard.chains.erase(it);
+			}
+		}
+	}
+
+	p_gcRunning = false;
+}
+
+void InMemoryStorage::processFetch(FetchRequest *fetch,
+		Async::Callback<void(FetchData &)> on_data,
+		Async::Callback<void(FetchError)> callback) {
+	FetchData data;
+	bool found = false;
+
+	Shard &shard = getShard(fetch->documentId);
+	std::unique_lock<std::mutex> lock(shard.mutex);
+	auto iterator = shard.chains.find(fetch->documentId);
+	if(iterator != shard.chains.end()) {
+		Version *version = findVersion(iterator->second, fetch->sequenceId);
+		if(version && !version->deleted) {
+			data.documentId = fetch->documentId;
+			data.sequenceId = version->sequenceId;
+			data.buffer = version->buffer;
+			found = true;
+		}
+	}
+	lock.unlock();
+
+	if(found) {
+		on_data(data);
+		callback(kFetchSuccess);
+	}else{
+		callback(kFetchDocumentNotFound);
+	}
+	finishRequest();
+}
+
+void InMemoryStorage::processMultiFetch(MultiFetchRequest *fetch,
+		Async::Callback<void(std::vector<FetchData> &)> on_data,
+		Async::Callback<void(FetchError)> callback) {
+	std::vector<DocumentId> document_ids = fetch->documentIds;
+	std::sort(document_ids.begin(), document_ids.end());
+	document_ids.erase(std::unique(document_ids.begin(), document_ids.end()),
+			document_ids.end());
+
+	std::vector<FetchData> batch;
+	for(DocumentId document_id : document_ids) {
+		Shard &shard = getShard(document_id);
+		std::unique_lock<std::mutex> lock(shard.mutex);
+		auto iterator = shard.chains.find(document_id);
+		if(iterator == shard.chains.end())
+			continue;
+		Version *version = findVersion(iterator->second, fetch->sequenceId);
+		if(!version || version->deleted)
+			continue;
+
+		FetchData data;
+		data.documentId = document_id;
+		data.sequenceId = version->sequenceId;
+		data.buffer = version->buffer;
+		lock.unlock();
+
+		batch.push_back(std::move(data));
+		if(batch.size() >= kReportBatch) {
+			on_data(batch);
+			batch.clear();
+		}
+	}
+	if(!batch.empty())
+		on_data(batch);
+
+	callback(kFetchSuccess);
+	finishRequest();
+}
+
+void InMemoryStorage::processHistory(HistoryRequest *request,
+		Async::Callback<void(std::vector<VersionData> &)> on_data,
+		Async::Callback<void(FetchError)> callback) {
+	std::vector<VersionData> versions;
+
+	Shard &shard = getShard(request->documentId);
+	std::unique_lock<std::mutex> lock(shard.mutex);
+	auto iterator = shard.chains.find(request->documentId);
+	if(iterator != shard.chains.end()) {
+		for(auto &version : iterator->second) {
+			if(version.sequenceId < request->fromSequenceId
+					|| version.sequenceId > request->toSequenceId)
+				continue;
+			VersionData data;
+			data.sequenceId = version.sequenceId;
+			data.deleted = version.deleted;
+			data.buffer = version.buffer;
+			versions.push_back(std::move(data));
+		}
+	}
+	lock.unlock();
+
+	std::vector<VersionData> batch;
+	for(auto &version : versions) {
+		batch.push_back(std::move(version));
+		if(batch.size() >= kReportBatch) {
+			on_data(batch);
+			batch.clear();
+		}
+	}
+	if(!batch.empty())
+		on_data(batch);
+
+	callback(kFetchSuccess);
+	finishRequest();
+}
+
+InMemoryStorage::Factory::Factory()
+		: StorageDriver::Factory("InMemoryStorage") {
+}
+
+StorageDriver *InMemoryStorage::Factory::newDriver(Engine *engine) {
+	return new InMemoryStorage(engine);
+}
+
+}; // namespace Db
+
@@ -25,32 +25,23 @@ std::string exceptString(const v8::Handle<v8::Message> message) {
 namespace Db {
 
 JsView::JsView(Engine *engine)
-	: QueuedViewDriver(engine),
-		p_keyFile("keys", engine->getCacheHost(), engine->getIoPool()),
-		p_orderTree("order", 4096, KeyRef::kStructSize, Link::kStructSize,
+	: QueuedViewDriver(engine), p_prefetchFraction(0), p_prefetchDistance(0),
+		p_orderTree("order", 4096, Link::kStructSize,
 			engine->getCacheHost(), engine->getIoPool()),
-		p_keyPointer(0) {
-	p_orderTree.setWriteKey(ASYNC_MEMBER(this, &JsView::writeKeyRef));
-	p_orderTree.setReadKey(ASYNC_MEMBER(this, &JsView::readKeyRef));
-}
-
-void JsView::writeKeyRef(void *buffer, const KeyRef &keyref) {
-	OS::packLe64((char *)buffer + KeyRef::kOffset, keyref.offset);
-	OS::packLe32((char *)buffer + KeyRef::kLength, keyref.length);
-}
-JsView::KeyRef JsView::readKeyRef(const void *buffer) {
-	KeyRef keyref;
-	keyref.offset = OS::unpackLe64((char *)buffer + KeyRef::kOffset);
-	keyref.length = OS::unpackLe32((char *)buffer + KeyRef::kLength);
-	return keyref;
+		p_overflowLength(0), p_compactClosure(&p_orderTree),
+		p_removedSinceCompact(0), p_compactRunning(false), p_compactions(0) {
 }
 
 void JsView::createView(const Proto::ViewConfig &config) {
 	if(!config.has_base_storage()
-			|| !config.has_script_file())
+			|| !config.has_script_file()
+			|| !OrderTree::isValidBlockSize(config.block_size())
+			|| config.prefetch_fraction() < 0 || config.prefetch_fraction() > 1)
 		throw std::runtime_error("Illegal configuration for JsView");
 	p_storageName = config.base_storage();
 	p_scriptFile = config.script_file();
+	p_prefetchFraction = config.prefetch_fraction();
+	p_prefetchDistance = config.prefetch_distance();
 
 	OS::writeFileSync(getPath() + "/config", config.SerializeAsString());
 
@@ -59,11 +50,12 @@ void JsView::createView(const Proto::ViewConfig &config) {
 	for(int i = 0; i < 5; i++)
 		p_idleInstances.push(new JsInstance(p_path + "/../../extern/" + p_scriptFile));
 	
-	p_keyFile.setPath(getPath());
-	p_keyFile.createFile();
-
 	p_orderTree.setPath(getPath());
+	p_orderTree.setBlockSize(config.block_size());
+	if(config.order_statistics())
+		p_orderTree.setOrderStatistics(true);
 	p_orderTree.createTree();
+	openOverflow();
 
 	processQueue();
 }
@@ -73,23 +65,27 @@ void JsView::loadView() {
 	config.ParseFromString(OS::readFileSync(getPath() + "/config"));
 
 	if(!config.has_base_storage()
-			|| !config.has_script_file())
+			|| !config.has_script_file()
+			|| !OrderTree::isValidBlockSize(config.block_size())
+			|| config.prefetch_fraction() < 0 || config.prefetch_fraction() > 1)
 		throw std::runtime_error("Illegal configuration for JsView");
 	p_storageName = config.base_storage();
 	p_scriptFile = config.script_file();
+	p_prefetchFraction = config.prefetch_fraction();
+	p_prefetchDistance = config.prefetch_distance();
 
 	p_storage = getEngine()->getStorage(p_storageName);
 	
 	for(int i = 0; i < 5; i++)
 		p_idleInstances.push(new JsInstance(p_path + "/../../extern/" + p_scriptFile));
 
-	p_keyFile.setPath(getPath());
-	//NOTE: to test the durability implementation we always delete the data on load!
-	p_keyFile.createFile();
-
 	p_orderTree.setPath(getPath());
+	p_orderTree.setBlockSize(config.block_size());
+	if(config.order_statistics())
+		p_orderTree.setOrderStatistics(true);
 	//NOTE: to test the durability implementation we always delete the data on load!
 	p_orderTree.createTree();
+	openOverflow();
 
 	processQueue();
 }
@@ -98,30 +94,57 @@ void JsView::reinspect(Mutation &mutation) {
 	// we don't have to do anything here
 }
 
+int JsView::getBaseStorage() {
+	return p_storage;
+}
+
 void JsView::processInsert(SequenceId sequence_id,
 		Mutation &mutation, Async::Callback<void(Error)> callback) {
-	if(mutation.storageIndex != p_storage) {
-		callback(Error(true));
-		return;
-	}
-
 	auto closure = new InsertClosure(this, mutation.documentId,
-			sequence_id, mutation.buffer, callback);
+			sequence_id, mutation.buffer, false, callback);
 	closure->apply();
 }
 
 void JsView::processModify(SequenceId sequence_id,
 		Mutation &mutation, Async::Callback<void(Error)> callback) {
-	if(mutation.storageIndex != p_storage) {
-		callback(Error(true));
-		return;
-	}
-
+	// queries skip entries of superseded versions but ranks and
+	// counts would include them. without order statistics the entry
+	// is kept so that queries on older snapshots can still find it
 	auto closure = new InsertClosure(this, mutation.documentId,
-			sequence_id, mutation.buffer, callback);
+			sequence_id, mutation.buffer,
+			p_orderTree.hasOrderStatistics(), callback);
+	closure->apply();
+}
+
+void JsView::processDelete(SequenceId sequence_id,
+		Mutation &mutation, Async::Callback<void(Error)> callback) {
+	auto closure = new DeleteClosure(this, mutation.documentId,
+			sequence_id, callback);
 	closure->apply();
 }
 
+void JsView::afterSequence(SequenceId sequence_id) {
+	{
+		std::lock_guard<std::mutex> lock(p_batchMutex);
+		p_batchKeys.clear();
+	}
+
+	// removals only merge blocks on their own path; blocks that became
+	// underfull afterwards are merged by a compaction of the whole tree
+	if(p_removedSinceCompact < kCompactRemovals || p_compactRunning.exchange(true))
+		return;
+	p_removedSinceCompact = 0;
+
+	getEngine()->getProcessPool()->submit(ASYNC_MEMBER(this,
+			&JsView::compactOrderTree));
+}
+
+bool JsView::requiresSnapshot(QueryRequest *query) {
+	// ranks are only exact if no batch is applied during the query
+	// and the superseded entries of the snapshot have been removed
+	return p_orderTree.hasOrderStatistics();
+}
+
 void JsView::processQuery(QueryRequest *request,
 		Async::Callback<void(QueryData &)> on_data,
 		Async::Callback<void(QueryError)> on_complete) {
@@ -129,6 +152,11 @@ void JsView::processQuery(QueryRequest *request,
 	closure->process();
 }
 
+void JsView::checkIntegrity(Async::Callback<void(const std::string &)> callback) {
+	auto closure = new CheckClosure(this, callback);
+	closure->check();
+}
+
 void JsView::grabInstance(Async::Callback<void(JsInstance *)> callback) {
 	std::unique_lock<std::mutex> lock(p_mutex);
 
@@ -157,6 +185,78 @@ void JsView::releaseInstance(JsInstance *instance) {
 	}
 }
 
+void JsView::openOverflow() {
+	// the overflow file is rebuilt together with the order tree
+	p_overflowFile = osIntf->createFile();
+	p_overflowFile->openSync(getPath() + "/overflow", Linux::kFileRead
+			| Linux::kFileWrite | Linux::kFileCreate | Linux::kFileTrunc);
+	p_overflowLength = 0;
+}
+
+int JsView::compareLinks(const char *a, const char *b) {
+	DocumentId id_a = OS::unpackLe64((void *)(a + Link::kDocumentId));
+	DocumentId id_b = OS::unpackLe64((void *)(b + Link::kDocumentId));
+	if(id_a != id_b)
+		return id_a < id_b ? -1 : 1;
+	SequenceId seq_a = OS::unpackLe64((void *)(a + Link::kSequenceId));
+	SequenceId seq_b = OS::unpackLe64((void *)(b + Link::kSequenceId));
+	if(seq_a != seq_b)
+		return seq_a < seq_b ? -1 : 1;
+	return 0;
+}
+
+std::string JsView::storeKey(const std::string &key, const char *link) {
+	if(key.size() + Link::kStructSize <= p_orderTree.getMaxKeyLength())
+		return key + std::string(link, Link::kStructSize);
+
+	Linux::off_type offset;
+	{
+		std::lock_guard<std::mutex> lock(p_overflowMutex);
+		offset = p_overflowLength;
+		p_overflowLength += key.size();
+	}
+	p_overflowFile->pwriteSync(offset, key.size(), key.data());
+
+	char ref[OverflowRef::kStructSize];
+	ref[OverflowRef::kTag] = kOverflowTag;
+	OS::packLe64(ref + OverflowRef::kOffset, offset);
+	OS::packLe32(ref + OverflowRef::kLength, key.size());
+	return std::string(ref, OverflowRef::kStructSize)
+			+ std::string(link, Link::kStructSize);
+}
+
+v8::Local<v8::Value> JsView::deserializeStored(JsInstance *instance,
+		const std::string &stored) {
+	assert(stored.size() >= Link::kStructSize);
+	size_t key_length = stored.size() - Link::kStructSize;
+
+	v8::Local<v8::Value> ser;
+	if(key_length == OverflowRef::kStructSize
+			&& stored[OverflowRef::kTag] == kOverflowTag) {
+		// the key is appended before its reference is inserted into the tree
+		Linux::off_type offset = OS::unpackLe64((void *)(stored.data()
+				+ OverflowRef::kOffset));
+		Linux::size_type length = OS::unpackLe32((void *)(stored.data()
+				+ OverflowRef::kLength));
+		std::string key(length, 0);
+		p_overflowFile->preadSync(offset, length, &key[0]);
+		ser = v8::String::NewFromUtf8(v8::Isolate::GetCurrent(),
+				key.data(), v8::NewStringType::kNormal, key.size()).ToLocalChecked();
+	}else{
+		ser = v8::String::NewFromUtf8(v8::Isolate::GetCurrent(),
+				stored.data(), v8::NewStringType::kNormal, key_length).ToLocalChecked();
+	}
+	return instance->deserializeKey(ser);
+}
+
+void JsView::compactOrderTree() {
+	p_compactClosure.compact(ASYNC_MEMBER(this, &JsView::finishCompaction));
+}
+void JsView::finishCompaction() {
+	p_compactions++;
+	p_compactRunning = false;
+}
+
 // --------------------------------------------------------
 // JsView::Factory
 // --------------------------------------------------------
@@ -353,61 +453,74 @@ JsView::JsScope::JsScope(JsInstance &instance)
 // --------------------------------------------------------
 
 JsView::InsertClosure::InsertClosure(JsView *view, DocumentId document_id,
-		SequenceId sequence_id, std::string buffer,
+		SequenceId sequence_id, std::string buffer, bool supersedes,
 		Async::Callback<void(Error)> callback)
 	: p_view(view), p_documentId(document_id),
-		p_sequenceId(sequence_id), p_buffer(buffer), p_callback(callback),
-		p_keyWrite(&view->p_keyFile), p_keyRead(&view->p_keyFile) { }
+		p_sequenceId(sequence_id), p_buffer(buffer),
+		p_supersedes(supersedes), p_callback(callback) { }
 
 void JsView::InsertClosure::apply() {
+	bool in_batch;
+	{
+		std::lock_guard<std::mutex> lock(p_view->p_batchMutex);
+		in_batch = p_view->p_batchKeys.find(p_documentId)
+				!= p_view->p_batchKeys.end();
+	}
+	if(p_supersedes || in_batch) {
+		auto closure = new DeleteClosure(p_view, p_documentId,
+				p_sequenceId, ASYNC_MEMBER(this, &InsertClosure::onRemoved));
+		closure->apply();
+		return;
+	}
+	p_view->grabInstance(ASYNC_MEMBER(this, &InsertClosure::acquireInstance));
+}
+void JsView::InsertClosure::onRemoved(Error error) {
 	p_view->grabInstance(ASYNC_MEMBER(this, &InsertClosure::acquireInstance));
 }
 
 void JsView::InsertClosure::acquireInstance(JsInstance *instance) {
 	p_instance = instance;
 
-	JsScope scope(*p_instance);
-	
-	v8::Local<v8::Value> extracted = p_instance->extractDoc(p_documentId,
-		p_buffer.data(), p_buffer.length());
-	p_newKey = v8::Global<v8::Value>(v8::Isolate::GetCurrent(), p_instance->keyOf(extracted));
+	{
+		JsScope scope(*p_instance);
+		
+		v8::Local<v8::Value> extracted = p_instance->extractDoc(p_documentId,
+			p_buffer.data(), p_buffer.length());
+		p_newKey = v8::Global<v8::Value>(v8::Isolate::GetCurrent(), p_instance->keyOf(extracted));
 
-	v8::Local<v8::Value> ser = p_instance->serializeKey(p_newKey.Get(v8::Isolate::GetCurrent()));
-	v8::String::Utf8Value ser_value(ser);	
-	
-	p_insertKey.offset = p_view->p_keyPointer;
-	p_insertKey.length = ser_value.length();
-	p_view->p_keyPointer += ser_value.length();
-	p_keyWrite.write(p_insertKey.offset, p_insertKey.length, *ser_value,
-			ASYNC_MEMBER(this, &InsertClosure::afterWriteKey));
-}
-void JsView::InsertClosure::afterWriteKey() {
+		v8::Local<v8::Value> ser = p_instance->serializeKey(p_newKey.Get(v8::Isolate::GetCurrent()));
+		v8::String::Utf8Value ser_value(ser);
+		p_insertKey = std::string(*ser_value, ser_value.length());
+	}
 	OS::packLe64(p_linkBuffer + Link::kDocumentId, p_documentId);
 	OS::packLe64(p_linkBuffer + Link::kSequenceId, p_sequenceId);
+	p_insertKey = p_view->storeKey(p_insertKey, p_linkBuffer);
 
 	auto action = p_view->p_orderTree.insert(&p_insertKey, p_linkBuffer,
 		ASYNC_MEMBER(this, &InsertClosure::compareToNew));
 	libchain::run(action, ASYNC_MEMBER(this, &InsertClosure::onComplete));
 }
-void JsView::InsertClosure::compareToNew(const KeyRef &keyref,
+void JsView::InsertClosure::compareToNew(const std::string &key,
 		Async::Callback<void(int)> callback) {
-	p_compareBuffer = new char[keyref.length];
-	p_compareLength = keyref.length;
-	p_compareCallback = callback;
-	p_keyRead.read(keyref.offset, keyref.length, p_compareBuffer,
-			ASYNC_MEMBER(this, &InsertClosure::doCompareToNew));
-}
-void JsView::InsertClosure::doCompareToNew() {
-	JsScope scope(*p_instance);
-	
-	v8::Local<v8::Value> ser_a = v8::String::NewFromUtf8(v8::Isolate::GetCurrent(),
-			p_compareBuffer, v8::NewStringType::kNormal, p_compareLength).ToLocalChecked();
-	delete[] p_compareBuffer;
-	v8::Local<v8::Value> key_a = p_instance->deserializeKey(ser_a);
-	v8::Local<v8::Value> result = p_instance->compare(key_a, p_newKey.Get(v8::Isolate::GetCurrent()));
-	p_compareCallback(result->Int32Value());
+	int result;
+	{
+		JsScope scope(*p_instance);
+		
+		v8::Local<v8::Value> key_a = p_view->deserializeStored(p_instance, key);
+		result = p_instance->compare(key_a,
+				p_newKey.Get(v8::Isolate::GetCurrent()))->Int32Value();
+	}
+	if(result == 0)
+		result = compareLinks(key.data() + key.size() - Link::kStructSize,
+				p_linkBuffer);
+	callback(result);
 }
 void JsView::InsertClosure::onComplete() {
+	{
+		std::lock_guard<std::mutex> lock(p_view->p_batchMutex);
+		p_view->p_batchKeys[p_documentId] = p_insertKey;
+	}
+
 	p_view->releaseInstance(p_instance);
 	p_callback(Error(true));
 	delete this;
@@ -415,6 +528,154 @@ void JsView::InsertClosure::onComplete() {
 
 
 
+// --------------------------------------------------------
+// JsView::DeleteClosure
+// --------------------------------------------------------
+
+JsView::DeleteClosure::DeleteClosure(JsView *view, DocumentId document_id,
+		SequenceId sequence_id, Async::Callback<void(Error)> callback)
+	: p_view(view), p_documentId(document_id), p_sequenceId(sequence_id),
+		p_callback(callback), p_found(false), p_versionId(0),
+		p_btreeFind(&view->p_orderTree),
+		p_btreeIterate(&view->p_orderTree) { }
+
+void JsView::DeleteClosure::apply() {
+	{
+		std::unique_lock<std::mutex> lock(p_view->p_batchMutex);
+		auto iterator = p_view->p_batchKeys.find(p_documentId);
+		if(iterator != p_view->p_batchKeys.end()) {
+			p_storedKey = iterator->second;
+			p_view->p_batchKeys.erase(iterator);
+			lock.unlock();
+
+			p_found = true;
+			p_versionId = p_sequenceId;
+			p_view->grabInstance(ASYNC_MEMBER(this, &DeleteClosure::acquireInstance));
+			return;
+		}
+	}
+
+	// the key of the deleted version is not part of the mutation.
+	// the snapshot stays pinned until the fetch completes
+	if(!p_view->getEngine()->pinSnapshot(p_sequenceId - 1)) {
+		scan();
+		return;
+	}
+	p_fetch.storageIndex = p_view->p_storage;
+	p_fetch.documentId = p_documentId;
+	p_fetch.sequenceId = p_sequenceId - 1;
+	p_view->getEngine()->fetch(&p_fetch,
+			ASYNC_MEMBER(this, &DeleteClosure::onFetchData),
+			ASYNC_MEMBER(this, &DeleteClosure::onFetchComplete));
+}
+void JsView::DeleteClosure::onFetchData(FetchData &data) {
+	p_found = true;
+	p_versionId = data.sequenceId;
+	p_buffer = data.buffer;
+}
+void JsView::DeleteClosure::onFetchComplete(FetchError error) {
+	p_view->getEngine()->unpinSnapshot(p_sequenceId - 1);
+
+	if(error == kFetchSuccess) {
+		// everything is okay
+	}else if(error == kFetchDocumentNotFound) {
+		// the document was never inserted or it is deleted already
+	}else throw std::logic_error("Unexpected error during fetch");
+
+	if(!p_found) {
+		p_callback(Error(true));
+		delete this;
+		return;
+	}
+	p_view->grabInstance(ASYNC_MEMBER(this, &DeleteClosure::acquireInstance));
+}
+void JsView::DeleteClosure::scan() {
+	p_btreeFind.findFirst(ASYNC_MEMBER(this, &DeleteClosure::onScanFirst));
+}
+void JsView::DeleteClosure::onScanFirst(OrderTree::Ref ref) {
+	p_btreeIterate.seek(ref, ASYNC_MEMBER(this, &DeleteClosure::onScanEntry));
+}
+void JsView::DeleteClosure::onScanEntry() {
+	if(!p_btreeIterate.valid()) {
+		onScanComplete();
+		return;
+	}
+
+	// the latest version before the deletion has the largest sequence id
+	char link_buffer[Link::kStructSize];
+	p_btreeIterate.getValue(link_buffer);
+	DocumentId document_id = OS::unpackLe64(link_buffer + Link::kDocumentId);
+	SequenceId version_id = OS::unpackLe64(link_buffer + Link::kSequenceId);
+	if(document_id == p_documentId
+			&& version_id < p_sequenceId
+			&& (!p_found || version_id > p_versionId)) {
+		p_found = true;
+		p_versionId = version_id;
+		p_storedKey = p_btreeIterate.getKey();
+	}
+	p_btreeIterate.forward(ASYNC_MEMBER(this, &DeleteClosure::onScanForward));
+}
+void JsView::DeleteClosure::onScanForward() {
+	LocalTaskQueue::get()->submit(ASYNC_MEMBER(this, &DeleteClosure::onScanEntry));
+}
+void JsView::DeleteClosure::onScanComplete() {
+	if(!p_found) {
+		p_callback(Error(true));
+		delete this;
+		return;
+	}
+	p_view->grabInstance(ASYNC_MEMBER(this, &DeleteClosure::acquireInstance));
+}
+void JsView::DeleteClosure::acquireInstance(JsInstance *instance) {
+	p_instance = instance;
+
+	{
+		JsScope scope(*p_instance);
+		
+		if(p_storedKey.empty()) {
+			v8::Local<v8::Value> extracted = p_instance->extractDoc(p_documentId,
+				p_buffer.data(), p_buffer.length());
+			p_oldKey = v8::Global<v8::Value>(v8::Isolate::GetCurrent(),
+					p_instance->keyOf(extracted));
+		}else{
+			p_oldKey = v8::Global<v8::Value>(v8::Isolate::GetCurrent(),
+					p_view->deserializeStored(p_instance, p_storedKey));
+		}
+	}
+
+	// compareToOld locates the entry; the key itself is never compared
+	OS::packLe64(p_linkBuffer + Link::kDocumentId, p_documentId);
+	OS::packLe64(p_linkBuffer + Link::kSequenceId, p_versionId);
+	p_removeKey = p_storedKey;
+
+	auto action = p_view->p_orderTree.remove(&p_removeKey,
+			ASYNC_MEMBER(this, &DeleteClosure::compareToOld));
+	libchain::run(action, ASYNC_MEMBER(this, &DeleteClosure::onRemove));
+}
+void JsView::DeleteClosure::compareToOld(const std::string &key,
+		Async::Callback<void(int)> callback) {
+	int result;
+	{
+		JsScope scope(*p_instance);
+		
+		v8::Local<v8::Value> key_a = p_view->deserializeStored(p_instance, key);
+		result = p_instance->compare(key_a,
+				p_oldKey.Get(v8::Isolate::GetCurrent()))->Int32Value();
+	}
+	if(result == 0)
+		result = compareLinks(key.data() + key.size() - Link::kStructSize,
+				p_linkBuffer);
+	callback(result);
+}
+void JsView::DeleteClosure::onRemove(bool removed) {
+	// there is nothing left to do if the entry does not exist
+	if(removed)
+		p_view->p_removedSinceCompact++;
+	p_view->releaseInstance(p_instance);
+	p_callback(Error(true));
+	delete this;
+}
+
 // --------------------------------------------------------
 // JsView::QueryClosure
 // --------------------------------------------------------
@@ -423,12 +684,22 @@ JsView::QueryClosure::QueryClosure(JsView *view, QueryRequest *query,
 		Async::Callback<void(QueryData &)> on_data,
 		Async::Callback<void(QueryError)> on_complete)
 	: p_view(view), p_query(query), p_onData(on_data),
-		p_onComplete(on_complete), p_keyRead(&view->p_keyFile),
+		p_onComplete(on_complete),
 		p_btreeFind(&view->p_orderTree),
 		p_btreeIterate(&view->p_orderTree) {
+	p_btreeIterate.setPrefetch(view->p_prefetchFraction, view->p_prefetchDistance);
 }
 
 void JsView::QueryClosure::process() {
+	// skipping and counting entries requires order statistics
+	if((p_query->countOnly || p_query->offset != 0)
+			&& !p_view->p_orderTree.hasOrderStatistics()) {
+		p_view->finishRequest();
+		p_onComplete(kQueryIllegalRequest);
+		delete this;
+		return;
+	}
+
 	p_view->grabInstance(ASYNC_MEMBER(this, &QueryClosure::acquireInstance));
 }
 
@@ -441,36 +712,106 @@ void JsView::QueryClosure::acquireInstance(JsInstance *instance) {
 		p_endKey = v8::Global<v8::Value>(v8::Isolate::GetCurrent(),
 				p_instance->extractKey(p_query->toKey.c_str(), p_query->toKey.size()));
 	
-	Btree<KeyRef>::Ref begin_ref;
-	if(p_query->useFromKey) {
+	if(p_query->useFromKey)
 		p_beginKey = v8::Global<v8::Value>(v8::Isolate::GetCurrent(),
 				p_instance->extractKey(p_query->fromKey.c_str(), p_query->fromKey.size()));
-		p_btreeFind.findNext(ASYNC_MEMBER(this, &QueryClosure::compareToBegin),
-				ASYNC_MEMBER(this, &QueryClosure::onFindBegin));
+
+	if(p_query->countOnly) {
+		if(p_query->useFromKey) {
+			p_btreeFind.rank(ASYNC_MEMBER(this, &QueryClosure::compareBeforeBegin),
+					ASYNC_MEMBER(this, &QueryClosure::onCountBegin));
+		}else{
+			onCountBegin(0);
+		}
+	}else if(p_query->offset != 0) {
+		// determine the rank of the first entry and skip the offset
+		if(p_query->useFromKey) {
+			if(p_query->descending) {
+				p_btreeFind.rank(ASYNC_MEMBER(this, &QueryClosure::compareToBegin),
+						ASYNC_MEMBER(this, &QueryClosure::onOffsetRank));
+			}else{
+				p_btreeFind.rank(ASYNC_MEMBER(this, &QueryClosure::compareBeforeBegin),
+						ASYNC_MEMBER(this, &QueryClosure::onOffsetRank));
+			}
+		}else if(p_query->descending) {
+			p_btreeFind.count(ASYNC_MEMBER(this, &QueryClosure::onOffsetRank));
+		}else{
+			onOffsetRank(0);
+		}
+	}else if(p_query->useFromKey) {
+		if(p_query->descending) {
+			p_btreeFind.findPrev(ASYNC_MEMBER(this, &QueryClosure::compareToBegin),
+					ASYNC_MEMBER(this, &QueryClosure::onFindBegin));
+		}else{
+			p_btreeFind.findNext(ASYNC_MEMBER(this, &QueryClosure::compareToBegin),
+					ASYNC_MEMBER(this, &QueryClosure::onFindBegin));
+		}
+	}else if(p_query->descending) {
+		p_btreeFind.findLast(ASYNC_MEMBER(this, &QueryClosure::onFindBegin));
 	}else{
 		p_btreeFind.findFirst(ASYNC_MEMBER(this, &QueryClosure::onFindBegin));
 	}
 }
-void JsView::QueryClosure::onFindBegin(Btree<KeyRef>::Ref ref) {
+void JsView::QueryClosure::onFindBegin(OrderTree::Ref ref) {
 	p_btreeIterate.seek(ref, ASYNC_MEMBER(this, &QueryClosure::fetchItem));
 }
-void JsView::QueryClosure::compareToBegin(const KeyRef &keyref,
+int JsView::QueryClosure::compareTo(const std::string &key,
+		v8::Global<v8::Value> &bound) {
+	JsScope scope(*p_instance);
+
+	v8::Local<v8::Value> key_a = p_view->deserializeStored(p_instance, key);
+	return p_instance->compare(key_a,
+			bound.Get(v8::Isolate::GetCurrent()))->Int32Value();
+}
+void JsView::QueryClosure::compareToBegin(const std::string &key,
 		Async::Callback<void(int)> callback) {
-	p_compareBuffer = new char[keyref.length];
-	p_compareLength = keyref.length;
-	p_compareCallback = callback;
-	p_keyRead.read(keyref.offset, keyref.length, p_compareBuffer,
-			ASYNC_MEMBER(this, &QueryClosure::doCompareToBegin));
+	callback(compareTo(key, p_beginKey));
 }
-void JsView::QueryClosure::doCompareToBegin() {
-	JsScope scope(*p_instance);
+void JsView::QueryClosure::compareBeforeBegin(const std::string &key,
+		Async::Callback<void(int)> callback) {
+	// entries that are equal to the begin key are not counted
+	callback(compareTo(key, p_beginKey) < 0 ? -1 : 1);
+}
+void JsView::QueryClosure::compareToEnd(const std::string &key,
+		Async::Callback<void(int)> callback) {
+	callback(compareTo(key, p_endKey));
+}
+void JsView::QueryClosure::onCountBegin(uint64_t rank) {
+	p_beginRank = rank;
+
+	if(p_query->useToKey) {
+		p_btreeFind.rank(ASYNC_MEMBER(this, &QueryClosure::compareToEnd),
+				ASYNC_MEMBER(this, &QueryClosure::onCountEnd));
+	}else{
+		p_btreeFind.count(ASYNC_MEMBER(this, &QueryClosure::onCountEnd));
+	}
+}
+void JsView::QueryClosure::onCountEnd(uint64_t rank) {
+	p_query->count = rank > p_beginRank ? rank - p_beginRank : 0;
+	complete();
+}
+void JsView::QueryClosure::onOffsetRank(uint64_t rank) {
+	if(!p_query->descending) {
+		p_btreeFind.seekToRank(rank + p_query->offset,
+				ASYNC_MEMBER(this, &QueryClosure::onFindBegin));
+	}else if(rank > p_query->offset) {
+		// rank is the number of entries up to and including the first one
+		p_btreeFind.seekToRank(rank - 1 - p_query->offset,
+				ASYNC_MEMBER(this, &QueryClosure::onFindBegin));
+	}else{
+		onFindBegin(OrderTree::Ref());
+	}
+}
+void JsView::QueryClosure::compareToCursor(const std::string &key,
+		Async::Callback<void(int)> callback) {
+	int result;
+	{
+		JsScope scope(*p_instance);
 
-	v8::Local<v8::Value> ser_a = v8::String::NewFromUtf8(v8::Isolate::GetCurrent(),
-			p_compareBuffer, v8::NewStringType::kNormal, p_compareLength).ToLocalChecked();
-	delete[] p_compareBuffer;
-	v8::Local<v8::Value> key_a = p_instance->deserializeKey(ser_a);
-	v8::Local<v8::Value> result = p_instance->compare(key_a, p_beginKey.Get(v8::Isolate::GetCurrent()));
-	p_compareCallback(result->Int32Value());
+		result = p_instance->compare(p_view->deserializeStored(p_instance, key),
+				p_view->deserializeStored(p_instance, p_cursorKey))->Int32Value();
+	}
+	callback(result);
 }
 void JsView::QueryClosure::fetchItem() {
 	if(!p_btreeIterate.valid()) {
@@ -487,12 +828,6 @@ void JsView::QueryClosure::fetchItem() {
 	DocumentId id = OS::unpackLe64(link_buffer + Link::kDocumentId);
 	p_expectedSequenceId = OS::unpackLe64(link_buffer + Link::kSequenceId);
 
-	// skip removed documents
-	if(id == 0) {
-		p_btreeIterate.forward(ASYNC_MEMBER(this, &QueryClosure::fetchItemLoop));
-		return;
-	}
-	
 	p_fetch.storageIndex = p_view->p_storage;
 	p_fetch.documentId = id;
 	p_fetch.sequenceId = p_query->sequenceId;
@@ -529,6 +864,8 @@ void JsView::QueryClosure::onFetchData(FetchData &data) {
 void JsView::QueryClosure::onFetchComplete(FetchError error) {
 	if(error == kFetchSuccess) {
 		// everything is okay
+	}else if(error == kFetchDocumentNotFound) {
+		// the document was deleted but its entry was not removed (yet)
 	}else throw std::logic_error("Unexpected error during fetch");
 
 	if(p_queryData.items.size() >= 1000) {
@@ -536,7 +873,16 @@ void JsView::QueryClosure::onFetchComplete(FetchError error) {
 		p_queryData.items.clear();
 	}
 
-	p_btreeIterate.forward(ASYNC_MEMBER(this, &QueryClosure::fetchItemLoop));
+	nextItem();
+}
+void JsView::QueryClosure::nextItem() {
+	if(p_query->descending) {
+		p_cursorKey = p_btreeIterate.getKey();
+		p_btreeIterate.backward(ASYNC_MEMBER(this, &QueryClosure::compareToCursor),
+				ASYNC_MEMBER(this, &QueryClosure::fetchItemLoop));
+	}else{
+		p_btreeIterate.forward(ASYNC_MEMBER(this, &QueryClosure::fetchItemLoop));
+	}
 }
 void JsView::QueryClosure::complete() {
 	if(p_queryData.items.size() > 0)
@@ -548,5 +894,41 @@ void JsView::QueryClosure::complete() {
 	delete this;
 }
 
+// --------------------------------------------------------
+// JsView::CheckClosure
+// --------------------------------------------------------
+
+JsView::CheckClosure::CheckClosure(JsView *view,
+		Async::Callback<void(const std::string &)> callback)
+	: p_view(view), p_callback(callback), p_btreeCheck(&view->p_orderTree) { }
+
+void JsView::CheckClosure::check() {
+	p_view->grabInstance(ASYNC_MEMBER(this, &CheckClosure::acquireInstance));
+}
+void JsView::CheckClosure::acquireInstance(JsInstance *instance) {
+	p_instance = instance;
+
+	// the instance is shared by all threads of the pool; JsScope locks its isolate
+	p_btreeCheck.setCompare(ASYNC_MEMBER(this, &CheckClosure::compareKeys));
+	p_btreeCheck.check(p_view->getEngine()->getProcessPool(),
+			ASYNC_MEMBER(this, &CheckClosure::onComplete));
+}
+int JsView::CheckClosure::compareKeys(const std::string &a, const std::string &b) {
+	JsScope scope(*p_instance);
+
+	int result = p_instance->compare(p_view->deserializeStored(p_instance, a),
+			p_view->deserializeStored(p_instance, b))->Int32Value();
+	if(result == 0)
+		result = compareLinks(a.data() + a.size() - Link::kStructSize,
+				b.data() + b.size() - Link::kStructSize);
+	return result;
+}
+void JsView::CheckClosure::onComplete() {
+	p_view->releaseInstance(p_instance);
+	p_callback("compactions: " + std::to_string(p_view->p_compactions) + "\n"
+			+ "order tree\n" + p_btreeCheck.getReport().format());
+	delete this;
+}
+
 }; // namespace Db
 
@@ -0,0 +1,838 @@
+#include <cstdint>
+#include <string>
+#include <algorithm>
+
+#include "async.hpp"
+#include "os/linux.hpp"
+#include "ll/tasks.hpp"
+
+#include "db/types.hpp"
+#include "db/storage-driver.hpp"
+#include "db/view-driver.hpp"
+#include "db/engine.hpp"
+
+#include "db/lsm-storage.hpp"
+
+namespace Db {
+
+LsmStorage::LsmStorage(Engine *engine)
+		: QueuedStorageDriver(engine), p_lastDocumentId(0),
+			p_blockSize(4096), p_memtableLimit(0), p_segmentSize(0),
+			p_levelRatio(0), p_level0Segments(0), p_filterBitsPerKey(0),
+			p_retainSequences(0), p_retainVersions(1),
+			p_memtable(std::make_shared<Memtable>()),
+			p_tree(std::make_shared<Tree>()),
+			p_flushRunning(false), p_compactRunning(false) {
+}
+
+void LsmStorage::createStorage(const Proto::StorageConfig &config) {
+	configure(config);
+
+	OS::writeFileSync(getPath() + "/config", config.SerializeAsString());
+
+	processQueue();
+}
+
+void LsmStorage::loadStorage() {
+	Proto::StorageConfig config;
+	config.ParseFromString(OS::readFileSync(getPath() + "/config"));
+	configure(config);
+
+	//NOTE: to test the durability implementation we always delete the data on load!
+	// segment files are truncated when they are allocated
+
+	processQueue();
+}
+
+void LsmStorage::configure(const Proto::StorageConfig &config) {
+	uint32_t block_size = config.block_size();
+	if(block_size < 1024 || block_size > 65536
+			|| (block_size & (block_size - 1)) != 0
+			|| config.retain_versions() < 1
+			|| config.memtable_limit() == 0
+			|| config.segment_size() < block_size
+			|| config.level_ratio() < 2
+			|| config.level0_segments() < 1)
+		throw std::runtime_error("Illegal configuration for LsmStorage");
+
+	p_blockSize = block_size;
+	p_memtableLimit = config.memtable_limit();
+	p_segmentSize = config.segment_size();
+	p_levelRatio = config.level_ratio();
+	p_level0Segments = config.level0_segments();
+	p_filterBitsPerKey = config.filter_bits_per_key();
+	p_retainSequences = config.retain_sequences();
+	p_retainVersions = config.retain_versions();
+}
+
+DocumentId LsmStorage::allocate() {
+	return ++p_lastDocumentId;
+}
+
+void LsmStorage::reinspect(Mutation &mutation) {
+	if(mutation.type == Mutation::kTypeInsert) {
+		if(p_lastDocumentId < mutation.documentId)
+			p_lastDocumentId = mutation.documentId;
+	}
+}
+
+void LsmStorage::processInsert(SequenceId sequence_id,
+		Mutation &mutation, Async::Callback<void(Error)> callback) {
+	insertVersion(mutation.documentId, sequence_id, false, mutation.buffer);
+	callback(Error(true));
+}
+void LsmStorage::processModify(SequenceId sequence_id,
+		Mutation &mutation, Async::Callback<void(Error)> callback) {
+	insertVersion(mutation.documentId, sequence_id, false, mutation.buffer);
+	callback(Error(true));
+}
+void LsmStorage::processDelete(SequenceId sequence_id,
+		Mutation &mutation, Async::Callback<void(Error)> callback) {
+	insertVersion(mutation.documentId, sequence_id, true, std::string());
+	callback(Error(true));
+}
+
+void LsmStorage::insertVersion(DocumentId document_id, SequenceId sequence_id,
+		bool deleted, const std::string &buffer) {
+	std::lock_guard<std::mutex> lock(p_memtableMutex);
+	Version &version = p_memtable->entries[Key{ document_id, sequence_id }];
+	version.deleted = deleted;
+	version.buffer = buffer;
+	p_memtable->size += buffer.size() + kEntryOverhead;
+}
+
+void LsmStorage::afterSequence(SequenceId sequence_id) {
+	// no mutation of the batch is in flight anymore
+	if(p_memtable->size < p_memtableLimit)
+		return;
+
+	std::lock_guard<std::mutex> tree_lock(p_treeMutex);
+	auto tree = std::make_shared<Tree>(*std::atomic_load(&p_tree));
+
+	std::unique_lock<std::mutex> lock(p_memtableMutex);
+	tree->frozen.insert(tree->frozen.begin(), p_memtable);
+	std::atomic_store(&p_tree, tree);
+	p_memtable = std::make_shared<Memtable>();
+	lock.unlock();
+
+	if(!p_flushRunning)
+		startFlush();
+}
+
+void LsmStorage::startFlush() {
+	auto tree = std::atomic_load(&p_tree);
+	if(tree->frozen.empty())
+		return;
+
+	bool bottom = true;
+	for(auto &level : tree->levels)
+		if(!level.empty())
+			bottom = false;
+
+	// memtables are flushed from oldest to newest
+	p_flushRunning = true;
+	auto closure = new CompactClosure(this, tree->frozen.back(),
+			std::vector<std::shared_ptr<Segment>>(), 0, bottom);
+	getEngine()->getProcessPool()->submit(ASYNC_MEMBER(closure, &CompactClosure::run));
+}
+
+void LsmStorage::maybeCompact() {
+	if(p_compactRunning)
+		return;
+
+	auto tree = std::atomic_load(&p_tree);
+	auto &levels = tree->levels;
+	if(p_compactCursor.size() < levels.size())
+		p_compactCursor.resize(levels.size(), 0);
+
+	std::vector<std::shared_ptr<Segment>> inputs;
+	size_t output_level;
+	if(!levels.empty() && levels[0].size() >= p_level0Segments) {
+		// level 0 segments overlap; all of them are merged at once
+		inputs = levels[0];
+		output_level = 1;
+	}else{
+		size_t level = 1;
+		for(; level < levels.size(); level++) {
+			int64_t size = 0;
+			for(auto &segment : levels[level])
+				size += segment->size;
+			if(size > levelLimit(level))
+				break;
+		}
+		if(level >= levels.size())
+			return;
+
+		// the segments of a level are compacted in a round-robin fashion
+		auto &segments = levels[level];
+		size_t index = 0;
+		while(index < segments.size()
+				&& segments[index]->minDocument <= p_compactCursor[level])
+			index++;
+		if(index == segments.size())
+			index = 0;
+		p_compactCursor[level] = segments[index]->maxDocument;
+		inputs.push_back(segments[index]);
+		output_level = level + 1;
+	}
+
+	DocumentId min_document = inputs.front()->minDocument;
+	DocumentId max_document = inputs.front()->maxDocument;
+	for(auto &segment : inputs) {
+		min_document = std::min(min_document, segment->minDocument);
+		max_document = std::max(max_document, segment->maxDocument);
+	}
+	if(output_level < levels.size()) {
+		for(auto &segment : levels[output_level])
+			if(segment->maxDocument >= min_document
+					&& segment->minDocument <= max_document)
+				inputs.push_back(segment);
+	}
+
+	bool bottom = true;
+	for(size_t level = output_level + 1; level < levels.size(); level++)
+		if(!levels[level].empty())
+			bottom = false;
+
+	p_compactRunning = true;
+	auto closure = new CompactClosure(this, nullptr, inputs, output_level, bottom);
+	getEngine()->getProcessPool()->submit(ASYNC_MEMBER(closure, &CompactClosure::run));
+}
+
+int64_t LsmStorage::levelLimit(int level) {
+	int64_t limit = int64_t(p_segmentSize) * p_level0Segments;
+	for(int i = 0; i < level; i++)
+		limit *= p_levelRatio;
+	return limit;
+}
+
+Ll::RandomAccessFile *LsmStorage::allocateFile() {
+	std::lock_guard<std::mutex> lock(p_fileMutex);
+	if(!p_freeFiles.empty()) {
+		Ll::RandomAccessFile *file = p_freeFiles.back();
+		p_freeFiles.pop_back();
+		return file;
+	}
+
+	// page caches cannot be destroyed while the cache host knows their pages.
+	// files are reused instead
+	auto file = new Ll::RandomAccessFile("segment-" + std::to_string(p_files.size()),
+			getEngine()->getCacheHost(), getEngine()->getIoPool());
+	file->setPath(getPath());
+	file->setPageSize(p_blockSize);
+	file->createFile();
+	p_files.emplace_back(file);
+	return file;
+}
+std::shared_ptr<LsmStorage::Segment> LsmStorage::manageSegment(Segment *segment) {
+	return std::shared_ptr<Segment>(segment, [this] (Segment *segment) {
+		freeSegment(segment);
+	});
+}
+void LsmStorage::freeSegment(Segment *segment) {
+	// no reader holds a page of the file anymore
+	segment->file->truncate();
+
+	std::unique_lock<std::mutex> lock(p_fileMutex);
+	p_freeFiles.push_back(segment->file);
+	lock.unlock();
+
+	delete segment;
+}
+
+void LsmStorage::appendRecord(SegmentImage &image,
+		const Key &key, const Version &version) {
+	size_t record_size = Record::kHeaderSize + version.buffer.size();
+	int64_t block_used = image.data.size() - image.blockStart;
+	if(image.fences.empty()
+			|| (block_used > 0 && block_used + record_size > p_blockSize)) {
+		image.blockStart = image.data.size();
+		image.fences.push_back(Fence{ key, image.blockStart });
+	}
+	if(image.documents.empty() || image.documents.back() != key.documentId)
+		image.documents.push_back(key.documentId);
+
+	char header[Record::kHeaderSize];
+	OS::packLe64(header + Record::kDocumentId, key.documentId);
+	OS::packLe64(header + Record::kSequenceId, key.sequenceId);
+	OS::packLe32(header + Record::kFlags, version.deleted ? Record::kFlagDeleted : 0);
+	OS::packLe32(header + Record::kLength, version.buffer.size());
+	image.data.append(header, Record::kHeaderSize);
+	image.data.append(version.buffer);
+}
+
+void LsmStorage::decodeRecords(const char *data, size_t length,
+		std::vector<Entry> &entries) {
+	size_t offset = 0;
+	while(offset < length) {
+		assert(offset + Record::kHeaderSize <= length);
+		char *header = const_cast<char *>(data + offset);
+		uint32_t record_length = OS::unpackLe32(header + Record::kLength);
+
+		Entry entry;
+		entry.first.documentId = OS::unpackLe64(header + Record::kDocumentId);
+		entry.first.sequenceId = OS::unpackLe64(header + Record::kSequenceId);
+		entry.second.deleted = OS::unpackLe32(header + Record::kFlags)
+				& Record::kFlagDeleted;
+		entry.second.buffer.assign(data + offset + Record::kHeaderSize, record_length);
+		entries.push_back(std::move(entry));
+
+		offset += Record::kHeaderSize + record_length;
+	}
+}
+
+bool LsmStorage::findInMemtable(Memtable &memtable, DocumentId document_id,
+		SequenceId sequence_id, Key &key, Version &version) {
+	auto iterator = memtable.entries.upper_bound(Key{ document_id, sequence_id });
+	if(iterator == memtable.entries.begin())
+		return false;
+	--iterator;
+	if(iterator->first.documentId != document_id)
+		return false;
+	key = iterator->first;
+	version = iterator->second;
+	return true;
+}
+
+bool LsmStorage::findInBlock(const char *data, size_t length,
+		DocumentId document_id, SequenceId sequence_id,
+		Key &key, Version &version) {
+	// offset of the newest matching record
+	size_t found = length;
+	size_t offset = 0;
+	while(offset < length) {
+		assert(offset + Record::kHeaderSize <= length);
+		char *header = const_cast<char *>(data + offset);
+		DocumentId record_document_id = OS::unpackLe64(header + Record::kDocumentId);
+		SequenceId record_sequence_id = OS::unpackLe64(header + Record::kSequenceId);
+		if(record_document_id == document_id && record_sequence_id <= sequence_id)
+			found = offset;
+		offset += Record::kHeaderSize + OS::unpackLe32(header + Record::kLength);
+	}
+	if(found == length)
+		return false;
+
+	char *header = const_cast<char *>(data + found);
+	key.documentId = document_id;
+	key.sequenceId = OS::unpackLe64(header + Record::kSequenceId);
+	version.deleted = OS::unpackLe32(header + Record::kFlags) & Record::kFlagDeleted;
+	version.buffer.assign(data + found + Record::kHeaderSize,
+			OS::unpackLe32(header + Record::kLength));
+	return true;
+}
+
+std::shared_ptr<LsmStorage::Tree> LsmStorage::snapshot(DocumentId document_id,
+		SequenceId sequence_id, bool &found, Key &key, Version &version) {
+	std::unique_lock<std::mutex> lock(p_memtableMutex);
+	found = findInMemtable(*p_memtable, document_id, sequence_id, key, version);
+	auto tree = std::atomic_load(&p_tree);
+	lock.unlock();
+
+	// frozen memtables are not modified anymore
+	for(auto &memtable : tree->frozen) {
+		if(found)
+			break;
+		found = findInMemtable(*memtable, document_id, sequence_id, key, version);
+	}
+	return tree;
+}
+
+void LsmStorage::collectSegments(Tree &tree, DocumentId document_id,
+		std::vector<Segment *> &segments) {
+	auto contains = [&] (Segment *segment) {
+		if(document_id < segment->minDocument || document_id > segment->maxDocument)
+			return false;
+		return !segment->filter || segment->filter->mayContain(document_id);
+	};
+
+	for(size_t level = 0; level < tree.levels.size(); level++) {
+		auto &level_segments = tree.levels[level];
+		if(level == 0) {
+			for(auto &segment : level_segments)
+				if(contains(segment.get()))
+					segments.push_back(segment.get());
+			continue;
+		}
+
+		// at most one segment of the other levels contains the document
+		auto iterator = std::upper_bound(level_segments.begin(), level_segments.end(),
+				document_id, [] (DocumentId id, const std::shared_ptr<Segment> &segment) {
+			return id < segment->minDocument;
+		});
+		if(iterator == level_segments.begin())
+			continue;
+		--iterator;
+		if(contains(iterator->get()))
+			segments.push_back(iterator->get());
+	}
+}
+
+void LsmStorage::locateBlocks(Segment *segment, const Key &first,
+		const Key &last, int64_t &offset, int64_t &length) {
+	auto &fences = segment->fences;
+	auto compare = [] (const Key &key, const Fence &fence) {
+		return key < fence.key;
+	};
+
+	// the block that contains the first key and the block after the last key
+	auto begin = std::upper_bound(fences.begin(), fences.end(), first, compare);
+	auto end = std::upper_bound(fences.begin(), fences.end(), last, compare);
+	if(end == fences.begin()) {
+		offset = 0;
+		length = 0;
+		return;
+	}
+	if(begin != fences.begin())
+		--begin;
+
+	offset = begin->offset;
+	length = (end == fences.end() ? segment->size : end->offset) - offset;
+}
+
+void LsmStorage::processFetch(FetchRequest *fetch,
+		Async::Callback<void(FetchData &)> on_data,
+		Async::Callback<void(FetchError)> callback) {
+	auto closure = new FetchClosure(this, fetch, on_data, callback);
+	closure->process();
+}
+
+void LsmStorage::processMultiFetch(MultiFetchRequest *fetch,
+		Async::Callback<void(std::vector<FetchData> &)> on_data,
+		Async::Callback<void(FetchError)> callback) {
+	auto closure = new MultiFetchClosure(this, fetch, on_data, callback);
+	closure->process();
+}
+
+void LsmStorage::processHistory(HistoryRequest *request,
+		Async::Callback<void(std::vector<VersionData> &)> on_data,
+		Async::Callback<void(FetchError)> callback) {
+	auto closure = new HistoryClosure(this, request, on_data, callback);
+	closure->process();
+}
+
+LsmStorage::Factory::Factory()
+		: StorageDriver::Factory("LsmStorage") {
+}
+
+StorageDriver *LsmStorage::Factory::newDriver(Engine *engine) {
+	return new LsmStorage(engine);
+}
+
+// --------------------------------------------------------
+// LookupClosure
+// --------------------------------------------------------
+
+LsmStorage::LookupClosure::LookupClosure(LsmStorage *storage)
+	: p_storage(storage), p_dataRead(nullptr) { }
+
+void LsmStorage::LookupClosure::lookup(DocumentId document_id,
+		SequenceId sequence_id, Async::Callback<void(bool)> callback) {
+	p_documentId = document_id;
+	p_sequenceId = sequence_id;
+	p_callback = callback;
+
+	bool found;
+	p_tree = p_storage->snapshot(document_id, sequence_id, found, p_key, p_version);
+	if(found) {
+		p_tree.reset();
+		p_callback(true);
+		return;
+	}
+
+	p_segments.clear();
+	p_storage->collectSegments(*p_tree, document_id, p_segments);
+	p_index = 0;
+	readBlock();
+}
+
+LsmStorage::Key &LsmStorage::LookupClosure::getKey() {
+	return p_key;
+}
+LsmStorage::Version &LsmStorage::LookupClosure::getVersion() {
+	return p_version;
+}
+
+void LsmStorage::LookupClosure::readBlock() {
+	Key key{ p_documentId, p_sequenceId };
+	int64_t offset, length = 0;
+	while(p_index < p_segments.size()) {
+		locateBlocks(p_segments[p_index], key, key, offset, length);
+		if(length != 0)
+			break;
+		p_index++;
+	}
+	if(p_index == p_segments.size()) {
+		p_tree.reset();
+		p_callback(false);
+		return;
+	}
+
+	p_buffer.resize(length);
+	p_dataRead = Ll::RandomAccessFile::ReadClosure(p_segments[p_index]->file);
+	p_dataRead.read(offset, length, &p_buffer[0],
+			ASYNC_MEMBER(this, &LookupClosure::onBlockRead));
+}
+void LsmStorage::LookupClosure::onBlockRead() {
+	// the newest segment that contains a version determines the result
+	if(findInBlock(p_buffer.data(), p_buffer.size(), p_documentId, p_sequenceId,
+			p_key, p_version)) {
+		p_tree.reset();
+		p_callback(true);
+		return;
+	}
+
+	p_index++;
+	LocalTaskQueue::get()->submit(ASYNC_MEMBER(this, &LookupClosure::readBlock));
+}
+
+// --------------------------------------------------------
+// FetchClosure
+// --------------------------------------------------------
+
+LsmStorage::FetchClosure::FetchClosure(LsmStorage *storage, FetchRequest *fetch,
+		Async::Callback<void(FetchData &)> on_data,
+		Async::Callback<void(FetchError)> callback)
+	: p_storage(storage), p_fetch(fetch), p_onData(on_data),
+		p_callback(callback), p_lookup(storage) { }
+
+void LsmStorage::FetchClosure::process() {
+	p_lookup.lookup(p_fetch->documentId, p_fetch->sequenceId,
+			ASYNC_MEMBER(this, &FetchClosure::onLookup));
+}
+void LsmStorage::FetchClosure::onLookup(bool found) {
+	if(found && !p_lookup.getVersion().deleted) {
+		FetchData data;
+		data.documentId = p_fetch->documentId;
+		data.sequenceId = p_lookup.getKey().sequenceId;
+		data.buffer.swap(p_lookup.getVersion().buffer);
+		p_onData(data);
+		p_callback(kFetchSuccess);
+	}else{
+		p_callback(kFetchDocumentNotFound);
+	}
+	p_storage->finishRequest();
+	delete this;
+}
+
+// --------------------------------------------------------
+// MultiFetchClosure
+// --------------------------------------------------------
+
+LsmStorage::MultiFetchClosure::MultiFetchClosure(LsmStorage *storage,
+		MultiFetchRequest *fetch,
+		Async::Callback<void(std::vector<FetchData> &)> on_data,
+		Async::Callback<void(FetchError)> callback)
+	: p_storage(storage), p_sequenceId(fetch->sequenceId),
+		p_onData(on_data), p_callback(callback),
+		p_documentIds(fetch->documentIds), p_current(0),
+		p_lookup(storage) { }
+
+void LsmStorage::MultiFetchClosure::process() {
+	std::sort(p_documentIds.begin(), p_documentIds.end());
+	p_documentIds.erase(std::unique(p_documentIds.begin(), p_documentIds.end()),
+			p_documentIds.end());
+	nextDocument();
+}
+
+void LsmStorage::MultiFetchClosure::nextDocument() {
+	if(p_current == p_documentIds.size()) {
+		complete();
+		return;
+	}
+	p_lookup.lookup(p_documentIds[p_current], p_sequenceId,
+			ASYNC_MEMBER(this, &MultiFetchClosure::onLookup));
+}
+void LsmStorage::MultiFetchClosure::onLookup(bool found) {
+	if(found && !p_lookup.getVersion().deleted) {
+		FetchData data;
+		data.documentId = p_documentIds[p_current];
+		data.sequenceId = p_lookup.getKey().sequenceId;
+		data.buffer.swap(p_lookup.getVersion().buffer);
+		p_batch.push_back(std::move(data));
+
+		if(p_batch.size() >= kReportBatch) {
+			p_onData(p_batch);
+			p_batch.clear();
+		}
+	}
+
+	p_current++;
+	LocalTaskQueue::get()->submit(ASYNC_MEMBER(this, &MultiFetchClosure::nextDocument));
+}
+
+void LsmStorage::MultiFetchClosure::complete() {
+	if(!p_batch.empty())
+		p_onData(p_batch);
+
+	p_callback(kFetchSuccess);
+	p_storage->finishRequest();
+	delete this;
+}
+
+// --------------------------------------------------------
+// HistoryClosure
+// --------------------------------------------------------
+
+LsmStorage::HistoryClosure::HistoryClosure(LsmStorage *storage,
+		HistoryRequest *request,
+		Async::Callback<void(std::vector<VersionData> &)> on_data,
+		Async::Callback<void(FetchError)> callback)
+	: p_storage(storage), p_request(request), p_onData(on_data),
+		p_callback(callback), p_index(0), p_dataRead(nullptr) { }
+
+void LsmStorage::HistoryClosure::process() {
+	Key first{ p_request->documentId, p_request->fromSequenceId };
+	Key last{ p_request->documentId, p_request->toSequenceId };
+	auto collect_memtable = [&] (Memtable &memtable) {
+		auto end = memtable.entries.upper_bound(last);
+		for(auto it = memtable.entries.lower_bound(first); it != end; ++it)
+			collect(it->first, it->second);
+	};
+
+	std::unique_lock<std::mutex> lock(p_storage->p_memtableMutex);
+	collect_memtable(*p_storage->p_memtable);
+	p_tree = std::atomic_load(&p_storage->p_tree);
+	lock.unlock();
+
+	for(auto &memtable : p_tree->frozen)
+		collect_memtable(*memtable);
+
+	p_storage->collectSegments(*p_tree, p_request->documentId, p_segments);
+	readBlocks();
+}
+
+void LsmStorage::HistoryClosure::collect(const Key &key, const Version &version) {
+	VersionData data;
+	data.sequenceId = key.sequenceId;
+	data.deleted = version.deleted;
+	data.buffer = version.buffer;
+	p_versions.push_back(std::move(data));
+}
+
+void LsmStorage::HistoryClosure::readBlocks() {
+	Key first{ p_request->documentId, p_request->fromSequenceId };
+	Key last{ p_request->documentId, p_request->toSequenceId };
+	int64_t offset, length = 0;
+	while(p_index < p_segments.size()) {
+		locateBlocks(p_segments[p_index], first, last, offset, length);
+		if(length != 0)
+			break;
+		p_index++;
+	}
+	if(p_index == p_segments.size()) {
+		complete();
+		return;
+	}
+
+	p_buffer.resize(length);
+	p_dataRead = Ll::RandomAccessFile::ReadClosure(p_segments[p_index]->file);
+	p_dataRead.read(offset, length, &p_buffer[0],
+			ASYNC_MEMBER(this, &HistoryClosure::onBlocksRead));
+}
+void LsmStorage::HistoryClosure::onBlocksRead() {
+	std::vector<Entry> entries;
+	decodeRecords(p_buffer.data(), p_buffer.size(), entries);
+	for(auto &entry : entries) {
+		if(entry.first.documentId != p_request->documentId
+				|| entry.first.sequenceId < p_request->fromSequenceId
+				|| entry.first.sequenceId > p_request->toSequenceId)
+			continue;
+		collect(entry.first, entry.second);
+	}
+
+	p_index++;
+	LocalTaskQueue::get()->submit(ASYNC_MEMBER(this, &HistoryClosure::readBlocks));
+}
+
+void LsmStorage::HistoryClosure::complete() {
+	p_tree.reset();
+
+	// each version is stored in exactly one source
+	std::sort(p_versions.begin(), p_versions.end(),
+			[] (const VersionData &a, const VersionData &b) {
+		return a.sequenceId < b.sequenceId;
+	});
+
+	std::vector<VersionData> batch;
+	for(auto &version : p_versions) {
+		batch.push_back(std::move(version));
+		if(batch.size() >= kReportBatch) {
+			p_onData(batch);
+			batch.clear();
+		}
+	}
+	if(!batch.empty())
+		p_onData(batch);
+
+	p_callback(kFetchSuccess);
+	p_storage->finishRequest();
+	delete this;
+}
+
+// --------------------------------------------------------
+// CompactClosure
+// --------------------------------------------------------
+
+LsmStorage::CompactClosure::CompactClosure(LsmStorage *storage,
+		std::shared_ptr<Memtable> memtable,
+		std::vector<std::shared_ptr<Segment>> inputs,
+		int output_level, bool bottom)
+	: p_storage(storage), p_memtable(memtable), p_inputs(inputs),
+		p_outputLevel(output_level), p_bottom(bottom), p_index(0),
+		p_dataRead(nullptr), p_dataWrite(nullptr) { }
+
+void LsmStorage::CompactClosure::run() {
+	readNext();
+}
+
+void LsmStorage::CompactClosure::readNext() {
+	if(p_index == p_inputs.size()) {
+		merge();
+		return;
+	}
+
+	Segment *segment = p_inputs[p_index].get();
+	p_buffer.resize(segment->size);
+	p_dataRead = Ll::RandomAccessFile::ReadClosure(segment->file);
+	p_dataRead.read(0, segment->size, &p_buffer[0],
+			ASYNC_MEMBER(this, &CompactClosure::onRead));
+}
+void LsmStorage::CompactClosure::onRead() {
+	decodeRecords(p_buffer.data(), p_buffer.size(), p_entries);
+	std::string().swap(p_buffer);
+
+	p_index++;
+	LocalTaskQueue::get()->submit(ASYNC_MEMBER(this, &CompactClosure::readNext));
+}
+
+void LsmStorage::CompactClosure::merge() {
+	if(p_memtable)
+		p_entries.insert(p_entries.end(), p_memtable->entries.begin(),
+				p_memtable->entries.end());
+	std::sort(p_entries.begin(), p_entries.end(),
+			[] (const Entry &a, const Entry &b) {
+		return a.first < b.first;
+	});
+
+	SequenceId horizon = p_storage->getEngine()->advanceHorizon(
+			p_storage->p_retainSequences);
+
+	p_images.emplace_back();
+	size_t begin = 0;
+	while(begin < p_entries.size()) {
+		// versions of a document in ascending order
+		size_t end = begin + 1;
+		while(end < p_entries.size()
+				&& p_entries[end].first.documentId == p_entries[begin].first.documentId)
+			end++;
+		Entry &newest = p_entries[end - 1];
+
+		// deleted documents disappear once no older segment can contain them
+		if(p_bottom && newest.second.deleted && newest.first.sequenceId <= horizon) {
+			begin = end;
+			continue;
+		}
+
+		// the newest version up to the horizon hides all older versions
+		size_t first = begin;
+		for(size_t i = begin; i < end; i++)
+			if(p_entries[i].first.sequenceId <= horizon)
+				first = i;
+		if(!newest.second.deleted && end - first < p_storage->p_retainVersions)
+			first = end - std::min(end - begin, size_t(p_storage->p_retainVersions));
+
+		// segments are split between documents
+		if(p_images.back().data.size() >= p_storage->p_segmentSize)
+			p_images.emplace_back();
+		for(size_t i = first; i < end; i++)
+			p_storage->appendRecord(p_images.back(), p_entries[i].first,
+					p_entries[i].second);
+		begin = end;
+	}
+	if(p_images.back().data.empty())
+		p_images.pop_back();
+	std::vector<Entry>().swap(p_entries);
+
+	p_index = 0;
+	writeNext();
+}
+
+void LsmStorage::CompactClosure::writeNext() {
+	if(p_index == p_images.size()) {
+		install();
+		return;
+	}
+
+	SegmentImage &image = p_images[p_index];
+	Segment *segment = new Segment;
+	segment->file = p_storage->allocateFile();
+	segment->size = image.data.size();
+	segment->minDocument = image.documents.front();
+	segment->maxDocument = image.documents.back();
+	segment->fences.swap(image.fences);
+	if(p_storage->p_filterBitsPerKey != 0) {
+		segment->filter.reset(new Ll::BloomFilter(image.documents.size(),
+				p_storage->p_filterBitsPerKey));
+		for(DocumentId document_id : image.documents)
+			segment->filter->insert(document_id);
+	}
+	p_outputs.push_back(p_storage->manageSegment(segment));
+
+	// segments are written sequentially in one piece
+	p_dataWrite = Ll::RandomAccessFile::WriteClosure(segment->file);
+	p_dataWrite.write(0, image.data.size(), image.data.data(),
+			ASYNC_MEMBER(this, &CompactClosure::onWrite));
+}
+void LsmStorage::CompactClosure::onWrite() {
+	std::string().swap(p_images[p_index].data);
+
+	p_index++;
+	LocalTaskQueue::get()->submit(ASYNC_MEMBER(this, &CompactClosure::writeNext));
+}
+
+void LsmStorage::CompactClosure::install() {
+	std::unique_lock<std::mutex> lock(p_storage->p_treeMutex);
+	auto tree = std::make_shared<Tree>(*std::atomic_load(&p_storage->p_tree));
+
+	if(p_memtable) {
+		auto &frozen = tree->frozen;
+		frozen.erase(std::find(frozen.begin(), frozen.end(), p_memtable));
+	}
+	for(auto &level : tree->levels) {
+		level.erase(std::remove_if(level.begin(), level.end(),
+				[&] (const std::shared_ptr<Segment> &segment) {
+			return std::find(p_inputs.begin(), p_inputs.end(), segment)
+					!= p_inputs.end();
+		}), level.end());
+	}
+
+	if(tree->levels.size() <= size_t(p_outputLevel))
+		tree->levels.resize(p_outputLevel + 1);
+	auto &output = tree->levels[p_outputLevel];
+	if(p_outputLevel == 0) {
+		// the flushed memtable is newer than all other level 0 segments
+		output.insert(output.begin(), p_outputs.begin(), p_outputs.end());
+	}else{
+		output.insert(output.end(), p_outputs.begin(), p_outputs.end());
+		std::sort(output.begin(), output.end(),
+				[] (const std::shared_ptr<Segment> &a, const std::shared_ptr<Segment> &b) {
+			return a->minDocument < b->minDocument;
+		});
+	}
+	std::atomic_store(&p_storage->p_tree, tree);
+
+	if(p_memtable) {
+		p_storage->p_flushRunning = false;
+		p_storage->startFlush();
+	}else{
+		p_storage->p_compactRunning = false;
+	}
+	p_storage->maybeCompact();
+	lock.unlock();
+
+	// the input segments are recycled once running requests release them
+	delete this;
+}
+
+}; // namespace Db
+
@@ -0,0 +1,253 @@
+#include <map>
+#include <algorithm>
+
+#include "async.hpp"
+#include "os/linux.hpp"
+#include "ll/tasks.hpp"
+
+#include "db/types.hpp"
+#include "db/sequence-queue.hpp"
+
+namespace Db {
+
+SequenceQueue::SequenceQueue(MutationProcessor *processor)
+		: p_processor(processor), p_currentSequenceId(0),
+		p_advancedSequenceId(0), p_lastBatchSequenceId(0),
+		p_sequencing(false), p_holds(0) {
+	p_eventFd = osIntf->createEventFd();
+}
+
+void SequenceQueue::process() {
+	auto closure = new ProcessClosure(this);
+	closure->process();
+}
+
+void SequenceQueue::sequence(SequenceId sequence_id,
+		std::vector<Mutation> &mutations,
+		Async::Callback<void()> callback) {
+	std::unique_lock<std::mutex> lock(p_mutex);
+
+	SequenceQueueItem item;
+	item.sequenceId = sequence_id;
+	item.mutations = &mutations;
+	item.callback = callback;
+	item.advancedBefore = p_advancedSequenceId;
+	p_sequenceQueue.push(item);
+
+	lock.unlock();
+	p_eventFd->increment();
+}
+
+void SequenceQueue::advance(SequenceId sequence_id) {
+	std::unique_lock<std::mutex> lock(p_mutex);
+
+	// queued batches must be applied before the watermark passes them
+	if(p_advancedSequenceId < sequence_id)
+		p_advancedSequenceId = sequence_id;
+	if(!p_sequenceQueue.empty() || p_sequencing)
+		return;
+	applied(lock, sequence_id);
+}
+
+bool SequenceQueue::isApplied(SequenceId sequence_id) {
+	std::lock_guard<std::mutex> lock(p_mutex);
+
+	return sequence_id <= p_currentSequenceId;
+}
+
+void SequenceQueue::waitFor(SequenceId sequence_id,
+		Async::Callback<void()> callback) {
+	std::unique_lock<std::mutex> lock(p_mutex);
+
+	if(sequence_id > p_currentSequenceId) {
+		p_waiters.insert(std::make_pair(sequence_id, Waiter{ callback, nullptr }));
+		return;
+	}
+	lock.unlock();
+	callback();
+}
+
+void SequenceQueue::holdSnapshot(SequenceId sequence_id, bool *held,
+		Async::Callback<void()> callback) {
+	std::unique_lock<std::mutex> lock(p_mutex);
+
+	if(sequence_id > p_currentSequenceId) {
+		p_waiters.insert(std::make_pair(sequence_id, Waiter{ callback, held }));
+		return;
+	}
+	*held = tryHold(sequence_id);
+	lock.unlock();
+	callback();
+}
+
+void SequenceQueue::releaseSnapshot() {
+	std::unique_lock<std::mutex> lock(p_mutex);
+
+	assert(p_holds > 0);
+	p_holds--;
+	bool wake = p_holds == 0 && !p_sequenceQueue.empty();
+	lock.unlock();
+
+	if(wake)
+		p_eventFd->increment();
+}
+
+bool SequenceQueue::tryHold(SequenceId sequence_id) {
+	// a batch that is in progress belongs to a later sequence id
+	if(p_sequencing || p_lastBatchSequenceId > sequence_id)
+		return false;
+	p_holds++;
+	return true;
+}
+
+void SequenceQueue::applied(std::unique_lock<std::mutex> &lock,
+		SequenceId sequence_id) {
+	if(p_currentSequenceId < sequence_id)
+		p_currentSequenceId = sequence_id;
+
+	// holds are taken before the next batch can be started
+	std::vector<Async::Callback<void()>> ready;
+	auto end = p_waiters.upper_bound(p_currentSequenceId);
+	for(auto it = p_waiters.begin(); it != end; ++it) {
+		if(it->second.held)
+			*it->second.held = tryHold(it->first);
+		ready.push_back(it->second.callback);
+	}
+	p_waiters.erase(p_waiters.begin(), end);
+	lock.unlock();
+
+	for(auto it = ready.begin(); it != ready.end(); ++it)
+		LocalTaskQueue::get()->submit(*it);
+}
+
+// --------------------------------------------------------
+// ProcessClosure
+// --------------------------------------------------------
+
+SequenceQueue::ProcessClosure::ProcessClosure(SequenceQueue *queue)
+		: p_queue(queue) { }
+
+void SequenceQueue::ProcessClosure::process() {
+	std::unique_lock<std::mutex> lock(p_queue->p_mutex);
+
+	if(!p_queue->p_sequenceQueue.empty() && p_queue->p_holds == 0) {
+		p_sequenceItem = p_queue->p_sequenceQueue.front();
+		p_queue->p_sequenceQueue.pop();
+		p_queue->p_sequencing = true;
+
+		lock.unlock();
+		p_index = 0;
+		processSequence();
+	}else{
+		// releaseSnapshot() wakes us up once the last hold is released
+		lock.unlock();
+		p_queue->p_eventFd->wait(ASYNC_MEMBER(this, &ProcessClosure::process));
+	}
+}
+
+void SequenceQueue::ProcessClosure::processSequence() {
+	MutationProcessor *processor = p_queue->p_processor;
+	std::vector<Mutation> &mutations = *p_sequenceItem.mutations;
+	if(p_index == mutations.size()) {
+		finishSequence();
+		return;
+	}
+
+	// a phase ends before the next exclusive mutation
+	size_t end = p_index + 1;
+	if(!processor->isExclusive(mutations[p_index]))
+		while(end < mutations.size() && !processor->isExclusive(mutations[end]))
+			end++;
+
+	p_chains.clear();
+	std::map<std::pair<int, DocumentId>, ChainClosure *> documents;
+	for(size_t i = p_index; i < end; i++) {
+		auto key = std::make_pair(mutations[i].storageIndex, mutations[i].documentId);
+		auto iterator = documents.find(key);
+		if(iterator == documents.end()) {
+			p_chains.emplace_back(new ChainClosure(this));
+			iterator = documents.insert(std::make_pair(key, p_chains.back().get())).first;
+		}
+		iterator->second->indices.push_back(i);
+	}
+	p_index = end;
+
+	size_t initial = std::min(p_chains.size(), size_t(kParallelChains));
+	std::unique_lock<std::mutex> lock(p_chainMutex);
+	p_nextChain = initial;
+	p_pendingChains = p_chains.size();
+	lock.unlock();
+
+	// the phase cannot finish before the last initial chain is started
+	for(size_t i = 0; i < initial; i++)
+		p_chains[i]->apply();
+}
+void SequenceQueue::ProcessClosure::onChainComplete() {
+	std::unique_lock<std::mutex> lock(p_chainMutex);
+	p_pendingChains--;
+	if(p_nextChain < p_chains.size()) {
+		ChainClosure *chain = p_chains[p_nextChain++].get();
+		lock.unlock();
+		chain->apply();
+		return;
+	}
+	if(p_pendingChains > 0)
+		return;
+	lock.unlock();
+
+	LocalTaskQueue::get()->submit(ASYNC_MEMBER(this, &ProcessClosure::processSequence));
+}
+void SequenceQueue::ProcessClosure::finishSequence() {
+	std::unique_lock<std::mutex> lock(p_queue->p_mutex);
+	p_queue->p_sequencing = false;
+	p_queue->p_lastBatchSequenceId = p_sequenceItem.sequenceId;
+
+	// sequence ids that were advanced before the next
+	// queued batch do not have to wait for that batch
+	SequenceId watermark = p_sequenceItem.sequenceId;
+	SequenceId advanced = p_queue->p_sequenceQueue.empty()
+			? p_queue->p_advancedSequenceId
+			: p_queue->p_sequenceQueue.front().advancedBefore;
+	if(watermark < advanced)
+		watermark = advanced;
+	p_queue->applied(lock, watermark);
+
+	p_queue->p_processor->afterSequence(p_sequenceItem.sequenceId);
+	p_sequenceItem.callback();
+	LocalTaskQueue::get()->submit(ASYNC_MEMBER(this, &ProcessClosure::process));
+}
+
+// --------------------------------------------------------
+// ProcessClosure::ChainClosure
+// --------------------------------------------------------
+
+SequenceQueue::ProcessClosure::ChainClosure::ChainClosure(ProcessClosure *process)
+		: p_process(process), p_position(0) { }
+
+void SequenceQueue::ProcessClosure::ChainClosure::apply() {
+	MutationProcessor *processor = p_process->p_queue->p_processor;
+	SequenceId sequence_id = p_process->p_sequenceItem.sequenceId;
+	Mutation &mutation = (*p_process->p_sequenceItem.mutations)[indices[p_position]];
+	if(mutation.type == Mutation::kTypeInsert) {
+		processor->processInsert(sequence_id,
+				mutation, ASYNC_MEMBER(this, &ChainClosure::onItem));
+	}else if(mutation.type == Mutation::kTypeModify) {
+		processor->processModify(sequence_id,
+				mutation, ASYNC_MEMBER(this, &ChainClosure::onItem));
+	}else if(mutation.type == Mutation::kTypeDelete) {
+		processor->processDelete(sequence_id,
+				mutation, ASYNC_MEMBER(this, &ChainClosure::onItem));
+	}else throw std::logic_error("Illegal mutation type");
+}
+void SequenceQueue::ProcessClosure::ChainClosure::onItem(Error error) {
+	//FIXME: don't ignore error
+	p_position++;
+	if(p_position < indices.size()) {
+		apply();
+		return;
+	}
+	p_process->onChainComplete();
+}
+
+}; // namespace Db
+
@@ -1,6 +1,7 @@
 
 #include <iostream>
 #include <functional>
+#include <algorithm>
 
 #include "async.hpp"
 #include "os/linux.hpp"
@@ -13,53 +14,84 @@
 
 namespace Db {
 
-QueuedStorageDriver::QueuedStorageDriver(Engine *engine)
-		: StorageDriver(engine), p_currentSequenceId(0),
-		p_activeRequests(0), p_requestPhase(true) {
-	p_eventFd = osIntf->createEventFd();
+void StorageDriver::checkIntegrity(Async::Callback<void(const std::string &)> callback) {
+	callback(std::string("integrity checks are not supported by this driver\n"));
 }
 
+QueuedStorageDriver::QueuedStorageDriver(Engine *engine)
+		: StorageDriver(engine), p_sequenceQueue(this),
+		p_activeRequests(0) { }
+
 void QueuedStorageDriver::processQueue() {
-	auto closure = new ProcessClosure(this);
-	closure->process();
+	p_sequenceQueue.process();
 }
 
 void QueuedStorageDriver::sequence(SequenceId sequence_id,
 		std::vector<Mutation> &mutations,
 		Async::Callback<void()> callback) {
-	std::unique_lock<std::mutex> lock(p_mutex);
+	p_sequenceQueue.sequence(sequence_id, mutations, callback);
+}
 
-	SequenceQueueItem item;
-	item.sequenceId = sequence_id;
-	item.mutations = &mutations;
-	item.callback = callback;
-	p_sequenceQueue.push(item);
-	
-	lock.unlock();
-	p_eventFd->increment();
+void QueuedStorageDriver::advance(SequenceId sequence_id) {
+	p_sequenceQueue.advance(sequence_id);
 }
 
 void QueuedStorageDriver::fetch(FetchRequest *fetch,
 		Async::Callback<void(FetchData &)> on_data,
 		Async::Callback<void(FetchError)> callback) {
 	std::unique_lock<std::mutex> lock(p_mutex);
+	p_activeRequests++;
+	lock.unlock();
 
-	if(p_requestPhase) {
-		p_activeRequests++;
-
-		lock.unlock();
-		processFetch(fetch, on_data, callback);
-	}else{
-		FetchQueueItem item;
-		item.fetch = fetch;
-		item.onData = on_data;
-		item.callback = callback;
-		p_fetchQueue.push(item);
+	SequenceId snapshot = snapshotOf(fetch->sequenceId);
+	if(!p_sequenceQueue.isApplied(snapshot)) {
+		auto closure = new DeferredClosure(this, DeferredClosure::kTypeFetch);
+		closure->fetch = fetch;
+		closure->onFetchData = on_data;
+		closure->callback = callback;
+		p_sequenceQueue.waitFor(snapshot,
+				ASYNC_MEMBER(closure, &DeferredClosure::resume));
+		return;
+	}
+	processFetch(fetch, on_data, callback);
+}
+void QueuedStorageDriver::multiFetch(MultiFetchRequest *fetch,
+		Async::Callback<void(std::vector<FetchData> &)> on_data,
+		Async::Callback<void(FetchError)> callback) {
+	std::unique_lock<std::mutex> lock(p_mutex);
+	p_activeRequests++;
+	lock.unlock();
 
-		lock.unlock();
+	SequenceId snapshot = snapshotOf(fetch->sequenceId);
+	if(!p_sequenceQueue.isApplied(snapshot)) {
+		auto closure = new DeferredClosure(this, DeferredClosure::kTypeMultiFetch);
+		closure->multiFetch = fetch;
+		closure->onMultiFetchData = on_data;
+		closure->callback = callback;
+		p_sequenceQueue.waitFor(snapshot,
+				ASYNC_MEMBER(closure, &DeferredClosure::resume));
+		return;
 	}
+	processMultiFetch(fetch, on_data, callback);
+}
+void QueuedStorageDriver::history(HistoryRequest *request,
+		Async::Callback<void(std::vector<VersionData> &)> on_data,
+		Async::Callback<void(FetchError)> callback) {
+	std::unique_lock<std::mutex> lock(p_mutex);
+	p_activeRequests++;
+	lock.unlock();
 
-	p_eventFd->increment();
+	SequenceId snapshot = snapshotOf(request->toSequenceId);
+	if(!p_sequenceQueue.isApplied(snapshot)) {
+		auto closure = new DeferredClosure(this, DeferredClosure::kTypeHistory);
+		closure->history = request;
+		closure->onHistoryData = on_data;
+		closure->callback = callback;
+		p_sequenceQueue.waitFor(snapshot,
+				ASYNC_MEMBER(closure, &DeferredClosure::resume));
+		return;
+	}
+	processHistory(request, on_data, callback);
 }
 
 void QueuedStorageDriver::finishRequest() {
@@ -68,97 +100,34 @@ void QueuedStorageDriver::finishRequest() {
 	p_activeRequests--;
 }
 
-// --------------------------------------------------------
-// ProcessClosure
-// --------------------------------------------------------
-
-QueuedStorageDriver::ProcessClosure::ProcessClosure(QueuedStorageDriver *storage)
-		: p_storage(storage) { }
-
-void QueuedStorageDriver::ProcessClosure::process() {
-	std::unique_lock<std::mutex> lock(p_storage->p_mutex);
-
-	if(!p_storage->p_sequenceQueue.empty()) {
-		p_storage->p_requestPhase = false;
-		
-		lock.unlock();
-		endRequestPhase();
-	}else{
-		lock.unlock();
-		p_storage->p_eventFd->wait(ASYNC_MEMBER(this, &ProcessClosure::process));
-	}
+bool QueuedStorageDriver::isExclusive(Mutation &mutation) {
+	return false;
 }
 
-void QueuedStorageDriver::ProcessClosure::endRequestPhase() {
-	std::unique_lock<std::mutex> lock(p_storage->p_mutex);
-
-	if(p_storage->p_activeRequests == 0) {
-		lock.unlock();
-		sequencePhase();
-	}else{
-		lock.unlock();
-		p_storage->p_eventFd->wait(ASYNC_MEMBER(this, &ProcessClosure::endRequestPhase));
-	}
+void QueuedStorageDriver::afterSequence(SequenceId sequence_id) {
 }
 
-void QueuedStorageDriver::ProcessClosure::sequencePhase() {
-	std::unique_lock<std::mutex> lock(p_storage->p_mutex);
-
-	if(p_storage->p_sequenceQueue.empty()) {
-		p_storage->p_requestPhase = true;
-		
-		TaskPool *pool = p_storage->getEngine()->getProcessPool();
-		for(int i = 0; i < p_storage->p_fetchQueue.size() + 1; i++)
-			pool->submit(ASYNC_MEMBER(this, &ProcessClosure::unqueueRequest));
-	}else{
-		p_sequenceItem = p_storage->p_sequenceQueue.front();
-		p_storage->p_sequenceQueue.pop();
-
-		lock.unlock();
-		p_index = 0;
-		processSequence();
-	}
+SequenceId QueuedStorageDriver::snapshotOf(SequenceId sequence_id) {
+	return std::min(sequence_id, p_engine->currentSequenceId());
 }
 
-void QueuedStorageDriver::ProcessClosure::unqueueRequest() {
-	std::unique_lock<std::mutex> lock(p_storage->p_mutex);
-	
-	if(p_storage->p_fetchQueue.empty()) {
-		lock.unlock();
-		process();
-	}else{
-		auto fetch_item = p_storage->p_fetchQueue.front();
-		p_storage->p_fetchQueue.pop();
-		
-		p_storage->p_activeRequests++;
-
-		lock.unlock();
-		p_storage->processFetch(fetch_item.fetch, fetch_item.onData,
-				fetch_item.callback);
-	}
-}
+// --------------------------------------------------------
+// QueuedStorageDriver::DeferredClosure
+// --------------------------------------------------------
 
-void QueuedStorageDriver::ProcessClosure::processSequence() {
-	if(p_index == p_sequenceItem.mutations->size()) {
-		p_storage->p_currentSequenceId = p_sequenceItem.sequenceId;
-		p_sequenceItem.callback();
-		LocalTaskQueue::get()->submit(ASYNC_MEMBER(this, &ProcessClosure::sequencePhase));
-		return;
-	}
-	
-	Mutation &mutation = (*p_sequenceItem.mutations)[p_index];
-	if(mutation.type == Mutation::kTypeInsert) {
-		p_storage->processInsert(p_sequenceItem.sequenceId,
-				mutation, ASYNC_MEMBER(this, &ProcessClosure::onSequenceItem));
-	}else if(mutation.type == Mutation::kTypeModify) {
-		p_storage->processModify(p_sequenceItem.sequenceId,
-				mutation, ASYNC_MEMBER(this, &ProcessClosure::onSequenceItem));
-	}else throw std::logic_error("Illegal mutation type");
-}
-void QueuedStorageDriver::ProcessClosure::onSequenceItem(Error error) {
-	//FIXME: don't ignore error
-	p_index++;
-	processSequence();
+QueuedStorageDriver::DeferredClosure::DeferredClosure(QueuedStorageDriver *driver,
+		Type type) : type(type), fetch(nullptr), multiFetch(nullptr),
+		history(nullptr), p_driver(driver) { }
+
+void QueuedStorageDriver::DeferredClosure::resume() {
+	if(type == kTypeFetch) {
+		p_driver->processFetch(fetch, onFetchData, callback);
+	}else if(type == kTypeMultiFetch) {
+		p_driver->processMultiFetch(multiFetch, onMultiFetchData, callback);
+	}else if(type == kTypeHistory) {
+		p_driver->processHistory(history, onHistoryData, callback);
+	}else throw std::logic_error("Illegal deferred request");
+	delete this;
 }
 
 } /* namespace Db  */
@@ -2,6 +2,7 @@
 
 #include <iostream>
 #include <functional>
+#include <algorithm>
 
 #include "async.hpp"
 #include "os/linux.hpp"
@@ -14,53 +15,50 @@
 
 namespace Db {
 
-QueuedViewDriver::QueuedViewDriver(Engine *engine)
-		: ViewDriver(engine), p_currentSequenceId(0),
-		p_activeRequests(0), p_requestPhase(true) {
-	p_eventFd = osIntf->createEventFd();
+void ViewDriver::checkIntegrity(Async::Callback<void(const std::string &)> callback) {
+	callback(std::string("integrity checks are not supported by this driver\n"));
 }
 
+QueuedViewDriver::QueuedViewDriver(Engine *engine)
+		: ViewDriver(engine), p_sequenceQueue(this),
+		p_activeRequests(0) { }
+
 void QueuedViewDriver::processQueue() {
-	auto closure = new ProcessClosure(this);
-	closure->process();
+	p_sequenceQueue.process();
 }
 
 void QueuedViewDriver::sequence(SequenceId sequence_id,
 		std::vector<Mutation> &mutations,
 		Async::Callback<void()> callback) {
-	std::unique_lock<std::mutex> lock(p_mutex);
-
-	SequenceQueueItem item;
-	item.sequenceId = sequence_id;
-	item.mutations = &mutations;
-	item.callback = callback;
-	p_sequenceQueue.push(item);
+	p_sequenceQueue.sequence(sequence_id, mutations, callback);
+}
 
-	lock.unlock();
-	p_eventFd->increment();
+void QueuedViewDriver::advance(SequenceId sequence_id) {
+	p_sequenceQueue.advance(sequence_id);
 }
 
 void QueuedViewDriver::query(QueryRequest *query,
 		Async::Callback<void(QueryData &)> on_data,
 		Async::Callback<void(QueryError)> callback) {
 	std::unique_lock<std::mutex> lock(p_mutex);
+	p_activeRequests++;
+	lock.unlock();
 
-	if(p_requestPhase) {
-		p_activeRequests++;
-		
-		lock.unlock();
-		processQuery(query, on_data, callback);
-	}else{
-		QueryQueueItem item;
-		item.query = query;
-		item.onData = on_data;
-		item.callback = callback;
-		p_queryQueue.push(item);
-
-		lock.unlock();
+	// queries cannot see sequence ids that the engine has not assigned yet
+	SequenceId snapshot = std::min(query->sequenceId,
+			p_engine->currentSequenceId());
+	if(requiresSnapshot(query)) {
+		auto closure = new DeferredClosure(this, query, on_data, callback);
+		closure->hold(snapshot);
+		return;
 	}
-
-	p_eventFd->increment();
+	if(!p_sequenceQueue.isApplied(snapshot)) {
+		auto closure = new DeferredClosure(this, query, on_data, callback);
+		p_sequenceQueue.waitFor(snapshot,
+				ASYNC_MEMBER(closure, &DeferredClosure::resume));
+		return;
+	}
+	processQuery(query, on_data, callback);
 }
 
 void QueuedViewDriver::finishRequest() {
@@ -69,96 +67,50 @@ void QueuedViewDriver::finishRequest() {
 	p_activeRequests--;
 }
 
-// --------------------------------------------------------
-// ProcessClosure
-// --------------------------------------------------------
-
-QueuedViewDriver::ProcessClosure::ProcessClosure(QueuedViewDriver *view)
-		: p_view(view) { }
+bool QueuedViewDriver::isExclusive(Mutation &mutation) {
+	return false;
+}
 
-void QueuedViewDriver::ProcessClosure::process() {
-	std::unique_lock<std::mutex> lock(p_view->p_mutex);
+void QueuedViewDriver::afterSequence(SequenceId sequence_id) {
+}
 
-	if(!p_view->p_sequenceQueue.empty()) {
-		p_view->p_requestPhase = false;
-		
-		lock.unlock();
-		endRequestPhase();
-	}else{
-		lock.unlock();
-		p_view->p_eventFd->wait(ASYNC_MEMBER(this, &ProcessClosure::process));
-	}
+bool QueuedViewDriver::requiresSnapshot(QueryRequest *query) {
+	return false;
 }
 
-void QueuedViewDriver::ProcessClosure::endRequestPhase() {
-	std::unique_lock<std::mutex> lock(p_view->p_mutex);
+// --------------------------------------------------------
+// QueuedViewDriver::DeferredClosure
+// --------------------------------------------------------
 
-	if(p_view->p_activeRequests == 0) {
-		lock.unlock();
-		sequencePhase();
-	}else{
-		lock.unlock();
-		p_view->p_eventFd->wait(ASYNC_MEMBER(this, &ProcessClosure::endRequestPhase));
-	}
-}
+QueuedViewDriver::DeferredClosure::DeferredClosure(QueuedViewDriver *driver,
+		QueryRequest *query, Async::Callback<void(QueryData &)> on_data,
+		Async::Callback<void(QueryError)> callback)
+	: p_driver(driver), p_query(query), p_onData(on_data),
+		p_callback(callback), p_held(false) { }
 
-void QueuedViewDriver::ProcessClosure::sequencePhase() {
-	std::unique_lock<std::mutex> lock(p_view->p_mutex);
-
-	if(p_view->p_sequenceQueue.empty()) {
-		p_view->p_requestPhase = true;
-		
-		TaskPool *pool = p_view->getEngine()->getProcessPool();
-		for(int i = 0; i < p_view->p_queryQueue.size() + 1; i++)
-			pool->submit(ASYNC_MEMBER(this, &ProcessClosure::unqueueRequest));
-	}else{
-		p_sequenceItem = p_view->p_sequenceQueue.front();
-		p_view->p_sequenceQueue.pop();
-
-		lock.unlock();
-		p_index = 0;
-		processSequence();
-	}
+void QueuedViewDriver::DeferredClosure::resume() {
+	p_driver->processQuery(p_query, p_onData, p_callback);
+	delete this;
 }
 
-void QueuedViewDriver::ProcessClosure::unqueueRequest() {
-	std::unique_lock<std::mutex> lock(p_view->p_mutex);
-	
-	if(p_view->p_queryQueue.empty()) {
-		lock.unlock();
-		process();
-	}else{
-		auto query_item = p_view->p_queryQueue.front();
-		p_view->p_queryQueue.pop();
-
-		p_view->p_activeRequests++;
-			
-		lock.unlock();
-		p_view->processQuery(query_item.query, query_item.onData, query_item.callback);
-	}
+void QueuedViewDriver::DeferredClosure::hold(SequenceId snapshot) {
+	p_driver->p_sequenceQueue.holdSnapshot(snapshot, &p_held,
+			ASYNC_MEMBER(this, &DeferredClosure::onHeld));
 }
-
-void QueuedViewDriver::ProcessClosure::processSequence() {
-	if(p_index == p_sequenceItem.mutations->size()) {
-		p_view->p_currentSequenceId = p_sequenceItem.sequenceId;
-		p_sequenceItem.callback();
-		LocalTaskQueue::get()->submit(ASYNC_MEMBER(this, &ProcessClosure::sequencePhase));
+void QueuedViewDriver::DeferredClosure::onHeld() {
+	if(!p_held) {
+		p_driver->finishRequest();
+		p_callback(kQuerySnapshotTooOld);
+		delete this;
 		return;
 	}
-	
-	Mutation &mutation = (*p_sequenceItem.mutations)[p_index];
-	if(mutation.type == Mutation::kTypeInsert) {
-		p_view->processInsert(p_sequenceItem.sequenceId,
-				mutation, ASYNC_MEMBER(this, &ProcessClosure::onSequenceItem));
-	}else if(mutation.type == Mutation::kTypeModify) {
-		p_view->processModify(p_sequenceItem.sequenceId,
-				mutation, ASYNC_MEMBER(this, &ProcessClosure::onSequenceItem));
-	}else throw std::logic_error("Illegal mutation type");
+	p_driver->processQuery(p_query, p_onData,
+			ASYNC_MEMBER(this, &DeferredClosure::onComplete));
 }
-void QueuedViewDriver::ProcessClosure::onSequenceItem(Error error) {
-	//FIXME: don't ignore error
-	p_index++;
-	processSequence();
+void QueuedViewDriver::DeferredClosure::onComplete(QueryError error) {
+	p_driver->p_sequenceQueue.releaseSnapshot();
+	p_callback(error);
+	delete this;
 }
 
 } /* namespace Db  */
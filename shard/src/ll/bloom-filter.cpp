@@ -0,0 +1,55 @@
+
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+#include "ll/bloom-filter.hpp"
+
+namespace Ll {
+
+// mixes all bits of the key. document ids are sequential
+// so they must not be used as hashes directly
+static uint64_t mixKey(uint64_t key) {
+	key += 0x9E3779B97F4A7C15;
+	key = (key ^ (key >> 30)) * 0xBF58476D1CE4E5B9;
+	key = (key ^ (key >> 27)) * 0x94D049BB133111EB;
+	return key ^ (key >> 31);
+}
+
+BloomFilter::BloomFilter(size_t capacity, int bits_per_key)
+		: p_capacity(capacity) {
+	size_t num_words = (capacity * bits_per_key + 63) / 64;
+	p_numBits = std::max(num_words, size_t(1)) * 64;
+	// ln(2) * bits_per_key probes minimize the false positive rate
+	p_numProbes = std::min(std::max(int(bits_per_key * 0.69), 1), 16);
+
+	p_words.reset(new std::atomic<uint64_t>[p_numBits / 64]);
+	for(size_t i = 0; i < p_numBits / 64; i++)
+		p_words[i].store(0, std::memory_order_relaxed);
+}
+
+void BloomFilter::insert(uint64_t key) {
+	// double hashing: the probes are h1 + i * h2
+	uint64_t hash = mixKey(key);
+	uint32_t h1 = hash, h2 = (hash >> 32) | 1;
+	for(int i = 0; i < p_numProbes; i++) {
+		size_t bit = (h1 + uint64_t(i) * h2) % p_numBits;
+		p_words[bit / 64].fetch_or(uint64_t(1) << (bit % 64),
+				std::memory_order_release);
+	}
+}
+
+bool BloomFilter::mayContain(uint64_t key) {
+	uint64_t hash = mixKey(key);
+	uint32_t h1 = hash, h2 = (hash >> 32) | 1;
+	for(int i = 0; i < p_numProbes; i++) {
+		size_t bit = (h1 + uint64_t(i) * h2) % p_numBits;
+		uint64_t word = p_words[bit / 64].load(std::memory_order_acquire);
+		if(!(word & (uint64_t(1) << (bit % 64))))
+			return false;
+	}
+	return true;
+}
+
+} // namespace Ll
+
@@ -0,0 +1,98 @@
+
+#include <string>
+#include <stdexcept>
+
+#include <lz4.h>
+#include <zstd.h>
+
+#include "ll/compression.hpp"
+
+namespace Ll {
+
+// zstd contexts must not be shared between threads
+static ZSTD_CCtx *threadCompressContext() {
+	static thread_local ZSTD_CCtx *context = nullptr;
+	if(!context)
+		context = ZSTD_createCCtx();
+	return context;
+}
+static ZSTD_DCtx *threadDecompressContext() {
+	static thread_local ZSTD_DCtx *context = nullptr;
+	if(!context)
+		context = ZSTD_createDCtx();
+	return context;
+}
+
+Compressor::Compressor()
+	: p_codec(kCodecNone), p_level(0),
+		p_compressDict(nullptr), p_decompressDict(nullptr) { }
+
+Compressor::~Compressor() {
+	if(p_compressDict)
+		ZSTD_freeCDict(p_compressDict);
+	if(p_decompressDict)
+		ZSTD_freeDDict(p_decompressDict);
+}
+
+void Compressor::configure(Codec codec, int level, const std::string &dictionary) {
+	p_codec = codec;
+	p_level = level;
+
+	if(codec == kCodecZstd && !dictionary.empty()) {
+		p_compressDict = ZSTD_createCDict(dictionary.data(), dictionary.size(), level);
+		p_decompressDict = ZSTD_createDDict(dictionary.data(), dictionary.size());
+		if(!p_compressDict || !p_decompressDict)
+			throw std::runtime_error("Could not load zstd dictionary");
+	}
+}
+
+Compressor::Codec Compressor::compress(const char *data, size_t length,
+		std::string &output) {
+	if(p_codec == kCodecLz4) {
+		output.resize(LZ4_compressBound(length));
+		int result = LZ4_compress_fast(data, &output[0], length, output.size(),
+				p_level > 0 ? p_level : 1);
+		if(result <= 0 || size_t(result) >= length)
+			return kCodecNone;
+		output.resize(result);
+		return kCodecLz4;
+	}else if(p_codec == kCodecZstd) {
+		output.resize(ZSTD_compressBound(length));
+		size_t result;
+		if(p_compressDict) {
+			result = ZSTD_compress_usingCDict(threadCompressContext(),
+					&output[0], output.size(), data, length, p_compressDict);
+		}else{
+			result = ZSTD_compressCCtx(threadCompressContext(),
+					&output[0], output.size(), data, length, p_level);
+		}
+		if(ZSTD_isError(result) || result >= length)
+			return kCodecNone;
+		output.resize(result);
+		return kCodecZstd;
+	}
+	return kCodecNone;
+}
+
+void Compressor::decompress(Codec codec, const char *data, size_t length,
+		char *output, size_t raw_length) {
+	if(codec == kCodecLz4) {
+		int result = LZ4_decompress_safe(data, output, length, raw_length);
+		if(result < 0 || size_t(result) != raw_length)
+			throw std::runtime_error("Corrupted lz4 record");
+	}else if(codec == kCodecZstd) {
+		size_t result;
+		if(p_decompressDict) {
+			result = ZSTD_decompress_usingDDict(threadDecompressContext(),
+					output, raw_length, data, length, p_decompressDict);
+		}else{
+			result = ZSTD_decompressDCtx(threadDecompressContext(),
+					output, raw_length, data, length);
+		}
+		if(ZSTD_isError(result) || result != raw_length)
+			throw std::runtime_error("Corrupted zstd record");
+	}else throw std::logic_error("Illegal codec");
+}
+
+} // namespace Ll
+
@@ -0,0 +1,99 @@
+
+#include <cassert>
+
+#include "async.hpp"
+#include "os/linux.hpp"
+#include "ll/tasks.hpp"
+
+#include "ll/latch.hpp"
+
+// --------------------------------------------------------
+// LatchTable
+// --------------------------------------------------------
+
+void LatchTable::acquireShared(LatchId id, Async::Callback<void()> callback) {
+	std::unique_lock<std::mutex> lock(p_mutex);
+
+	// NOTE: queued requests are granted in order to prevent starvation of writers
+	Latch &latch = p_latches[id];
+	if(!latch.exclusive && latch.waitQueue.empty()) {
+		latch.sharedCount++;
+
+		lock.unlock();
+		callback();
+	}else{
+		latch.waitQueue.emplace_back(false, TaskCallback(callback));
+	}
+}
+
+void LatchTable::acquireExclusive(LatchId id, Async::Callback<void()> callback) {
+	std::unique_lock<std::mutex> lock(p_mutex);
+
+	Latch &latch = p_latches[id];
+	if(!latch.exclusive && latch.sharedCount == 0 && latch.waitQueue.empty()) {
+		latch.exclusive = true;
+
+		lock.unlock();
+		callback();
+	}else{
+		latch.waitQueue.emplace_back(true, TaskCallback(callback));
+	}
+}
+
+bool LatchTable::tryAcquireShared(LatchId id) {
+	std::lock_guard<std::mutex> lock(p_mutex);
+
+	auto iterator = p_latches.find(id);
+	if(iterator == p_latches.end()) {
+		p_latches[id].sharedCount++;
+		return true;
+	}
+	
+	Latch &latch = iterator->second;
+	if(latch.exclusive || !latch.waitQueue.empty())
+		return false;
+	latch.sharedCount++;
+	return true;
+}
+
+void LatchTable::release(LatchId id) {
+	std::lock_guard<std::mutex> lock(p_mutex);
+
+	auto iterator = p_latches.find(id);
+	assert(iterator != p_latches.end());
+	Latch &latch = iterator->second;
+
+	if(latch.exclusive) {
+		latch.exclusive = false;
+	}else{
+		assert(latch.sharedCount > 0);
+		latch.sharedCount--;
+	}
+
+	if(latch.sharedCount == 0)
+		grantWaiters(latch);
+	
+	if(!latch.exclusive && latch.sharedCount == 0)
+		p_latches.erase(iterator);
+}
+
+void LatchTable::grantWaiters(Latch &latch) {
+	assert(!latch.exclusive && latch.sharedCount == 0);
+	
+	if(latch.waitQueue.empty())
+		return;
+	
+	if(latch.waitQueue.front().exclusive) {
+		latch.exclusive = true;
+		latch.waitQueue.front().callback();
+		latch.waitQueue.pop_front();
+		return;
+	}
+
+	while(!latch.waitQueue.empty() && !latch.waitQueue.front().exclusive) {
+		latch.sharedCount++;
+		latch.waitQueue.front().callback();
+		latch.waitQueue.pop_front();
+	}
+}
+
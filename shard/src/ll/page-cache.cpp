@@ -26,7 +26,7 @@ CacheHost::CacheHost() : p_activeFootprint(0), p_limit(0) {
 }
 
 void CacheHost::requestAcquire(Cacheable *item) {
-	assert(item->getFootprint() < p_limit);
+	assert(item->getFootprint() <= p_limit);
 
 	item->acquire();
 	
@@ -42,7 +42,9 @@ void CacheHost::requestAcquire(Cacheable *item) {
 	mostRecently()->p_moreRecentlyUsed = item;
 	mostRecently() = item;
 
-	while(p_activeFootprint > p_limit)
+	// items of different sizes share the same limit.
+	// a large item may displace several small ones but never itself
+	while(p_activeFootprint > p_limit && leastRecently() != item)
 		releaseItem(leastRecently(), lock);
 }
 void CacheHost::onAccess(Cacheable *item) {
@@ -67,6 +69,22 @@ void CacheHost::afterRelease(Cacheable *item) {
 	std::lock_guard<std::mutex> lock(p_listMutex);
 }
 
+bool CacheHost::forget(Cacheable *item) {
+	std::lock_guard<std::mutex> lock(p_listMutex);
+
+	if(!item->p_alive)
+		return false;
+	item->p_alive = false;
+	p_activeFootprint -= item->getFootprint();
+
+	// remove the item from the list
+	Cacheable *less_recently = item->p_lessRecentlyUsed;
+	Cacheable *more_recently = item->p_moreRecentlyUsed;
+	less_recently->p_moreRecentlyUsed = more_recently;
+	more_recently->p_lessRecentlyUsed = less_recently;
+	return true;
+}
+
 void CacheHost::setLimit(int64_t limit) {
 	p_limit = limit;
 }
@@ -196,7 +214,7 @@ void PageInfo::diskRead() {
 	p_cache->p_file->preadSync(p_number * p_cache->p_pageSize,
 			p_cache->p_pageSize, p_buffer);
 	
-	std::lock_guard<std::mutex> lock(p_cache->p_mutex);
+	std::unique_lock<std::mutex> lock(p_cache->p_mutex);
 
 	assert(p_useCount == 0);
 	p_flags |= kFlagLoaded;
@@ -205,6 +223,10 @@ void PageInfo::diskRead() {
 	for(auto it = p_waitQueue.begin(); it != p_waitQueue.end(); it++)
 		(*it)();
 	p_waitQueue.clear();
+
+	// prefetched pages have no users. they might have been evicted during the read
+	if(p_useCount == 0 && (p_flags & kFlagRelease))
+		doRelease(std::move(lock));
 }
 
 // --------------------------------------------------------
@@ -216,6 +238,12 @@ PageCache::PageCache(CacheHost *cache_host, int page_size, TaskPool *io_pool)
 	p_file = osIntf->createFile();
 }
 
+void PageCache::setPageSize(int page_size) {
+	std::lock_guard<std::mutex> lock(p_mutex);
+	assert(p_presentPages.empty());
+	p_pageSize = page_size;
+}
+
 void PageCache::open(const std::string &path) {
 	p_file->openSync(path, Linux::kFileCreate | Linux::kFileTrunc
 			| Linux::FileMode::read | Linux::FileMode::write);
@@ -236,11 +264,18 @@ void PageCache::initializePage(PageNumber number,
 		
 		lock.unlock();
 		p_cacheHost->requestAcquire(info);
+	}else if(!(iterator->second->p_flags & PageInfo::kFlagLoaded)) {
+		// the page is still being loaded by a prefetch or written back.
+		// wait for it just like readPage() does
+		PageInfo *info = iterator->second;
+
+		auto *read_closure = new ReadClosure(this, number, callback);
+		TaskCallback wrapper(ASYNC_MEMBER(read_closure, &ReadClosure::complete));
+		info->p_waitQueue.push_back(wrapper);
 	}else{
 		PageInfo *info = iterator->second;
 		
 		assert(info->p_waitQueue.empty());
-		assert(info->p_flags & PageInfo::kFlagLoaded);
 		assert(info->p_useCount == 0);
 		if(!(info->p_flags & PageInfo::kFlagRelease)) {
 			info->p_useCount = 1;
@@ -288,6 +323,18 @@ void PageCache::readPage(PageNumber number,
 		}
 	}
 }
+void PageCache::prefetchPage(PageNumber number) {
+	std::unique_lock<std::mutex> lock(p_mutex);
+
+	if(p_presentPages.find(number) != p_presentPages.end())
+		return;
+
+	PageInfo *info = new PageInfo(this, number);
+	p_presentPages.insert(std::make_pair(number, info));
+	
+	lock.unlock();
+	p_cacheHost->requestAcquire(info);
+}
 void PageCache::writePage(PageNumber number) {
 	std::unique_lock<std::mutex> lock(p_mutex);
 
@@ -308,6 +355,18 @@ void PageCache::releasePage(PageNumber number) {
 		info->doRelease(std::move(lock));
 }
 
+void PageCache::truncate() {
+	std::unique_lock<std::mutex> lock(p_mutex);
+
+	for(auto it = p_presentPages.begin(); it != p_presentPages.end(); ++it) {
+		PageInfo *info = it->second;
+		assert(info->p_useCount == 0);
+		// the contents are garbage now; do not write them back
+		info->p_flags &= ~PageInfo::kFlagDirty;
+	}
+	p_file->truncateSync(0);
+}
+
 int PageCache::getPageSize() {
 	return p_pageSize;
 }
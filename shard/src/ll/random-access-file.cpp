@@ -17,10 +17,18 @@ void RandomAccessFile::setPath(const std::string &path) {
 	p_path = path;
 }
 
+void RandomAccessFile::setPageSize(int page_size) {
+	p_pageCache.setPageSize(page_size);
+}
+
 void RandomAccessFile::createFile() {
 	p_pageCache.open(p_path + '/' + p_name + ".bin");
 }
 
+void RandomAccessFile::truncate() {
+	p_pageCache.truncate();
+}
+
 // --------------------------------------------------------
 // RandomAccessFile::ReadClosure
 // --------------------------------------------------------
@@ -18,6 +18,8 @@
 #include "db/engine.hpp"
 
 #include "db/flex-storage.hpp"
+#include "db/lsm-storage.hpp"
+#include "db/in-memory-storage.hpp"
 #include "db/js-view.hpp"
 
 #include "api/server.hpp"
@@ -46,6 +48,8 @@ int main(int argc, char **argv) {
 	WorkerThread worker2;
 
 	Db::globStorageRegistry.addDriver(new Db::FlexStorage::Factory);
+	Db::globStorageRegistry.addDriver(new Db::LsmStorage::Factory);
+	Db::globStorageRegistry.addDriver(new Db::InMemoryStorage::Factory);
 	Db::globViewRegistry.addDriver(new Db::JsView::Factory);
 
 	po::options_description desc("Options");
@@ -87,6 +87,10 @@ void Linux::File::fdatasyncSync() {
 	if(::fdatasync(p_fileFd) == -1)
 		throw std::runtime_error("fsync() failed");
 }
+void Linux::File::truncateSync(Linux::off_type length) {
+	if(::ftruncate(p_fileFd, length) == -1)
+		throw std::runtime_error("ftruncate() failed");
+}
 
 std::unique_ptr<Linux::File> Linux::createFile() {
 	return std::unique_ptr<Linux::File>(new Linux::File());
@@ -4,6 +4,7 @@ var net = require('net');
 var child_process = require('child_process');
 var async = require('async');
 var d3b = require('../client-nodejs/d3b');
+var d3bUtil = require('../client-nodejs/d3b-util');
 
 var showServerOutput = !!process.env.D3B_SHOW_SERVER_OUTPUT;
 var useRunningServer = !!process.env.D3B_USE_RUNNING_SERVER;
@@ -144,5 +145,46 @@ function defaultTest(functor) {
 	};
 }
 
+// creates a storage from config, inserts all buffers of data and fetches each
+// document back. resolves to a Map from document ids to the inserted buffers
+function insertAndFetch(test, client, config, data) {
+	let written = new Map();
+
+	return d3bUtil.createStorage(client, config)
+	.then(() => {
+		return Promise.all(data.map(buffer => {
+			return d3bUtil.insert(client, {
+				storageName: config.identifier,
+				buffer: buffer
+			}).then(result => {
+				written.set(result.documentId, buffer);
+			});
+		}));
+	})
+	.then(() => {
+		return Promise.all(Array.from(written.keys()).map(id => {
+			return d3bUtil.fetch(client, {
+				storageName: config.identifier,
+				documentId: id
+			})
+			.then(result => {
+				test.ok(written.get(id).equals(result));
+			});
+		}));
+	})
+	.then(() => written);
+}
+
+// returns count buffers of the form 'item #i'
+function itemBuffers(count) {
+	let data = [ ];
+	for(let i = 0; i < count; i++) {
+		data.push(Buffer.from('item #' + i));
+	}
+	return data;
+}
+
 module.exports.defaultTest = defaultTest;
+module.exports.insertAndFetch = insertAndFetch;
+module.exports.itemBuffers = itemBuffers;
 
@@ -7,12 +7,110 @@ module.exports = {
 testInsert: common.defaultTest((test, client) => {
 	test.expect(1000);
 
+	return common.insertAndFetch(test, client, {
+		driver: 'FlexStorage',
+		identifier: 'test-storage'
+	}, common.itemBuffers(1000));
+}),
+
+testInsertLargeBlocks: common.defaultTest((test, client) => {
+	test.expect(1001);
+
+	return common.insertAndFetch(test, client, {
+		driver: 'FlexStorage',
+		identifier: 'test-storage',
+		blockSize: 65536
+	}, common.itemBuffers(1000))
+	.then(() => {
+		return d3bUtil.checkIntegrity(client, {
+			storageName: 'test-storage'
+		});
+	})
+	.then(report => {
+		// all entries fit into a single leaf
+		test.ok(/^depth: 1$/m.test(report));
+	});
+}),
+
+testInsertCompressed: common.defaultTest((test, client) => {
+	test.expect(2002);
+
+	// short documents do not shrink and are stored uncompressed
+	let data = [ ];
+	for(let i = 0; i < 1000; i++) {
+		let document = { id: i, tags: [ ] };
+		for(let j = 0; j < i % 50; j++)
+			document.tags.push('tag #' + j);
+		data.push(Buffer.from(JSON.stringify(document)));
+	}
+
+	let dataBytes = (storage_name) => {
+		return d3bUtil.checkIntegrity(client, {
+			storageName: storage_name
+		})
+		.then(report => {
+			return Number(/^data bytes: (\d+)$/m.exec(report)[1]);
+		});
+	};
+
+	return common.insertAndFetch(test, client, {
+		driver: 'FlexStorage',
+		identifier: 'test-storage',
+		compression: d3bUtil.kCompressLz4
+	}, data)
+	.then(() => {
+		// stores the same documents without compression
+		return common.insertAndFetch(test, client, {
+			driver: 'FlexStorage',
+			identifier: 'plain-storage'
+		}, data);
+	})
+	.then(() => {
+		return Promise.all([ dataBytes('test-storage'), dataBytes('plain-storage') ]);
+	})
+	.then(bytes => {
+		let total = data.reduce((sum, buffer) => sum + buffer.length, 0);
+		test.equals(bytes[1], total);
+		test.ok(bytes[0] < bytes[1]);
+	});
+}),
+
+testInsertInline: common.defaultTest((test, client) => {
+	test.expect(1001);
+
+	// documents of up to 64 bytes are stored in the index
+	let data = [ ];
+	for(let i = 0; i < 1000; i++) {
+		data.push(Buffer.from(('item #' + i).repeat(i % 20)));
+	}
+
+	return common.insertAndFetch(test, client, {
+		driver: 'FlexStorage',
+		identifier: 'test-storage',
+		inlineThreshold: 64
+	}, data)
+	.then(() => {
+		return d3bUtil.checkIntegrity(client, {
+			storageName: 'test-storage'
+		});
+	})
+	.then(report => {
+		// only the documents above the threshold occupy the data segment
+		let expected = data.filter(buffer => buffer.length > 64)
+				.reduce((sum, buffer) => sum + buffer.length, 0);
+		test.ok(new RegExp('^data bytes: ' + expected + '$', 'm').test(report));
+	});
+}),
+
+testMultiFetch: common.defaultTest((test, client) => {
+	test.expect(1001);
+
 	let data = [ ];
 	for(let i = 0; i < 1000; i++) {
 		data.push(Buffer.from('item #' + i));
 	}
 
-	let written = [ ];
+	let written = new Map();
 
 	return d3bUtil.createStorage(client, {
 		driver: 'FlexStorage',
@@ -24,23 +122,147 @@ testInsert: common.defaultTest((test, client) => {
 				storageName: 'test-storage',
 				buffer: buffer
 			}).then(result => {
-				written.push({
-					source: buffer,
-					documentId: result.documentId
-				});
+				written.set(result.documentId, buffer);
+			});
+		}));
+	})
+	.then(() => {
+		// every other document is requested twice; unknown ids are skipped
+		let ids = Array.from(written.keys());
+		return d3bUtil.multiFetch(client, {
+			storageName: 'test-storage',
+			documentIds: ids.concat(ids.filter((id, i) => i % 2 == 0), [ 100000 ])
+		});
+	})
+	.then(results => {
+		test.equal(results.length, 1000);
+		results.forEach(result => {
+			test.ok(written.get(result.documentId).equals(result.buffer));
+		});
+	});
+}),
+
+testMultiFetchFilter: common.defaultTest((test, client) => {
+	test.expect(5001);
+
+	// the filter is rebuilt while documents are inserted
+	let data = [ ];
+	for(let i = 0; i < 5000; i++) {
+		data.push(Buffer.from('item #' + i));
+	}
+
+	let written = new Map();
+
+	return d3bUtil.createStorage(client, {
+		driver: 'FlexStorage',
+		identifier: 'test-storage',
+		filterBitsPerKey: 10
+	})
+	.then(() => {
+		return Promise.all(data.map(buffer => {
+			return d3bUtil.insert(client, {
+				storageName: 'test-storage',
+				buffer: buffer
+			}).then(result => {
+				written.set(result.documentId, buffer);
 			});
 		}));
 	})
 	.then(() => {
-		return Promise.all(written.map(entry => {
-			return d3bUtil.fetch(client, {
+		let missing = [ ];
+		for(let i = 0; i < 1000; i++)
+			missing.push(100000 + i);
+		return d3bUtil.multiFetch(client, {
+			storageName: 'test-storage',
+			documentIds: Array.from(written.keys()).concat(missing)
+		});
+	})
+	.then(results => {
+		test.equal(results.length, 5000);
+		results.forEach(result => {
+			test.ok(written.get(result.documentId).equals(result.buffer));
+		});
+	});
+}),
+
+testInsertIntegrity: common.defaultTest((test, client) => {
+	test.expect(3);
+
+	let data = [ ];
+	for(let i = 0; i < 1000; i++) {
+		data.push(Buffer.from('item #' + i));
+	}
+
+	return d3bUtil.createStorage(client, {
+		driver: 'FlexStorage',
+		identifier: 'test-storage'
+	})
+	.then(() => {
+		// the check must not interfere with concurrent inserts
+		let inserts = Promise.all(data.map(buffer => {
+			return d3bUtil.insert(client, {
 				storageName: 'test-storage',
-				documentId: entry.documentId
-			})
-			.then(result => {
-				test.ok(entry.source.equals(result));
+				buffer: buffer
 			});
 		}));
+		let check = d3bUtil.checkIntegrity(client, {
+			storageName: 'test-storage'
+		});
+		return Promise.all([ inserts, check ]);
+	})
+	.then(results => {
+		test.ok(/^errors: 0$/m.test(results[1]));
+
+		return d3bUtil.checkIntegrity(client, {
+			storageName: 'test-storage'
+		});
+	})
+	.then(report => {
+		test.ok(/^errors: 0$/m.test(report));
+		test.ok(/^entries: 1000$/m.test(report));
+	});
+}),
+
+testLsmStorage: common.defaultTest((test, client) => {
+	test.expect(2001);
+
+	// small memtables and segments force flushes and compactions
+	return common.insertAndFetch(test, client, {
+		driver: 'LsmStorage',
+		identifier: 'test-storage',
+		blockSize: 1024,
+		memtableLimit: 8192,
+		segmentSize: 4096,
+		level0Segments: 2,
+		filterBitsPerKey: 10
+	}, common.itemBuffers(2000))
+	.then(written => {
+		return d3bUtil.multiFetch(client, {
+			storageName: 'test-storage',
+			documentIds: Array.from(written.keys()).concat([ 100000 ])
+		});
+	})
+	.then(results => {
+		test.equal(results.length, 2000);
+	});
+}),
+
+testInMemoryStorage: common.defaultTest((test, client) => {
+	test.expect(1001);
+
+	return common.insertAndFetch(test, client, {
+		driver: 'InMemoryStorage',
+		identifier: 'test-storage',
+		gcInterval: 1
+	}, common.itemBuffers(1000))
+	.then(written => {
+		return d3bUtil.multiFetch(client, {
+			storageName: 'test-storage',
+			documentIds: Array.from(written.keys())
+		});
+	})
+	.then(results => {
+		test.equal(results.length, 1000);
 	});
 })
 
@@ -84,5 +84,949 @@ testQuery: common.defaultTest((test, client) => {
 	});*/
 }),
 
+testQueryDescending: common.defaultTest((test, client) => {
+	test.expect(11);
+
+	let file = require('fs').readFileSync('tests/views/simple-view.js');
+
+	let ids = [ ];
+	let retrieved = [ ];
+
+	return d3bUtil.uploadExtern(client, {
+		fileName: 'simple-view.js',
+		buffer: file
+	})
+	.then(() => {
+		return d3bUtil.createStorage(client, {
+			driver: 'FlexStorage',
+			identifier: 'test-storage'
+		});
+	})
+	.then(() => {
+		return d3bUtil.createView(client, {
+			driver: 'JsView',
+			identifier: 'test-view',
+			baseStorage: 'test-storage',
+			scriptFile: 'simple-view.js'
+		});
+	})
+	.then(() => {
+		let promises = [ ];
+		for(let i = 0; i < 1000; i++) {
+			promises.push(d3bUtil.insert(client, {
+				storageName: 'test-storage',
+				buffer: Buffer.from('item #' + i)
+			}).then(result => {
+				ids.push(Number(result.documentId));
+			}));
+		}
+		return Promise.all(promises);
+	})
+	.then(() => {
+		return d3bUtil.query(client, {
+			viewName: 'test-view',
+			limit: 10,
+			descending: true
+		}, data => {
+			retrieved.push(JSON.parse(data.toString()).id);
+		});
+	})
+	.then(() => {
+		// the view is ordered by document id
+		ids.sort((a, b) => b - a);
+		test.equals(retrieved.length, 10);
+		for(let i = 0; i < retrieved.length; i++)
+			test.equals(retrieved[i], ids[i]);
+	});
+}),
+
+testQueryDescendingDuplicates: common.defaultTest((test, client) => {
+	test.expect(4);
+
+	// the view is ordered by the document buffer; each key is shared by
+	// many documents that span multiple leaves
+	let data = [ ];
+	for(let i = 0; i < 2000; i++) {
+		data.push(Buffer.from('dup #' + (i % 10)));
+	}
+
+	let file = require('fs').readFileSync('tests/views/buffer-view.js');
+
+	let ids = [ ];
+	let retrieved = [ ];
+
+	return d3bUtil.uploadExtern(client, {
+		fileName: 'buffer-view.js',
+		buffer: file
+	})
+	.then(() => {
+		return d3bUtil.createStorage(client, {
+			driver: 'FlexStorage',
+			identifier: 'test-storage'
+		});
+	})
+	.then(() => {
+		return d3bUtil.createView(client, {
+			driver: 'JsView',
+			identifier: 'test-view',
+			baseStorage: 'test-storage',
+			scriptFile: 'buffer-view.js',
+			blockSize: 1024
+		});
+	})
+	.then(() => {
+		return Promise.all(data.map(buffer => {
+			return d3bUtil.insert(client, {
+				storageName: 'test-storage',
+				buffer: buffer
+			}).then(result => {
+				ids.push(Number(result.documentId));
+			});
+		}));
+	})
+	.then(() => {
+		// concurrent inserts latch leaves while the query moves backward
+		let inserts = [ ];
+		for(let i = 0; i < 500; i++) {
+			inserts.push(d3bUtil.insert(client, {
+				storageName: 'test-storage',
+				buffer: Buffer.from('dup #' + (i % 10) + ' concurrent')
+			}));
+		}
+		let query = d3bUtil.query(client, {
+			viewName: 'test-view',
+			descending: true
+		}, data => {
+			retrieved.push(JSON.parse(data.toString()));
+		});
+		return Promise.all(inserts.concat([ query ]));
+	})
+	.then(() => {
+		let rows = retrieved.filter(row => !row.buffer.endsWith(' concurrent'));
+		test.equals(rows.length, ids.length);
+
+		let unique = new Set(rows.map(row => row.id));
+		test.equals(unique.size, ids.length);
+		test.ok(ids.every(id => unique.has(id)));
+		test.ok(retrieved.every((row, i) => i == 0
+				|| retrieved[i - 1].buffer >= row.buffer));
+	});
+}),
+
+testQueryCountOffset: common.defaultTest((test, client) => {
+	test.expect(6);
+
+	let file = require('fs').readFileSync('tests/views/simple-view.js');
+
+	let ids = [ ];
+	let retrieved = [ ];
+
+	return d3bUtil.uploadExtern(client, {
+		fileName: 'simple-view.js',
+		buffer: file
+	})
+	.then(() => {
+		return d3bUtil.createStorage(client, {
+			driver: 'FlexStorage',
+			identifier: 'test-storage'
+		});
+	})
+	.then(() => {
+		return d3bUtil.createView(client, {
+			driver: 'JsView',
+			identifier: 'test-view',
+			baseStorage: 'test-storage',
+			scriptFile: 'simple-view.js',
+			orderStatistics: true
+		});
+	})
+	.then(() => {
+		let promises = [ ];
+		for(let i = 0; i < 1000; i++) {
+			promises.push(d3bUtil.insert(client, {
+				storageName: 'test-storage',
+				buffer: Buffer.from('item #' + i)
+			}).then(result => {
+				ids.push(Number(result.documentId));
+			}));
+		}
+		return Promise.all(promises);
+	})
+	.then(() => {
+		return d3bUtil.query(client, {
+			viewName: 'test-view',
+			countOnly: true
+		}, data => { });
+	})
+	.then(count => {
+		test.equals(Number(count), 1000);
+
+		return d3bUtil.query(client, {
+			viewName: 'test-view',
+			offset: 500,
+			limit: 5
+		}, data => {
+			retrieved.push(JSON.parse(data.toString()).id);
+		});
+	})
+	.then(() => {
+		ids.sort((a, b) => a - b);
+		for(let i = 0; i < retrieved.length; i++)
+			test.equals(retrieved[i], ids[500 + i]);
+	});
+}),
+
+testQueryDelete: common.defaultTest((test, client) => {
+	test.expect(52);
+
+	let data = [ ];
+	for(let i = 0; i < 100; i++) {
+		data.push(Buffer.from('item #' + i));
+	}
+
+	let file = require('fs').readFileSync('tests/views/simple-view.js');
+
+	let ids, deleted;
+
+	return d3bUtil.uploadExtern(client, {
+		fileName: 'simple-view.js',
+		buffer: file
+	})
+	.then(() => {
+		return d3bUtil.createStorage(client, {
+			driver: 'FlexStorage',
+			identifier: 'test-storage'
+		});
+	})
+	.then(() => {
+		return d3bUtil.createView(client, {
+			driver: 'JsView',
+			identifier: 'test-view',
+			baseStorage: 'test-storage',
+			scriptFile: 'simple-view.js'
+		});
+	})
+	.then(() => {
+		return Promise.all(data.map(buffer => {
+			return d3bUtil.insert(client, {
+				storageName: 'test-storage',
+				buffer: buffer
+			});
+		}));
+	})
+	.then(results => {
+		ids = results.map(result => result.documentId);
+		deleted = ids.filter((id, i) => i % 2 == 0);
+
+		return d3bUtil.transaction(client, { });
+	})
+	.then(transaction_id => {
+		return d3bUtil.update(client, {
+			transactionId: transaction_id,
+			mutations: deleted.map(id => {
+				return {
+					type: d3bUtil.kMutateDelete,
+					storageName: 'test-storage',
+					documentId: id
+				};
+			})
+		})
+		.then(() => {
+			return d3bUtil.apply(client, {
+				transactionId: transaction_id,
+				type: d3bUtil.kApplySubmit
+			});
+		})
+		.then(() => {
+			return d3bUtil.apply(client, {
+				transactionId: transaction_id,
+				type: d3bUtil.kApplyCommit
+			});
+		});
+	})
+	.then(() => {
+		let rows = [ ];
+		return d3bUtil.query(client, {
+			viewName: 'test-view'
+		}, data => {
+			rows.push(JSON.parse(data.toString()).id);
+		})
+		.then(() => {
+			test.equal(rows.length, ids.length - deleted.length);
+			rows.forEach(id => {
+				test.ok(deleted.indexOf(id) == -1);
+			});
+		});
+	})
+	.then(() => {
+		// deleted documents cannot be fetched anymore
+		return d3bUtil.multiFetch(client, {
+			storageName: 'test-storage',
+			documentIds: ids
+		});
+	})
+	.then(results => {
+		test.equal(results.length, ids.length - deleted.length);
+	});
+}),
+
+testQueryDeleteDuplicates: common.defaultTest((test, client) => {
+	test.expect(5);
+
+	// deleted documents share their keys with documents that remain
+	let data = [ ];
+	for(let i = 0; i < 1000; i++) {
+		data.push(Buffer.from('dup #' + (i % 5)));
+	}
+
+	let file = require('fs').readFileSync('tests/views/buffer-view.js');
+
+	let ids, deleted;
+
+	return d3bUtil.uploadExtern(client, {
+		fileName: 'buffer-view.js',
+		buffer: file
+	})
+	.then(() => {
+		return d3bUtil.createStorage(client, {
+			driver: 'FlexStorage',
+			identifier: 'test-storage'
+		});
+	})
+	.then(() => {
+		return d3bUtil.createView(client, {
+			driver: 'JsView',
+			identifier: 'test-view',
+			baseStorage: 'test-storage',
+			scriptFile: 'buffer-view.js',
+			orderStatistics: true,
+			blockSize: 1024
+		});
+	})
+	.then(() => {
+		return Promise.all(data.map(buffer => {
+			return d3bUtil.insert(client, {
+				storageName: 'test-storage',
+				buffer: buffer
+			});
+		}));
+	})
+	.then(results => {
+		ids = results.map(result => Number(result.documentId));
+		deleted = ids.filter((id, i) => i % 3 == 0);
+
+		return d3bUtil.transaction(client, { });
+	})
+	.then(transaction_id => {
+		return d3bUtil.update(client, {
+			transactionId: transaction_id,
+			mutations: deleted.map(id => {
+				return {
+					type: d3bUtil.kMutateDelete,
+					storageName: 'test-storage',
+					documentId: id
+				};
+			})
+		})
+		.then(() => {
+			return d3bUtil.apply(client, {
+				transactionId: transaction_id,
+				type: d3bUtil.kApplySubmit
+			});
+		})
+		.then(() => {
+			return d3bUtil.apply(client, {
+				transactionId: transaction_id,
+				type: d3bUtil.kApplyCommit
+			});
+		});
+	})
+	.then(() => {
+		// the entries are removed from the order tree, so counts drop
+		return d3bUtil.query(client, {
+			viewName: 'test-view',
+			countOnly: true
+		}, data => { });
+	})
+	.then(count => {
+		test.equals(Number(count), ids.length - deleted.length);
+
+		let rows = [ ];
+		return d3bUtil.query(client, {
+			viewName: 'test-view'
+		}, data => {
+			rows.push(JSON.parse(data.toString()));
+		})
+		.then(() => {
+			let removed = new Set(deleted);
+			test.equals(rows.length, ids.length - deleted.length);
+			test.ok(rows.every(row => !removed.has(row.id)));
+			test.ok(rows.every((row, i) => i == 0
+					|| rows[i - 1].buffer <= row.buffer));
+		});
+	})
+	.then(() => {
+		return d3bUtil.checkIntegrity(client, {
+			viewName: 'test-view'
+		});
+	})
+	.then(report => {
+		test.ok(/^errors: 0$/m.test(report));
+	});
+}),
+
+testQueryDeleteRange: common.defaultTest((test, client) => {
+	test.expect(5);
+
+	let file = require('fs').readFileSync('tests/views/simple-view.js');
+
+	let ids, deleted;
+
+	// compactions run in the background after the batch
+	let checkCompacted = (attempts) => {
+		return d3bUtil.checkIntegrity(client, {
+			viewName: 'test-view'
+		})
+		.then(report => {
+			if(attempts == 0 || !/^compactions: 0$/m.test(report))
+				return report;
+			return new Promise(resolve => setTimeout(resolve, 100))
+			.then(() => {
+				return checkCompacted(attempts - 1);
+			});
+		});
+	};
+
+	return d3bUtil.uploadExtern(client, {
+		fileName: 'simple-view.js',
+		buffer: file
+	})
+	.then(() => {
+		return d3bUtil.createStorage(client, {
+			driver: 'FlexStorage',
+			identifier: 'test-storage'
+		});
+	})
+	.then(() => {
+		return d3bUtil.createView(client, {
+			driver: 'JsView',
+			identifier: 'test-view',
+			baseStorage: 'test-storage',
+			scriptFile: 'simple-view.js',
+			orderStatistics: true,
+			blockSize: 1024
+		});
+	})
+	.then(() => {
+		let inserts = [ ];
+		for(let i = 0; i < 4000; i++)
+			inserts.push(d3bUtil.insert(client, {
+				storageName: 'test-storage',
+				buffer: Buffer.from('item #' + i)
+			}));
+		return Promise.all(inserts);
+	})
+	.then(results => {
+		// the view is ordered by id; remove a contiguous range of it
+		ids = results.map(result => Number(result.documentId));
+		ids.sort((a, b) => a - b);
+		deleted = ids.slice(500, 3500);
+
+		return d3bUtil.transaction(client, { });
+	})
+	.then(transaction_id => {
+		return d3bUtil.update(client, {
+			transactionId: transaction_id,
+			mutations: deleted.map(id => {
+				return {
+					type: d3bUtil.kMutateDelete,
+					storageName: 'test-storage',
+					documentId: id
+				};
+			})
+		})
+		.then(() => {
+			return d3bUtil.apply(client, {
+				transactionId: transaction_id,
+				type: d3bUtil.kApplySubmit
+			});
+		})
+		.then(() => {
+			return d3bUtil.apply(client, {
+				transactionId: transaction_id,
+				type: d3bUtil.kApplyCommit
+			});
+		});
+	})
+	.then(() => {
+		let rows = [ ];
+		return d3bUtil.query(client, {
+			viewName: 'test-view'
+		}, data => {
+			rows.push(JSON.parse(data.toString()).id);
+		})
+		.then(() => {
+			let remaining = ids.slice(0, 500).concat(ids.slice(3500));
+			test.deepEqual(rows, remaining);
+		});
+	})
+	.then(() => {
+		return checkCompacted(50);
+	})
+	.then(report => {
+		test.ok(!/^compactions: 0$/m.test(report));
+		test.ok(/^entries: 1000$/m.test(report));
+		test.ok(/^errors: 0$/m.test(report));
+		test.ok(!/^subtree counts were not checked$/m.test(report));
+	});
+}),
+
+testQueryLongKeys: common.defaultTest((test, client) => {
+	test.expect(102);
+
+	// the view is ordered by the document buffer; most keys exceed
+	// the maximal key length of the order tree
+	let data = [ ];
+	for(let i = 0; i < 100; i++) {
+		let prefix = ('00' + ((i * 37) % 100)).slice(-3);
+		data.push(Buffer.from(prefix + '#'.repeat(i * 50)));
+	}
+
+	let file = require('fs').readFileSync('tests/views/buffer-view.js');
+
+	let retrieved = [ ];
+
+	return d3bUtil.uploadExtern(client, {
+		fileName: 'buffer-view.js',
+		buffer: file
+	})
+	.then(() => {
+		return d3bUtil.createStorage(client, {
+			driver: 'FlexStorage',
+			identifier: 'test-storage'
+		});
+	})
+	.then(() => {
+		return d3bUtil.createView(client, {
+			driver: 'JsView',
+			identifier: 'test-view',
+			baseStorage: 'test-storage',
+			scriptFile: 'buffer-view.js',
+			blockSize: 1024
+		});
+	})
+	.then(() => {
+		return Promise.all(data.map(buffer => {
+			return d3bUtil.insert(client, {
+				storageName: 'test-storage',
+				buffer: buffer
+			});
+		}));
+	})
+	.then(() => {
+		return d3bUtil.query(client, {
+			viewName: 'test-view'
+		}, data => {
+			retrieved.push(JSON.parse(data.toString()).buffer);
+		});
+	})
+	.then(() => {
+		let expected = data.map(buffer => buffer.toString()).sort();
+		test.equals(retrieved.length, expected.length);
+		for(let i = 0; i < retrieved.length; i++)
+			test.equals(retrieved[i], expected[i]);
+
+		return d3bUtil.checkIntegrity(client, {
+			viewName: 'test-view'
+		});
+	})
+	.then(report => {
+		test.ok(/^errors: 0$/m.test(report));
+	});
+}),
+
+testQueryUntouched: common.defaultTest((test, client) => {
+	test.expect(6);
+
+	// only the first storage is mutated after the setup; the drivers of
+	// the second storage must still serve reads at later sequence ids
+	let file = require('fs').readFileSync('tests/views/simple-view.js');
+
+	let untouched = [ ];
+	let sequence_id = 0;
+	let visible = 0;
+
+	return d3bUtil.uploadExtern(client, {
+		fileName: 'simple-view.js',
+		buffer: file
+	})
+	.then(() => {
+		return Promise.all([ 'touched', 'untouched' ].map(name => {
+			return d3bUtil.createStorage(client, {
+				driver: 'FlexStorage',
+				identifier: name + '-storage'
+			})
+			.then(() => {
+				return d3bUtil.createView(client, {
+					driver: 'JsView',
+					identifier: name + '-view',
+					baseStorage: name + '-storage',
+					scriptFile: 'simple-view.js'
+				});
+			});
+		}));
+	})
+	.then(() => {
+		let inserts = [ ];
+		for(let i = 0; i < 50; i++)
+			inserts.push(d3bUtil.insert(client, {
+				storageName: 'untouched-storage',
+				buffer: Buffer.from('untouched #' + i)
+			}));
+		return Promise.all(inserts);
+	})
+	.then(results => {
+		untouched = results.map(result => Number(result.documentId));
+
+		// each read waits until its own insert is applied
+		let inserts = [ ];
+		for(let i = 0; i < 200; i++) {
+			let buffer = Buffer.from('touched #' + i);
+			inserts.push(d3bUtil.insert(client, {
+				storageName: 'touched-storage',
+				buffer: buffer
+			})
+			.then(result => {
+				sequence_id = Math.max(sequence_id, Number(result.sequenceId));
+				return d3bUtil.fetch(client, {
+					storageName: 'touched-storage',
+					documentId: result.documentId,
+					sequenceId: result.sequenceId
+				})
+				.then(fetched => {
+					if(buffer.equals(fetched))
+						visible++;
+				});
+			}));
+		}
+		return Promise.all(inserts);
+	})
+	.then(() => {
+		test.equals(visible, 200);
+
+		return d3bUtil.fetch(client, {
+			storageName: 'untouched-storage',
+			documentId: untouched[0],
+			sequenceId: sequence_id
+		});
+	})
+	.then(buffer => {
+		test.ok(buffer.toString().startsWith('untouched #'));
+
+		return d3bUtil.multiFetch(client, {
+			storageName: 'untouched-storage',
+			documentIds: untouched,
+			sequenceId: sequence_id
+		});
+	})
+	.then(documents => {
+		test.equals(documents.length, untouched.length);
+
+		let retrieved = [ ];
+		return d3bUtil.query(client, {
+			viewName: 'untouched-view',
+			sequenceId: sequence_id
+		}, data => {
+			retrieved.push(JSON.parse(data.toString()));
+		})
+		.then(() => {
+			test.equals(retrieved.length, untouched.length);
+			test.ok(retrieved.every(row => row.buffer.startsWith('untouched #')));
+
+			let count = 0;
+			return d3bUtil.query(client, {
+				viewName: 'touched-view',
+				sequenceId: sequence_id
+			}, () => {
+				count++;
+			})
+			.then(() => {
+				test.equals(count, 200);
+			});
+		});
+	});
+}),
+
+testQueryCountModified: common.defaultTest((test, client) => {
+	test.expect(10);
+
+	let data = [ ];
+	for(let i = 0; i < 100; i++) {
+		data.push(Buffer.from('item #' + (1000 + i)));
+	}
+
+	let file = require('fs').readFileSync('tests/views/buffer-view.js');
+
+	let ids, deleted, sequence_id = 0;
+	let buffers = new Map();
+
+	let commit = (mutations) => {
+		return d3bUtil.transaction(client, { })
+		.then(transaction_id => {
+			return d3bUtil.update(client, {
+				transactionId: transaction_id,
+				mutations: mutations
+			})
+			.then(() => {
+				return d3bUtil.apply(client, {
+					transactionId: transaction_id,
+					type: d3bUtil.kApplySubmit
+				});
+			})
+			.then(() => {
+				return d3bUtil.apply(client, {
+					transactionId: transaction_id,
+					type: d3bUtil.kApplyCommit
+				});
+			});
+		});
+	};
+	let modify = (id, buffer) => {
+		buffers.set(id, buffer);
+		return {
+			type: d3bUtil.kMutateModify,
+			storageName: 'test-storage',
+			documentId: id,
+			buffer: Buffer.from(buffer)
+		};
+	};
+	let countEntries = () => {
+		return d3bUtil.query(client, {
+			viewName: 'test-view',
+			countOnly: true
+		}, data => { })
+		.then(count => Number(count));
+	};
+	let expected = () => {
+		return Array.from(buffers.values()).sort();
+	};
+
+	return d3bUtil.uploadExtern(client, {
+		fileName: 'buffer-view.js',
+		buffer: file
+	})
+	.then(() => {
+		return d3bUtil.createStorage(client, {
+			driver: 'FlexStorage',
+			identifier: 'test-storage'
+		});
+	})
+	.then(() => {
+		return d3bUtil.createView(client, {
+			driver: 'JsView',
+			identifier: 'test-view',
+			baseStorage: 'test-storage',
+			scriptFile: 'buffer-view.js',
+			orderStatistics: true
+		});
+	})
+	.then(() => {
+		return Promise.all(data.map(buffer => {
+			return d3bUtil.insert(client, {
+				storageName: 'test-storage',
+				buffer: buffer
+			});
+		}));
+	})
+	.then(results => {
+		ids = results.map(result => Number(result.documentId));
+		results.forEach((result, i) => {
+			buffers.set(ids[i], data[i].toString());
+			sequence_id = Math.max(sequence_id, Number(result.sequenceId));
+		});
+		return countEntries();
+	})
+	.then(count => {
+		test.equals(count, 100);
+
+		// every document is modified twice by the same batch
+		let mutations = [ ];
+		ids.forEach((id, i) => {
+			mutations.push(modify(id, 'first #' + (1000 + i)));
+		});
+		ids.forEach((id, i) => {
+			mutations.push(modify(id, 'second #' + (1000 + i)));
+		});
+		return commit(mutations);
+	})
+	.then(() => {
+		return countEntries();
+	})
+	.then(count => {
+		test.equals(count, 100);
+
+		// half of the documents are modified again by a later batch
+		return commit(ids.filter((id, i) => i % 2 == 0).map((id, i) => {
+			return modify(id, 'third #' + (1000 + i));
+		}));
+	})
+	.then(() => {
+		return countEntries();
+	})
+	.then(count => {
+		test.equals(count, 100);
+
+		let rows = [ ];
+		return d3bUtil.query(client, {
+			viewName: 'test-view',
+			offset: 90
+		}, data => {
+			rows.push(JSON.parse(data.toString()));
+		})
+		.then(() => {
+			test.deepEqual(rows.map(row => row.buffer), expected().slice(90));
+		});
+	})
+	.then(() => {
+		deleted = ids.filter((id, i) => i % 10 == 0);
+		return commit(deleted.map(id => {
+			buffers.delete(id);
+			return {
+				type: d3bUtil.kMutateDelete,
+				storageName: 'test-storage',
+				documentId: id
+			};
+		}));
+	})
+	.then(() => {
+		return countEntries();
+	})
+	.then(count => {
+		test.equals(count, 100 - deleted.length);
+
+		let rows = [ ];
+		return d3bUtil.query(client, {
+			viewName: 'test-view',
+			offset: 80
+		}, data => {
+			rows.push(JSON.parse(data.toString()));
+		})
+		.then(() => {
+			test.deepEqual(rows.map(row => row.buffer), expected().slice(80));
+		});
+	})
+	.then(() => {
+		// the view applied later batches; its counts do not match the snapshot
+		return d3bUtil.query(client, {
+			viewName: 'test-view',
+			sequenceId: sequence_id,
+			countOnly: true
+		}, data => { })
+		.then(() => {
+			test.ok(false, "counting an outdated snapshot must fail");
+		}, error => {
+			test.ok(/error code 5$/.test(error.message));
+		});
+	})
+	.then(() => {
+		// superseded entries are gone so rows of the snapshot are missing
+		let rows = [ ];
+		return d3bUtil.query(client, {
+			viewName: 'test-view',
+			sequenceId: sequence_id
+		}, data => {
+			rows.push(JSON.parse(data.toString()));
+		})
+		.then(() => {
+			test.ok(false, "queries on outdated snapshots must fail");
+		}, error => {
+			test.ok(/error code 5$/.test(error.message));
+		});
+	})
+	.then(() => {
+		return d3bUtil.checkIntegrity(client, {
+			viewName: 'test-view'
+		});
+	})
+	.then(report => {
+		test.ok(/^entries: 90$/m.test(report));
+		test.ok(/^errors: 0$/m.test(report));
+	});
+}),
+
+testQueryNumericKeys: common.defaultTest((test, client) => {
+	test.expect(3);
+
+	// keys are decimal numbers; their numeric order differs from their byte
+	// order, e.g. a leaf with the keys 1 to 12 shares no common prefix
+	let file = require('fs').readFileSync('tests/views/simple-view.js');
+
+	let ids;
+
+	return d3bUtil.uploadExtern(client, {
+		fileName: 'simple-view.js',
+		buffer: file
+	})
+	.then(() => {
+		return d3bUtil.createStorage(client, {
+			driver: 'FlexStorage',
+			identifier: 'test-storage'
+		});
+	})
+	.then(() => {
+		return d3bUtil.createView(client, {
+			driver: 'JsView',
+			identifier: 'test-view',
+			baseStorage: 'test-storage',
+			scriptFile: 'simple-view.js',
+			blockSize: 1024
+		});
+	})
+	.then(() => {
+		let promises = [ ];
+		for(let i = 0; i < 300; i++) {
+			promises.push(d3bUtil.insert(client, {
+				storageName: 'test-storage',
+				buffer: Buffer.from('item #' + i)
+			}));
+		}
+		return Promise.all(promises);
+	})
+	.then(results => {
+		ids = results.map(result => Number(result.documentId))
+				.sort((a, b) => a - b);
+
+		let rows = [ ];
+		return d3bUtil.query(client, {
+			viewName: 'test-view'
+		}, data => {
+			rows.push(JSON.parse(data.toString()).id);
+		})
+		.then(() => {
+			test.deepEqual(rows, ids);
+		});
+	})
+	.then(() => {
+		let rows = [ ];
+		return d3bUtil.query(client, {
+			viewName: 'test-view',
+			descending: true
+		}, data => {
+			rows.push(JSON.parse(data.toString()).id);
+		})
+		.then(() => {
+			test.deepEqual(rows, ids.slice().reverse());
+		});
+	})
+	.then(() => {
+		return d3bUtil.checkIntegrity(client, {
+			viewName: 'test-view'
+		});
+	})
+	.then(report => {
+		test.ok(/^errors: 0$/m.test(report));
+	});
+}),
+
 };
 
@@ -275,6 +275,190 @@ testDurableSubmit: function(test) {
 		test.done();
 	});
 },
+testReplayConcurrent: function(test) {
+	test.expect(5);
+
+	let instance = new common.D3bInstance();
+	let client;
+
+	let connect = () => {
+		return new Promise(resolve => {
+			instance.connect(the_client => {
+				client = the_client;
+				resolve();
+			});
+		});
+	};
+	let restart = () => {
+		return new Promise(resolve => {
+			d3bUtil.shutdown(client);
+			instance.wait(resolve);
+		})
+		.then(() => new Promise(resolve => client.close(resolve)))
+		.then(() => new Promise(resolve => instance.start(resolve)))
+		.then(connect);
+	};
+	let submit = (mutations) => {
+		return d3bUtil.transaction(client, { })
+		.then(transaction_id => {
+			return d3bUtil.update(client, {
+				transactionId: transaction_id,
+				mutations: mutations
+			})
+			.then(() => {
+				return d3bUtil.apply(client, {
+					transactionId: transaction_id,
+					type: d3bUtil.kApplySubmit
+				});
+			})
+			.then(() => transaction_id);
+		});
+	};
+	let commit = (transaction_id) => {
+		return d3bUtil.apply(client, {
+			transactionId: transaction_id,
+			type: d3bUtil.kApplyCommit
+		});
+	};
+	let modify = (id, buffer) => {
+		return {
+			type: d3bUtil.kMutateModify,
+			storageName: 'test-storage',
+			documentId: id,
+			buffer: Buffer.from(buffer)
+		};
+	};
+
+	let file = require('fs').readFileSync('tests/views/simple-view.js');
+
+	let ids, pending;
+	let expected = new Map();
+	let versions = new Map();
+
+	new Promise(resolve => instance.setup(resolve))
+	.then(connect)
+	.then(() => {
+		return d3bUtil.uploadExtern(client, {
+			fileName: 'simple-view.js',
+			buffer: file
+		});
+	})
+	.then(() => {
+		return d3bUtil.createStorage(client, {
+			driver: 'FlexStorage',
+			identifier: 'test-storage'
+		});
+	})
+	.then(() => {
+		return d3bUtil.createView(client, {
+			driver: 'JsView',
+			identifier: 'test-view',
+			baseStorage: 'test-storage',
+			scriptFile: 'simple-view.js'
+		});
+	})
+	.then(() => {
+		let promises = [ ];
+		for(let i = 0; i < 100; i++) {
+			promises.push(d3bUtil.insert(client, {
+				storageName: 'test-storage',
+				buffer: Buffer.from('item #' + i)
+			}));
+		}
+		return Promise.all(promises);
+	})
+	.then(results => {
+		ids = results.map(result => result.documentId);
+		ids.forEach((id, i) => {
+			expected.set(id, 'item #' + i);
+		});
+
+		// concurrent transactions are written to the log in batches
+		return Promise.all(ids.map((id, i) => {
+			if(i % 4 == 0) {
+				expected.delete(id);
+				return submit([ {
+					type: d3bUtil.kMutateDelete,
+					storageName: 'test-storage',
+					documentId: id
+				} ]).then(commit);
+			}
+			expected.set(id, 'modified #' + i);
+			return submit([ modify(id, 'modified #' + i) ]).then(commit);
+		}));
+	})
+	.then(() => {
+		// these transactions are submitted but not committed before the restart
+		return Promise.all(ids.filter((id, i) => i % 4 == 1).map(id => {
+			return submit([ modify(id, 'pending #' + id) ]);
+		}));
+	})
+	.then(transaction_ids => {
+		pending = transaction_ids;
+
+		return d3bUtil.multiFetch(client, {
+			storageName: 'test-storage',
+			documentIds: ids
+		});
+	})
+	.then(results => {
+		results.forEach(result => {
+			versions.set(result.documentId, Number(result.sequenceId));
+		});
+		return restart();
+	})
+	.then(() => {
+		// replay assigns the same sequence ids as before the restart
+		return d3bUtil.multiFetch(client, {
+			storageName: 'test-storage',
+			documentIds: ids
+		});
+	})
+	.then(results => {
+		let byId = (a, b) => a[0] - b[0];
+		test.deepEqual(results.map(result => [ result.documentId,
+				Number(result.sequenceId), result.buffer.toString() ]).sort(byId),
+			ids.filter(id => expected.has(id)).map(id => [ id,
+				versions.get(id), expected.get(id) ]).sort(byId));
+
+		let rows = [ ];
+		return d3bUtil.query(client, {
+			viewName: 'test-view'
+		}, data => {
+			rows.push(JSON.parse(data.toString()).buffer);
+		})
+		.then(() => {
+			test.deepEqual(rows.sort(), Array.from(expected.values()).sort());
+		});
+	})
+	.then(() => {
+		return Promise.all(pending.map(commit));
+	})
+	.then(sequence_ids => {
+		let latest = Math.max.apply(null, Array.from(versions.values()));
+		test.ok(sequence_ids.every(sequence_id => Number(sequence_id) > latest));
+
+		return d3bUtil.multiFetch(client, {
+			storageName: 'test-storage',
+			documentIds: ids.filter((id, i) => i % 4 == 1)
+		});
+	})
+	.then(results => {
+		test.equals(results.length, 25);
+		test.ok(results.every(result => {
+			return result.buffer.toString() == 'pending #' + result.documentId;
+		}));
+	})
+	.catch(error => {
+		test.ok(false, error.stack);
+	})
+	.then(() => new Promise(resolve => client.close(resolve)))
+	.then(() => new Promise(resolve => instance.shutdown(resolve)))
+	.then(() => {
+		test.done();
+	});
+}
+,
 
 };
 
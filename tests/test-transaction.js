@@ -86,6 +86,338 @@ testRollback: common.defaultTest((test, client) => {
 	.then(() => {
 		console.log("FIXME: verify that the document was NOT written!");
 	});
+}),
+
+testCommitInterleaved: common.defaultTest((test, client) => {
+	test.expect(5);
+
+	// a single batch mutates each document many times; mutations of
+	// different documents are interleaved
+	const kDocuments = 20;
+	const kRounds = 10;
+
+	let file = require('fs').readFileSync('tests/views/buffer-view.js');
+
+	let ids = [ ];
+	let expected = new Map();
+
+	return d3bUtil.uploadExtern(client, {
+		fileName: 'buffer-view.js',
+		buffer: file
+	})
+	.then(() => {
+		return d3bUtil.createStorage(client, {
+			driver: 'FlexStorage',
+			identifier: 'test-storage'
+		});
+	})
+	.then(() => {
+		return d3bUtil.createView(client, {
+			driver: 'JsView',
+			identifier: 'test-view',
+			baseStorage: 'test-storage',
+			scriptFile: 'buffer-view.js'
+		});
+	})
+	.then(() => {
+		let inserts = [ ];
+		for(let i = 0; i < kDocuments; i++)
+			inserts.push(d3bUtil.insert(client, {
+				storageName: 'test-storage',
+				buffer: Buffer.from('initial #' + i)
+			}));
+		return Promise.all(inserts);
+	})
+	.then(results => {
+		ids = results.map(result => Number(result.documentId));
+		return d3bUtil.transaction(client, { });
+	})
+	.then(transaction_id => {
+		// the view order of the final buffers is the reverse of the
+		// document order; the last document is deleted at the end
+		let mutations = [ ];
+		for(let r = 0; r < kRounds; r++) {
+			ids.forEach((id, i) => {
+				let buffer = (r == kRounds - 1)
+						? 'final #' + String(kDocuments - i).padStart(3, '0')
+						: 'round #' + r + ' doc #' + i;
+				mutations.push({
+					type: d3bUtil.kMutateModify,
+					storageName: 'test-storage',
+					documentId: id,
+					buffer: Buffer.from(buffer)
+				});
+				expected.set(id, buffer);
+			});
+		}
+		mutations.push({
+			type: d3bUtil.kMutateDelete,
+			storageName: 'test-storage',
+			documentId: ids[kDocuments - 1]
+		});
+		expected.delete(ids[kDocuments - 1]);
+
+		return d3bUtil.update(client, {
+			transactionId: transaction_id,
+			mutations: mutations
+		})
+		.then(() => {
+			return d3bUtil.apply(client, {
+				transactionId: transaction_id,
+				type: d3bUtil.kApplySubmit
+			});
+		})
+		.then(() => {
+			return d3bUtil.apply(client, {
+				transactionId: transaction_id,
+				type: d3bUtil.kApplyCommit
+			});
+		});
+	})
+	.then(() => {
+		return d3bUtil.multiFetch(client, {
+			storageName: 'test-storage',
+			documentIds: ids
+		});
+	})
+	.then(documents => {
+		test.equals(documents.length, kDocuments - 1);
+		test.ok(documents.every(document => expected.get(Number(document.documentId))
+				== document.buffer.toString()));
+
+		let retrieved = [ ];
+		return d3bUtil.query(client, {
+			viewName: 'test-view'
+		}, data => {
+			retrieved.push(JSON.parse(data.toString()));
+		})
+		.then(() => {
+			// only the last version of each document is visible
+			test.equals(retrieved.length, kDocuments - 1);
+			test.ok(retrieved.every(row => expected.get(row.id) == row.buffer));
+			test.deepEqual(retrieved.map(row => row.id),
+					ids.slice(0, kDocuments - 1).reverse());
+		});
+	});
+}),
+
+testCommitConcurrent: common.defaultTest((test, client) => {
+	test.expect(402);
+
+	// every transaction modifies the shared document and one of its own
+	let count = 200;
+	let shared_id, ids, initial_id;
+	let sequence_ids = [ ];
+
+	return d3bUtil.createStorage(client, {
+		driver: 'FlexStorage',
+		identifier: 'test-storage'
+	})
+	.then(() => {
+		return d3bUtil.insert(client, {
+			storageName: 'test-storage',
+			buffer: Buffer.from('shared')
+		});
+	})
+	.then(result => {
+		shared_id = result.documentId;
+		initial_id = Number(result.sequenceId);
+
+		let promises = [ ];
+		for(let i = 0; i < count; i++) {
+			promises.push(d3bUtil.insert(client, {
+				storageName: 'test-storage',
+				buffer: Buffer.from('initial #' + i)
+			}));
+		}
+		return Promise.all(promises);
+	})
+	.then(results => {
+		ids = results.map(result => result.documentId);
+
+		return Promise.all(ids.map((id, i) => {
+			return d3bUtil.transaction(client, { })
+			.then(transaction_id => {
+				return d3bUtil.update(client, {
+					transactionId: transaction_id,
+					mutations: [ {
+						type: d3bUtil.kMutateModify,
+						storageName: 'test-storage',
+						documentId: shared_id,
+						buffer: Buffer.from('version #' + i)
+					}, {
+						type: d3bUtil.kMutateModify,
+						storageName: 'test-storage',
+						documentId: id,
+						buffer: Buffer.from('item #' + i)
+					} ]
+				})
+				.then(() => {
+					return d3bUtil.apply(client, {
+						transactionId: transaction_id,
+						type: d3bUtil.kApplySubmit
+					});
+				})
+				.then(() => {
+					return d3bUtil.apply(client, {
+						transactionId: transaction_id,
+						type: d3bUtil.kApplyCommit
+					});
+				})
+				.then(sequence_id => {
+					sequence_ids[i] = Number(sequence_id);
+				});
+			});
+		}));
+	})
+	.then(() => {
+		return d3bUtil.history(client, {
+			storageName: 'test-storage',
+			documentId: shared_id
+		});
+	})
+	.then(versions => {
+		// the versions of the shared document follow the commit order
+		let order = sequence_ids.map((sequence_id, i) => i)
+				.sort((a, b) => sequence_ids[a] - sequence_ids[b]);
+		test.deepEqual(versions.filter(version => Number(version.sequenceId) > initial_id)
+				.map(version => Number(version.sequenceId) + ' ' + version.buffer.toString()),
+			order.map(i => sequence_ids[i] + ' version #' + i));
+		test.equals(new Set(sequence_ids).size, count);
+
+		// both mutations of a transaction become visible at its sequence id
+		return Promise.all(sequence_ids.map((sequence_id, i) => {
+			return d3bUtil.fetch(client, {
+				storageName: 'test-storage',
+				documentId: shared_id,
+				sequenceId: sequence_id
+			})
+			.then(buffer => {
+				test.equals(buffer.toString(), 'version #' + i);
+
+				return d3bUtil.multiFetch(client, {
+					storageName: 'test-storage',
+					documentIds: ids,
+					sequenceId: sequence_id
+				});
+			})
+			.then(results => {
+				test.ok(results.length == count && results.every(result => {
+					let j = ids.indexOf(result.documentId);
+					return result.buffer.toString() == (sequence_ids[j] <= sequence_id
+							? 'item #' + j : 'initial #' + j);
+				}));
+			});
+		}));
+	});
+}),
+
+testTransactionReuse: common.defaultTest((test, client) => {
+	test.expect(101);
+
+	// finished transactions are recycled. a recycled transaction
+	// must not apply mutations of its previous use
+	let count = 100, rounds = 5;
+	let ids;
+	let expected = new Map();
+
+	let round = (r) => {
+		return Promise.all(ids.map((id, i) => {
+			let buffer = 'round ' + r + ' #' + i;
+			let mode = (i + r) % 3;
+			if(mode == 0)
+				expected.get(id).push(buffer);
+
+			return d3bUtil.transaction(client, { })
+			.then(transaction_id => {
+				return d3bUtil.update(client, {
+					transactionId: transaction_id,
+					mutations: [ {
+						type: d3bUtil.kMutateModify,
+						storageName: 'test-storage',
+						documentId: id,
+						buffer: Buffer.from(buffer)
+					} ]
+				})
+				.then(() => {
+					// some transactions are rolled back before they are submitted
+					if(mode == 2)
+						return;
+					return d3bUtil.apply(client, {
+						transactionId: transaction_id,
+						type: d3bUtil.kApplySubmit
+					});
+				})
+				.then(() => {
+					return d3bUtil.apply(client, {
+						transactionId: transaction_id,
+						type: mode == 0 ? d3bUtil.kApplyCommit : d3bUtil.kApplyRollback
+					});
+				});
+			});
+		}));
+	};
+
+	return d3bUtil.createStorage(client, {
+		driver: 'FlexStorage',
+		identifier: 'test-storage'
+	})
+	.then(() => {
+		let promises = [ ];
+		for(let i = 0; i < count; i++) {
+			promises.push(d3bUtil.insert(client, {
+				storageName: 'test-storage',
+				buffer: Buffer.from('item #' + i)
+			}));
+		}
+		return Promise.all(promises);
+	})
+	.then(results => {
+		ids = results.map(result => result.documentId);
+		ids.forEach((id, i) => {
+			expected.set(id, [ 'item #' + i ]);
+		});
+
+		let promise = Promise.resolve();
+		for(let r = 0; r < rounds; r++)
+			promise = promise.then(() => round(r));
+		return promise;
+	})
+	.then(() => {
+		// empty transactions reuse the same objects and must not mutate anything
+		let promises = [ ];
+		for(let i = 0; i < count; i++) {
+			promises.push(d3bUtil.transaction(client, { })
+			.then(transaction_id => {
+				return d3bUtil.apply(client, {
+					transactionId: transaction_id,
+					type: d3bUtil.kApplySubmit
+				})
+				.then(() => {
+					return d3bUtil.apply(client, {
+						transactionId: transaction_id,
+						type: d3bUtil.kApplyCommit
+					});
+				});
+			}));
+		}
+		return Promise.all(promises);
+	})
+	.then(sequence_ids => {
+		test.equals(new Set(sequence_ids.map(Number)).size, count);
+
+		// every committed modification yields exactly one version
+		return Promise.all(ids.map(id => {
+			return d3bUtil.history(client, {
+				storageName: 'test-storage',
+				documentId: id
+			})
+			.then(versions => {
+				test.deepEqual(versions.map(version => version.buffer.toString()),
+						expected.get(id));
+			});
+		}));
+	});
 })
 
 };
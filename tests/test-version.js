@@ -96,5 +96,278 @@ testVersion: function(test) {
 	});
 },
 
+testVersionGc: common.defaultTest((test, client) => {
+	test.expect(103);
+
+	let data = [ ];
+	for(let i = 0; i < 100; i++) {
+		data.push(Buffer.from('item #' + i));
+	}
+	let ids;
+
+	// modifies all documents in a single transaction
+	let modifyAll = round => {
+		return d3bUtil.transaction(client, { })
+		.then(transaction_id => {
+			return d3bUtil.update(client, {
+				transactionId: transaction_id,
+				mutations: ids.map(id => {
+					return {
+						type: d3bUtil.kMutateModify,
+						storageName: 'test-storage',
+						documentId: id,
+						buffer: Buffer.from('modified #' + round + ' of ' + id)
+					};
+				})
+			})
+			.then(() => {
+				return d3bUtil.apply(client, {
+					transactionId: transaction_id,
+					type: d3bUtil.kApplySubmit
+				});
+			})
+			.then(() => {
+				return d3bUtil.apply(client, {
+					transactionId: transaction_id,
+					type: d3bUtil.kApplyCommit
+				});
+			});
+		});
+	};
+
+	// garbage collection runs in the background; poll until it caught up
+	let waitForEntries = (count, attempts) => {
+		return d3bUtil.checkIntegrity(client, {
+			storageName: 'test-storage'
+		})
+		.then(report => {
+			if(new RegExp('^entries: ' + count + '$', 'm').test(report) || !attempts)
+				return report;
+			return new Promise(resolve => setTimeout(resolve, 100))
+			.then(() => waitForEntries(count, attempts - 1));
+		});
+	};
+
+	return d3bUtil.createStorage(client, {
+		driver: 'FlexStorage',
+		identifier: 'test-storage',
+		gcInterval: 1,
+		retainVersions: 1,
+		// compact the data file behind the collector; fetches must still succeed
+		compactThreshold: 50,
+		compactBatch: 16
+	})
+	.then(() => {
+		return Promise.all(data.map(buffer => {
+			return d3bUtil.insert(client, {
+				storageName: 'test-storage',
+				buffer: buffer
+			});
+		}));
+	})
+	.then(results => {
+		ids = results.map(result => result.documentId);
+
+		return [ 1, 2, 3 ].reduce((promise, round) => {
+			return promise.then(() => modifyAll(round));
+		}, Promise.resolve());
+	})
+	.then(() => {
+		return waitForEntries(ids.length, 50);
+	})
+	.then(report => {
+		test.ok(/^errors: 0$/m.test(report));
+		test.ok(new RegExp('^entries: ' + ids.length + '$', 'm').test(report));
+
+		return Promise.all(ids.map(id => {
+			return d3bUtil.fetch(client, {
+				storageName: 'test-storage',
+				documentId: id
+			})
+			.then(buffer => {
+				test.ok(buffer.equals(Buffer.from('modified #3 of ' + id)));
+			});
+		}));
+	})
+	.then(() => {
+		// the snapshot of the first insert is behind the horizon
+		return d3bUtil.fetch(client, {
+			storageName: 'test-storage',
+			documentId: ids[0],
+			sequenceId: 1
+		})
+		.then(() => {
+			test.ok(false);
+		}, () => {
+			test.ok(true);
+		});
+	});
+}),
+
+testVersionCache: common.defaultTest((test, client) => {
+	test.expect(4);
+
+	let id, first_sequence;
+
+	let fetchLatest = () => {
+		return d3bUtil.fetch(client, {
+			storageName: 'test-storage',
+			documentId: id
+		});
+	};
+
+	return d3bUtil.createStorage(client, {
+		driver: 'FlexStorage',
+		identifier: 'test-storage',
+		documentCacheLimit: 1024
+	})
+	.then(() => {
+		return d3bUtil.insert(client, {
+			storageName: 'test-storage',
+			buffer: Buffer.from('original')
+		});
+	})
+	.then(result => {
+		id = result.documentId;
+		first_sequence = result.sequenceId;
+
+		// the second fetch is served by the cache
+		return fetchLatest().then(fetchLatest);
+	})
+	.then(buffer => {
+		test.ok(buffer.equals(Buffer.from('original')));
+
+		return d3bUtil.transaction(client, { });
+	})
+	.then(transaction_id => {
+		return d3bUtil.update(client, {
+			transactionId: transaction_id,
+			mutations: [ {
+				type: d3bUtil.kMutateModify,
+				storageName: 'test-storage',
+				documentId: id,
+				buffer: Buffer.from('modified')
+			} ]
+		})
+		.then(() => {
+			return d3bUtil.apply(client, {
+				transactionId: transaction_id,
+				type: d3bUtil.kApplySubmit
+			});
+		})
+		.then(() => {
+			return d3bUtil.apply(client, {
+				transactionId: transaction_id,
+				type: d3bUtil.kApplyCommit
+			});
+		});
+	})
+	.then(() => {
+		return fetchLatest().then(fetchLatest);
+	})
+	.then(buffer => {
+		test.ok(buffer.equals(Buffer.from('modified')));
+
+		// older snapshots do not see the cached version
+		return d3bUtil.fetch(client, {
+			storageName: 'test-storage',
+			documentId: id,
+			sequenceId: first_sequence
+		});
+	})
+	.then(buffer => {
+		test.ok(buffer.equals(Buffer.from('original')));
+
+		return d3bUtil.checkIntegrity(client, {
+			storageName: 'test-storage'
+		});
+	})
+	.then(report => {
+		test.ok(/^entries: 2$/m.test(report));
+	});
+}),
+
+testVersionHistory: common.defaultTest((test, client) => {
+	test.expect(8);
+
+	let id;
+
+	// applies a single mutation in its own transaction
+	let mutate = mutation => {
+		return d3bUtil.transaction(client, { })
+		.then(transaction_id => {
+			return d3bUtil.update(client, {
+				transactionId: transaction_id,
+				mutations: [ mutation ]
+			})
+			.then(() => {
+				return d3bUtil.apply(client, {
+					transactionId: transaction_id,
+					type: d3bUtil.kApplySubmit
+				});
+			})
+			.then(() => {
+				return d3bUtil.apply(client, {
+					transactionId: transaction_id,
+					type: d3bUtil.kApplyCommit
+				});
+			});
+		});
+	};
+
+	return d3bUtil.createStorage(client, {
+		driver: 'FlexStorage',
+		identifier: 'test-storage'
+	})
+	.then(() => {
+		return d3bUtil.insert(client, {
+			storageName: 'test-storage',
+			buffer: Buffer.from('version #0')
+		});
+	})
+	.then(result => {
+		id = result.documentId;
+
+		return [ 1, 2, 3 ].reduce((promise, round) => {
+			return promise.then(() => mutate({
+				type: d3bUtil.kMutateModify,
+				storageName: 'test-storage',
+				documentId: id,
+				buffer: Buffer.from('version #' + round)
+			}));
+		}, Promise.resolve());
+	})
+	.then(() => {
+		return mutate({
+			type: d3bUtil.kMutateDelete,
+			storageName: 'test-storage',
+			documentId: id
+		});
+	})
+	.then(() => {
+		return d3bUtil.history(client, {
+			storageName: 'test-storage',
+			documentId: id
+		});
+	})
+	.then(versions => {
+		test.equal(versions.length, 5);
+		for(let i = 0; i < 4; i++)
+			test.ok(versions[i].buffer.equals(Buffer.from('version #' + i)));
+		test.ok(versions[4].deleted);
+
+		return d3bUtil.history(client, {
+			storageName: 'test-storage',
+			documentId: id,
+			fromSequenceId: versions[1].sequenceId,
+			toSequenceId: versions[2].sequenceId
+		});
+	})
+	.then(versions => {
+		test.equal(versions.length, 2);
+		test.ok(versions[1].buffer.equals(Buffer.from('version #2')));
+	});
+}),
+
 };
 
@@ -0,0 +1,33 @@
+
+hook("extractDoc", function(id, buffer) {
+	var doc = { id: id, buffer: buffer };
+	return doc;
+});
+
+hook("extractKey", function(buffer) {
+	return buffer;
+});
+
+hook("keyOf", function(doc) {
+	return doc.buffer;
+});
+
+hook("compare", function(a, b) {
+	if(a < b)
+		return -1;
+	if(a > b)
+		return 1;
+	return 0;
+});
+
+hook("serializeKey", function(key) {
+	return key;
+});
+hook("deserializeKey", function(buffer) {
+	return buffer;
+});
+
+hook("report", function(doc) {
+	return JSON.stringify(doc);
+});
+